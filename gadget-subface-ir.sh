@@ -74,14 +74,30 @@ mkdir "${FUNCTIONS_UVC_IR}"
 
 echo 2048 > "${FUNCTIONS_UVC_IR}/streaming_maxpacket"
 
-# L8 (8-bit greyscale format) configuration
-config_frame ${FUNCTIONS_UVC_IR} uncompressed u 480 480
+# IR bit depth: 8 (L8), 10 (packed 10-bit) or 16 (L16)
+IR_BITS=${IR_BITS:-8}
 
-# Set pixel format to UVC_GUID_FORMAT_KSMEDIA_L8_IR
-cat UVC_GUID_FORMAT_KSMEDIA_L8_IR > ${FUNCTIONS_UVC_IR}/streaming/uncompressed/u/guidFormat
+# Greyscale format configuration
+config_frame ${FUNCTIONS_UVC_IR} uncompressed u 480 480
 
-# Set 8 bits per pixel
-echo 8 > ${FUNCTIONS_UVC_IR}/streaming/uncompressed/u/bBitsPerPixel
+case ${IR_BITS} in
+    10)
+        # Set pixel format to packed 10-bit greyscale (MIPI RAW10)
+        cat UVC_GUID_FORMAT_Y10P > ${FUNCTIONS_UVC_IR}/streaming/uncompressed/u/guidFormat
+        ;;
+    16)
+        # Set pixel format to UVC_GUID_FORMAT_KSMEDIA_L16_IR
+        cat UVC_GUID_FORMAT_KSMEDIA_L16_IR > ${FUNCTIONS_UVC_IR}/streaming/uncompressed/u/guidFormat
+        ;;
+    *)
+        # Set pixel format to UVC_GUID_FORMAT_KSMEDIA_L8_IR
+        cat UVC_GUID_FORMAT_KSMEDIA_L8_IR > ${FUNCTIONS_UVC_IR}/streaming/uncompressed/u/guidFormat
+        IR_BITS=8
+        ;;
+esac
+
+# Set bits per pixel
+echo ${IR_BITS} > ${FUNCTIONS_UVC_IR}/streaming/uncompressed/u/bBitsPerPixel
 
 echo "INFO: Initialize configs and functions"
 
@@ -0,0 +1,555 @@
+/*
+ * Micro-benchmarks of the pixel kernels, image loaders and buffer fill
+ *
+ * Every benchmark runs for a fixed time at QVGA to 4K and reports one CSV
+ * line per resolution, so runs of two versions can be compared by a script.
+ * Cycles and cache misses are counted with perf_event_open() when the kernel
+ * allows it (perf_event_paranoid), otherwise they are reported as nan.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ */
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+
+#include "image-convert.h"
+
+#define ARRAY_SIZE(a) (sizeof(a) / sizeof((a)[0]))
+
+/* Iterations are repeated for at least this long, and at least BENCH_MIN_ITERATIONS times */
+#define BENCH_DEFAULT_MS 200
+#define BENCH_MIN_ITERATIONS 3
+
+/* Queued buffers cycled through by the fill benchmark, like the default -n 3 */
+#define BENCH_FILL_BUFFERS 3
+
+struct bench_resolution {
+    const char *name;
+    unsigned int width;
+    unsigned int height;
+};
+
+static const struct bench_resolution resolutions[] = {
+    { "QVGA", 320, 240 },
+    { "VGA", 640, 480 },
+    { "HD", 1280, 720 },
+    { "FHD", 1920, 1080 },
+    { "4K", 3840, 2160 },
+};
+
+/* Inputs and outputs of one resolution */
+struct bench_context {
+    unsigned int width;
+    unsigned int height;
+    size_t npixels;
+
+    struct image rgba;
+    struct image grey;
+    struct image grey16;
+    uint8_t *y10p;
+    uint8_t *dst;
+
+    char png_file[256];
+    char png16_file[256];
+    char l8_file[256];
+
+    uint8_t *jpeg;
+    unsigned long jpeg_size;
+
+    uint8_t *fill_buffers[BENCH_FILL_BUFFERS];
+    unsigned int fill_next;
+    uint64_t hash;
+};
+
+struct bench {
+    const char *name;
+    size_t (*bytes)(const struct bench_context *ctx);   /* input bytes of one iteration */
+    void (*run)(struct bench_context *ctx);
+};
+
+/* Hardware counters, -1 when not available */
+struct bench_counters {
+    int cycles;
+    int cache_misses;
+};
+
+static struct bench_counters counters = { -1, -1 };
+
+static double monotonic_ns()
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+/* ---------------------------------------------------------------------------
+ * Hardware counters
+ */
+
+static int perf_counter_open(unsigned int type, unsigned long long config)
+{
+    struct perf_event_attr attr;
+
+    memset(&attr, 0, sizeof(attr));
+    attr.size = sizeof(attr);
+    attr.type = type;
+    attr.config = config;
+    attr.disabled = 1;
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+
+    return syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+}
+
+static void perf_counters_open()
+{
+    counters.cycles = perf_counter_open(PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES);
+    counters.cache_misses = perf_counter_open(PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES);
+
+    if (counters.cycles < 0 || counters.cache_misses < 0) {
+        fprintf(stderr, "BENCH: Hardware counters not available (%s), cycles and cache misses not reported\n",
+                strerror(errno));
+    }
+}
+
+static void perf_counter_start(int fd)
+{
+    if (fd >= 0) {
+        ioctl(fd, PERF_EVENT_IOC_RESET, 0);
+        ioctl(fd, PERF_EVENT_IOC_ENABLE, 0);
+    }
+}
+
+static double perf_counter_stop(int fd)
+{
+    unsigned long long value;
+
+    if (fd < 0) {
+        return NAN;
+    }
+
+    ioctl(fd, PERF_EVENT_IOC_DISABLE, 0);
+    if (read(fd, &value, sizeof(value)) != sizeof(value)) {
+        return NAN;
+    }
+    return value;
+}
+
+/* ---------------------------------------------------------------------------
+ * Inputs
+ */
+
+static int write_file(const char *filename, const void *data, size_t size)
+{
+    FILE *fp = fopen(filename, "wb");
+
+    if (!fp) {
+        fprintf(stderr, "BENCH: Could not create %s: %s\n", filename, strerror(errno));
+        return -errno;
+    }
+
+    if (fwrite(data, 1, size, fp) != size) {
+        fclose(fp);
+        return -EIO;
+    }
+    return (fclose(fp) == 0) ? 0 : -EIO;
+}
+
+/* Gradient with some noise, so encoders and compressors see a photo-like image */
+static int context_init(struct bench_context *ctx, const struct bench_resolution *res)
+{
+    const char *tmpdir = getenv("TMPDIR") ? getenv("TMPDIR") : "/tmp";
+    unsigned int seed = 1;
+    uint8_t *rgba;
+    uint8_t *grey;
+    uint16_t *grey16;
+    unsigned int x, y;
+    size_t i;
+    int ret;
+
+    memset(ctx, 0, sizeof(*ctx));
+    ctx->width = res->width;
+    ctx->height = res->height;
+    ctx->npixels = (size_t) res->width * res->height;
+
+    ctx->rgba = (struct image) { IMAGE_PIXEL_RGBA8, res->width, res->height, malloc(ctx->npixels * 4) };
+    ctx->grey = (struct image) { IMAGE_PIXEL_GREY8, res->width, res->height, malloc(ctx->npixels) };
+    ctx->grey16 = (struct image) { IMAGE_PIXEL_GREY16, res->width, res->height, malloc(ctx->npixels * 2) };
+    ctx->y10p = malloc(Y10P_SIZE(ctx->npixels));
+    ctx->dst = malloc(ctx->npixels * 4);
+    for (i = 0; i < BENCH_FILL_BUFFERS; i++) {
+        ctx->fill_buffers[i] = malloc(ctx->npixels * 2);
+        if (!ctx->fill_buffers[i]) {
+            return -ENOMEM;
+        }
+        memset(ctx->fill_buffers[i], 0, ctx->npixels * 2);
+    }
+    if (!ctx->rgba.pixels || !ctx->grey.pixels || !ctx->grey16.pixels || !ctx->y10p || !ctx->dst) {
+        return -ENOMEM;
+    }
+
+    rgba = ctx->rgba.pixels;
+    grey = ctx->grey.pixels;
+    grey16 = ctx->grey16.pixels;
+    for (y = 0, i = 0; y < res->height; y++) {
+        for (x = 0; x < res->width; x++, i++) {
+            seed = seed * 1103515245 + 12345;
+            rgba[i * 4 + 0] = x * 255 / res->width + (seed >> 28);
+            rgba[i * 4 + 1] = y * 255 / res->height + (seed >> 24 & 0xf);
+            rgba[i * 4 + 2] = (x + y) * 255 / (res->width + res->height);
+            rgba[i * 4 + 3] = 0xff;
+            grey[i] = rgba[i * 4 + 1];
+            grey16[i] = grey[i] << 8 | (seed >> 16 & 0xff);
+        }
+    }
+    memset(ctx->dst, 0, ctx->npixels * 4);
+    convert_y16_to_y10p(ctx->y10p, grey16, ctx->npixels);
+
+    snprintf(ctx->png_file, sizeof(ctx->png_file), "%s/image-bench-%d.png", tmpdir, getpid());
+    snprintf(ctx->png16_file, sizeof(ctx->png16_file), "%s/image-bench-%d-16.png", tmpdir, getpid());
+    snprintf(ctx->l8_file, sizeof(ctx->l8_file), "%s/image-bench-%d.l8", tmpdir, getpid());
+
+    ret = save_png_image(ctx->png_file, &ctx->rgba);
+    if (ret < 0) {
+        return ret;
+    }
+    ret = save_png_image(ctx->png16_file, &ctx->grey16);
+    if (ret < 0) {
+        return ret;
+    }
+    ret = write_file(ctx->l8_file, ctx->grey.pixels, ctx->npixels);
+    if (ret < 0) {
+        return ret;
+    }
+
+    return image_encode_jpeg(&ctx->rgba, 90, &ctx->jpeg, &ctx->jpeg_size);
+}
+
+static void context_cleanup(struct bench_context *ctx)
+{
+    unsigned int i;
+
+    unlink(ctx->png_file);
+    unlink(ctx->png16_file);
+    unlink(ctx->l8_file);
+
+    image_free(&ctx->rgba);
+    image_free(&ctx->grey);
+    image_free(&ctx->grey16);
+    free(ctx->y10p);
+    free(ctx->dst);
+    free(ctx->jpeg);
+    for (i = 0; i < BENCH_FILL_BUFFERS; i++) {
+        free(ctx->fill_buffers[i]);
+    }
+}
+
+/* ---------------------------------------------------------------------------
+ * Benchmarks
+ */
+
+static size_t bytes_rgba(const struct bench_context *ctx) { return ctx->npixels * 4; }
+static size_t bytes_grey(const struct bench_context *ctx) { return ctx->npixels; }
+static size_t bytes_grey16(const struct bench_context *ctx) { return ctx->npixels * 2; }
+static size_t bytes_y10p(const struct bench_context *ctx) { return Y10P_SIZE(ctx->npixels); }
+static size_t bytes_jpeg(const struct bench_context *ctx) { return ctx->jpeg_size; }
+
+static void run_rgba_yuyv(struct bench_context *ctx)
+{
+    convert_rgba_to_yuyv(ctx->dst, ctx->rgba.pixels, ctx->width, ctx->height);
+}
+
+static void run_rgba_nv12(struct bench_context *ctx)
+{
+    convert_rgba_to_nv12(ctx->dst, ctx->rgba.pixels, ctx->width, ctx->height);
+}
+
+static void run_rgba_rgb565(struct bench_context *ctx)
+{
+    convert_rgba_to_rgb565(ctx->dst, ctx->rgba.pixels, ctx->npixels);
+}
+
+static void run_rgba_grey(struct bench_context *ctx)
+{
+    convert_rgba_to_grey(ctx->dst, ctx->rgba.pixels, ctx->npixels);
+}
+
+static void run_scale_y16(struct bench_context *ctx)
+{
+    convert_scale_y16((uint16_t *) ctx->dst, ctx->grey16.pixels, ctx->npixels, 10);
+}
+
+static void run_y16_y10p(struct bench_context *ctx)
+{
+    convert_y16_to_y10p(ctx->dst, ctx->grey16.pixels, ctx->npixels);
+}
+
+static void run_y10p_y16(struct bench_context *ctx)
+{
+    convert_y10p_to_y16((uint16_t *) ctx->dst, ctx->y10p, ctx->npixels);
+}
+
+static void run_y16_grey(struct bench_context *ctx)
+{
+    convert_y16_to_grey(ctx->dst, ctx->grey16.pixels, ctx->npixels);
+}
+
+static void run_grey_y16(struct bench_context *ctx)
+{
+    convert_grey_to_y16((uint16_t *) ctx->dst, ctx->grey.pixels, ctx->npixels);
+}
+
+static void run_resize(struct bench_context *ctx)
+{
+    struct image resized;
+
+    if (image_resize(&resized, &ctx->rgba, ctx->width / 2, ctx->height / 2) == 0) {
+        image_free(&resized);
+    }
+}
+
+static void run_resize_grey16(struct bench_context *ctx)
+{
+    struct image resized;
+
+    if (image_resize(&resized, &ctx->grey16, ctx->width / 2, ctx->height / 2) == 0) {
+        image_free(&resized);
+    }
+}
+
+static void run_encode_jpeg(struct bench_context *ctx)
+{
+    unsigned long size;
+    uint8_t *jpeg;
+
+    if (image_encode_jpeg(&ctx->rgba, 90, &jpeg, &size) == 0) {
+        free(jpeg);
+    }
+}
+
+static void run_index_jpeg(struct bench_context *ctx)
+{
+    struct jpeg_frame *frames;
+    unsigned int count;
+
+    if (jpeg_index_frames(ctx->jpeg, ctx->jpeg_size, &frames, &count) == 0) {
+        free(frames);
+    }
+}
+
+static void run_load_png(struct bench_context *ctx)
+{
+    struct image image;
+
+    if (load_png_image(ctx->png_file, &image) == 0) {
+        image_free(&image);
+    }
+}
+
+static void run_load_png16(struct bench_context *ctx)
+{
+    struct image image;
+
+    if (load_png16_image(ctx->png16_file, &image) == 0) {
+        image_free(&image);
+    }
+}
+
+static void run_load_l8(struct bench_context *ctx)
+{
+    struct image image;
+
+    if (load_l8_image(ctx->l8_file, ctx->width, ctx->height, &image) == 0) {
+        image_free(&image);
+    }
+}
+
+/* Fill of the streaming loop: a converted YUYV frame copied to one buffer over and over */
+static void run_fill_same(struct bench_context *ctx)
+{
+    memcpy(ctx->fill_buffers[0], ctx->dst, ctx->npixels * 2);
+}
+
+/* Fill of the streaming loop: copied to the queued buffers in turn */
+static void run_fill_queue(struct bench_context *ctx)
+{
+    memcpy(ctx->fill_buffers[ctx->fill_next], ctx->dst, ctx->npixels * 2);
+    ctx->fill_next = (ctx->fill_next + 1) % BENCH_FILL_BUFFERS;
+}
+
+/* Fingerprint of a converted YUYV frame, compared with the copy it can save */
+static void run_hash(struct bench_context *ctx)
+{
+    ctx->hash += image_hash(ctx->dst, ctx->npixels * 2);
+}
+
+static const struct bench benches[] = {
+    { "convert_rgba_to_yuyv", bytes_rgba, run_rgba_yuyv },
+    { "convert_rgba_to_nv12", bytes_rgba, run_rgba_nv12 },
+    { "convert_rgba_to_rgb565", bytes_rgba, run_rgba_rgb565 },
+    { "convert_rgba_to_grey", bytes_rgba, run_rgba_grey },
+    { "convert_scale_y16", bytes_grey16, run_scale_y16 },
+    { "convert_y16_to_y10p", bytes_grey16, run_y16_y10p },
+    { "convert_y10p_to_y16", bytes_y10p, run_y10p_y16 },
+    { "convert_y16_to_grey", bytes_grey16, run_y16_grey },
+    { "convert_grey_to_y16", bytes_grey, run_grey_y16 },
+    { "image_resize_half", bytes_rgba, run_resize },
+    { "image_resize_half_grey16", bytes_grey16, run_resize_grey16 },
+    { "image_encode_jpeg", bytes_rgba, run_encode_jpeg },
+    { "jpeg_index_frames", bytes_jpeg, run_index_jpeg },
+    { "load_png_image", bytes_rgba, run_load_png },
+    { "load_png16_image", bytes_grey16, run_load_png16 },
+    { "load_l8_image", bytes_grey, run_load_l8 },
+    { "fill_memcpy_same", bytes_grey16, run_fill_same },
+    { "fill_memcpy_queue", bytes_grey16, run_fill_queue },
+    { "image_hash", bytes_grey16, run_hash },
+};
+
+static void bench_run(const struct bench *bench, const struct bench_resolution *res,
+        struct bench_context *ctx, double budget_ns)
+{
+    unsigned long long iterations = 0;
+    double cycles, misses;
+    double start, elapsed;
+
+    /* Warm up caches and allocator */
+    bench->run(ctx);
+
+    perf_counter_start(counters.cycles);
+    perf_counter_start(counters.cache_misses);
+    start = monotonic_ns();
+    do {
+        bench->run(ctx);
+        iterations++;
+        elapsed = monotonic_ns() - start;
+    } while (elapsed < budget_ns || iterations < BENCH_MIN_ITERATIONS);
+    cycles = perf_counter_stop(counters.cycles);
+    misses = perf_counter_stop(counters.cache_misses);
+
+    printf("%s,%s,%u,%u,%llu,%.0f,%.3f,%.3f,%.1f,%.0f\n", bench->name, res->name,
+            res->width, res->height, iterations, elapsed / iterations,
+            elapsed / iterations / ctx->npixels, cycles / iterations / ctx->npixels,
+            bench->bytes(ctx) * iterations / (elapsed / 1e9) / 1e6, misses / iterations);
+    fflush(stdout);
+}
+
+static void usage(const char *argv0)
+{
+    fprintf(stderr, "Usage: %s [options]\n", argv0);
+    fprintf(stderr, "Available options are\n");
+    fprintf(stderr, " -f name     Only run the benchmarks whose name contains name\n");
+    fprintf(stderr, " -h          Print this help screen and exit\n");
+    fprintf(stderr, " -r name     Only run at the given resolution (QVGA, VGA, HD, FHD, 4K)\n");
+    fprintf(stderr, " -t ms       Time spent per benchmark and resolution (default %d)\n", BENCH_DEFAULT_MS);
+}
+
+int main(int argc, char *argv[])
+{
+    const char *filter = NULL;
+    const char *resolution = NULL;
+    int budget_ms = BENCH_DEFAULT_MS;
+    struct bench_context ctx;
+    unsigned int r, b;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "hf:r:t:")) != -1) {
+        switch (opt) {
+            case 'f':
+                filter = optarg;
+                break;
+
+            case 'r':
+                resolution = optarg;
+                break;
+
+            case 't':
+                budget_ms = atoi(optarg);
+                if (budget_ms < 1) {
+                    fprintf(stderr, "ERROR: Invalid benchmark time\n");
+                    return 1;
+                }
+                break;
+
+            case 'h':
+                usage(argv[0]);
+                return 0;
+
+            default:
+                usage(argv[0]);
+                return 1;
+        }
+    }
+
+    for (r = 0; resolution && r < ARRAY_SIZE(resolutions); r++) {
+        if (!strcasecmp(resolution, resolutions[r].name)) {
+            break;
+        }
+    }
+    if (r == ARRAY_SIZE(resolutions)) {
+        fprintf(stderr, "ERROR: Unknown resolution %s\n", resolution);
+        return 1;
+    }
+
+    for (b = 0; filter && b < ARRAY_SIZE(benches); b++) {
+        if (strstr(benches[b].name, filter)) {
+            break;
+        }
+    }
+    if (b == ARRAY_SIZE(benches)) {
+        fprintf(stderr, "ERROR: No benchmark matches %s\n", filter);
+        return 1;
+    }
+
+    perf_counters_open();
+
+    /*
+     * ns_per_pixel and cycles_per_pixel are per pixel of the resolution,
+     * mb_per_s counts the input bytes of the benchmark (source pixels,
+     * file content or copied frame)
+     */
+    printf("bench,resolution,width,height,iterations,ns_per_iteration,ns_per_pixel,"
+            "cycles_per_pixel,mb_per_s,cache_misses_per_iteration\n");
+
+    for (r = 0; r < ARRAY_SIZE(resolutions); r++) {
+        if (resolution && strcasecmp(resolution, resolutions[r].name) != 0) {
+            continue;
+        }
+
+        if (context_init(&ctx, &resolutions[r]) < 0) {
+            fprintf(stderr, "BENCH: Could not prepare the %s inputs\n", resolutions[r].name);
+            context_cleanup(&ctx);
+            return 1;
+        }
+
+        for (b = 0; b < ARRAY_SIZE(benches); b++) {
+            if (filter && !strstr(benches[b].name, filter)) {
+                continue;
+            }
+            bench_run(&benches[b], &resolutions[r], &ctx, budget_ms * 1e6);
+        }
+
+        context_cleanup(&ctx);
+    }
+
+    return 0;
+}
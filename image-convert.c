@@ -0,0 +1,1474 @@
+/*
+ * Pixel format loaders and conversion kernels
+ *
+ * The kernels below have a vectorized path for SSE2 (x86) and NEON (ARM)
+ * and a plain C fallback which is also used for the tail of each row.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ */
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <setjmp.h>
+#include <png.h>
+#include <jpeglib.h>
+
+#include <linux/videodev2.h>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#elif defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
+
+#include "image-convert.h"
+
+/* ---------------------------------------------------------------------------
+ * Image loaders
+ */
+
+static int png_read(FILE *fp, struct image *image, enum image_pixel_type type,
+        unsigned int *bits)
+{
+    png_structp png;
+    png_infop info;
+    png_color_8p sig_bit;
+    png_byte color_type;
+    png_byte bit_depth;
+    png_bytep *volatile row_pointers = NULL;
+    uint8_t *volatile buffer = NULL;
+    size_t rowbytes;
+    unsigned int width;
+    unsigned int height;
+
+    png = png_create_read_struct(PNG_LIBPNG_VER_STRING, NULL, NULL, NULL);
+    if (!png) {
+        return -ENOMEM;
+    }
+
+    info = png_create_info_struct(png);
+    if (!info) {
+        png_destroy_read_struct(&png, NULL, NULL);
+        return -ENOMEM;
+    }
+
+    if (setjmp(png_jmpbuf(png))) {
+        free(row_pointers);
+        free(buffer);
+        png_destroy_read_struct(&png, &info, NULL);
+        return -EINVAL;
+    }
+
+    png_init_io(png, fp);
+    png_read_info(png, info);
+
+    width      = png_get_image_width(png, info);
+    height     = png_get_image_height(png, info);
+    color_type = png_get_color_type(png, info);
+    bit_depth  = png_get_bit_depth(png, info);
+
+    *bits = bit_depth;
+
+    if (type == IMAGE_PIXEL_RGBA8) {
+        // Read any color_type into 8 bit depth, RGBA format.
+        // See http://www.libpng.org/pub/png/libpng-manual.txt
+        if (bit_depth == 16)
+            png_set_strip_16(png);
+
+        if (color_type == PNG_COLOR_TYPE_PALETTE)
+            png_set_palette_to_rgb(png);
+
+        // PNG_COLOR_TYPE_GRAY_ALPHA is always 8 or 16bit depth
+        if (color_type == PNG_COLOR_TYPE_GRAY && bit_depth < 8)
+            png_set_expand_gray_1_2_4_to_8(png);
+
+        if (png_get_valid(png, info, PNG_INFO_tRNS))
+            png_set_tRNS_to_alpha(png);
+
+        // These color_type don't have an alpha channel then fill it with 0xff.
+        if (color_type == PNG_COLOR_TYPE_RGB ||
+                color_type == PNG_COLOR_TYPE_GRAY ||
+                color_type == PNG_COLOR_TYPE_PALETTE)
+            png_set_filler(png, 0xFF, PNG_FILLER_AFTER);
+
+        if (color_type == PNG_COLOR_TYPE_GRAY ||
+                color_type == PNG_COLOR_TYPE_GRAY_ALPHA)
+            png_set_gray_to_rgb(png);
+
+    } else {
+        // Significant bits of a greyscale image, e.g. 10 for data of a 10-bit sensor
+        if (bit_depth == 16 && color_type == PNG_COLOR_TYPE_GRAY &&
+                png_get_sBIT(png, info, &sig_bit) & PNG_INFO_sBIT) {
+            *bits = sig_bit->gray;
+        }
+
+        // Read any color_type into 16 bit depth, greyscale format.
+        if (color_type == PNG_COLOR_TYPE_PALETTE)
+            png_set_palette_to_rgb(png);
+
+        if (color_type == PNG_COLOR_TYPE_GRAY && bit_depth < 8)
+            png_set_expand_gray_1_2_4_to_8(png);
+
+        if (color_type & PNG_COLOR_MASK_ALPHA)
+            png_set_strip_alpha(png);
+
+        if (color_type & (PNG_COLOR_MASK_COLOR | PNG_COLOR_MASK_PALETTE))
+            png_set_rgb_to_gray_fixed(png, 1, -1, -1);
+
+        if (bit_depth < 16)
+            png_set_expand_16(png);
+
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+        png_set_swap(png);
+#endif
+    }
+
+    png_read_update_info(png, info);
+
+    rowbytes = png_get_rowbytes(png, info);
+    if (rowbytes != (size_t) width * ((type == IMAGE_PIXEL_RGBA8) ? 4 : 2)) {
+        png_error(png, "unexpected row size");
+    }
+
+    buffer = malloc(rowbytes * height);
+    row_pointers = malloc(sizeof(png_bytep) * height);
+    if (buffer == NULL || row_pointers == NULL) {
+        png_error(png, "out of memory");
+    }
+
+    for (unsigned int y = 0; y < height; y++) {
+        row_pointers[y] = buffer + rowbytes * y;
+    }
+
+    png_read_image(png, row_pointers);
+    png_destroy_read_struct(&png, &info, NULL);
+    free(row_pointers);
+
+    image->type = type;
+    image->width = width;
+    image->height = height;
+    image->pixels = buffer;
+    return 0;
+}
+
+/*
+ * Load PNG image
+ */
+int load_png_image(const char *filename, struct image *image)
+{
+    unsigned int bits;
+    int ret;
+
+    FILE *fp = fopen(filename, "rb");
+    if (fp == NULL) {
+        printf("[-] Error: Could not open PNG image '%s'\n", filename);
+        return -ENOENT;
+    }
+
+    ret = png_read(fp, image, IMAGE_PIXEL_RGBA8, &bits);
+    fclose(fp);
+    return ret;
+}
+
+/*
+ * Load 16-bit PNG image (greyscale)
+ */
+int load_png16_image(const char *filename, struct image *image)
+{
+    unsigned int bits;
+    uint16_t max_value = 0;
+    uint16_t *pixels;
+    size_t npixels;
+    size_t i;
+    int ret;
+
+    FILE *fp = fopen(filename, "rb");
+    if (fp == NULL) {
+        printf("[-] Error: Could not open PNG image '%s'\n", filename);
+        return -ENOENT;
+    }
+
+    ret = png_read(fp, image, IMAGE_PIXEL_GREY16, &bits);
+    fclose(fp);
+    if (ret < 0) {
+        return ret;
+    }
+
+    /*
+     * Depth and IR pipelines often store the raw N-bit sensor values in a 16-bit
+     * PNG together with an sBIT chunk instead of scaling them to the full range.
+     * Scale such images up, so Y16 output is always MSB aligned.
+     */
+    pixels = image->pixels;
+    npixels = (size_t) image->width * image->height;
+    if (bits < 16) {
+        for (i = 0; i < npixels; i++) {
+            max_value = max_value > pixels[i] ? max_value : pixels[i];
+        }
+
+        if (max_value < (1 << bits)) {
+            convert_scale_y16(pixels, pixels, npixels, bits);
+        }
+    }
+
+    return 0;
+}
+
+/*
+ * Load raw video frame (GREY, Y16, Y10P or YUYV)
+ */
+int load_raw_image(const char *filename, unsigned int fourcc, unsigned int width,
+        unsigned int height, struct image *image)
+{
+    size_t npixels = (size_t) width * height;
+    size_t size = image_frame_size(fourcc, width, height);
+    uint8_t *frame;
+    long file_size;
+
+    switch (fourcc) {
+        case V4L2_PIX_FMT_GREY:
+        case V4L2_PIX_FMT_Y16:
+        case V4L2_PIX_FMT_Y10P:
+            break;
+
+        case V4L2_PIX_FMT_YUYV:
+            if (width % 2) {
+                return -EINVAL;
+            }
+            break;
+
+        default:
+            return -EINVAL;
+    }
+
+    FILE *fp = fopen(filename, "rb");
+    if (fp == NULL) {
+        printf("[-] Error: Could not open raw image '%s'\n", filename);
+        return -ENOENT;
+    }
+
+    fseek(fp, 0, SEEK_END);
+    file_size = ftell(fp);
+    fseek(fp, 0, SEEK_SET);
+
+    if (file_size < (long) size) {
+        printf("[-] Error: Raw image '%s' is smaller than %ux%u\n", filename, width, height);
+        fclose(fp);
+        return -EINVAL;
+    }
+
+    frame = malloc(size);
+    if (frame == NULL) {
+        fclose(fp);
+        return -ENOMEM;
+    }
+
+    if (fread(frame, 1, size, fp) != size) {
+        free(frame);
+        fclose(fp);
+        return -EIO;
+    }
+
+    fclose(fp);
+
+    image->width = width;
+    image->height = height;
+
+    switch (fourcc) {
+        case V4L2_PIX_FMT_GREY:
+            image->type = IMAGE_PIXEL_GREY8;
+            image->pixels = frame;
+            return 0;
+
+        case V4L2_PIX_FMT_Y16:
+            image->type = IMAGE_PIXEL_GREY16;
+            image->pixels = frame;
+            return 0;
+
+        case V4L2_PIX_FMT_Y10P:
+            image->type = IMAGE_PIXEL_GREY16;
+            image->pixels = malloc(npixels * 2);
+            if (image->pixels) {
+                convert_y10p_to_y16(image->pixels, frame, npixels);
+            }
+            break;
+
+        default:
+            image->type = IMAGE_PIXEL_RGBA8;
+            image->pixels = malloc(npixels * 4);
+            if (image->pixels) {
+                convert_yuyv_to_rgba(image->pixels, frame, width, height);
+            }
+            break;
+    }
+
+    free(frame);
+    return (image->pixels) ? 0 : -ENOMEM;
+}
+
+/*
+ * Load L8 image (8-bit grayscale)
+ */
+int load_l8_image(const char *filename, unsigned int width, unsigned int height,
+        struct image *image)
+{
+    return load_raw_image(filename, V4L2_PIX_FMT_GREY, width, height, image);
+}
+
+/*
+ * Save image as PNG: RGBA8 as RGBA, GREY8 as 8-bit and GREY16 as 16-bit greyscale
+ */
+int save_png_image(const char *filename, const struct image *image)
+{
+    png_image png;
+
+    memset(&png, 0, sizeof(png));
+    png.version = PNG_IMAGE_VERSION;
+    png.width = image->width;
+    png.height = image->height;
+
+    switch (image->type) {
+        case IMAGE_PIXEL_RGBA8:
+            png.format = PNG_FORMAT_RGBA;
+            break;
+
+        case IMAGE_PIXEL_GREY8:
+            png.format = PNG_FORMAT_GRAY;
+            break;
+
+        case IMAGE_PIXEL_GREY16:
+            png.format = PNG_FORMAT_LINEAR_Y;
+            break;
+    }
+
+    if (!png_image_write_to_file(&png, filename, 0, image->pixels, 0, NULL)) {
+        printf("[-] Error: Could not write PNG image '%s': %s\n", filename, png.message);
+        return -EIO;
+    }
+
+    return 0;
+}
+
+void image_free(struct image *image)
+{
+    free(image->pixels);
+    image->pixels = NULL;
+}
+
+static unsigned int image_bytes_per_pixel(enum image_pixel_type type)
+{
+    switch (type) {
+        case IMAGE_PIXEL_RGBA8:
+            return 4;
+
+        case IMAGE_PIXEL_GREY16:
+            return 2;
+
+        default:
+            return 1;
+    }
+}
+
+/* ---------------------------------------------------------------------------
+ * Scaling
+ */
+
+#define RESIZE_LERP(a, b, f) ((a) + ((((int) (b) - (int) (a)) * (int) (f)) >> 16))
+/* 16-bit samples: a difference of up to 65535 times a 16-bit fraction overflows int */
+#define RESIZE_LERP16(a, b, f) ((a) + (int) ((((int64_t) (b) - (a)) * (f)) >> 16))
+
+int image_resize(struct image *dst, const struct image *src, unsigned int width, unsigned int height)
+{
+    unsigned int bpp = image_bytes_per_pixel(src->type);
+    unsigned int channels = (src->type == IMAGE_PIXEL_RGBA8) ? 4 : 1;
+    uint32_t step_x;
+    uint32_t step_y;
+
+    if (!width || !height || !src->width || !src->height) {
+        return -EINVAL;
+    }
+
+    dst->type = src->type;
+    dst->width = width;
+    dst->height = height;
+    dst->pixels = malloc((size_t) width * height * bpp);
+    if (dst->pixels == NULL) {
+        return -ENOMEM;
+    }
+
+    /* 16.16 fixed point source position of each destination pixel (pixel centers aligned) */
+    step_x = ((uint64_t) src->width << 16) / width;
+    step_y = ((uint64_t) src->height << 16) / height;
+
+    for (unsigned int y = 0; y < height; y++) {
+        int64_t sy = (int64_t) y * step_y + step_y / 2 - 0x8000;
+        unsigned int y0 = (sy < 0) ? 0 : sy >> 16;
+        unsigned int y1 = (y0 + 1 < src->height) ? y0 + 1 : y0;
+        uint32_t fy = (sy < 0) ? 0 : sy & 0xffff;
+
+        for (unsigned int x = 0; x < width; x++) {
+            int64_t sx = (int64_t) x * step_x + step_x / 2 - 0x8000;
+            unsigned int x0 = (sx < 0) ? 0 : sx >> 16;
+            unsigned int x1 = (x0 + 1 < src->width) ? x0 + 1 : x0;
+            uint32_t fx = (sx < 0) ? 0 : sx & 0xffff;
+
+            for (unsigned int c = 0; c < channels; c++) {
+                size_t i00 = ((size_t) y0 * src->width + x0) * channels + c;
+                size_t i01 = ((size_t) y0 * src->width + x1) * channels + c;
+                size_t i10 = ((size_t) y1 * src->width + x0) * channels + c;
+                size_t i11 = ((size_t) y1 * src->width + x1) * channels + c;
+                size_t o = ((size_t) y * width + x) * channels + c;
+
+                if (bpp == 2) {
+                    const uint16_t *p = src->pixels;
+                    int top = RESIZE_LERP16(p[i00], p[i01], fx);
+                    int bottom = RESIZE_LERP16(p[i10], p[i11], fx);
+                    ((uint16_t *) dst->pixels)[o] = RESIZE_LERP16(top, bottom, fy);
+                } else {
+                    const uint8_t *p = src->pixels;
+                    int top = RESIZE_LERP(p[i00], p[i01], fx);
+                    int bottom = RESIZE_LERP(p[i10], p[i11], fx);
+                    ((uint8_t *) dst->pixels)[o] = RESIZE_LERP(top, bottom, fy);
+                }
+            }
+        }
+    }
+
+    return 0;
+}
+
+/* ---------------------------------------------------------------------------
+ * JPEG encoding
+ */
+
+struct jpeg_error {
+    struct jpeg_error_mgr mgr;
+    jmp_buf jmp;
+};
+
+static void jpeg_error_exit(j_common_ptr cinfo)
+{
+    struct jpeg_error *err = (struct jpeg_error *) cinfo->err;
+    char message[JMSG_LENGTH_MAX];
+
+    (*cinfo->err->format_message)(cinfo, message);
+    printf("[-] Error: JPEG encoder: %s\n", message);
+    longjmp(err->jmp, 1);
+}
+
+int image_encode_jpeg(const struct image *src, unsigned int quality,
+        uint8_t **jpeg, unsigned long *size)
+{
+    struct jpeg_compress_struct cinfo;
+    struct jpeg_error err;
+    unsigned char *volatile buffer = NULL;
+    unsigned long buffer_size = 0;
+    uint8_t *volatile row = NULL;
+    JSAMPROW row_pointer;
+
+    cinfo.err = jpeg_std_error(&err.mgr);
+    err.mgr.error_exit = jpeg_error_exit;
+
+    if (setjmp(err.jmp)) {
+        jpeg_destroy_compress(&cinfo);
+        free(buffer);
+        free(row);
+        return -EINVAL;
+    }
+
+    jpeg_create_compress(&cinfo);
+    jpeg_mem_dest(&cinfo, (unsigned char **) &buffer, &buffer_size);
+
+    cinfo.image_width = src->width;
+    cinfo.image_height = src->height;
+
+    /* Greyscale sources are expanded to RGB, hosts expect YCbCr MJPEG */
+#ifdef JCS_EXTENSIONS
+    if (src->type == IMAGE_PIXEL_RGBA8) {
+        cinfo.input_components = 4;
+        cinfo.in_color_space = JCS_EXT_RGBA;
+    } else
+#endif
+    {
+        cinfo.input_components = 3;
+        cinfo.in_color_space = JCS_RGB;
+        row = malloc((size_t) src->width * 3);
+        if (row == NULL) {
+            jpeg_destroy_compress(&cinfo);
+            return -ENOMEM;
+        }
+    }
+
+    jpeg_set_defaults(&cinfo);
+    jpeg_set_colorspace(&cinfo, JCS_YCbCr);
+    jpeg_set_quality(&cinfo, quality, TRUE);
+
+    /* YCbCr 4:2:2, the subsampling used by most UVC cameras */
+    cinfo.comp_info[0].h_samp_factor = 2;
+    cinfo.comp_info[0].v_samp_factor = 1;
+
+    jpeg_start_compress(&cinfo, TRUE);
+
+    while (cinfo.next_scanline < cinfo.image_height) {
+        size_t offset = (size_t) cinfo.next_scanline * src->width;
+
+        if (row == NULL) {
+            row_pointer = (uint8_t *) src->pixels + offset * 4;
+        } else {
+            for (unsigned int x = 0; x < src->width; x++) {
+                uint8_t v;
+
+                switch (src->type) {
+                    case IMAGE_PIXEL_RGBA8:
+                        memcpy(&row[x * 3], (uint8_t *) src->pixels + (offset + x) * 4, 3);
+                        continue;
+
+                    case IMAGE_PIXEL_GREY16:
+                        v = ((uint16_t *) src->pixels)[offset + x] >> 8;
+                        break;
+
+                    default:
+                        v = ((uint8_t *) src->pixels)[offset + x];
+                        break;
+                }
+                row[x * 3] = row[x * 3 + 1] = row[x * 3 + 2] = v;
+            }
+            row_pointer = row;
+        }
+
+        jpeg_write_scanlines(&cinfo, &row_pointer, 1);
+    }
+
+    jpeg_finish_compress(&cinfo);
+    jpeg_destroy_compress(&cinfo);
+    free(row);
+
+    *jpeg = buffer;
+    *size = buffer_size;
+    return 0;
+}
+
+/* ---------------------------------------------------------------------------
+ * JPEG stream indexing
+ */
+
+#define JPEG_MARKER_SOI  0xd8
+#define JPEG_MARKER_EOI  0xd9
+#define JPEG_MARKER_SOS  0xda
+#define JPEG_MARKER_TEM  0x01
+
+#define JPEG_IS_RST(m) ((m) >= 0xd0 && (m) <= 0xd7)
+#define JPEG_IS_SOF(m) ((m) >= 0xc0 && (m) <= 0xcf && (m) != 0xc4 && (m) != 0xc8 && (m) != 0xcc)
+
+static inline unsigned int jpeg_be16(const uint8_t *p)
+{
+    return (p[0] << 8) | p[1];
+}
+
+/*
+ * Walk the segments of one frame starting after SOI. Returns the offset
+ * after EOI or 0 if the frame is truncated or corrupt.
+ */
+static size_t jpeg_walk_frame(const uint8_t *data, size_t size, size_t pos, struct jpeg_frame *frame)
+{
+    unsigned int marker;
+    unsigned int length;
+
+    while (pos + 2 <= size) {
+        if (data[pos] != 0xff) {
+            return 0;
+        }
+
+        /* fill bytes */
+        while (pos + 1 < size && data[pos + 1] == 0xff) {
+            pos++;
+        }
+
+        if (pos + 2 > size) {
+            return 0;
+        }
+
+        marker = data[pos + 1];
+        pos += 2;
+
+        if (marker == JPEG_MARKER_EOI) {
+            return pos;
+        }
+
+        if (marker == JPEG_MARKER_TEM || JPEG_IS_RST(marker)) {
+            continue;
+        }
+
+        if (marker == JPEG_MARKER_SOI || pos + 2 > size) {
+            return 0;
+        }
+
+        length = jpeg_be16(&data[pos]);
+        if (length < 2 || pos + length > size) {
+            return 0;
+        }
+
+        if (JPEG_IS_SOF(marker) && length >= 7) {
+            frame->height = jpeg_be16(&data[pos + 3]);
+            frame->width = jpeg_be16(&data[pos + 5]);
+        }
+
+        pos += length;
+
+        if (marker == JPEG_MARKER_SOS) {
+            /* entropy coded data ends at the first marker other than RSTn (0xff00 is stuffing) */
+            while (pos + 1 < size) {
+                if (data[pos] == 0xff && data[pos + 1] != 0x00 && !JPEG_IS_RST(data[pos + 1])) {
+                    break;
+                }
+                pos++;
+            }
+        }
+    }
+
+    return 0;
+}
+
+int jpeg_index_frames(const uint8_t *data, size_t size, struct jpeg_frame **frames,
+        unsigned int *count)
+{
+    struct jpeg_frame *list = NULL;
+    struct jpeg_frame *tmp;
+    struct jpeg_frame frame;
+    unsigned int capacity = 0;
+    unsigned int n = 0;
+    size_t pos = 0;
+    size_t end;
+
+    while (pos + 4 <= size) {
+        if (data[pos] != 0xff || data[pos + 1] != JPEG_MARKER_SOI) {
+            pos++;
+            continue;
+        }
+
+        frame.offset = pos;
+        frame.width = 0;
+        frame.height = 0;
+
+        end = jpeg_walk_frame(data, size, pos + 2, &frame);
+        if (!end || !frame.width || !frame.height) {
+            /* resynchronize on the next SOI */
+            pos += 2;
+            continue;
+        }
+
+        frame.size = end - pos;
+        pos = end;
+
+        if (n == capacity) {
+            capacity = capacity ? capacity * 2 : 16;
+            tmp = realloc(list, capacity * sizeof(*list));
+            if (tmp == NULL) {
+                free(list);
+                return -ENOMEM;
+            }
+            list = tmp;
+        }
+        list[n++] = frame;
+    }
+
+    *frames = list;
+    *count = n;
+    return 0;
+}
+
+/* ---------------------------------------------------------------------------
+ * Conversion dispatch
+ */
+
+unsigned int image_frame_size(unsigned int fourcc, unsigned int width, unsigned int height)
+{
+    switch (fourcc) {
+        case V4L2_PIX_FMT_YUYV:
+        case V4L2_PIX_FMT_RGB565:
+        case V4L2_PIX_FMT_Y16:
+            return width * height * 2;
+
+        case V4L2_PIX_FMT_NV12:
+            return width * height * 3 / 2;
+
+        case V4L2_PIX_FMT_GREY:
+            return width * height;
+
+        case V4L2_PIX_FMT_Y10P:
+            return Y10P_SIZE(width * height);
+    }
+
+    return 0;
+}
+
+static int image_to_type(struct image *dst, const struct image *src, enum image_pixel_type type)
+{
+    size_t npixels = (size_t) src->width * src->height;
+    uint8_t *grey;
+
+    dst->type = type;
+    dst->width = src->width;
+    dst->height = src->height;
+    dst->pixels = malloc(npixels * image_bytes_per_pixel(type));
+    if (dst->pixels == NULL) {
+        return -ENOMEM;
+    }
+
+    switch (src->type) {
+        case IMAGE_PIXEL_RGBA8:
+            if (type == IMAGE_PIXEL_GREY8) {
+                convert_rgba_to_grey(dst->pixels, src->pixels, npixels);
+                return 0;
+            }
+
+            grey = malloc(npixels);
+            if (grey == NULL) {
+                break;
+            }
+            convert_rgba_to_grey(grey, src->pixels, npixels);
+            convert_grey_to_y16(dst->pixels, grey, npixels);
+            free(grey);
+            return 0;
+
+        case IMAGE_PIXEL_GREY8:
+            convert_grey_to_y16(dst->pixels, src->pixels, npixels);
+            return 0;
+
+        case IMAGE_PIXEL_GREY16:
+            convert_y16_to_grey(dst->pixels, src->pixels, npixels);
+            return 0;
+    }
+
+    image_free(dst);
+    return -ENOMEM;
+}
+
+static void kernel_rgba_yuyv(void *dst, const struct image *src)
+{
+    convert_rgba_to_yuyv(dst, src->pixels, src->width, src->height);
+}
+
+static void kernel_rgba_nv12(void *dst, const struct image *src)
+{
+    convert_rgba_to_nv12(dst, src->pixels, src->width, src->height);
+}
+
+static void kernel_rgba_rgb565(void *dst, const struct image *src)
+{
+    convert_rgba_to_rgb565(dst, src->pixels, (size_t) src->width * src->height);
+}
+
+static void kernel_rgba_grey(void *dst, const struct image *src)
+{
+    convert_rgba_to_grey(dst, src->pixels, (size_t) src->width * src->height);
+}
+
+static void kernel_grey_grey(void *dst, const struct image *src)
+{
+    memcpy(dst, src->pixels, (size_t) src->width * src->height);
+}
+
+static void kernel_grey_yuyv(void *dst, const struct image *src)
+{
+    size_t npixels = (size_t) src->width * src->height;
+    const uint8_t *grey = src->pixels;
+    uint8_t *yuyv = dst;
+
+    for (size_t i = 0; i < npixels; i++) {
+        yuyv[2 * i] = grey[i];
+        yuyv[2 * i + 1] = 128;
+    }
+}
+
+static void kernel_grey_nv12(void *dst, const struct image *src)
+{
+    size_t npixels = (size_t) src->width * src->height;
+
+    memcpy(dst, src->pixels, npixels);
+    memset((uint8_t *) dst + npixels, 128, npixels / 2);
+}
+
+static void kernel_grey_rgb565(void *dst, const struct image *src)
+{
+    size_t npixels = (size_t) src->width * src->height;
+    const uint8_t *grey = src->pixels;
+    uint16_t *rgb = dst;
+
+    for (size_t i = 0; i < npixels; i++) {
+        rgb[i] = ((grey[i] >> 3) << 11) | ((grey[i] >> 2) << 5) | (grey[i] >> 3);
+    }
+}
+
+static void kernel_grey_y16(void *dst, const struct image *src)
+{
+    convert_grey_to_y16(dst, src->pixels, (size_t) src->width * src->height);
+}
+
+static void kernel_grey16_y16(void *dst, const struct image *src)
+{
+    memcpy(dst, src->pixels, (size_t) src->width * src->height * 2);
+}
+
+static void kernel_grey16_y10p(void *dst, const struct image *src)
+{
+    convert_y16_to_y10p(dst, src->pixels, (size_t) src->width * src->height);
+}
+
+static void kernel_grey16_grey(void *dst, const struct image *src)
+{
+    convert_y16_to_grey(dst, src->pixels, (size_t) src->width * src->height);
+}
+
+/*
+ * Conversion kernels per source pixel type and video format. Combinations
+ * without a direct kernel are converted via an intermediate pixel type.
+ */
+static const struct {
+    enum image_pixel_type type;
+    unsigned int fourcc;
+    void (*kernel)(void *dst, const struct image *src);
+    enum image_pixel_type via;
+} image_kernels[] = {
+    { IMAGE_PIXEL_RGBA8,  V4L2_PIX_FMT_YUYV,   kernel_rgba_yuyv,   0 },
+    { IMAGE_PIXEL_RGBA8,  V4L2_PIX_FMT_NV12,   kernel_rgba_nv12,   0 },
+    { IMAGE_PIXEL_RGBA8,  V4L2_PIX_FMT_RGB565, kernel_rgba_rgb565, 0 },
+    { IMAGE_PIXEL_RGBA8,  V4L2_PIX_FMT_GREY,   kernel_rgba_grey,   0 },
+    { IMAGE_PIXEL_RGBA8,  V4L2_PIX_FMT_Y16,    NULL,               IMAGE_PIXEL_GREY16 },
+    { IMAGE_PIXEL_RGBA8,  V4L2_PIX_FMT_Y10P,   NULL,               IMAGE_PIXEL_GREY16 },
+    { IMAGE_PIXEL_GREY8,  V4L2_PIX_FMT_GREY,   kernel_grey_grey,   0 },
+    { IMAGE_PIXEL_GREY8,  V4L2_PIX_FMT_YUYV,   kernel_grey_yuyv,   0 },
+    { IMAGE_PIXEL_GREY8,  V4L2_PIX_FMT_NV12,   kernel_grey_nv12,   0 },
+    { IMAGE_PIXEL_GREY8,  V4L2_PIX_FMT_RGB565, kernel_grey_rgb565, 0 },
+    { IMAGE_PIXEL_GREY8,  V4L2_PIX_FMT_Y16,    kernel_grey_y16,    0 },
+    { IMAGE_PIXEL_GREY8,  V4L2_PIX_FMT_Y10P,   NULL,               IMAGE_PIXEL_GREY16 },
+    { IMAGE_PIXEL_GREY16, V4L2_PIX_FMT_Y16,    kernel_grey16_y16,  0 },
+    { IMAGE_PIXEL_GREY16, V4L2_PIX_FMT_Y10P,   kernel_grey16_y10p, 0 },
+    { IMAGE_PIXEL_GREY16, V4L2_PIX_FMT_GREY,   kernel_grey16_grey, 0 },
+    { IMAGE_PIXEL_GREY16, V4L2_PIX_FMT_YUYV,   NULL,               IMAGE_PIXEL_GREY8 },
+    { IMAGE_PIXEL_GREY16, V4L2_PIX_FMT_NV12,   NULL,               IMAGE_PIXEL_GREY8 },
+    { IMAGE_PIXEL_GREY16, V4L2_PIX_FMT_RGB565, NULL,               IMAGE_PIXEL_GREY8 },
+};
+
+int image_convert(void *dst, unsigned int fourcc, const struct image *src)
+{
+    struct image tmp;
+    unsigned int i;
+    int ret;
+
+    for (i = 0; i < sizeof(image_kernels) / sizeof(image_kernels[0]); i++) {
+        if (image_kernels[i].type != src->type || image_kernels[i].fourcc != fourcc) {
+            continue;
+        }
+
+        if (image_kernels[i].kernel) {
+            image_kernels[i].kernel(dst, src);
+            return 0;
+        }
+
+        ret = image_to_type(&tmp, src, image_kernels[i].via);
+        if (ret < 0) {
+            return ret;
+        }
+
+        ret = image_convert(dst, fourcc, &tmp);
+        image_free(&tmp);
+        return ret;
+    }
+
+    return -EINVAL;
+}
+
+/* ---------------------------------------------------------------------------
+ * Colour kernels
+ */
+
+/*
+ * RGB to YUYV conversion 
+ */
+
+static const unsigned int mult_38[256] = {0, 38, 76, 114, 152, 190, 228, 266, 304, 342, 380, 418, 456, 494, 532,
+    570, 608, 646, 684, 722, 760, 798, 836, 874, 912, 950, 988, 1026, 1064, 1102, 1140, 1178, 1216,
+    1254, 1292, 1330, 1368, 1406, 1444, 1482, 1520, 1558, 1596, 1634, 1672, 1710, 1748, 1786, 1824,
+    1862, 1900, 1938, 1976, 2014, 2052, 2090, 2128, 2166, 2204, 2242, 2280, 2318, 2356, 2394, 2432,
+    2470, 2508, 2546, 2584, 2622, 2660, 2698, 2736, 2774, 2812, 2850, 2888, 2926, 2964, 3002, 3040,
+    3078, 3116, 3154, 3192, 3230, 3268, 3306, 3344, 3382, 3420, 3458, 3496, 3534, 3572, 3610, 3648,
+    3686, 3724, 3762, 3800, 3838, 3876, 3914, 3952, 3990, 4028, 4066, 4104, 4142, 4180, 4218, 4256,
+    4294, 4332, 4370, 4408, 4446, 4484, 4522, 4560, 4598, 4636, 4674, 4712, 4750, 4788, 4826, 4864,
+    4902, 4940, 4978, 5016, 5054, 5092, 5130, 5168, 5206, 5244, 5282, 5320, 5358, 5396, 5434, 5472,
+    5510, 5548, 5586, 5624, 5662, 5700, 5738, 5776, 5814, 5852, 5890, 5928, 5966, 6004, 6042, 6080,
+    6118, 6156, 6194, 6232, 6270, 6308, 6346, 6384, 6422, 6460, 6498, 6536, 6574, 6612, 6650, 6688,
+    6726, 6764, 6802, 6840, 6878, 6916, 6954, 6992, 7030, 7068, 7106, 7144, 7182, 7220, 7258, 7296,
+    7334, 7372, 7410, 7448, 7486, 7524, 7562, 7600, 7638, 7676, 7714, 7752, 7790, 7828, 7866, 7904,
+    7942, 7980, 8018, 8056, 8094, 8132, 8170, 8208, 8246, 8284, 8322, 8360, 8398, 8436, 8474, 8512,
+    8550, 8588, 8626, 8664, 8702, 8740, 8778, 8816, 8854, 8892, 8930, 8968, 9006, 9044, 9082, 9120,
+    9158, 9196, 9234, 9272, 9310, 9348, 9386, 9424, 9462, 9500, 9538, 9576, 9614, 9652, 9690
+};
+
+static const unsigned int mult_74[256] = {0, 74, 148, 222, 296, 370, 444, 518, 592, 666, 740, 814, 888, 962,
+    1036, 1110, 1184, 1258, 1332, 1406, 1480, 1554, 1628, 1702, 1776, 1850, 1924, 1998, 2072, 2146,
+    2220, 2294, 2368, 2442, 2516, 2590, 2664, 2738, 2812, 2886, 2960, 3034, 3108, 3182, 3256, 3330,
+    3404, 3478, 3552, 3626, 3700, 3774, 3848, 3922, 3996, 4070, 4144, 4218, 4292, 4366, 4440, 4514,
+    4588, 4662, 4736, 4810, 4884, 4958, 5032, 5106, 5180, 5254, 5328, 5402, 5476, 5550, 5624, 5698,
+    5772, 5846, 5920, 5994, 6068, 6142, 6216, 6290, 6364, 6438, 6512, 6586, 6660, 6734, 6808, 6882,
+    6956, 7030, 7104, 7178, 7252, 7326, 7400, 7474, 7548, 7622, 7696, 7770, 7844, 7918, 7992, 8066,
+    8140, 8214, 8288, 8362, 8436, 8510, 8584, 8658, 8732, 8806, 8880, 8954, 9028, 9102, 9176, 9250,
+    9324, 9398, 9472, 9546, 9620, 9694, 9768, 9842, 9916, 9990, 10064, 10138, 10212, 10286, 10360,
+    10434, 10508, 10582, 10656, 10730, 10804, 10878, 10952, 11026, 11100, 11174, 11248, 11322, 11396,
+    11470, 11544, 11618, 11692, 11766, 11840, 11914, 11988, 12062, 12136, 12210, 12284, 12358, 12432,
+    12506, 12580, 12654, 12728, 12802, 12876, 12950, 13024, 13098, 13172, 13246, 13320, 13394, 13468,
+    13542, 13616, 13690, 13764, 13838, 13912, 13986, 14060, 14134, 14208, 14282, 14356, 14430, 14504,
+    14578, 14652, 14726, 14800, 14874, 14948, 15022, 15096, 15170, 15244, 15318, 15392, 15466, 15540,
+    15614, 15688, 15762, 15836, 15910, 15984, 16058, 16132, 16206, 16280, 16354, 16428, 16502, 16576,
+    16650, 16724, 16798, 16872, 16946, 17020, 17094, 17168, 17242, 17316, 17390, 17464, 17538, 17612,
+    17686, 17760, 17834, 17908, 17982, 18056, 18130, 18204, 18278, 18352, 18426, 18500, 18574, 18648,
+    18722, 18796, 18870
+};
+
+static const unsigned int mult_112[256] = {0, 112, 224, 336, 448, 560, 672, 784, 896, 1008, 1120, 1232, 1344, 1456,
+    1568, 1680, 1792, 1904, 2016, 2128, 2240, 2352, 2464, 2576, 2688, 2800, 2912, 3024, 3136, 3248,
+    3360, 3472, 3584, 3696, 3808, 3920, 4032, 4144, 4256, 4368, 4480, 4592, 4704, 4816, 4928, 5040,
+    5152, 5264, 5376, 5488, 5600, 5712, 5824, 5936, 6048, 6160, 6272, 6384, 6496, 6608, 6720, 6832,
+    6944, 7056, 7168, 7280, 7392, 7504, 7616, 7728, 7840, 7952, 8064, 8176, 8288, 8400, 8512, 8624,
+    8736, 8848, 8960, 9072, 9184, 9296, 9408, 9520, 9632, 9744, 9856, 9968, 10080, 10192, 10304,
+    10416, 10528, 10640, 10752, 10864, 10976, 11088, 11200, 11312, 11424, 11536, 11648, 11760, 11872,
+    11984, 12096, 12208, 12320, 12432, 12544, 12656, 12768, 12880, 12992, 13104, 13216, 13328, 13440,
+    13552, 13664, 13776, 13888, 14000, 14112, 14224, 14336, 14448, 14560, 14672, 14784, 14896, 15008,
+    15120, 15232, 15344, 15456, 15568, 15680, 15792, 15904, 16016, 16128, 16240, 16352, 16464, 16576,
+    16688, 16800, 16912, 17024, 17136, 17248, 17360, 17472, 17584, 17696, 17808, 17920, 18032, 18144,
+    18256, 18368, 18480, 18592, 18704, 18816, 18928, 19040, 19152, 19264, 19376, 19488, 19600, 19712,
+    19824, 19936, 20048, 20160, 20272, 20384, 20496, 20608, 20720, 20832, 20944, 21056, 21168, 21280,
+    21392, 21504, 21616, 21728, 21840, 21952, 22064, 22176, 22288, 22400, 22512, 22624, 22736, 22848,
+    22960, 23072, 23184, 23296, 23408, 23520, 23632, 23744, 23856, 23968, 24080, 24192, 24304, 24416,
+    24528, 24640, 24752, 24864, 24976, 25088, 25200, 25312, 25424, 25536, 25648, 25760, 25872, 25984,
+    26096, 26208, 26320, 26432, 26544, 26656, 26768, 26880, 26992, 27104, 27216, 27328, 27440, 27552,
+    27664, 27776, 27888, 28000, 28112, 28224, 28336, 28448, 28560
+};
+
+static const unsigned int mult_94[256] = {0, 94, 188, 282, 376, 470, 564, 658, 752, 846, 940, 1034, 1128, 1222,
+    1316, 1410, 1504, 1598, 1692, 1786, 1880, 1974, 2068, 2162, 2256, 2350, 2444, 2538, 2632, 2726,
+    2820, 2914, 3008, 3102, 3196, 3290, 3384, 3478, 3572, 3666, 3760, 3854, 3948, 4042, 4136, 4230,
+    4324, 4418, 4512, 4606, 4700, 4794, 4888, 4982, 5076, 5170, 5264, 5358, 5452, 5546, 5640, 5734,
+    5828, 5922, 6016, 6110, 6204, 6298, 6392, 6486, 6580, 6674, 6768, 6862, 6956, 7050, 7144, 7238,
+    7332, 7426, 7520, 7614, 7708, 7802, 7896, 7990, 8084, 8178, 8272, 8366, 8460, 8554, 8648, 8742,
+    8836, 8930, 9024, 9118, 9212, 9306, 9400, 9494, 9588, 9682, 9776, 9870, 9964, 10058, 10152, 10246,
+    10340, 10434, 10528, 10622, 10716, 10810, 10904, 10998, 11092, 11186, 11280, 11374, 11468, 11562,
+    11656, 11750, 11844, 11938, 12032, 12126, 12220, 12314, 12408, 12502, 12596, 12690, 12784, 12878,
+    12972, 13066, 13160, 13254, 13348, 13442, 13536, 13630, 13724, 13818, 13912, 14006, 14100, 14194,
+    14288, 14382, 14476, 14570, 14664, 14758, 14852, 14946, 15040, 15134, 15228, 15322, 15416, 15510,
+    15604, 15698, 15792, 15886, 15980, 16074, 16168, 16262, 16356, 16450, 16544, 16638, 16732, 16826,
+    16920, 17014, 17108, 17202, 17296, 17390, 17484, 17578, 17672, 17766, 17860, 17954, 18048, 18142,
+    18236, 18330, 18424, 18518, 18612, 18706, 18800, 18894, 18988, 19082, 19176, 19270, 19364, 19458,
+    19552, 19646, 19740, 19834, 19928, 20022, 20116, 20210, 20304, 20398, 20492, 20586, 20680, 20774,
+    20868, 20962, 21056, 21150, 21244, 21338, 21432, 21526, 21620, 21714, 21808, 21902, 21996, 22090,
+    22184, 22278, 22372, 22466, 22560, 22654, 22748, 22842, 22936, 23030, 23124, 23218, 23312, 23406,
+    23500, 23594, 23688, 23782, 23876, 23970
+};
+
+static const unsigned int mult_18[256] = {128, 146, 164, 182, 200, 218, 236, 254, 272, 290, 308, 326, 344, 362,
+    380, 398, 416, 434, 452, 470, 488, 506, 524, 542, 560, 578, 596, 614, 632, 650, 668, 686, 704,
+    722, 740, 758, 776, 794, 812, 830, 848, 866, 884, 902, 920, 938, 956, 974, 992, 1010, 1028, 1046,
+    1064, 1082, 1100, 1118, 1136, 1154, 1172, 1190, 1208, 1226, 1244, 1262, 1280, 1298, 1316, 1334,
+    1352, 1370, 1388, 1406, 1424, 1442, 1460, 1478, 1496, 1514, 1532, 1550, 1568, 1586, 1604, 1622,
+    1640, 1658, 1676, 1694, 1712, 1730, 1748, 1766, 1784, 1802, 1820, 1838, 1856, 1874, 1892, 1910,
+    1928, 1946, 1964, 1982, 2000, 2018, 2036, 2054, 2072, 2090, 2108, 2126, 2144, 2162, 2180, 2198,
+    2216, 2234, 2252, 2270, 2288, 2306, 2324, 2342, 2360, 2378, 2396, 2414, 2432, 2450, 2468, 2486,
+    2504, 2522, 2540, 2558, 2576, 2594, 2612, 2630, 2648, 2666, 2684, 2702, 2720, 2738, 2756, 2774,
+    2792, 2810, 2828, 2846, 2864, 2882, 2900, 2918, 2936, 2954, 2972, 2990, 3008, 3026, 3044, 3062,
+    3080, 3098, 3116, 3134, 3152, 3170, 3188, 3206, 3224, 3242, 3260, 3278, 3296, 3314, 3332, 3350,
+    3368, 3386, 3404, 3422, 3440, 3458, 3476, 3494, 3512, 3530, 3548, 3566, 3584, 3602, 3620, 3638,
+    3656, 3674, 3692, 3710, 3728, 3746, 3764, 3782, 3800, 3818, 3836, 3854, 3872, 3890, 3908, 3926,
+    3944, 3962, 3980, 3998, 4016, 4034, 4052, 4070, 4088, 4106, 4124, 4142, 4160, 4178, 4196, 4214,
+    4232, 4250, 4268, 4286, 4304, 4322, 4340, 4358, 4376, 4394, 4412, 4430, 4448, 4466, 4484, 4502,
+    4520, 4538, 4556, 4574, 4592, 4610, 4628, 4646, 4664, 4682, 4700, 4718
+};
+
+#define rgb2yvyu(b1, g1, r1, b2, g2, r2)                                                 \
+    ({                                                                                   \
+        uint8_t r12 = (r1 + r2) >> 1;                                                    \
+        uint8_t g12 = (g1 + g2) >> 1;                                                    \
+        uint8_t b12 = (b1 + b2) >> 1;                                                    \
+        (uint8_t) ((r1 >> 2) + (g1 >> 1) + (b1 >> 3) + 16) +                             \
+        ((uint8_t)(((mult_112[r12] - mult_94[g12] -  mult_18[b12]) >> 8) + 128) << 8) +  \
+        ((uint8_t)((r2 >> 2) + (g2 >> 1) + (b2 >> 3) + 16) << 16) +                      \
+        ((uint8_t)(((-mult_38[r12] - mult_74[g12] + mult_112[b12]) >> 8) + 128) << 24);  \
+    })
+
+void convert_rgba_to_yuyv(uint8_t *dst, const uint8_t *src, unsigned int width, unsigned int height)
+{
+    const uint8_t *pixel1;
+    const uint8_t *pixel2;
+    unsigned int yvyu;
+
+    for (unsigned int y = 0; y < height; y++) {
+        const uint8_t *row = src + (size_t) y * width * 4;
+
+        for (unsigned int x = 0; x < width; x += 2) {
+            pixel1 = &(row[x * 4]);
+            pixel2 = (x + 1 < width) ? &(row[(x + 1) * 4]) : pixel1;
+
+            yvyu = rgb2yvyu(pixel1[0], pixel1[1], pixel1[2], pixel2[0], pixel2[1], pixel2[2]);
+            memcpy(dst, &yvyu, 4);
+            dst += 4;
+        }
+    }
+}
+
+static inline uint8_t clamp_u8(int value)
+{
+    return (value < 0) ? 0 : (value > 255) ? 255 : value;
+}
+
+/* ITU-R BT.601 limited range, each Cb/Cr pair shared by two pixels (even width) */
+void convert_yuyv_to_rgba(uint8_t *dst, const uint8_t *src, unsigned int width, unsigned int height)
+{
+    size_t npixels = (size_t) width * height;
+
+    for (size_t i = 0; i < npixels; i++) {
+        const uint8_t *pair = &src[(i & ~(size_t) 1) * 2];
+        int c = 298 * (pair[(i & 1) * 2] - 16);
+        int d = pair[1] - 128;
+        int e = pair[3] - 128;
+
+        *dst++ = clamp_u8((c + 409 * e + 128) >> 8);
+        *dst++ = clamp_u8((c - 100 * d - 208 * e + 128) >> 8);
+        *dst++ = clamp_u8((c + 516 * d + 128) >> 8);
+        *dst++ = 0xff;
+    }
+}
+
+/* ITU-R BT.601 limited range, Y plane followed by interleaved CbCr at half resolution */
+void convert_rgba_to_nv12(uint8_t *dst, const uint8_t *src, unsigned int width, unsigned int height)
+{
+    uint8_t *uv = dst + (size_t) width * height;
+
+    for (unsigned int y = 0; y < height; y++) {
+        const uint8_t *row = src + (size_t) y * width * 4;
+
+        for (unsigned int x = 0; x < width; x++) {
+            const uint8_t *p = &row[x * 4];
+            *dst++ = ((66 * p[0] + 129 * p[1] + 25 * p[2] + 128) >> 8) + 16;
+        }
+    }
+
+    for (unsigned int y = 0; y + 1 < height; y += 2) {
+        const uint8_t *row0 = src + (size_t) y * width * 4;
+        const uint8_t *row1 = row0 + (size_t) width * 4;
+
+        for (unsigned int x = 0; x + 1 < width; x += 2) {
+            int r = row0[x * 4] + row0[x * 4 + 4] + row1[x * 4] + row1[x * 4 + 4];
+            int g = row0[x * 4 + 1] + row0[x * 4 + 5] + row1[x * 4 + 1] + row1[x * 4 + 5];
+            int b = row0[x * 4 + 2] + row0[x * 4 + 6] + row1[x * 4 + 2] + row1[x * 4 + 6];
+
+            *uv++ = ((-38 * r - 74 * g + 112 * b + 512) >> 10) + 128;
+            *uv++ = ((112 * r - 94 * g - 18 * b + 512) >> 10) + 128;
+        }
+    }
+}
+
+void convert_rgba_to_rgb565(uint8_t *dst, const uint8_t *src, size_t npixels)
+{
+    uint16_t *rgb = (uint16_t *) dst;
+
+    for (size_t i = 0; i < npixels; i++, src += 4) {
+        rgb[i] = ((src[0] >> 3) << 11) | ((src[1] >> 2) << 5) | (src[2] >> 3);
+    }
+}
+
+/* ITU-R 601-2 luma (the weights of PIL's "L" mode), also the GREY/L8 output of image-tool */
+void convert_rgba_to_grey(uint8_t *dst, const uint8_t *src, size_t npixels)
+{
+    for (size_t i = 0; i < npixels; i++, src += 4) {
+        dst[i] = (src[0] * 19595 + src[1] * 38470 + src[2] * 7471 + 0x8000) >> 16;
+    }
+}
+
+/* ---------------------------------------------------------------------------
+ * Bit depth kernels
+ */
+
+/*
+ * Bit depth scaling: LSB aligned N-bit samples to the full 16-bit range
+ */
+void convert_scale_y16(uint16_t *dst, const uint16_t *src, size_t npixels, unsigned int bits)
+{
+    size_t i = 0;
+
+    if (bits >= 16) {
+        memmove(dst, src, npixels * 2);
+        return;
+    }
+
+    uint16_t mask = (1 << bits) - 1;
+
+    if (bits >= 8) {
+        unsigned int left = 16 - bits;
+        unsigned int right = 2 * bits - 16;
+
+#if defined(__SSE2__)
+        const __m128i vmask = _mm_set1_epi16(mask);
+        const __m128i vleft = _mm_cvtsi32_si128(left);
+        const __m128i vright = _mm_cvtsi32_si128(right);
+
+        for (; i + 8 <= npixels; i += 8) {
+            __m128i v = _mm_and_si128(_mm_loadu_si128((const __m128i *) (src + i)), vmask);
+            v = _mm_or_si128(_mm_sll_epi16(v, vleft), _mm_srl_epi16(v, vright));
+            _mm_storeu_si128((__m128i *) (dst + i), v);
+        }
+#elif defined(__ARM_NEON)
+        const uint16x8_t vmask = vdupq_n_u16(mask);
+        const int16x8_t vleft = vdupq_n_s16(left);
+        const int16x8_t vright = vdupq_n_s16(-(int) right);
+
+        for (; i + 8 <= npixels; i += 8) {
+            uint16x8_t v = vandq_u16(vld1q_u16(src + i), vmask);
+            v = vorrq_u16(vshlq_u16(v, vleft), vshlq_u16(v, vright));
+            vst1q_u16(dst + i, v);
+        }
+#endif
+
+        for (; i < npixels; i++) {
+            uint16_t v = src[i] & mask;
+            dst[i] = (v << left) | (v >> right);
+        }
+        return;
+    }
+
+    // Less than 8 significant bits, replicate the pattern until all bits are filled
+    for (; i < npixels; i++) {
+        uint32_t v = src[i] & mask;
+        uint32_t out = 0;
+        int shift = 16 - bits;
+
+        while (shift > -(int) bits) {
+            out |= (shift >= 0) ? (v << shift) : (v >> -shift);
+            shift -= bits;
+        }
+        dst[i] = out;
+    }
+}
+
+static inline void y10p_pack4(uint8_t *dst, const uint16_t *src)
+{
+    dst[0] = src[0] >> 8;
+    dst[1] = src[1] >> 8;
+    dst[2] = src[2] >> 8;
+    dst[3] = src[3] >> 8;
+    dst[4] = ((src[0] >> 6) & 3) | (((src[1] >> 6) & 3) << 2) |
+        (((src[2] >> 6) & 3) << 4) | (((src[3] >> 6) & 3) << 6);
+}
+
+static inline void y10p_unpack4(uint16_t *dst, const uint8_t *src)
+{
+    for (int k = 0; k < 4; k++) {
+        uint16_t v = (src[k] << 2) | ((src[4] >> (2 * k)) & 3);
+        dst[k] = (v << 6) | (v >> 4);
+    }
+}
+
+/*
+ * Y16 to packed 10-bit greyscale (the 10 MSBs of every sample are kept)
+ */
+void convert_y16_to_y10p(uint8_t *dst, const uint16_t *src, size_t npixels)
+{
+    size_t i = 0;
+    uint32_t hi0 __attribute__((unused));
+    uint32_t hi1 __attribute__((unused));
+
+#if defined(__SSE2__)
+    const __m128i mul = _mm_setr_epi16(1, 4, 16, 64, 1, 4, 16, 64);
+    const __m128i three = _mm_set1_epi16(3);
+    const __m128i ones = _mm_set1_epi16(1);
+
+    for (; i + 8 <= npixels; i += 8) {
+        __m128i v = _mm_loadu_si128((const __m128i *) (src + i));
+        __m128i hi = _mm_packus_epi16(_mm_srli_epi16(v, 8), _mm_setzero_si128());
+        __m128i lo = _mm_mullo_epi16(_mm_and_si128(_mm_srli_epi16(v, 6), three), mul);
+
+        /* sum up the 2-bit fields of 4 neighbouring pixels into one byte */
+        lo = _mm_madd_epi16(lo, ones);
+        lo = _mm_add_epi32(lo, _mm_srli_epi64(lo, 32));
+
+        hi0 = _mm_cvtsi128_si32(hi);
+        hi1 = _mm_cvtsi128_si32(_mm_srli_si128(hi, 4));
+        memcpy(dst, &hi0, 4);
+        dst[4] = _mm_cvtsi128_si32(lo);
+        memcpy(dst + 5, &hi1, 4);
+        dst[9] = _mm_cvtsi128_si32(_mm_srli_si128(lo, 8));
+        dst += 10;
+    }
+#elif defined(__ARM_NEON)
+    const int16x8_t shifts = { 0, 2, 4, 6, 0, 2, 4, 6 };
+    const uint16x8_t three = vdupq_n_u16(3);
+
+    for (; i + 8 <= npixels; i += 8) {
+        uint16x8_t v = vld1q_u16(src + i);
+        uint32x2_t hi = vreinterpret_u32_u8(vshrn_n_u16(v, 8));
+        uint16x8_t lo = vshlq_u16(vandq_u16(vshrq_n_u16(v, 6), three), shifts);
+
+        /* sum up the 2-bit fields of 4 neighbouring pixels into one byte */
+        uint64x2_t lo64 = vpaddlq_u32(vpaddlq_u16(lo));
+
+        hi0 = vget_lane_u32(hi, 0);
+        hi1 = vget_lane_u32(hi, 1);
+        memcpy(dst, &hi0, 4);
+        dst[4] = vgetq_lane_u64(lo64, 0);
+        memcpy(dst + 5, &hi1, 4);
+        dst[9] = vgetq_lane_u64(lo64, 1);
+        dst += 10;
+    }
+#endif
+
+    for (; i + 4 <= npixels; i += 4) {
+        y10p_pack4(dst, src + i);
+        dst += 5;
+    }
+
+    if (i < npixels) {
+        uint16_t tail[4] = { 0, 0, 0, 0 };
+        memcpy(tail, src + i, (npixels - i) * 2);
+        y10p_pack4(dst, tail);
+    }
+}
+
+/*
+ * Packed 10-bit greyscale to Y16 (MSB aligned, low bits replicated)
+ */
+void convert_y10p_to_y16(uint16_t *dst, const uint8_t *src, size_t npixels)
+{
+    size_t i = 0;
+    uint32_t hi0 __attribute__((unused));
+    uint32_t hi1 __attribute__((unused));
+
+#if defined(__SSE2__)
+    const __m128i mul = _mm_setr_epi16(64, 16, 4, 1, 64, 16, 4, 1);
+    const __m128i mask = _mm_set1_epi16(0xc0);
+
+    for (; i + 8 <= npixels; i += 8) {
+        memcpy(&hi0, src, 4);
+        memcpy(&hi1, src + 5, 4);
+
+        __m128i hi = _mm_unpacklo_epi8(_mm_setzero_si128(), _mm_set_epi32(0, 0, hi1, hi0));
+        __m128i lo = _mm_setr_epi16(src[4], src[4], src[4], src[4], src[9], src[9], src[9], src[9]);
+        __m128i v = _mm_or_si128(hi, _mm_and_si128(_mm_mullo_epi16(lo, mul), mask));
+
+        v = _mm_or_si128(v, _mm_srli_epi16(v, 10));
+        _mm_storeu_si128((__m128i *) (dst + i), v);
+        src += 10;
+    }
+#elif defined(__ARM_NEON)
+    const int16x8_t shifts = { 6, 4, 2, 0, 6, 4, 2, 0 };
+    const uint16x8_t mask = vdupq_n_u16(0xc0);
+
+    for (; i + 8 <= npixels; i += 8) {
+        memcpy(&hi0, src, 4);
+        memcpy(&hi1, src + 5, 4);
+
+        uint16x8_t hi = vshll_n_u8(vcreate_u8(hi0 | ((uint64_t) hi1 << 32)), 8);
+        uint16x8_t lo = vcombine_u16(vdup_n_u16(src[4]), vdup_n_u16(src[9]));
+        uint16x8_t v = vorrq_u16(hi, vandq_u16(vshlq_u16(lo, shifts), mask));
+
+        v = vorrq_u16(v, vshrq_n_u16(v, 10));
+        vst1q_u16(dst + i, v);
+        src += 10;
+    }
+#endif
+
+    for (; i + 4 <= npixels; i += 4) {
+        y10p_unpack4(dst + i, src);
+        src += 5;
+    }
+
+    if (i < npixels) {
+        uint16_t tail[4];
+        y10p_unpack4(tail, src);
+        memcpy(dst + i, tail, (npixels - i) * 2);
+    }
+}
+
+/*
+ * Y16 to 8-bit greyscale
+ */
+void convert_y16_to_grey(uint8_t *dst, const uint16_t *src, size_t npixels)
+{
+    size_t i = 0;
+
+#if defined(__SSE2__)
+    for (; i + 16 <= npixels; i += 16) {
+        __m128i v0 = _mm_srli_epi16(_mm_loadu_si128((const __m128i *) (src + i)), 8);
+        __m128i v1 = _mm_srli_epi16(_mm_loadu_si128((const __m128i *) (src + i + 8)), 8);
+        _mm_storeu_si128((__m128i *) (dst + i), _mm_packus_epi16(v0, v1));
+    }
+#elif defined(__ARM_NEON)
+    for (; i + 16 <= npixels; i += 16) {
+        uint8x16x2_t v = vld2q_u8((const uint8_t *) (src + i));
+        vst1q_u8(dst + i, v.val[1]);
+    }
+#endif
+
+    for (; i < npixels; i++) {
+        dst[i] = src[i] >> 8;
+    }
+}
+
+/*
+ * 8-bit greyscale to Y16 (full range, v * 257)
+ */
+void convert_grey_to_y16(uint16_t *dst, const uint8_t *src, size_t npixels)
+{
+    size_t i = 0;
+
+#if defined(__SSE2__)
+    for (; i + 16 <= npixels; i += 16) {
+        __m128i v = _mm_loadu_si128((const __m128i *) (src + i));
+        _mm_storeu_si128((__m128i *) (dst + i), _mm_unpacklo_epi8(v, v));
+        _mm_storeu_si128((__m128i *) (dst + i + 8), _mm_unpackhi_epi8(v, v));
+    }
+#elif defined(__ARM_NEON)
+    for (; i + 16 <= npixels; i += 16) {
+        uint8x16_t v = vld1q_u8(src + i);
+        uint8x16x2_t z = { { v, v } };
+        vst2q_u8((uint8_t *) (dst + i), z);
+    }
+#endif
+
+    for (; i < npixels; i++) {
+        dst[i] = src[i] * 257;
+    }
+}
+
+/* ---------------------------------------------------------------------------
+ * Content hash
+ */
+
+#define HASH_PRIME1 0x9e3779b185ebca87ULL
+#define HASH_PRIME2 0xc2b2ae3d27d4eb4fULL
+
+/* Key of each lane and its increment per stripe, so equal stripes at different offsets differ */
+static const uint64_t hash_keys[4] = {
+    0xbe4ba423396cfeb8ULL, 0x1cad21f72c81017cULL, 0xdb979083e96dd4deULL, 0x1f67b3b7a4a44072ULL,
+};
+static const uint64_t hash_steps[4] = {
+    0x165667b19e3779f9ULL, 0x27d4eb2f165667c5ULL, 0x85ebca77c2b2ae63ULL, 0x94d049bb133111ebULL,
+};
+
+static inline uint64_t hash_mix(uint64_t h)
+{
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdULL;
+    h ^= h >> 33;
+    h *= 0xc4ceb9fe1a85ec53ULL;
+    h ^= h >> 33;
+    return h;
+}
+
+static inline void hash_word(uint64_t *acc, uint64_t *key, unsigned int lane, uint64_t word)
+{
+    uint64_t dk = word ^ key[lane];
+
+    acc[lane] += (dk & 0xffffffff) * (dk >> 32) + word;
+    key[lane] += hash_steps[lane];
+}
+
+/*
+ * Four 64-bit lanes over 32-byte stripes: each word is xored with the key of
+ * its lane and stripe, and the product of the two halves is accumulated
+ * (like XXH3). The vector paths compute the same value as the C path.
+ */
+uint64_t image_hash(const void *data, size_t size)
+{
+    const uint8_t *p = data;
+    uint64_t acc[4] = { HASH_PRIME1, HASH_PRIME2, 0, HASH_PRIME1 ^ HASH_PRIME2 };
+    uint64_t key[4];
+    uint64_t word;
+    uint64_t h;
+    size_t i = 0;
+    unsigned int lane;
+
+    memcpy(key, hash_keys, sizeof(key));
+
+#if defined(__SSE2__)
+    {
+        __m128i acc0 = _mm_loadu_si128((const __m128i *) &acc[0]);
+        __m128i acc1 = _mm_loadu_si128((const __m128i *) &acc[2]);
+        __m128i key0 = _mm_loadu_si128((const __m128i *) &key[0]);
+        __m128i key1 = _mm_loadu_si128((const __m128i *) &key[2]);
+        const __m128i step0 = _mm_loadu_si128((const __m128i *) &hash_steps[0]);
+        const __m128i step1 = _mm_loadu_si128((const __m128i *) &hash_steps[2]);
+
+        for (; i + 32 <= size; i += 32) {
+            __m128i d0 = _mm_loadu_si128((const __m128i *) (p + i));
+            __m128i d1 = _mm_loadu_si128((const __m128i *) (p + i + 16));
+            __m128i dk0 = _mm_xor_si128(d0, key0);
+            __m128i dk1 = _mm_xor_si128(d1, key1);
+
+            acc0 = _mm_add_epi64(acc0, _mm_add_epi64(_mm_mul_epu32(dk0, _mm_srli_epi64(dk0, 32)), d0));
+            acc1 = _mm_add_epi64(acc1, _mm_add_epi64(_mm_mul_epu32(dk1, _mm_srli_epi64(dk1, 32)), d1));
+            key0 = _mm_add_epi64(key0, step0);
+            key1 = _mm_add_epi64(key1, step1);
+        }
+
+        _mm_storeu_si128((__m128i *) &acc[0], acc0);
+        _mm_storeu_si128((__m128i *) &acc[2], acc1);
+        _mm_storeu_si128((__m128i *) &key[0], key0);
+        _mm_storeu_si128((__m128i *) &key[2], key1);
+    }
+#elif defined(__ARM_NEON)
+    {
+        uint64x2_t acc0 = vld1q_u64(&acc[0]);
+        uint64x2_t acc1 = vld1q_u64(&acc[2]);
+        uint64x2_t key0 = vld1q_u64(&key[0]);
+        uint64x2_t key1 = vld1q_u64(&key[2]);
+        const uint64x2_t step0 = vld1q_u64(&hash_steps[0]);
+        const uint64x2_t step1 = vld1q_u64(&hash_steps[2]);
+
+        for (; i + 32 <= size; i += 32) {
+            uint64x2_t d0 = vreinterpretq_u64_u8(vld1q_u8(p + i));
+            uint64x2_t d1 = vreinterpretq_u64_u8(vld1q_u8(p + i + 16));
+            uint64x2_t dk0 = veorq_u64(d0, key0);
+            uint64x2_t dk1 = veorq_u64(d1, key1);
+
+            acc0 = vaddq_u64(acc0, vaddq_u64(vmull_u32(vmovn_u64(dk0), vshrn_n_u64(dk0, 32)), d0));
+            acc1 = vaddq_u64(acc1, vaddq_u64(vmull_u32(vmovn_u64(dk1), vshrn_n_u64(dk1, 32)), d1));
+            key0 = vaddq_u64(key0, step0);
+            key1 = vaddq_u64(key1, step1);
+        }
+
+        vst1q_u64(&acc[0], acc0);
+        vst1q_u64(&acc[2], acc1);
+        vst1q_u64(&key[0], key0);
+        vst1q_u64(&key[2], key1);
+    }
+#endif
+
+    for (; i + 32 <= size; i += 32) {
+        for (lane = 0; lane < 4; lane++) {
+            memcpy(&word, p + i + lane * 8, 8);
+            hash_word(acc, key, lane, word);
+        }
+    }
+
+    /* Tail: whole words, then the last bytes zero padded */
+    for (lane = 0; i < size; i += 8, lane++) {
+        word = 0;
+        memcpy(&word, p + i, (size - i < 8) ? size - i : 8);
+        hash_word(acc, key, lane, word);
+    }
+
+    h = size * HASH_PRIME1;
+    for (lane = 0; lane < 4; lane++) {
+        h = (h ^ hash_mix(acc[lane])) * HASH_PRIME2;
+        h = (h << 27) | (h >> 37);
+    }
+    return hash_mix(h);
+}
@@ -0,0 +1,117 @@
+/*
+ *	image-convert.h  --  Pixel format loaders and conversion kernels
+ *
+ *	This program is free software; you can redistribute it and/or modify
+ *	it under the terms of the GNU General Public License as published by
+ *	the Free Software Foundation; either version 2 of the License, or
+ *	(at your option) any later version.
+ */
+
+#ifndef IMAGE_CONVERT_H
+#define IMAGE_CONVERT_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* Size in bytes of npixels greyscale samples packed as MIPI RAW10 (4 pixels in 5 bytes) */
+#define Y10P_SIZE(npixels) ((((npixels) + 3) / 4) * 5)
+
+/* Pixel layout of a decoded source image */
+enum image_pixel_type {
+    IMAGE_PIXEL_RGBA8,
+    IMAGE_PIXEL_GREY8,
+    IMAGE_PIXEL_GREY16,
+};
+
+/* Decoded source image (tightly packed rows), before conversion to a video format */
+struct image {
+    enum image_pixel_type type;
+    unsigned int width;
+    unsigned int height;
+    void *pixels;
+};
+
+/*
+ * Image loaders
+ *
+ * PNG   - any PNG image as 8-bit RGBA
+ * PNG16 - any PNG image as 16-bit greyscale (host byte order, full 16-bit range)
+ * L8    - raw 8-bit greyscale samples of the given geometry
+ * RAW   - raw GREY, Y16, Y10P or YUYV video frame of the given geometry, decoded
+ *         to GREY8, GREY16, GREY16 and RGBA8 respectively
+ */
+int load_png_image(const char *filename, struct image *image);
+int load_png16_image(const char *filename, struct image *image);
+int load_l8_image(const char *filename, unsigned int width, unsigned int height,
+        struct image *image);
+int load_raw_image(const char *filename, unsigned int fourcc, unsigned int width,
+        unsigned int height, struct image *image);
+void image_free(struct image *image);
+
+/* Save a source image as PNG (RGBA, 8-bit or 16-bit greyscale by pixel type) */
+int save_png_image(const char *filename, const struct image *image);
+
+/* Scale a source image to the given resolution (bilinear) */
+int image_resize(struct image *dst, const struct image *src, unsigned int width, unsigned int height);
+
+/*
+ * Encode a source image as baseline JPEG (YCbCr 4:2:2) with the given quality.
+ * The encoded frame is allocated with malloc() and returned in jpeg/size.
+ */
+int image_encode_jpeg(const struct image *src, unsigned int quality,
+        uint8_t **jpeg, unsigned long *size);
+
+/* Position and resolution of one frame in a JPEG / MJPEG stream */
+struct jpeg_frame {
+    size_t offset;
+    size_t size;
+    unsigned int width;
+    unsigned int height;
+};
+
+/*
+ * Index the frames of a JPEG file or a concatenated MJPEG stream by walking the
+ * JPEG markers from SOI to EOI. Data between frames and truncated frames are
+ * skipped. The frame array is allocated with malloc().
+ */
+int jpeg_index_frames(const uint8_t *data, size_t size, struct jpeg_frame **frames,
+        unsigned int *count);
+
+/* Frame size in bytes of an uncompressed video format, 0 if unsupported */
+unsigned int image_frame_size(unsigned int fourcc, unsigned int width, unsigned int height);
+
+/*
+ * Convert a source image to the given video format (V4L2 fourcc) using the
+ * matching conversion kernel. dst must hold image_frame_size() bytes.
+ */
+int image_convert(void *dst, unsigned int fourcc, const struct image *src);
+
+/*
+ * Colour kernels (RGBA8 input)
+ */
+void convert_rgba_to_yuyv(uint8_t *dst, const uint8_t *src, unsigned int width, unsigned int height);
+void convert_rgba_to_nv12(uint8_t *dst, const uint8_t *src, unsigned int width, unsigned int height);
+void convert_rgba_to_rgb565(uint8_t *dst, const uint8_t *src, size_t npixels);
+void convert_rgba_to_grey(uint8_t *dst, const uint8_t *src, size_t npixels);
+void convert_yuyv_to_rgba(uint8_t *dst, const uint8_t *src, unsigned int width, unsigned int height);
+
+/*
+ * Bit depth kernels
+ *
+ * Y16  - 16-bit greyscale, little endian, MSB aligned
+ * Y10P - 10-bit greyscale, MIPI RAW10 packed (4 x 8 MSBs followed by 4 x 2 LSBs)
+ * GREY - 8-bit greyscale
+ */
+void convert_scale_y16(uint16_t *dst, const uint16_t *src, size_t npixels, unsigned int bits);
+void convert_y16_to_y10p(uint8_t *dst, const uint16_t *src, size_t npixels);
+void convert_y10p_to_y16(uint16_t *dst, const uint8_t *src, size_t npixels);
+void convert_y16_to_grey(uint8_t *dst, const uint16_t *src, size_t npixels);
+void convert_grey_to_y16(uint16_t *dst, const uint8_t *src, size_t npixels);
+
+/*
+ * 64-bit hash of a frame's contents, to recognize identical frames (not
+ * cryptographic). Vectorized like the kernels, same value on every path.
+ */
+uint64_t image_hash(const void *data, size_t size);
+
+#endif /* IMAGE_CONVERT_H */
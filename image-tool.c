@@ -0,0 +1,397 @@
+/*
+ * Batch converter between PNG images and raw video frames
+ *
+ * PNG images are converted to raw frames with the loaders, scaler and kernels
+ * of uvc-gadget, so a frame converted here has the same bytes the gadget
+ * streams for the same source image and resolution. Raw GREY, Y16, Y10P and
+ * YUYV frames are converted back to PNG for inspection. Files are converted
+ * in parallel by one thread per online CPU.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ */
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <sys/stat.h>
+
+#include <linux/videodev2.h>
+
+#include "image-convert.h"
+
+#define ARRAY_SIZE(a) (sizeof(a) / sizeof((a)[0]))
+
+#define CONVERT_MAX_JOBS 64
+
+struct convert_format {
+    const char *name;
+    const char *extension;
+    unsigned int fourcc;
+    bool decode;                /* raw frames can be converted back to PNG */
+};
+
+static const struct convert_format formats[] = {
+    { "GREY", "l8", V4L2_PIX_FMT_GREY, true },
+    { "YUYV", "yuyv", V4L2_PIX_FMT_YUYV, true },
+    { "Y16", "y16", V4L2_PIX_FMT_Y16, true },
+    { "Y10P", "y10p", V4L2_PIX_FMT_Y10P, true },
+    { "NV12", "nv12", V4L2_PIX_FMT_NV12, false },
+    { "RGBP", "rgbp", V4L2_PIX_FMT_RGB565, false },
+};
+
+struct convert_settings {
+    const struct convert_format *output_format;
+    const struct convert_format *input_format;  /* NULL: by file extension */
+    unsigned int width;
+    unsigned int height;
+    bool png16;
+    const char *output_dir;
+};
+
+static struct convert_settings settings = {
+    .output_format = &formats[0],
+};
+
+static char **files;
+static unsigned int file_count;
+static _Atomic unsigned int file_next;
+static _Atomic unsigned int failed;
+
+static double monotonic_ns()
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+/* Format by name or file extension, case insensitive */
+static const struct convert_format *convert_find_format(const char *name)
+{
+    unsigned int i;
+
+    for (i = 0; i < ARRAY_SIZE(formats); i++) {
+        if (!strcasecmp(name, formats[i].name) || !strcasecmp(name, formats[i].extension)) {
+            return &formats[i];
+        }
+    }
+
+    if (!strcasecmp(name, "L8")) {
+        return &formats[0];
+    }
+    return NULL;
+}
+
+static const char *convert_extension(const char *filename)
+{
+    const char *base = strrchr(filename, '/');
+    const char *dot;
+
+    base = (base) ? base + 1 : filename;
+    dot = strrchr(base, '.');
+    return (dot && dot != base) ? dot + 1 : "";
+}
+
+/* Output file: the input file name with the extension replaced, in the output directory if given */
+static int convert_output_path(char *path, size_t size, const char *input, const char *extension)
+{
+    const char *base = strrchr(input, '/');
+    const char *suffix = convert_extension(input);
+    int dir_length;
+    int base_length;
+    int ret;
+
+    base = (base) ? base + 1 : input;
+    base_length = (*suffix) ? suffix - base - 1 : (int) strlen(base);
+
+    if (settings.output_dir) {
+        ret = snprintf(path, size, "%s/%.*s.%s", settings.output_dir, base_length, base, extension);
+    } else {
+        dir_length = base - input;
+        ret = snprintf(path, size, "%.*s%.*s.%s", dir_length, input, base_length, base, extension);
+    }
+
+    return (ret < 0 || (size_t) ret >= size) ? -ENAMETOOLONG : 0;
+}
+
+static int write_file(const char *filename, const void *data, size_t size)
+{
+    FILE *fp = fopen(filename, "wb");
+
+    if (!fp) {
+        return -errno;
+    }
+
+    if (fwrite(data, 1, size, fp) != size) {
+        fclose(fp);
+        return -EIO;
+    }
+    return (fclose(fp) == 0) ? 0 : -EIO;
+}
+
+/*
+ * PNG to raw frame, the same steps as the image source of uvc-gadget: load,
+ * scale to the frame resolution if it differs, convert
+ */
+static int convert_png_to_raw(const char *input, const char *output)
+{
+    const struct convert_format *format = settings.output_format;
+    struct image source;
+    struct image scaled;
+    const struct image *image = &source;
+    unsigned int size;
+    uint8_t *frame = NULL;
+    int ret;
+
+    ret = (settings.png16) ? load_png16_image(input, &source) : load_png_image(input, &source);
+    if (ret < 0) {
+        return ret;
+    }
+
+    if (settings.width && (settings.width != source.width || settings.height != source.height)) {
+        ret = image_resize(&scaled, &source, settings.width, settings.height);
+        if (ret < 0) {
+            image_free(&source);
+            return ret;
+        }
+        image = &scaled;
+    }
+
+    size = image_frame_size(format->fourcc, image->width, image->height);
+    if (!size) {
+        ret = -EINVAL;
+        goto done;
+    }
+
+    frame = malloc(size);
+    if (!frame) {
+        ret = -ENOMEM;
+        goto done;
+    }
+
+    ret = image_convert(frame, format->fourcc, image);
+    if (ret == 0) {
+        ret = write_file(output, frame, size);
+    }
+
+done:
+    free(frame);
+    if (image == &scaled) {
+        image_free(&scaled);
+    }
+    image_free(&source);
+    return ret;
+}
+
+static int convert_raw_to_png(const char *input, const char *output,
+        const struct convert_format *format)
+{
+    struct image image;
+    int ret;
+
+    ret = load_raw_image(input, format->fourcc, settings.width, settings.height, &image);
+    if (ret < 0) {
+        return ret;
+    }
+
+    ret = save_png_image(output, &image);
+    image_free(&image);
+    return ret;
+}
+
+static int convert_file(const char *input)
+{
+    const char *extension = convert_extension(input);
+    const struct convert_format *format;
+    char output[PATH_MAX];
+    int ret;
+
+    if (!strcasecmp(extension, "png")) {
+        ret = convert_output_path(output, sizeof(output), input, settings.output_format->extension);
+        return (ret < 0) ? ret : convert_png_to_raw(input, output);
+    }
+
+    format = (settings.input_format) ? settings.input_format : convert_find_format(extension);
+    if (!format || !format->decode) {
+        printf("CONVERT: Unknown raw format of %s, use -i\n", input);
+        return -EINVAL;
+    }
+
+    if (!settings.width) {
+        printf("CONVERT: Raw frame %s needs a geometry, use -s\n", input);
+        return -EINVAL;
+    }
+
+    ret = convert_output_path(output, sizeof(output), input, "png");
+    return (ret < 0) ? ret : convert_raw_to_png(input, output, format);
+}
+
+static void *convert_thread(void *arg)
+{
+    unsigned int index;
+    int ret;
+
+    (void) arg;
+
+    while ((index = atomic_fetch_add(&file_next, 1)) < file_count) {
+        ret = convert_file(files[index]);
+        if (ret < 0) {
+            printf("CONVERT: Could not convert %s: %s (%d)\n", files[index], strerror(-ret), -ret);
+            atomic_fetch_add(&failed, 1);
+        }
+    }
+
+    return NULL;
+}
+
+static void usage(const char *argv0)
+{
+    unsigned int i;
+
+    fprintf(stderr, "Usage: %s [options] file...\n", argv0);
+    fprintf(stderr, "PNG files are converted to raw frames, any other file from a raw frame to PNG\n");
+    fprintf(stderr, "Available options are\n");
+    fprintf(stderr, " -f format   Raw format of PNG conversions (default GREY)\n");
+    fprintf(stderr, " -h          Print this help screen and exit\n");
+    fprintf(stderr, " -i format   Format of raw input files (default by extension)\n");
+    fprintf(stderr, " -j jobs     Number of files converted in parallel (default online CPUs)\n");
+    fprintf(stderr, " -o dir      Write the output files to dir, created if missing (default next to the input)\n");
+    fprintf(stderr, " -p          Load PNG files as 16-bit greyscale, like uvc-gadget -y\n");
+    fprintf(stderr, " -s WxH      Frame geometry: PNG images are scaled to it, raw inputs have it\n");
+    fprintf(stderr, "Formats (extension)\n");
+    for (i = 0; i < ARRAY_SIZE(formats); i++) {
+        fprintf(stderr, " %-11s .%s%s\n", formats[i].name, formats[i].extension,
+                (formats[i].decode) ? "" : ", output only");
+    }
+}
+
+int main(int argc, char *argv[])
+{
+    pthread_t threads[CONVERT_MAX_JOBS];
+    long jobs = sysconf(_SC_NPROCESSORS_ONLN);
+    unsigned int started = 0;
+    unsigned int i;
+    struct stat st;
+    double start;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "f:hi:j:o:ps:")) != -1) {
+        switch (opt) {
+            case 'f':
+                settings.output_format = convert_find_format(optarg);
+                if (!settings.output_format) {
+                    fprintf(stderr, "ERROR: Unknown format %s\n", optarg);
+                    return 1;
+                }
+                break;
+
+            case 'i':
+                settings.input_format = convert_find_format(optarg);
+                if (!settings.input_format || !settings.input_format->decode) {
+                    fprintf(stderr, "ERROR: Unsupported raw input format %s\n", optarg);
+                    return 1;
+                }
+                break;
+
+            case 'j':
+                jobs = atoi(optarg);
+                if (jobs < 1) {
+                    fprintf(stderr, "ERROR: Invalid number of jobs\n");
+                    return 1;
+                }
+                break;
+
+            case 'o':
+                settings.output_dir = optarg;
+                break;
+
+            case 'p':
+                settings.png16 = true;
+                break;
+
+            case 's':
+                if (sscanf(optarg, "%ux%u", &settings.width, &settings.height) != 2 ||
+                        !settings.width || !settings.height) {
+                    fprintf(stderr, "ERROR: Invalid geometry %s\n", optarg);
+                    return 1;
+                }
+                break;
+
+            case 'h':
+                usage(argv[0]);
+                return 0;
+
+            default:
+                usage(argv[0]);
+                return 1;
+        }
+    }
+
+    files = &argv[optind];
+    file_count = argc - optind;
+    if (!file_count) {
+        usage(argv[0]);
+        return 1;
+    }
+
+    /* Created once here, so a missing directory is not reported for every file */
+    if (settings.output_dir && mkdir(settings.output_dir, 0755) < 0 && errno != EEXIST) {
+        fprintf(stderr, "ERROR: Could not create %s: %s (%d)\n", settings.output_dir, strerror(errno), errno);
+        return 1;
+    }
+    if (settings.output_dir && (stat(settings.output_dir, &st) < 0 || !S_ISDIR(st.st_mode))) {
+        fprintf(stderr, "ERROR: %s is not a directory\n", settings.output_dir);
+        return 1;
+    }
+
+    if (jobs < 1) {
+        jobs = 1;
+    }
+    if (jobs > CONVERT_MAX_JOBS) {
+        jobs = CONVERT_MAX_JOBS;
+    }
+    if (jobs > file_count) {
+        jobs = file_count;
+    }
+
+    start = monotonic_ns();
+
+    for (i = 0; i < jobs; i++) {
+        if (pthread_create(&threads[i], NULL, convert_thread, NULL) != 0) {
+            break;
+        }
+        started++;
+    }
+
+    /* Convert in this thread if no worker could be started */
+    if (!started) {
+        convert_thread(NULL);
+    }
+
+    for (i = 0; i < started; i++) {
+        pthread_join(threads[i], NULL);
+    }
+
+    printf("CONVERT: %u file(s) converted in %.0f ms with %u thread(s), %u failed\n",
+            file_count - failed, (monotonic_ns() - start) / 1e6, (started) ? started : 1, failed);
+    return (failed) ? 1 : 0;
+}
@@ -0,0 +1,139 @@
+/*
+ * Span recorder with Chrome trace-event export
+ *
+ * Every traced thread records its spans into a ring of its own, without locks
+ * or system calls besides the vDSO clock. The rings are only read when the
+ * trace is written out.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ */
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "trace.h"
+
+__thread struct trace_buffer *trace_current;
+
+static struct trace_buffer *trace_buffers[TRACE_MAX_THREADS];
+static _Atomic unsigned int trace_buffer_count;
+
+/* Counter and CLOCK_MONOTONIC (ns) sampled together when tracing starts */
+static uint64_t trace_origin_ticks;
+static double trace_origin_ns;
+
+static double monotonic_ns()
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+int trace_thread_register(const char *name)
+{
+    struct trace_buffer *buffer;
+    unsigned int index;
+
+    index = atomic_fetch_add(&trace_buffer_count, 1);
+    if (index == 0) {
+        trace_origin_ticks = trace_clock();
+        trace_origin_ns = monotonic_ns();
+    }
+
+    if (index >= TRACE_MAX_THREADS) {
+        printf("TRACE: Too many traced threads, not tracing %s\n", name);
+        return -ENOSPC;
+    }
+
+    /* Touched up front, so recording never faults */
+    buffer = malloc(sizeof(*buffer));
+    if (!buffer) {
+        printf("TRACE: Out of memory for the spans of %s\n", name);
+        return -ENOMEM;
+    }
+    memset(buffer, 0, sizeof(*buffer));
+
+    snprintf(buffer->thread_name, sizeof(buffer->thread_name), "%s", name);
+    buffer->tid = gettid();
+
+    trace_buffers[index] = buffer;
+    trace_current = buffer;
+    return 0;
+}
+
+int trace_write(const char *filename)
+{
+    unsigned int count = atomic_load(&trace_buffer_count);
+    const struct trace_buffer *buffer;
+    const struct trace_span *span;
+    unsigned long long spans = 0;
+    bool first = true;
+    uint64_t head;
+    uint64_t i;
+    unsigned int t;
+    int pid = getpid();
+    double ns_per_tick;
+    uint64_t ticks;
+    FILE *fp;
+
+    fp = fopen(filename, "w");
+    if (!fp) {
+        printf("TRACE: Could not open %s: %s (%d)\n", filename, strerror(errno), errno);
+        return -errno;
+    }
+
+    /* Rate of the counter since tracing started */
+    ticks = trace_clock();
+    ns_per_tick = (ticks > trace_origin_ticks) ?
+            (monotonic_ns() - trace_origin_ns) / (ticks - trace_origin_ticks) : 1.0;
+
+    fprintf(fp, "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n");
+
+    for (t = 0; t < count && t < TRACE_MAX_THREADS; t++) {
+        buffer = trace_buffers[t];
+        if (!buffer) {
+            continue;
+        }
+
+        fprintf(fp, "%s{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":%d,\"tid\":%d,"
+                "\"args\":{\"name\":\"%s\"}}", (first) ? "" : ",\n", pid, buffer->tid,
+                buffer->thread_name);
+        first = false;
+
+        head = atomic_load_explicit(&buffer->head, memory_order_acquire);
+        for (i = (head > TRACE_SPANS) ? head - TRACE_SPANS : 0; i < head; i++) {
+            span = &buffer->spans[i & (TRACE_SPANS - 1)];
+            fprintf(fp, ",\n{\"name\":\"%s\",\"ph\":\"X\",\"pid\":%d,\"tid\":%d,"
+                    "\"ts\":%.3f,\"dur\":%.3f}", span->name, pid, buffer->tid,
+                    (trace_origin_ns + (double) (int64_t) (span->start - trace_origin_ticks) * ns_per_tick) / 1000.0,
+                    (span->end - span->start) * ns_per_tick / 1000.0);
+            spans++;
+        }
+    }
+
+    fprintf(fp, "\n]}\n");
+
+    if (fclose(fp) != 0) {
+        printf("TRACE: Could not write %s: %s (%d)\n", filename, strerror(errno), errno);
+        return -errno;
+    }
+
+    printf("TRACE: %llu span(s) written to %s\n", spans, filename);
+    return 0;
+}
@@ -0,0 +1,104 @@
+/*
+ *	trace.h  --  Span recorder with Chrome trace-event export
+ *
+ *	This program is free software; you can redistribute it and/or modify
+ *	it under the terms of the GNU General Public License as published by
+ *	the Free Software Foundation; either version 2 of the License, or
+ *	(at your option) any later version.
+ */
+
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <stdatomic.h>
+#include <stdint.h>
+#include <time.h>
+
+/* Spans kept per thread (power of two), the oldest ones are overwritten */
+#define TRACE_SPANS 65536
+#define TRACE_MAX_THREADS 8
+
+struct trace_span {
+    const char *name;           /* static string */
+    uint64_t start;             /* trace_clock() ticks */
+    uint64_t end;
+};
+
+/*
+ * Ring of the spans of one thread. Only its thread writes to it, the head is
+ * published with release semantics for the exporter.
+ */
+struct trace_buffer {
+    char thread_name[16];
+    int tid;
+    _Atomic uint64_t head;
+    struct trace_span spans[TRACE_SPANS];
+};
+
+/* Buffer of the calling thread, NULL when it is not traced */
+extern __thread struct trace_buffer *trace_current;
+
+/*
+ * Span timestamps are raw counter ticks (TSC on x86, the generic timer on
+ * arm64), converted to CLOCK_MONOTONIC when the trace is written. Other
+ * architectures read CLOCK_MONOTONIC in ns directly.
+ */
+static inline uint64_t trace_clock(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+    return __builtin_ia32_rdtsc();
+#elif defined(__aarch64__)
+    uint64_t ticks;
+
+    __asm__ __volatile__ ("mrs %0, cntvct_el0" : "=r" (ticks));
+    return ticks;
+#else
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+#endif
+}
+
+/*
+ * Recording: trace_begin() returns 0 in threads that are not traced, so a
+ * disabled tracer costs a thread-local load and a branch per span.
+ *
+ *	uint64_t start = trace_begin();
+ *	...
+ *	trace_end("DQBUF", start);
+ */
+static inline uint64_t trace_begin(void)
+{
+    return (trace_current) ? trace_clock() : 0;
+}
+
+static inline void trace_end(const char *name, uint64_t start)
+{
+    struct trace_buffer *buffer = trace_current;
+    struct trace_span *span;
+    uint64_t head;
+
+    if (!start || !buffer) {
+        return;
+    }
+
+    head = atomic_load_explicit(&buffer->head, memory_order_relaxed);
+    span = &buffer->spans[head & (TRACE_SPANS - 1)];
+    span->name = name;
+    span->start = start;
+    span->end = trace_clock();
+    atomic_store_explicit(&buffer->head, head + 1, memory_order_release);
+}
+
+/* Start tracing the calling thread, the name shows up in the timeline */
+int trace_thread_register(const char *name);
+
+/*
+ * Write the recorded spans of all threads as Chrome trace-event JSON
+ * (chrome://tracing, Perfetto). Spans recorded while writing may be torn
+ * if a ring wraps around meanwhile.
+ */
+int trace_write(const char *filename);
+
+#endif /* TRACE_H */
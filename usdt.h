@@ -0,0 +1,95 @@
+/*
+ *	usdt.h  --  User space statically defined tracing probes
+ *
+ *	Minimal equivalent of <sys/sdt.h> (SystemTap SDT v3 notes), so the
+ *	probes need neither systemtap headers at build time nor anything at
+ *	runtime. Each probe is a nop and a .note.stapsdt ELF note describing
+ *	where its arguments are; bpftrace, perf and bcc attach to them as
+ *	usdt:<binary>:uvc_gadget:<name>.
+ *
+ *	This program is free software; you can redistribute it and/or modify
+ *	it under the terms of the GNU General Public License as published by
+ *	the Free Software Foundation; either version 2 of the License, or
+ *	(at your option) any later version.
+ */
+
+#ifndef USDT_H
+#define USDT_H
+
+#define USDT_PROVIDER "uvc_gadget"
+
+#if defined(__GNUC__) && !defined(NO_USDT)
+
+#if defined(__LP64__)
+#define USDT_ASM_ADDR ".8byte"
+#else
+#define USDT_ASM_ADDR ".4byte"
+#endif
+
+/*
+ * Arguments are passed as long: "-N@operand", the size negated for a signed
+ * value, with the operand in the assembler syntax of the target
+ */
+#define USDT_ARG(n, x) [usdt_s##n] "n" ((int) sizeof(long)), [usdt_a##n] "nor" ((long) (x))
+#define USDT_ARGFMT(n) "%n[usdt_s" #n "]@%[usdt_a" #n "]"
+
+#define USDT_ASM(name, args) \
+    "990: nop\n" \
+    ".pushsection .note.stapsdt,\"?\",\"note\"\n" \
+    ".balign 4\n" \
+    ".4byte 992f-991f, 994f-993f, 3\n" \
+    "991: .asciz \"stapsdt\"\n" \
+    "992: .balign 4\n" \
+    "993: " USDT_ASM_ADDR " 990b\n" \
+    USDT_ASM_ADDR " _.stapsdt.base\n" \
+    USDT_ASM_ADDR " 0\n" \
+    ".asciz \"" USDT_PROVIDER "\"\n" \
+    ".asciz \"" #name "\"\n" \
+    ".asciz \"" args "\"\n" \
+    "994: .balign 4\n" \
+    ".popsection\n" \
+    ".ifndef _.stapsdt.base\n" \
+    ".pushsection .stapsdt.base,\"aG\",\"progbits\",.stapsdt.base,comdat\n" \
+    ".weak _.stapsdt.base\n" \
+    ".hidden _.stapsdt.base\n" \
+    "_.stapsdt.base: .space 1\n" \
+    ".size _.stapsdt.base, 1\n" \
+    ".popsection\n" \
+    ".endif\n"
+
+#define USDT_PROBE0(name) \
+    __asm__ __volatile__ (USDT_ASM(name, ""))
+
+#define USDT_PROBE1(name, a1) \
+    __asm__ __volatile__ (USDT_ASM(name, USDT_ARGFMT(1)) :: USDT_ARG(1, a1))
+
+#define USDT_PROBE2(name, a1, a2) \
+    __asm__ __volatile__ (USDT_ASM(name, USDT_ARGFMT(1) " " USDT_ARGFMT(2)) \
+            :: USDT_ARG(1, a1), USDT_ARG(2, a2))
+
+#define USDT_PROBE3(name, a1, a2, a3) \
+    __asm__ __volatile__ (USDT_ASM(name, USDT_ARGFMT(1) " " USDT_ARGFMT(2) " " USDT_ARGFMT(3)) \
+            :: USDT_ARG(1, a1), USDT_ARG(2, a2), USDT_ARG(3, a3))
+
+#define USDT_PROBE4(name, a1, a2, a3, a4) \
+    __asm__ __volatile__ (USDT_ASM(name, USDT_ARGFMT(1) " " USDT_ARGFMT(2) " " USDT_ARGFMT(3) \
+                " " USDT_ARGFMT(4)) \
+            :: USDT_ARG(1, a1), USDT_ARG(2, a2), USDT_ARG(3, a3), USDT_ARG(4, a4))
+
+#define USDT_PROBE5(name, a1, a2, a3, a4, a5) \
+    __asm__ __volatile__ (USDT_ASM(name, USDT_ARGFMT(1) " " USDT_ARGFMT(2) " " USDT_ARGFMT(3) \
+                " " USDT_ARGFMT(4) " " USDT_ARGFMT(5)) \
+            :: USDT_ARG(1, a1), USDT_ARG(2, a2), USDT_ARG(3, a3), USDT_ARG(4, a4), USDT_ARG(5, a5))
+
+#else
+
+#define USDT_PROBE0(name) do { } while (0)
+#define USDT_PROBE1(name, a1) do { } while (0)
+#define USDT_PROBE2(name, a1, a2) do { } while (0)
+#define USDT_PROBE3(name, a1, a2, a3) do { } while (0)
+#define USDT_PROBE4(name, a1, a2, a3, a4) do { } while (0)
+#define USDT_PROBE5(name, a1, a2, a3, a4, a5) do { } while (0)
+
+#endif
+
+#endif /* USDT_H */
@@ -40,8 +40,13 @@
  * with this program; if not, write to the Free Software Foundation, Inc.,
  */
 
+#define _GNU_SOURCE
+
+#include <sys/epoll.h>
+#include <sys/inotify.h>
 #include <sys/ioctl.h>
 #include <sys/mman.h>
+#include <sys/resource.h>
 #include <sys/select.h>
 #include <sys/stat.h>
 #include <sys/time.h>
@@ -57,8 +62,16 @@
 #include <unistd.h>
 #include <stdbool.h>
 #include <time.h>
+#include <limits.h>
 #include <ftw.h>
+#include <malloc.h>
+#include <dirent.h>
+#include <mntent.h>
 #include <png.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdatomic.h>
 
 #include <linux/usb/ch9.h>
 #include <linux/usb/video.h>
@@ -66,15 +79,216 @@
 #include <linux/fb.h>
 
 #include "uvc-gadget.h"
+#include "image-convert.h"
+#include "trace.h"
+#include "usdt.h"
 
 volatile sig_atomic_t terminate = 0;
 
+/* For the time to the first response to the host */
+static double start_time;
+
 void term(int signum)
 {
     (void)(signum); /* avoid warning: unused parameter 'signum' */
     terminate = 1;
 }
 
+/* SIGUSR1 writes the trace recorded so far with -T */
+volatile sig_atomic_t trace_requested = 0;
+
+void trace_signal(int signum)
+{
+    (void)(signum);
+    trace_requested = 1;
+}
+
+/* Leave SIGINT / SIGTERM / SIGUSR1 to the main thread, so they interrupt its select() */
+static void thread_block_signals()
+{
+    sigset_t set;
+
+    sigemptyset(&set);
+    sigaddset(&set, SIGINT);
+    sigaddset(&set, SIGTERM);
+    sigaddset(&set, SIGUSR1);
+    pthread_sigmask(SIG_BLOCK, &set, NULL);
+}
+
+/* Monotonic time in milliseconds */
+static double monotonic_ms()
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000.0 + ts.tv_nsec / 1000000.0;
+}
+
+/* ---------------------------------------------------------------------------
+ * Real-time settings
+ */
+
+/* Touch the stack the streaming loop will use, so it doesn't fault later */
+static void rt_prefault_stack()
+{
+    volatile unsigned char stack[RT_STACK_PREFAULT];
+    unsigned int i;
+
+    for (i = 0; i < sizeof(stack); i += 4096) {
+        stack[i] = 0;
+    }
+}
+
+/*
+ * Apply the scheduling policy, CPU affinity and memory locking of the command
+ * line to the calling (streaming) thread. Threads created afterwards inherit
+ * policy and affinity.
+ */
+static void rt_apply_settings()
+{
+    struct sched_param param;
+    int ret;
+
+    if (settings.rt_policy != SCHED_OTHER) {
+        CLEAR(param);
+        param.sched_priority = settings.rt_priority;
+        ret = pthread_setschedparam(pthread_self(), settings.rt_policy, &param);
+        if (ret) {
+            printf("RT: Could not set %s priority %d: %s (%d)\n",
+                    (settings.rt_policy == SCHED_FIFO) ? "SCHED_FIFO" : "SCHED_RR",
+                    settings.rt_priority, strerror(ret), ret);
+        }
+    }
+
+    if (settings.rt_cpus_set) {
+        ret = pthread_setaffinity_np(pthread_self(), sizeof(settings.rt_cpus), &settings.rt_cpus);
+        if (ret) {
+            printf("RT: Could not set the CPU affinity: %s (%d)\n", strerror(ret), ret);
+        }
+    }
+
+    if (settings.lock_memory) {
+        if (mlockall(MCL_CURRENT | MCL_FUTURE) < 0) {
+            printf("RT: Could not lock memory: %s (%d)\n", strerror(errno), errno);
+        }
+        rt_prefault_stack();
+    }
+}
+
+static long rt_page_faults()
+{
+    struct rusage usage;
+
+    if (getrusage(RUSAGE_THREAD, &usage) < 0) {
+        return 0;
+    }
+    return usage.ru_minflt + usage.ru_majflt;
+}
+
+/*
+ * Warn when the streaming loop page faults once the stream runs, locked and
+ * prefaulted memory should make that impossible
+ */
+static void rt_check_page_faults(double now)
+{
+    long faults;
+
+    if (now - uvc_dev.page_fault_check < 1000) {
+        return;
+    }
+
+    faults = rt_page_faults();
+    if (uvc_dev.is_streaming && now - uvc_dev.stream_start > 2000 && faults > uvc_dev.page_faults) {
+        printf("RT: %ld page fault(s) in the streaming loop in steady state\n", faults - uvc_dev.page_faults);
+    }
+
+    uvc_dev.page_faults = faults;
+    uvc_dev.page_fault_check = now;
+}
+
+static int compare_double(const void *a, const void *b)
+{
+    double x = *(const double *) a;
+    double y = *(const double *) b;
+
+    return (x > y) - (x < y);
+}
+
+/*
+ * Wake up at every frame interval and copy one frame, the way the streaming
+ * loop does, and report how late the wake-ups were
+ */
+static int rt_jitter_run(const char *name, void *dst, const void *src)
+{
+    unsigned int count = settings.jitter_seconds * settings.image_framerate;
+    long period = 1000000000L / settings.image_framerate;
+    struct timespec next;
+    struct timespec now;
+    double *late;
+    double sum = 0;
+    long faults;
+    unsigned int i;
+
+    late = malloc(count * sizeof(*late));
+    if (!late) {
+        return -ENOMEM;
+    }
+
+    faults = rt_page_faults();
+    clock_gettime(CLOCK_MONOTONIC, &next);
+
+    for (i = 0; i < count && !terminate; i++) {
+        next.tv_nsec += period;
+        if (next.tv_nsec >= 1000000000L) {
+            next.tv_nsec -= 1000000000L;
+            next.tv_sec++;
+        }
+
+        clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &next, NULL);
+        clock_gettime(CLOCK_MONOTONIC, &now);
+
+        late[i] = (now.tv_sec - next.tv_sec) * 1000000.0 + (now.tv_nsec - next.tv_nsec) / 1000.0;
+        sum += late[i];
+
+        memcpy(dst, src, RT_JITTER_FRAME_SIZE);
+    }
+    count = i;
+
+    if (count) {
+        qsort(late, count, sizeof(*late), compare_double);
+        printf("JITTER: %-9s %u wake-ups, late min %.1f us, avg %.1f us, p99 %.1f us, max %.1f us, "
+                "%ld page fault(s)\n", name, count, late[0], sum / count, late[count * 99 / 100],
+                late[count - 1], rt_page_faults() - faults);
+    }
+
+    free(late);
+    return 0;
+}
+
+/* Run the jitter benchmark with default scheduling, then with the real-time settings */
+static int rt_jitter_benchmark()
+{
+    uint8_t *src = malloc(RT_JITTER_FRAME_SIZE);
+    uint8_t *dst = malloc(RT_JITTER_FRAME_SIZE);
+    int ret = -ENOMEM;
+
+    if (src && dst) {
+        memset(src, 0x80, RT_JITTER_FRAME_SIZE);
+        memset(dst, 0, RT_JITTER_FRAME_SIZE);
+
+        printf("JITTER: %u s at %u fps\n", settings.jitter_seconds, settings.image_framerate);
+        ret = rt_jitter_run("default", dst, src);
+        if (ret == 0) {
+            rt_apply_settings();
+            ret = rt_jitter_run("real-time", dst, src);
+        }
+    }
+
+    free(src);
+    free(dst);
+    return ret;
+}
+
 static int sys_gpio_write(unsigned int type, char pin[], char value[])
 {
     FILE *sys_file;
@@ -188,12 +402,18 @@ static void streaming_status_value(bool state)
     char *gpio_value = (state) ? GPIO_VALUE_ON : GPIO_VALUE_OFF;
     char *led_value = (state) ? LED_BRIGHTNESS_HIGH : LED_BRIGHTNESS_LOW;
 
+    uint64_t start;
+
     if (settings.streaming_status_enabled) {
+        start = trace_begin();
         sys_gpio_write(GPIO_VALUE, settings.streaming_status_pin, gpio_value);
+        trace_end("GPIO write", start);
     }
 
     if (settings.streaming_status_onboard_enabled) {
+        start = trace_begin();
         sys_led_write(LED_BRIGHTNESS, led_value);
+        trace_end("LED write", start);
     }
 }
 
@@ -273,13 +493,19 @@ static char *uvc_vs_interface_control_name(unsigned int interface)
 
 static unsigned int get_frame_size(int pixelformat, int width, int height)
 {
-    switch (pixelformat) {
-        case V4L2_PIX_FMT_YUYV:
-            return width *height * 2;
+    unsigned int size;
 
+    switch (pixelformat) {
         case V4L2_PIX_FMT_MJPEG:
             return width * height;
             break;
+
+        default:
+            size = image_frame_size(pixelformat, width, height);
+            if (size) {
+                return size;
+            }
+            break;
     }
 
     return width * height;
@@ -325,1409 +551,5417 @@ err:
 }
 
 /*
- * Load PNG image
+ * Add an image source file (PNG, 16-bit PNG, L8 or JPEG passthrough), every
+ * further image is appended to the frame sequence of the source
  */
-void load_png_image(char *filename)
+static int image_add_file(enum image_type type, const char *filename)
 {
-    int width;
-    int height;
-    png_byte color_type;
-    png_byte bit_depth;
-    png_bytep *row_pointers = NULL;
-    png_bytep pixel1;
-    png_bytep pixel2;
-    unsigned int yvyu;
-    char *pixels_buffer;
-    char *pixels_yuyv;
-    unsigned int buffer_size;
-
-    FILE *fp = fopen(filename, "rb");
+    struct image_file *files;
 
-    png_structp png = png_create_read_struct(PNG_LIBPNG_VER_STRING, NULL, NULL, NULL);
-    if (!png) abort();
+    if (image_dev.image_file_count &&
+            (type == IMAGE_TYPE_JPEG || image_dev.image_files[0].type == IMAGE_TYPE_JPEG)) {
+        printf("[-] Error: JPEG passthrough can't be combined with other image sources\n");
+        return -EINVAL;
+    }
 
-    png_infop info = png_create_info_struct(png);
-    if (!info) abort();
+    files = realloc(image_dev.image_files, (image_dev.image_file_count + 1) * sizeof(*files));
+    if (!files) {
+        return -ENOMEM;
+    }
 
-    if (setjmp(png_jmpbuf(png))) abort();
+    image_dev.image_files = files;
+    image_dev.image_files[image_dev.image_file_count].name = filename;
+    image_dev.image_files[image_dev.image_file_count].type = type;
+    image_dev.image_file_count++;
+    return 0;
+}
 
-    png_init_io(png, fp);
+/*
+ * Map a JPEG file or a concatenated MJPEG stream and index its frames. The
+ * frames are sent as they are, without decoding or re-encoding.
+ */
+static int image_set_map_jpeg(struct image_set *set, const char *filename)
+{
+    struct stat st;
+    void *map;
+    int ret;
+    int fd;
 
-    png_read_info(png, info);
+    fd = open(filename, O_RDONLY);
+    if (fd < 0) {
+        printf("[-] Error: Could not open '%s': %s (%d)\n", filename, strerror(errno), errno);
+        return -errno;
+    }
 
-    width      = png_get_image_width(png, info);
-    height     = png_get_image_height(png, info);
-    color_type = png_get_color_type(png, info);
-    bit_depth  = png_get_bit_depth(png, info);
+    if (fstat(fd, &st) < 0 || st.st_size == 0) {
+        printf("[-] Error: '%s' is empty or not readable\n", filename);
+        close(fd);
+        return -EINVAL;
+    }
 
-    // Read any color_type into 8 bit depth, RGBA format.
-    // See http://www.libpng.org/pub/png/libpng-manual.txt
-    if (bit_depth == 16)
-        png_set_strip_16(png);
+    map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) {
+        printf("[-] Error: Could not map '%s': %s (%d)\n", filename, strerror(errno), errno);
+        return -errno;
+    }
+    madvise(map, st.st_size, MADV_WILLNEED);
 
-    if (color_type == PNG_COLOR_TYPE_PALETTE)
-        png_set_palette_to_rgb(png);
+    ret = jpeg_index_frames(map, st.st_size, &set->jpeg_frames, &set->jpeg_frame_count);
+    if (ret < 0 || !set->jpeg_frame_count) {
+        printf("[-] Error: No JPEG frames found in '%s'\n", filename);
+        munmap(map, st.st_size);
+        return ret < 0 ? ret : -EINVAL;
+    }
 
-    // PNG_COLOR_TYPE_GRAY_ALPHA is always 8 or 16bit depth
-    if(color_type == PNG_COLOR_TYPE_GRAY && bit_depth < 8)
-        png_set_expand_gray_1_2_4_to_8(png);
+    set->jpeg_map = map;
+    set->jpeg_map_size = st.st_size;
 
-    if (png_get_valid(png, info, PNG_INFO_tRNS))
-        png_set_tRNS_to_alpha(png);
+    printf("IMAGE: Indexed %u JPEG frame(s) in '%s', %ux%u\n", set->jpeg_frame_count,
+            filename, set->jpeg_frames[0].width, set->jpeg_frames[0].height);
+    return 0;
+}
 
-    // These color_type don't have an alpha channel then fill it with 0xff.
-    if (color_type == PNG_COLOR_TYPE_RGB ||
-            color_type == PNG_COLOR_TYPE_GRAY ||
-            color_type == PNG_COLOR_TYPE_PALETTE)
-        png_set_filler(png, 0xFF, PNG_FILLER_AFTER);
+/*
+ * Decode an image source file into the frame set
+ */
+static int image_set_load(struct image_set *set, const struct image_file *file)
+{
+    struct image *sources;
+    struct image image;
+    int ret = -EINVAL;
 
-    if(color_type == PNG_COLOR_TYPE_GRAY ||
-            color_type == PNG_COLOR_TYPE_GRAY_ALPHA)
-        png_set_gray_to_rgb(png);
+    switch (file->type) {
+        case IMAGE_TYPE_PNG:
+            ret = load_png_image(file->name, &image);
+            break;
 
-    png_read_update_info(png, info);
+        case IMAGE_TYPE_PNG16:
+            ret = load_png16_image(file->name, &image);
+            break;
 
-    if (row_pointers) abort();
+        case IMAGE_TYPE_L8:
+            // hardcoded image size (for test purposes)
+            ret = load_l8_image(file->name, 480, 480, &image);
+            break;
 
-    row_pointers = (png_bytep*)malloc(sizeof(png_bytep) *height);
-    for(int y = 0; y < height; y++) {
-        row_pointers[y] = (png_byte*)malloc(png_get_rowbytes(png,info));
+        case IMAGE_TYPE_JPEG:
+            return image_set_map_jpeg(set, file->name);
     }
 
-    png_read_image(png, row_pointers);
-    fclose(fp);
-    png_destroy_read_struct(&png, &info, NULL);
+    if (ret < 0) {
+        printf("[-] Error: Could not load image '%s': %s (%d)\n", file->name, strerror(-ret), -ret);
+        return ret;
+    }
 
-    // convert RGBA to YUYV
-    image_dev.image_width = width;
-    image_dev.image_height = height;
-    image_dev.image_size = width * height;
-    buffer_size = width * height * 4 * (bit_depth / 8);
-    image_dev.image_uncompressed_mem_size = width * height * 2;
+    sources = realloc(set->sources, (set->source_count + 1) * sizeof(*sources));
+    if (!sources) {
+        image_free(&image);
+        return -ENOMEM;
+    }
 
-    pixels_buffer = malloc(buffer_size);
-    if (pixels_buffer == NULL) {
-        printf("[-] Error: Could allocate enough memory for the PNG pixel buffer");
-        exit(1);
+    if (!set->source_count) {
+        set->source_width = image.width;
+        set->source_height = image.height;
     }
 
-    image_dev.image_uncompressed_memory = malloc(image_dev.image_uncompressed_mem_size);
-    if (image_dev.image_uncompressed_memory == NULL) {
-        printf("[-] Error: Could allocate enough memory for the uncompressed image");
-        exit(1);
+    set->sources = sources;
+    set->sources[set->source_count++] = image;
+    return 0;
+}
+
+/*
+ * Largest JPEG frame allowed by the bitrate of a frame descriptor
+ */
+static unsigned int image_mjpeg_frame_budget(struct uvc_frame_format *frame_format)
+{
+    unsigned long long budget = 0;
+
+    if (frame_format->dwMaxBitRate && frame_format->dwDefaultFrameInterval) {
+        /* dwMaxBitRate in bit/s, dwDefaultFrameInterval in 100 ns units */
+        budget = (unsigned long long) frame_format->dwMaxBitRate *
+            frame_format->dwDefaultFrameInterval / 8 / 10000000;
     }
 
-    pixels_yuyv = image_dev.image_uncompressed_memory;
+    if (frame_format->dwMaxVideoFrameBufferSize &&
+            (!budget || budget > frame_format->dwMaxVideoFrameBufferSize)) {
+        budget = frame_format->dwMaxVideoFrameBufferSize;
+    }
 
-    for (int y = 0; y < height; y++) {
-        png_bytep row = row_pointers[y];
+    return budget;
+}
 
-        for (int x = 0; x < width; x += 2) {
-            pixel1 = &(row[x * 4]);
-            pixel2 = &(row[(x + 1) * 4]);
+static void image_free_frames(struct image_converted *converted)
+{
+    unsigned int i;
 
-            yvyu = rgb2yvyu(pixel1[0], pixel1[1], pixel1[2], pixel2[0], pixel2[1], pixel2[2]);
-            memcpy(pixels_yuyv, &yvyu, 4);
-            pixels_yuyv += 4;
-        }
+    if (converted->mapped) {
+        return;
     }
 
-    // free pixels buffer
-    free(pixels_buffer);
+    for (i = 0; i < converted->nframes; i++) {
+        free(converted->frames[i].memory);
+        converted->frames[i].memory = NULL;
+    }
 }
 
 /*
- * Load L8 image (8-bit grayscale)
+ * Encode all source frames with the highest quality that fits the frame budget
+ * of every frame. The quality is searched between 1 and settings.jpeg_quality.
  */
-void load_l8_image(char *filename)
+static int image_prepare_mjpeg(struct image_converted *converted, struct image *sources,
+        unsigned int budget)
 {
-    FILE *fp = fopen(filename, "rb");
-    if (fp == NULL) {
-        printf("[-] Error: Could not open L8 image '%s'\n", filename);
-        exit(1);
-    }
+    unsigned int quality_min = 1;
+    unsigned int quality_max = settings.jpeg_quality;
+    unsigned int quality = quality_max;
+    unsigned long size;
+    unsigned int max_size;
+    unsigned int i;
+    uint8_t *jpeg;
+
+    while (true) {
+        max_size = 0;
+
+        image_free_frames(converted);
+        for (i = 0; i < converted->nframes; i++) {
+            if (image_encode_jpeg(&sources[i], quality, &jpeg, &size) < 0) {
+                image_free_frames(converted);
+                return -EINVAL;
+            }
+
+            converted->frames[i].memory = jpeg;
+            converted->frames[i].mem_size = size;
+            max_size = max(max_size, size);
+        }
 
-    fseek(fp, 0, SEEK_END);
-    image_dev.image_l8_mem_size = ftell(fp);
-    fseek(fp, 0, SEEK_SET);
+        if (!budget || max_size <= budget) {
+            quality_min = quality;
+        } else {
+            quality_max = quality - 1;
+        }
 
-    // hardcoded image size (for test purposes)
-    image_dev.image_width = 480;
-    image_dev.image_height = 480;
-    image_dev.image_size = 480 * 480;
+        if (quality_min >= quality_max) {
+            if (quality != quality_min) {
+                quality = quality_min;
+                continue;
+            }
+            break;
+        }
 
-    image_dev.image_l8_memory = malloc(image_dev.image_l8_mem_size);
-    if (image_dev.image_l8_memory == NULL) {
-        printf("[-] Error: Could allocate enough memory for the L8 image");
-        exit(1);
+        quality = (quality_min + quality_max + 1) / 2;
     }
 
-    fread(image_dev.image_l8_memory, 1, image_dev.image_l8_mem_size, fp);
+    if (budget && max_size > budget) {
+        printf("IMAGE: MJPEG %ux%u exceeds the frame budget of %u bytes (%u bytes at quality %u)\n",
+                converted->width, converted->height, budget, max_size, quality);
+    }
 
-    fclose(fp);
+    converted->quality = quality;
+    converted->max_size = max_size;
+    return 0;
 }
 
-/* ---------------------------------------------------------------------------
- * V4L2 streaming related
- */
-
-static void uvc_uninit_device()
+static struct image_converted *image_set_find(struct image_set *set, unsigned int video_format,
+        unsigned int width, unsigned int height)
 {
     unsigned int i;
-    if (settings.source_device == DEVICE_TYPE_IMAGE && uvc_dev.dummy_buf) {
-        printf("%s: Uninit device\n", uvc_dev.device_type_name);
 
-        for (i = 0; i < uvc_dev.nbufs; ++i) {
-            free(uvc_dev.dummy_buf[i].start);
-            uvc_dev.dummy_buf[i].start = NULL;
+    for (i = 0; i < set->converted_count; i++) {
+        if (set->converted[i].video_format == video_format &&
+                set->converted[i].width == width &&
+                set->converted[i].height == height) {
+            return &set->converted[i];
         }
-        free(uvc_dev.dummy_buf);
-        uvc_dev.dummy_buf = NULL;
     }
+    return NULL;
 }
 
-static int v4l2_video_stream_control(struct v4l2_device *dev, enum video_stream_action action)
+static struct image_converted *image_find_converted(struct uvc_frame_format *frame_format)
 {
-    int type = dev->buffer_type;
-    int ret;
-
-    if (action == STREAM_ON) {
-        ret = ioctl(dev->fd, VIDIOC_STREAMON, &type);
-        if (ret < 0) {
-            printf("%s: STREAM ON failed: %s (%d).\n", dev->device_type_name, strerror(errno), errno);
-            return ret;
-        }
+    if (!image_dev.image_set) {
+        return NULL;
+    }
 
-        printf("%s: STREAM ON success\n", dev->device_type_name);
-        dev->is_streaming = 1;
-        uvc_shutdown_requested = false;
+    return image_set_find(image_dev.image_set, frame_format->video_format,
+            frame_format->wWidth, frame_format->wHeight);
+}
 
-    } else if (dev->is_streaming) {
-        ret = ioctl(dev->fd, VIDIOC_STREAMOFF, &type);
-        if (ret < 0) {
-            printf("%s: STREAM OFF failed: %s (%d).\n", dev->device_type_name, strerror(errno), errno);
-            return ret;
-        }
+/*
+ * Frame size limit of a reloaded source, given by the buffers and the
+ * dwMaxVideoFrameSize negotiated for the set being replaced (0 if none)
+ */
+static unsigned int image_reload_limit(struct image_set *current, struct image_converted *converted)
+{
+    struct image_converted *old;
 
-        printf("%s: STREAM OFF success\n", dev->device_type_name);
-        dev->is_streaming = 0;
+    if (!current) {
+        return 0;
     }
-    return 0;
+
+    old = image_set_find(current, converted->video_format, converted->width, converted->height);
+    return (old) ? old->max_size : 0;
 }
 
-static int uvc_video_stream(enum video_stream_action action)
+/* Frame budget of an MJPEG conversion, within the frame size of the set being replaced */
+static unsigned int image_mjpeg_budget(struct uvc_frame_format *frame_format, struct image_set *current,
+        struct image_converted *converted)
 {
-    return v4l2_video_stream_control(&uvc_dev, action);
+    unsigned int budget = image_mjpeg_frame_budget(frame_format);
+    unsigned int limit = image_reload_limit(current, converted);
+
+    if (limit && (!budget || limit < budget)) {
+        budget = limit;
+    }
+    return budget;
 }
 
-static int v4l2_init_buffers(struct v4l2_device *dev, struct v4l2_requestbuffers *req,
-        unsigned int count)
+/*
+ * Serve the frames of the JPEG passthrough source to every MJPEG frame
+ * descriptor whose resolution matches the SOF header of the frames. Frames of
+ * other resolutions are left out of that descriptor's sequence.
+ */
+static int image_prepare_passthrough(struct image_set *set)
 {
-    int ret;
-    req->count  = count;
-    req->type   = dev->buffer_type;
-    req->memory = dev->memory_type;
+    struct uvc_frame_format *frame_format;
+    struct image_converted *converted;
+    struct jpeg_frame *jpeg;
+    unsigned int budget;
+    unsigned int i;
+    int k;
 
-    ret = ioctl(dev->fd, VIDIOC_REQBUFS, req);
-    if (ret < 0) {
-        if (ret == -EINVAL) {
-            printf("%s: Does not support %s\n", dev->device_type_name,
-                    (dev->memory_type == V4L2_MEMORY_USERPTR) ? "user pointer I/O" : "memory mapping");
+    for (k = 0; k <= last_format_index; k++) {
+        frame_format = &uvc_frame_format[k];
 
-        } else {
-            printf("%s: VIDIOC_REQBUFS error: %s (%d).\n",
-                    dev->device_type_name, strerror(errno), errno);
+        if (frame_format->video_format != V4L2_PIX_FMT_MJPEG) {
+            printf("IMAGE: JPEG passthrough skips format %c%c%c%c %ux%u\n",
+                    pixfmtstr(frame_format->video_format), frame_format->wWidth, frame_format->wHeight);
+            continue;
+        }
 
+        if (image_set_find(set, frame_format->video_format, frame_format->wWidth, frame_format->wHeight)) {
+            continue;
         }
-        return ret;
+
+        converted = &set->converted[set->converted_count];
+        converted->frames = calloc(set->jpeg_frame_count, sizeof(*converted->frames));
+        if (!converted->frames) {
+            return -ENOMEM;
+        }
+
+        converted->video_format = V4L2_PIX_FMT_MJPEG;
+        converted->width = frame_format->wWidth;
+        converted->height = frame_format->wHeight;
+        converted->quality = 0;
+        converted->max_size = 0;
+        converted->nframes = 0;
+        converted->mapped = true;
+
+        for (i = 0; i < set->jpeg_frame_count; i++) {
+            jpeg = &set->jpeg_frames[i];
+            if (jpeg->width != converted->width || jpeg->height != converted->height) {
+                continue;
+            }
+
+            converted->frames[converted->nframes].memory = (void *) (set->jpeg_map + jpeg->offset);
+            converted->frames[converted->nframes].mem_size = jpeg->size;
+            converted->max_size = max(converted->max_size, jpeg->size);
+            converted->nframes++;
+        }
+
+        if (!converted->nframes) {
+            printf("IMAGE: No JPEG frames with resolution %ux%u\n", converted->width, converted->height);
+            free(converted->frames);
+            converted->frames = NULL;
+            continue;
+        }
+
+        budget = image_mjpeg_frame_budget(frame_format);
+        if (budget && converted->max_size > budget) {
+            printf("IMAGE: MJPEG %ux%u exceeds the frame budget of %u bytes (%u bytes)\n",
+                    converted->width, converted->height, budget, converted->max_size);
+        }
+
+        printf("IMAGE: Passthrough of %u JPEG frame(s) as MJPEG %ux%u, max %u bytes\n",
+                converted->nframes, converted->width, converted->height, converted->max_size);
+
+        set->converted_count++;
     }
-    return count;
+
+    return (set->converted_count > 0) ? 0 : -EINVAL;
 }
 
-static int v4l2_reqbufs_mmap(struct v4l2_device *dev, struct v4l2_requestbuffers req)
+/*
+ * Convert the source frames to every video format and resolution of the UVC
+ * function, so the streaming path only has to copy the frames of the committed
+ * format. MJPEG frames are encoded once and cached per resolution. When
+ * replacing a current set, MJPEG frames are limited to its frame sizes.
+ */
+static int image_prepare_formats(struct image_set *set, struct image_set *current)
 {
+    struct uvc_frame_format *frame_format;
+    struct image_converted *converted;
+    struct image *sources;
+    unsigned int budget;
+    unsigned int mem_size;
+    unsigned int i;
     int ret;
-    unsigned int i = 0;
+    int k;
 
-    /* Map the buffers. */
-    dev->mem = calloc(req.count, sizeof dev->mem[0]);
-    if (!dev->mem) {
-        printf("%s: Out of memory\n", dev->device_type_name);
-        ret = -ENOMEM;
-        goto err;
+    if (set->jpeg_map) {
+        return image_prepare_passthrough(set);
     }
 
-    for (i = 0; i < req.count; ++i) {
-        CLEAR(dev->mem[i].buf);
+    if (!set->source_count) {
+        return -EINVAL;
+    }
 
-        dev->mem[i].buf.type   = dev->buffer_type;
-        dev->mem[i].buf.memory = V4L2_MEMORY_MMAP;
-        dev->mem[i].buf.index  = i;
+    sources = calloc(set->source_count, sizeof(*sources));
+    if (!sources) {
+        return -ENOMEM;
+    }
 
-        ret = ioctl(dev->fd, VIDIOC_QUERYBUF, &(dev->mem[i].buf));
-        if (ret < 0) {
-            printf("%s: VIDIOC_QUERYBUF failed for buf %d: %s (%d).\n",
-                    dev->device_type_name, i, strerror(errno), errno);
+    for (k = 0; k <= last_format_index; k++) {
+        frame_format = &uvc_frame_format[k];
 
-            ret = -EINVAL;
-            goto err_free;
+        if (image_set_find(set, frame_format->video_format, frame_format->wWidth, frame_format->wHeight)) {
+            continue;
         }
 
-        dev->mem[i].start =
-            mmap(NULL /* start anywhere */,
-                    dev->mem[i].buf.length,
-                    PROT_READ | PROT_WRITE /* required */,
-                    MAP_SHARED /* recommended */,
-                    dev->fd, dev->mem[i].buf.m.offset
-                );
+        converted = &set->converted[set->converted_count];
+        converted->video_format = frame_format->video_format;
+        converted->width = frame_format->wWidth;
+        converted->height = frame_format->wHeight;
+        converted->quality = 0;
+        converted->nframes = set->source_count;
+        converted->mapped = false;
+        converted->frames = calloc(converted->nframes, sizeof(*converted->frames));
+        if (!converted->frames) {
+            ret = -ENOMEM;
+            goto done;
+        }
 
-        if (MAP_FAILED == dev->mem[i].start) {
-            printf("%s: Unable to map buffer %u: %s (%d).\n",
-                    dev->device_type_name, i, strerror(errno), errno);
+        /* Scale the source frames to the frame resolution */
+        ret = 0;
+        for (i = 0; i < set->source_count && ret == 0; i++) {
+            if (set->sources[i].width == converted->width &&
+                    set->sources[i].height == converted->height) {
+                sources[i] = set->sources[i];
+            } else {
+                ret = image_resize(&sources[i], &set->sources[i],
+                        converted->width, converted->height);
+            }
+        }
 
-            dev->mem[i].length = 0;
-            ret = -EINVAL;
-            goto err_free;
+        if (ret < 0) {
+            printf("IMAGE: Scaling to %ux%u failed\n", converted->width, converted->height);
+            goto next;
         }
 
-        dev->mem[i].length = dev->mem[i].buf.length;
-        printf("%s: Buffer %u mapped at address %p, length %d.\n",
-                dev->device_type_name, i, dev->mem[i].start, dev->mem[i].length);
-    }
+        if (converted->video_format == V4L2_PIX_FMT_MJPEG) {
+            budget = image_mjpeg_budget(frame_format, current, converted);
 
-    return 0;
+            ret = image_prepare_mjpeg(converted, sources, budget);
+            if (ret < 0) {
+                printf("IMAGE: MJPEG encoding of %ux%u failed\n", converted->width, converted->height);
+                goto next;
+            }
 
-err_free:
-    free(dev->mem);
-err:
-    return ret;
-}
+            printf("IMAGE: Encoded %u frame(s) to MJPEG %ux%u, quality %u, max %u bytes (budget %u)\n",
+                    set->source_count, converted->width, converted->height,
+                    converted->quality, converted->max_size, budget);
 
-static int v4l2_reqbufs_userptr(struct v4l2_device *dev, struct v4l2_requestbuffers req)
-{
-    unsigned int payload_size;
-    unsigned int i;
+        } else {
+            mem_size = image_frame_size(converted->video_format, converted->width, converted->height);
+            if (!mem_size) {
+                printf("IMAGE: No conversion to format %c%c%c%c\n", pixfmtstr(converted->video_format));
+                ret = -EINVAL;
+                goto next;
+            }
 
-    // Image device
-    if (dev->device_type == DEVICE_TYPE_UVC && settings.source_device == DEVICE_TYPE_IMAGE) {
-        /* Allocate buffers to hold dummy data pattern. */
-        dev->dummy_buf = calloc(req.count, sizeof dev->dummy_buf[0]);
-        if (!dev->dummy_buf) {
-            printf("%s: Out of memory\n", dev->device_type_name);
-            return -ENOMEM;
-        }
+            for (i = 0; i < set->source_count; i++) {
+                converted->frames[i].memory = malloc(mem_size);
+                converted->frames[i].mem_size = mem_size;
+                if (!converted->frames[i].memory ||
+                        image_convert(converted->frames[i].memory, converted->video_format, &sources[i]) < 0) {
+                    printf("IMAGE: Conversion to format %c%c%c%c failed\n",
+                            pixfmtstr(converted->video_format));
+                    image_free_frames(converted);
+                    ret = -EINVAL;
+                    goto next;
+                }
+            }
+            converted->max_size = mem_size;
 
-        payload_size = image_dev.image_mem_size;
+            printf("IMAGE: Converted %u frame(s) to format %c%c%c%c %ux%u (%u bytes)\n",
+                    set->source_count, pixfmtstr(converted->video_format),
+                    converted->width, converted->height, mem_size);
+        }
 
-        for (i = 0; i < req.count; ++i) {
-            dev->dummy_buf[i].length = payload_size;
-            dev->dummy_buf[i].start  = malloc(payload_size);
-            if (!dev->dummy_buf[i].start) {
-                printf("%s: Out of memory\n", dev->device_type_name);
-                return -ENOMEM;
+next:
+        for (i = 0; i < set->source_count; i++) {
+            if (sources[i].pixels != set->sources[i].pixels) {
+                image_free(&sources[i]);
             }
+            sources[i].pixels = NULL;
         }
 
-        dev->mem = dev->dummy_buf;
+        if (ret < 0) {
+            free(converted->frames);
+            converted->frames = NULL;
+            continue;
+        }
+
+        set->converted_count++;
     }
 
-    return 0;
+    ret = (set->converted_count > 0) ? 0 : -EINVAL;
+
+done:
+    free(sources);
+    return ret;
 }
 
-static int v4l2_reqbufs(struct v4l2_device *dev, int nbufs)
-{
-    int ret = 0;
-    struct v4l2_requestbuffers req;
-    CLEAR(req);
+/* ---------------------------------------------------------------------------
+ * Converted frame cache
+ */
 
-    dev->dqbuf_count = 0;
-    dev->qbuf_count = 0;
+static uint64_t image_cache_hash(uint64_t hash, const void *data, size_t size)
+{
+    const uint8_t *bytes = data;
+    size_t i;
 
-    ret = v4l2_init_buffers(dev, &req, nbufs);
-    if (ret < 1) {
-        return ret;
+    /* FNV-1a */
+    for (i = 0; i < size; i++) {
+        hash = (hash ^ bytes[i]) * 0x100000001b3ULL;
     }
+    return hash;
+}
 
-    if (!req.count) {
-        return 0;
-    }
+/* Hash of the type and contents of every source file, in sequence order */
+static int image_cache_source_hash(uint64_t *hash)
+{
+    const struct image_file *file;
+    struct stat st;
+    unsigned int i;
+    void *map;
+    int fd;
 
-    if (dev->memory_type == V4L2_MEMORY_MMAP) {
-        if (req.count < 2) {
-            printf("%s: Insufficient buffer memory.\n", dev->device_type_name);
-            return -EINVAL;
-        }
+    *hash = 0xcbf29ce484222325ULL;
+    for (i = 0; i < image_dev.image_file_count; i++) {
+        file = &image_dev.image_files[i];
 
-        ret = v4l2_reqbufs_mmap(dev, req);
-        if (ret < 0) {
-            return -EINVAL;
+        fd = open(file->name, O_RDONLY);
+        if (fd < 0) {
+            return -errno;
         }
-    }
 
-    if (dev->memory_type == V4L2_MEMORY_USERPTR && settings.source_device == DEVICE_TYPE_IMAGE) {
-        if (req.count < 2) {
-            printf("%s: Insufficient buffer memory.\n", dev->device_type_name);
+        if (fstat(fd, &st) < 0 || st.st_size == 0) {
+            close(fd);
             return -EINVAL;
         }
 
-        ret = v4l2_reqbufs_userptr(dev, req);
-        if (ret < 0) {
-            return -EINVAL;
+        map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        close(fd);
+        if (map == MAP_FAILED) {
+            return -errno;
         }
-    }
-
-    dev->nbufs = req.count;
-    printf("%s: %u buffers allocated.\n", dev->device_type_name, req.count);
 
-    return ret;
+        *hash = image_cache_hash(*hash, &file->type, sizeof(file->type));
+        *hash = image_cache_hash(*hash, map, st.st_size);
+        munmap(map, st.st_size);
+    }
+    return 0;
 }
 
-static int uvc_request_bufs(int nbufs)
+/* File of a conversion: every parameter its output depends on is in the name */
+static void image_cache_path(char *path, size_t size, struct image_set *set,
+        struct uvc_frame_format *frame_format, struct image_set *current, struct image_converted *converted)
 {
-    return v4l2_reqbufs(&uvc_dev, nbufs);
+    uint64_t hash = set->source_hash;
+    unsigned int params[2] = { 0, 0 };
+
+    if (converted->video_format == V4L2_PIX_FMT_MJPEG) {
+        params[0] = image_mjpeg_budget(frame_format, current, converted);
+        params[1] = settings.jpeg_quality;
+        hash = image_cache_hash(hash, params, sizeof(params));
+    }
+
+    snprintf(path, size, "%s/%016llx-%c%c%c%c-%ux%u.v%u", settings.cache_dir, (unsigned long long) hash,
+            pixfmtstr(converted->video_format), converted->width, converted->height, IMAGE_CACHE_VERSION);
 }
 
-static int uvc_video_qbuf()
+/* Map the frames of a cache file, a hit is marked as recently used */
+static int image_cache_load(struct image_set *set, struct image_converted *converted, const char *path)
 {
+    const struct image_cache_header *header;
+    struct stat st;
     unsigned int i;
-    int ret;
+    void *map;
+    int fd;
 
-    // Image device
-    for (i = 0; i < uvc_dev.nbufs; ++i) {
-        struct v4l2_buffer buf;
+    fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        return -errno;
+    }
 
-        CLEAR(buf);
-        buf.type      = V4L2_BUF_TYPE_VIDEO_OUTPUT;
-        buf.memory    = V4L2_MEMORY_USERPTR;
-        buf.m.userptr = (unsigned long) uvc_dev.dummy_buf[i].start;
-        buf.length    = uvc_dev.dummy_buf[i].length;
-        buf.index     = i;
-        buf.bytesused = 0;
+    if (fstat(fd, &st) < 0 || (size_t) st.st_size < sizeof(*header)) {
+        close(fd);
+        return -EINVAL;
+    }
 
-        ret = ioctl(uvc_dev.fd, VIDIOC_QBUF, &buf);
-        if (ret < 0) {
-            printf("UVC: VIDIOC_QBUF failed : %s (%d).\n", strerror(errno), errno);
-            return ret;
+    /* Private and writable: frames are never written back to the cache */
+    map = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+    futimens(fd, NULL);
+    close(fd);
+    if (map == MAP_FAILED) {
+        return -errno;
+    }
+
+    header = map;
+    if (header->magic != IMAGE_CACHE_MAGIC || header->version != IMAGE_CACHE_VERSION ||
+            header->video_format != converted->video_format || header->width != converted->width ||
+            header->height != converted->height || header->nframes != image_dev.image_file_count ||
+            sizeof(*header) + header->nframes * sizeof(header->frames[0]) > (size_t) st.st_size) {
+        goto err;
+    }
+
+    for (i = 0; i < header->nframes; i++) {
+        if (header->frames[i].offset + header->frames[i].size > (uint64_t) st.st_size) {
+            goto err;
         }
+    }
 
-        uvc_dev.qbuf_count++;
+    converted->frames = calloc(header->nframes, sizeof(*converted->frames));
+    if (!converted->frames) {
+        goto err;
+    }
+
+    for (i = 0; i < header->nframes; i++) {
+        converted->frames[i].memory = (uint8_t *) map + header->frames[i].offset;
+        converted->frames[i].mem_size = header->frames[i].size;
+        converted->frames[i].fingerprint = header->frames[i].fingerprint;
     }
 
+    madvise(map, st.st_size, MADV_WILLNEED);
+    converted->nframes = header->nframes;
+    converted->quality = header->quality;
+    converted->max_size = header->max_size;
+    converted->mapped = true;
+    converted->cache_map = map;
+    converted->cache_map_size = st.st_size;
+
+    set->source_width = header->source_width;
+    set->source_height = header->source_height;
     return 0;
+
+err:
+    munmap(map, st.st_size);
+    return -EINVAL;
 }
 
 /*
- * V4L2 generic stuff
+ * Map the cached conversions of the set. Returns true when every format came
+ * from the cache, so the sources do not have to be decoded at all.
  */
-
-static int v4l2_get_format(struct v4l2_device *dev)
+static bool image_cache_lookup(struct image_set *set, struct image_set *current)
 {
-    struct v4l2_format fmt;
-    int ret;
+    struct uvc_frame_format *frame_format;
+    struct image_converted *converted;
+    char path[PATH_MAX];
+    bool complete = true;
+    int k;
 
-    CLEAR(fmt);
-    fmt.type = dev->buffer_type;
+    for (k = 0; k <= last_format_index; k++) {
+        frame_format = &uvc_frame_format[k];
 
-    ret = ioctl(dev->fd, VIDIOC_G_FMT, &fmt);
-    if (ret < 0) {
-        return ret;
-    }
+        if (image_set_find(set, frame_format->video_format, frame_format->wWidth, frame_format->wHeight)) {
+            continue;
+        }
 
-    printf("%s: Getting current format: %c%c%c%c %ux%u\n",
-            dev->device_type_name, pixfmtstr(fmt.fmt.pix.pixelformat),
-            fmt.fmt.pix.width, fmt.fmt.pix.height);
+        converted = &set->converted[set->converted_count];
+        memset(converted, 0, sizeof(*converted));
+        converted->video_format = frame_format->video_format;
+        converted->width = frame_format->wWidth;
+        converted->height = frame_format->wHeight;
 
-    return 0;
+        image_cache_path(path, sizeof(path), set, frame_format, current, converted);
+        if (image_cache_load(set, converted, path) < 0) {
+            complete = false;
+            continue;
+        }
+
+        printf("IMAGE: Cache hit for %u frame(s) of format %c%c%c%c %ux%u\n", converted->nframes,
+                pixfmtstr(converted->video_format), converted->width, converted->height);
+        set->converted_count++;
+    }
+
+    return complete;
 }
 
-static int v4l2_set_format(struct v4l2_device *dev, struct v4l2_format *fmt)
+/* Written to a temporary file and renamed, so a cache file is always complete */
+static int image_cache_store(struct image_set *set, struct image_converted *converted, const char *path)
 {
-    int ret;
+    size_t page_size = sysconf(_SC_PAGESIZE);
+    struct image_cache_header *header;
+    char tmp[PATH_MAX + 16];
+    size_t header_size;
+    uint64_t offset;
+    unsigned int i;
+    int ret = 0;
+    int fd;
 
-    ret = ioctl(dev->fd, VIDIOC_S_FMT, fmt);
-    if (ret < 0) {
-        printf("%s: Unable to set format %s (%d).\n",
-                dev->device_type_name, strerror(errno), errno);
-        return ret;
+    header_size = ALIGN_UP(sizeof(*header) + converted->nframes * sizeof(header->frames[0]), page_size);
+    header = calloc(1, header_size);
+    if (!header) {
+        return -ENOMEM;
     }
 
-    printf("%s: Setting format to: %c%c%c%c %ux%u\n",
-            dev->device_type_name, pixfmtstr(fmt->fmt.pix.pixelformat),
-            fmt->fmt.pix.width, fmt->fmt.pix.height);
-
-    return 0;
-}
+    header->magic = IMAGE_CACHE_MAGIC;
+    header->version = IMAGE_CACHE_VERSION;
+    header->video_format = converted->video_format;
+    header->width = converted->width;
+    header->height = converted->height;
+    header->source_width = set->source_width;
+    header->source_height = set->source_height;
+    header->quality = converted->quality;
+    header->max_size = converted->max_size;
+    header->nframes = converted->nframes;
+
+    offset = header_size;
+    for (i = 0; i < converted->nframes; i++) {
+        header->frames[i].offset = offset;
+        header->frames[i].size = converted->frames[i].mem_size;
+        header->frames[i].fingerprint = converted->frames[i].fingerprint;
+        offset += ALIGN_UP(converted->frames[i].mem_size, page_size);
+    }
 
-static int v4l2_apply_format(struct v4l2_device *dev, unsigned int pixelformat,
-        unsigned int width, unsigned int height)
-{
-    struct v4l2_format fmt;
-    int ret = -EINVAL;
+    snprintf(tmp, sizeof(tmp), "%s.%d.tmp", path, getpid());
+    fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) {
+        ret = -errno;
+        goto free;
+    }
 
-    if (dev->is_streaming || !dev->fd) {
-        return ret;
+    if (pwrite(fd, header, header_size, 0) != (ssize_t) header_size) {
+        ret = -EIO;
+    }
+    for (i = 0; i < converted->nframes && ret == 0; i++) {
+        if (pwrite(fd, converted->frames[i].memory, converted->frames[i].mem_size, header->frames[i].offset) !=
+                (ssize_t) converted->frames[i].mem_size) {
+            ret = -EIO;
+        }
     }
 
-    CLEAR(fmt);
-    fmt.type                = dev->buffer_type;
-    fmt.fmt.pix.width       = width;
-    fmt.fmt.pix.height      = height;
-    fmt.fmt.pix.sizeimage   = get_frame_size(pixelformat, width, height);
-    fmt.fmt.pix.pixelformat = pixelformat;
-    fmt.fmt.pix.field       = V4L2_FIELD_ANY;
+    /* The last frame is padded as well */
+    if (ret == 0 && ftruncate(fd, offset) < 0) {
+        ret = -errno;
+    }
+    close(fd);
 
-    ret = v4l2_set_format(dev, &fmt);
+    if (ret == 0 && rename(tmp, path) < 0) {
+        ret = -errno;
+    }
     if (ret < 0) {
-        return ret;
+        unlink(tmp);
     }
 
-    return v4l2_get_format(dev);
+free:
+    free(header);
+    return ret;
 }
 
-static void uvc_close()
+struct image_cache_entry {
+    char name[NAME_MAX + 1];
+    off_t size;
+    struct timespec mtime;
+};
+
+static int image_cache_compare_mtime(const void *a, const void *b)
 {
-    if (uvc_dev.fd) {
-        close(uvc_dev.fd);
-        uvc_dev.fd = -1;
+    const struct image_cache_entry *ea = a;
+    const struct image_cache_entry *eb = b;
+
+    if (ea->mtime.tv_sec != eb->mtime.tv_sec) {
+        return (ea->mtime.tv_sec < eb->mtime.tv_sec) ? -1 : 1;
     }
+    return (ea->mtime.tv_nsec < eb->mtime.tv_nsec) ? -1 : (ea->mtime.tv_nsec > eb->mtime.tv_nsec);
 }
 
 /*
- * UVC streaming related
+ * Remove the least recently used cache files until the cache fits its limit.
+ * Files used since the given time belong to the current set and are kept.
  */
-
-static void uvc_image_fill_buffer(struct v4l2_buffer *buf)
+static void image_cache_evict(const struct timespec *used_since)
 {
-    char *uvc_pixels = (char *)uvc_dev.mem[buf->index].start;
-
-    buf->bytesused = image_dev.image_mem_size;
-    memcpy(uvc_pixels, image_dev.image_memory, image_dev.image_mem_size);
-} 
+    struct image_cache_entry *entries = NULL;
+    struct image_cache_entry *grown;
+    unsigned long long total = 0;
+    unsigned long long limit = (unsigned long long) settings.cache_limit_mb << 20;
+    unsigned int count = 0;
+    unsigned int evicted = 0;
+    struct dirent *entry;
+    struct stat st;
+    unsigned int i;
+    DIR *dir;
 
-static void uvc_image_video_process()
-{
-    struct v4l2_buffer ubuf;
-    /*
-     * Return immediately if UVC video output device has not started
-     * streaming yet.
-     */
-    if (!uvc_dev.is_streaming) {
+    dir = opendir(settings.cache_dir);
+    if (!dir) {
         return;
     }
 
-    /* Prepare a v4l2 buffer to be dequeued from UVC domain. */
-    CLEAR(ubuf);
-    ubuf.type   = uvc_dev.buffer_type;
-    ubuf.memory = uvc_dev.memory_type;
+    while ((entry = readdir(dir))) {
+        if (!strstr(entry->d_name, ".v") || strstr(entry->d_name, ".tmp") ||
+                fstatat(dirfd(dir), entry->d_name, &st, 0) < 0 || !S_ISREG(st.st_mode)) {
+            continue;
+        }
 
-    if (ioctl(uvc_dev.fd, VIDIOC_DQBUF, &ubuf) < 0) {
-        printf("%s: Unable to dequeue buffer: %s (%d).\n",
-                uvc_dev.device_type_name, strerror(errno), errno);
-        return;
+        grown = realloc(entries, (count + 1) * sizeof(*entries));
+        if (!grown) {
+            break;
+        }
+        entries = grown;
+
+        snprintf(entries[count].name, sizeof(entries[count].name), "%s", entry->d_name);
+        entries[count].size = st.st_size;
+        entries[count].mtime = st.st_mtim;
+        total += st.st_size;
+        count++;
     }
 
-    uvc_image_fill_buffer(&ubuf);
+    qsort(entries, count, sizeof(*entries), image_cache_compare_mtime);
 
-    if (ioctl(uvc_dev.fd, VIDIOC_QBUF, &ubuf) < 0) {
-        printf("%s: Unable to queue buffer: %s (%d).\n",
-                uvc_dev.device_type_name, strerror(errno), errno);
-        return;
-    }
+    for (i = 0; i < count && total > limit; i++) {
+        if (image_cache_compare_mtime(&entries[i], &(struct image_cache_entry) { .mtime = *used_since }) >= 0) {
+            break;
+        }
 
-    uvc_dev.qbuf_count++;
+        if (unlinkat(dirfd(dir), entries[i].name, 0) == 0) {
+            total -= entries[i].size;
+            evicted++;
+        }
+    }
 
-    if (settings.show_fps) {
-        uvc_dev.buffers_processed++;
+    if (evicted) {
+        printf("IMAGE: Evicted %u file(s) from the cache, %llu MiB left\n", evicted, total >> 20);
     }
+
+    closedir(dir);
+    free(entries);
 }
 
-static void uvc_handle_streamon_event()
+/* Store the conversions of the set that did not come from the cache */
+static void image_cache_update(struct image_set *set, struct image_set *current, const struct timespec *used_since)
 {
-    printf("Stream On Event\n");
-    // Video4Linux2 device
+    struct image_converted *converted;
+    struct uvc_frame_format *frame_format;
+    char path[PATH_MAX];
+    unsigned int i;
+    int k;
+    int ret;
 
-    if (uvc_request_bufs(uvc_dev.nbufs) < 0) {
-        return;
-    }
+    for (i = 0; i < set->converted_count; i++) {
+        converted = &set->converted[i];
+        if (converted->mapped) {
+            continue;
+        }
 
-    // Image device
-    if (settings.source_device == DEVICE_TYPE_IMAGE) {
-        if (uvc_video_qbuf() < 0) {
-            return;
+        for (k = 0; k <= last_format_index; k++) {
+            frame_format = &uvc_frame_format[k];
+            if ((unsigned int) frame_format->video_format == converted->video_format &&
+                    frame_format->wWidth == converted->width && frame_format->wHeight == converted->height) {
+                break;
+            }
+        }
+        if (k > last_format_index) {
+            continue;
         }
 
-        uvc_video_stream(STREAM_ON);
-        settings.blink_on_startup = 0;
-        streaming_status_value(uvc_dev.is_streaming);
+        image_cache_path(path, sizeof(path), set, frame_format, current, converted);
+        ret = image_cache_store(set, converted, path);
+        if (ret < 0) {
+            printf("IMAGE: Could not write cache file %s: %s (%d)\n", path, strerror(-ret), -ret);
+        }
     }
+
+    image_cache_evict(used_since);
 }
 
-static void uvc_handle_streamoff_event()
+static void image_set_free(struct image_set *set)
 {
-    uvc_video_stream(STREAM_OFF);
-    uvc_request_bufs(0);
-    uvc_uninit_device();
+    unsigned int i;
 
-    streaming_status_value(uvc_dev.is_streaming);
-}
+    for (i = 0; i < set->converted_count; i++) {
+        image_free_frames(&set->converted[i]);
+        free(set->converted[i].frames);
+        if (set->converted[i].cache_map) {
+            munmap(set->converted[i].cache_map, set->converted[i].cache_map_size);
+        }
+    }
 
-/*
- * UVC Request processing
+    for (i = 0; i < set->source_count; i++) {
+        image_free(&set->sources[i]);
+    }
+    free(set->sources);
+
+    if (set->jpeg_map) {
+        munmap((void *) set->jpeg_map, set->jpeg_map_size);
+    }
+    free(set->jpeg_frames);
+    free(set);
+}
+
+/*
+ * Fingerprint every converted frame once, so the streaming loop can tell that
+ * a buffer still holds the frame it is about to send. Frames mapped from the
+ * cache come with their fingerprint and are not read. Passthrough frames are
+ * mapped from the source file and left without one: they are always copied.
  */
-static void dump_uvc_streaming_control(struct uvc_streaming_control *ctrl)
+static void image_set_fingerprint(struct image_set *set)
 {
-    printf("DUMP: uvc_streaming_control: format: %d, frame: %d, frame interval: %d\n",
-            ctrl->bFormatIndex,
-            ctrl->bFrameIndex,
-            ctrl->dwFrameInterval
-          );
+    struct image_frame *frame;
+    uint64_t hash;
+    unsigned int i, k;
+
+    if (set->jpeg_map) {
+        return;
+    }
+
+    for (k = 0; k < set->converted_count; k++) {
+        if (set->converted[k].mapped) {
+            continue;
+        }
+
+        for (i = 0; i < set->converted[k].nframes; i++) {
+            frame = &set->converted[k].frames[i];
+            if (frame->memory) {
+                hash = image_hash(frame->memory, frame->mem_size);
+                frame->fingerprint = (hash) ? hash : 1;
+            }
+        }
+    }
 }
 
-static int uvc_get_frame_format_index(int format_index, enum uvc_frame_format_getter getter)
+/*
+ * Load and convert all image source files. A set replacing the current one
+ * must provide every format of the current set within its frame sizes, so it
+ * can be streamed from the buffers and probe values already negotiated.
+ */
+static struct image_set *image_set_create(struct image_set *current)
 {
-    int index = -1;
-    int value;
-    int i;
+    struct image_converted *converted;
+    struct image_converted *old;
+    struct image_set *set;
+    struct timespec used_since;
+    bool cache = false;
+    bool cached = false;
+    unsigned int i;
 
-    for (i = 0; i <= last_format_index; i++) {
-        if (format_index == -1 || format_index == (int) uvc_frame_format[i].bFormatIndex) {
+    set = calloc(1, sizeof(*set));
+    if (!set) {
+        return NULL;
+    }
 
-            switch (getter) {
-                case FORMAT_INDEX_MIN:
-                case FORMAT_INDEX_MAX:
-                    value = uvc_frame_format[i].bFormatIndex;
-                    break;
+    /* Conversions found in the cache are mapped, the sources are only decoded for the others */
+    if (settings.cache_dir && image_dev.image_files[0].type != IMAGE_TYPE_JPEG) {
+        clock_gettime(CLOCK_REALTIME_COARSE, &used_since);
+        if (mkdir(settings.cache_dir, 0755) < 0 && errno != EEXIST) {
+            printf("IMAGE: Could not create cache directory %s: %s (%d)\n", settings.cache_dir,
+                    strerror(errno), errno);
+        } else if (image_cache_source_hash(&set->source_hash) == 0) {
+            cache = true;
+            cached = image_cache_lookup(set, current);
+        }
+    }
 
-                case FRAME_INDEX_MIN:
-                case FRAME_INDEX_MAX:
-                    value = uvc_frame_format[i].bFrameIndex;
-                    break;
-            }
-            if (index == -1) {
-                index = value;
+    for (i = 0; i < image_dev.image_file_count && !cached; i++) {
+        if (image_set_load(set, &image_dev.image_files[i]) < 0) {
+            goto err;
+        }
+    }
 
-            } else {
-                switch (getter) {
-                    case FORMAT_INDEX_MIN:
-                    case FRAME_INDEX_MIN:
-                        if (value < index) {
-                            index = value;
-                        }
-                        break;
+    if (!cached && image_prepare_formats(set, current) < 0) {
+        goto err;
+    }
 
-                    case FORMAT_INDEX_MAX:
-                    case FRAME_INDEX_MAX:
-                        if (value > index) {
-                            index = value;
-                        }
-                        break;
-                }
-            }
+    image_set_fingerprint(set);
+
+    if (cache && !cached) {
+        image_cache_update(set, current, &used_since);
+    }
+
+    for (i = 0; current && i < current->converted_count; i++) {
+        old = &current->converted[i];
+        converted = image_set_find(set, old->video_format, old->width, old->height);
+        if (!converted) {
+            printf("IMAGE: Reloaded source lacks format %c%c%c%c %ux%u\n",
+                    pixfmtstr(old->video_format), old->width, old->height);
+            goto err;
         }
+
+        if (converted->max_size > old->max_size) {
+            printf("IMAGE: Reloaded source exceeds %u bytes in format %c%c%c%c %ux%u\n",
+                    old->max_size, pixfmtstr(old->video_format), old->width, old->height);
+            goto err;
+        }
+        converted->max_size = old->max_size;
     }
-    return index;
+
+    return set;
+
+err:
+    image_set_free(set);
+    return NULL;
 }
 
-static int uvc_get_frame_format(struct uvc_frame_format **frame_format,
-        unsigned int iFormat, unsigned int iFrame)
+/* Source resolution of the initial set, for the probe control */
+static void image_source_size_init(struct image_set *set)
 {
-    int i;
-    for (i = 0; i <= last_format_index; i++) {
-        if (uvc_frame_format[i].bFormatIndex == iFormat &&
-                uvc_frame_format[i].bFrameIndex == iFrame
-           ) {
-            *frame_format = &uvc_frame_format[i];
-            return 0;
+    if (set->jpeg_map) {
+        image_dev.image_width = set->jpeg_frames[0].width;
+        image_dev.image_height = set->jpeg_frames[0].height;
+    } else {
+        image_dev.image_width = set->source_width;
+        image_dev.image_height = set->source_height;
+    }
+    image_dev.image_size = image_dev.image_width * image_dev.image_height;
+}
+
+/*
+ * Largest frame of every frame descriptor, for the probe control. Until the
+ * source is prepared, compressed frame sizes are unknown and the frame buffer
+ * size of the descriptor is announced.
+ */
+static void image_frame_sizes_init()
+{
+    struct uvc_frame_format *format;
+    struct image_converted *converted;
+    unsigned int size;
+    int k;
+
+    for (k = 0; k <= last_format_index; k++) {
+        format = &uvc_frame_format[k];
+        converted = image_find_converted(format);
+        if (converted) {
+            size = max((unsigned int) (image_dev.image_size * 1.5), converted->max_size);
+        } else {
+            size = max(format->dwMaxVideoFrameBufferSize,
+                    get_frame_size(format->video_format, format->wWidth, format->wHeight));
         }
+        atomic_store_explicit(&uvc_dev.frame_max_size[k], size, memory_order_relaxed);
     }
-    return -1;
 }
 
-static void uvc_dump_frame_format(struct uvc_frame_format *frame_format, const char *title)
+/* Largest frame of any format in the set */
+static unsigned int image_set_max_frame_size(struct image_set *set)
 {
-    printf("%s: format: %d, frame: %d, resolution: %dx%d, frame_interval: %d,  bitrate: [%d, %d]\n",
-            title,
-            frame_format->bFormatIndex,
-            frame_format->bFrameIndex,
-            frame_format->wWidth,
-            frame_format->wHeight,
-            frame_format->dwDefaultFrameInterval,
-            frame_format->dwMinBitRate,
-            frame_format->dwMaxBitRate
-          );
+    unsigned int max_size = 0;
+    unsigned int i;
+
+    for (i = 0; i < set->converted_count; i++) {
+        max_size = max(max_size, set->converted[i].max_size);
+    }
+    return max_size;
 }
 
-static void uvc_fill_streaming_control(struct uvc_streaming_control *ctrl,
-        enum stream_control_action action, int iformat, int iframe)
+/*
+ * Pick up a frame set published by the reload thread. The replaced set is
+ * handed back to the reload thread for freeing: the streaming loop is its only
+ * reader and never touches it again once switched.
+ */
+static void image_set_update()
 {
-    int format_first;
-    int format_last;
-    int frame_first;
-    int frame_last;
-    int format_frame_first;
-    int format_frame_last;
-    unsigned int frame_interval;
-    unsigned int dwMaxPayloadTransferSize;
+    struct image_converted *active = image_dev.image_active;
+    struct image_set *retired;
+    struct image_set *set;
 
-    switch (action) {
-        case STREAM_CONTROL_INIT:
-            printf("UVC: Streaming control: action: INIT\n");
-            break;
+    set = atomic_exchange(&image_dev.image_set_pending, NULL);
+    if (!set) {
+        return;
+    }
 
-        case STREAM_CONTROL_MIN:
-            printf("UVC: Streaming control: action: GET MIN\n");
-            break;
+    if (active) {
+        image_dev.image_active = image_set_find(set, active->video_format, active->width, active->height);
+        image_dev.image_frame_index = 0;
+    }
 
-        case STREAM_CONTROL_MAX:
-            printf("UVC: Streaming control: action: GET MAX\n");
-            break;
+    retired = atomic_exchange(&image_dev.image_set_retired, image_dev.image_set);
+    image_dev.image_set = set;
 
-        case STREAM_CONTROL_SET:
-            printf("UVC: Streaming control: action: SET, format: %d, frame: %d\n", iformat, iframe);
-            break;
+    if (retired) {
+        /* reload thread did not catch up */
+        image_set_free(retired);
+    }
+
+    printf("IMAGE: Switched to reloaded source\n");
+}
 
+/*
+ * Watch the directories of the source files, rebuild the frame set when one of
+ * the files is written or replaced and publish it to the streaming loop
+ */
+static void *image_reload_thread(void *arg)
+{
+    char events[4096] __attribute__ ((aligned(__alignof__(struct inotify_event))));
+    const struct inotify_event *event;
+    struct image_set *limits = arg;
+    struct image_set *set;
+    char dir[PATH_MAX];
+    struct pollfd pfd;
+    const char *name;
+    bool changed;
+    unsigned int i;
+    ssize_t len;
+    char *p;
+    int *wds;
+    int fd;
+
+    thread_block_signals();
+
+    fd = inotify_init1(IN_CLOEXEC | IN_NONBLOCK);
+    wds = calloc(image_dev.image_file_count, sizeof(*wds));
+    if (fd < 0 || !wds) {
+        printf("IMAGE: Could not watch the image source: %s (%d)\n", strerror(errno), errno);
+        goto done;
     }
 
-    format_first = uvc_get_frame_format_index(-1, FORMAT_INDEX_MIN);
-    format_last = uvc_get_frame_format_index(-1, FORMAT_INDEX_MAX);
+    for (i = 0; i < image_dev.image_file_count; i++) {
+        name = image_dev.image_files[i].name;
+        p = strrchr(name, '/');
+        snprintf(dir, sizeof(dir), "%.*s", (p) ? (int) (p - name) + 1 : 1, (p) ? name : ".");
 
-    frame_first = uvc_get_frame_format_index(-1, FRAME_INDEX_MIN);
-    frame_last = uvc_get_frame_format_index(-1, FRAME_INDEX_MAX);
+        wds[i] = inotify_add_watch(fd, dir, IN_CLOSE_WRITE | IN_MOVED_TO);
+        if (wds[i] < 0) {
+            printf("IMAGE: Could not watch '%s': %s (%d)\n", dir, strerror(errno), errno);
+        }
+    }
 
-    if (action == STREAM_CONTROL_MIN) {
-        iformat = format_first;
-        iframe = frame_first;
+    pfd.fd = fd;
+    pfd.events = POLLIN;
 
-    } else if (action == STREAM_CONTROL_MAX) {
-        iformat = format_last;
-        iframe = frame_last;
+    while (!terminate) {
+        set = atomic_exchange(&image_dev.image_set_retired, NULL);
+        if (set) {
+            image_set_free(set);
+        }
 
-    } else {
-        iformat = clamp(iformat, format_first, format_last);
+        if (poll(&pfd, 1, 500) <= 0) {
+            continue;
+        }
 
-        format_frame_first = uvc_get_frame_format_index(iformat, FRAME_INDEX_MIN);
-        format_frame_last = uvc_get_frame_format_index(iformat, FRAME_INDEX_MAX);
+        /* Collect events until the files have settled */
+        changed = false;
+        do {
+            while ((len = read(fd, events, sizeof(events))) > 0) {
+                for (p = events; p < events + len; p += sizeof(*event) + event->len) {
+                    event = (const struct inotify_event *) p;
+
+                    for (i = 0; i < image_dev.image_file_count && event->len; i++) {
+                        name = strrchr(image_dev.image_files[i].name, '/');
+                        name = (name) ? name + 1 : image_dev.image_files[i].name;
+                        if (event->wd == wds[i] && !strcmp(event->name, name)) {
+                            changed = true;
+                        }
+                    }
+                }
+            }
+        } while (poll(&pfd, 1, IMAGE_RELOAD_SETTLE_MS) > 0);
 
-        iframe = clamp(iframe, format_frame_first, format_frame_last);
-    }
+        if (!changed) {
+            continue;
+        }
 
-    struct uvc_frame_format *frame_format;
-    uvc_get_frame_format(&frame_format, iformat, iframe);
+        printf("IMAGE: Source changed, reloading\n");
 
-    uvc_dump_frame_format(frame_format, "FRAME");
+        set = image_set_create(limits);
+        if (!set) {
+            printf("IMAGE: Reload failed, keeping the current source\n");
+            continue;
+        }
 
-    if (frame_format->dwDefaultFrameInterval >= 100000) {
-        frame_interval = frame_format->dwDefaultFrameInterval;
-    } else {
-        frame_interval = 400000;
+        set = atomic_exchange(&image_dev.image_set_pending, set);
+        if (set) {
+            /* never picked up by the streaming loop */
+            image_set_free(set);
+        }
     }
 
-    dwMaxPayloadTransferSize = streaming_maxpacket;
-    if (streaming_maxpacket > 1024 && streaming_maxpacket % 1024 != 0) {
-        dwMaxPayloadTransferSize -= (streaming_maxpacket / 1024) * 128;
+done:
+    free(wds);
+    if (fd >= 0) {
+        close(fd);
     }
+    free(limits);
+    return NULL;
+}
 
-    memset(ctrl, 0, sizeof *ctrl);
-    ctrl->bmHint                   = 1;
-    ctrl->bFormatIndex             = iformat;
-    ctrl->bFrameIndex              = iframe;
-    /* ctrl->dwMaxVideoFrameSize      = get_frame_size(frame_format->video_format, frame_format->wWidth, frame_format->wHeight); */
-    ctrl->dwMaxVideoFrameSize      = image_dev.image_size * 1.5;
-    ctrl->dwMaxPayloadTransferSize = dwMaxPayloadTransferSize;
-    ctrl->dwFrameInterval          = frame_interval;
-    ctrl->bmFramingInfo            = 3;
-    ctrl->bMinVersion              = format_first;
-    ctrl->bMaxVersion              = format_last;
-    ctrl->bPreferedVersion         = format_last;
-
-    dump_uvc_streaming_control(ctrl);
+/*
+ * Start reloading the image source on changes. Reloaded sets are checked
+ * against the formats and frame sizes of the initial set; only those fields of
+ * the copy handed to the thread are used.
+ */
+static int image_reload_start()
+{
+    struct sched_param param;
+    struct image_set *limits;
+    pthread_attr_t attr;
+    pthread_t thread;
+    int ret;
 
-    if (uvc_dev.control == UVC_VS_COMMIT_CONTROL && action == STREAM_CONTROL_SET) {
-        v4l2_apply_format(&uvc_dev, frame_format->video_format, frame_format->wWidth, frame_format->wHeight);
+    limits = malloc(sizeof(*limits));
+    if (!limits) {
+        return -ENOMEM;
     }
+    *limits = *image_dev.image_set;
+
+    /* Conversions must not compete with a real-time streaming loop */
+    pthread_attr_init(&attr);
+    pthread_attr_setinheritsched(&attr, PTHREAD_EXPLICIT_SCHED);
+    pthread_attr_setschedpolicy(&attr, SCHED_OTHER);
+    CLEAR(param);
+    pthread_attr_setschedparam(&attr, &param);
+
+    ret = pthread_create(&thread, &attr, image_reload_thread, limits);
+    pthread_attr_destroy(&attr);
+    if (ret) {
+        printf("IMAGE: Could not start the reload thread: %s (%d)\n", strerror(ret), ret);
+        free(limits);
+        return -ret;
+    }
+
+    pthread_detach(thread);
+    return 0;
 }
 
-static void uvc_interface_control(unsigned int interface,
-        uint8_t req, uint8_t cs, uint8_t len, struct uvc_request_data *resp)
+static int image_select_format(struct uvc_frame_format *frame_format)
 {
-    int i;
-    bool found = false;
-    const char *request_code_name = uvc_request_code_name(req);
-    const char *interface_name = (interface == UVC_VC_INPUT_TERMINAL) ? "INPUT_TERMINAL" : "PROCESSING_UNIT";
+    struct image_converted *converted = image_find_converted(frame_format);
 
-    for (i = 0; i < control_mapping_size; i++) {
-        if (control_mapping[i].type == interface && control_mapping[i].uvc == cs) {
-            found = true;
-            break;
-        }
+    /* Selected again when the prepared set is adopted */
+    image_dev.image_selected = frame_format;
+    if (!image_dev.image_set) {
+        image_dev.image_active = NULL;
+        return -EAGAIN;
     }
 
-    if (!found) {
-        printf("UVC: %s - %s - %02x - UNSUPPORTED\n", interface_name, request_code_name, cs);
-        resp->length = -EL2HLT;
-        uvc_dev.request_error_code = REQEC_INVALID_CONTROL;
-        return;
+    if (!converted) {
+        printf("IMAGE: Source not available in format %c%c%c%c %ux%u\n",
+                pixfmtstr(frame_format->video_format), frame_format->wWidth, frame_format->wHeight);
+        image_dev.image_active = NULL;
+        return -EINVAL;
     }
 
-    if (!control_mapping[i].enabled) {
-        printf("UVC: %s - %s - %s - DISABLED\n", interface_name, request_code_name,
-                control_mapping[i].uvc_name);
-        resp->length = -EL2HLT;
-        uvc_dev.request_error_code = REQEC_INVALID_CONTROL;
+    image_dev.image_format = converted->video_format;
+    image_dev.image_mem_size = converted->max_size;
+    image_dev.image_active = converted;
+    image_dev.image_frame_index = 0;
+    return 0;
+}
+
+/* ---------------------------------------------------------------------------
+ * Buffer pool
+ */
+
+static void buffer_pool_release(struct buffer_pool *pool)
+{
+    if (!pool->memory) {
         return;
     }
 
-    printf("UVC: %s - %s - %s\n", interface_name, request_code_name, control_mapping[i].uvc_name);
-
-    switch (req) {
-        case UVC_SET_CUR:
-            resp->data[0] = 0x0;
-            resp->length = len;
-            uvc_dev.control_interface = interface;
-            uvc_dev.control_type = cs;
-            uvc_dev.request_error_code = REQEC_NO_ERROR;
-            break;
+    if (pool->locked) {
+        munlock(pool->memory, pool->size);
+    }
+    munmap(pool->memory, pool->size);
 
-        case UVC_GET_MIN:
-            resp->length = 4;
-            memcpy(&resp->data[0], &control_mapping[i].minimum, resp->length);
-            uvc_dev.request_error_code = REQEC_NO_ERROR;
-            break;
+    pool->memory = NULL;
+    pool->count = 0;
+    pool->buffer_size = 0;
+}
 
-        case UVC_GET_MAX:
-            resp->length = 4;
-            memcpy(&resp->data[0], &control_mapping[i].maximum, resp->length);
-            uvc_dev.request_error_code = REQEC_NO_ERROR;
-            break;
+/*
+ * Make sure the pool holds count buffers of at least size bytes. The buffers
+ * are page aligned, prefaulted and locked (on huge pages if requested) and are
+ * only reallocated when they do not fit, so streams and resolution changes
+ * reuse them without allocating.
+ */
+static int buffer_pool_reserve(struct buffer_pool *pool, unsigned int count, size_t size)
+{
+    size_t page_size = sysconf(_SC_PAGESIZE);
+    void *memory = MAP_FAILED;
+    size_t buffer_size;
+    bool hugepages = false;
+    size_t total;
+    unsigned int i;
 
-        case UVC_GET_CUR:
-            resp->length = 4;
-            memcpy(&resp->data[0], &control_mapping[i].value, resp->length);
-            uvc_dev.request_error_code = REQEC_NO_ERROR;
-            break;
+    if (count <= pool->count && size <= pool->buffer_size) {
+        return 0;
+    }
 
-        case UVC_GET_INFO:
-            resp->data[0] = (uint8_t)(UVC_CONTROL_CAP_GET | UVC_CONTROL_CAP_SET);
-            resp->length = 1;
-            uvc_dev.request_error_code = REQEC_NO_ERROR;
-            break;
+    if (count > UVC_MAX_BUFFERS) {
+        printf("POOL: %u buffers requested, at most %u supported\n", count, UVC_MAX_BUFFERS);
+        return -EINVAL;
+    }
 
-        case UVC_GET_DEF:
-            resp->length = 4;
-            memcpy(&resp->data[0], &control_mapping[i].default_value, resp->length);
-            uvc_dev.request_error_code = REQEC_NO_ERROR;
-            break;
+    count = max(count, pool->count);
+    buffer_size = ALIGN_UP(max(size, pool->buffer_size), page_size);
+    total = buffer_size * count;
 
-        case UVC_GET_RES:
-            resp->length = 4;
-            memcpy(&resp->data[0], &control_mapping[i].step, resp->length);
-            uvc_dev.request_error_code = REQEC_NO_ERROR;
+    if (settings.hugepages) {
+        memory = mmap(NULL, ALIGN_UP(total, BUFFER_POOL_HUGEPAGE_SIZE), PROT_READ | PROT_WRITE,
+                MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+        if (memory != MAP_FAILED) {
+            total = ALIGN_UP(total, BUFFER_POOL_HUGEPAGE_SIZE);
+            hugepages = true;
+        } else {
+            printf("POOL: Huge pages not available: %s (%d), using transparent huge pages\n",
+                    strerror(errno), errno);
+        }
+    }
+
+    if (memory == MAP_FAILED) {
+        memory = mmap(NULL, total, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (memory == MAP_FAILED) {
+            printf("POOL: Out of memory (%zu bytes)\n", total);
+            return -ENOMEM;
+        }
+
+        if (settings.hugepages) {
+            madvise(memory, total, MADV_HUGEPAGE);
+        }
+    }
+
+    /* Prefault the buffers, so the first frames don't pay for page faults */
+    memset(memory, 0, total);
+
+    buffer_pool_release(pool);
+
+    pool->locked = (mlock(memory, total) == 0);
+    if (!pool->locked) {
+        printf("POOL: Could not lock %zu bytes: %s (%d)\n", total, strerror(errno), errno);
+    }
+
+    pool->memory = memory;
+    pool->size = total;
+    pool->buffer_size = buffer_size;
+    pool->count = count;
+    pool->hugepages = hugepages;
+    pool->allocations++;
+    memset(pool->fingerprints, 0, sizeof(pool->fingerprints));
+
+    for (i = 0; i < count; i++) {
+        pool->buffers[i].start = (uint8_t *) memory + i * buffer_size;
+        pool->buffers[i].length = buffer_size;
+    }
+
+    printf("POOL: %u buffers of %zu bytes%s%s, allocation %llu\n", count, buffer_size,
+            (hugepages) ? ", huge pages" : "", (pool->locked) ? ", locked" : "", pool->allocations);
+    return 0;
+}
+
+/*
+ * Prepare the initial frame set on a worker thread: decoding and converting
+ * large sources must not delay the answers to the host during enumeration
+ */
+static void *image_prepare_thread(void *arg)
+{
+    double start = monotonic_ms();
+    struct image_set *set;
+
+    (void) arg;
+
+    set = image_set_create(NULL);
+
+    /* Buffers for the largest frame of any format and the deepest queue, allocated once */
+    if (set && buffer_pool_reserve(&uvc_dev.pool, (settings.nbufs_auto) ? QUEUE_DEPTH_MAX : settings.nbufs,
+                image_set_max_frame_size(set)) < 0) {
+        image_set_free(set);
+        set = NULL;
+    }
+
+    image_dev.prepared_set = set;
+    image_dev.prepare_time = monotonic_ms() - start;
+    atomic_store_explicit(&image_dev.prepare_done, true, memory_order_release);
+    return NULL;
+}
+
+static int image_prepare_start()
+{
+    struct sched_param param;
+    pthread_attr_t attr;
+    int ret;
+
+    atomic_store(&image_dev.prepare_done, false);
+    image_dev.prepared_set = NULL;
+
+    /* Like reloads, conversions must not compete with a real-time streaming loop */
+    pthread_attr_init(&attr);
+    pthread_attr_setinheritsched(&attr, PTHREAD_EXPLICIT_SCHED);
+    pthread_attr_setschedpolicy(&attr, SCHED_OTHER);
+    CLEAR(param);
+    pthread_attr_setschedparam(&attr, &param);
+
+    ret = pthread_create(&image_dev.prepare_thread, &attr, image_prepare_thread, NULL);
+    pthread_attr_destroy(&attr);
+    if (ret) {
+        printf("IMAGE: Could not start the prepare thread: %s (%d)\n", strerror(ret), ret);
+        return -ret;
+    }
+
+    image_dev.preparing = true;
+    return 0;
+}
+
+/*
+ * Adopt the prepared frame set in the streaming loop: the probe values, the
+ * committed format and reloading switch to it. Without wait, only a finished
+ * set is adopted.
+ */
+static int image_prepare_adopt(bool wait)
+{
+    struct image_set *set;
+
+    if (!image_dev.preparing) {
+        return (image_dev.image_set) ? 0 : -ENODATA;
+    }
+
+    if (!atomic_load_explicit(&image_dev.prepare_done, memory_order_acquire)) {
+        if (!wait) {
+            return -EAGAIN;
+        }
+        printf("IMAGE: Waiting for the source to be prepared\n");
+    }
+
+    pthread_join(image_dev.prepare_thread, NULL);
+    image_dev.preparing = false;
+
+    set = image_dev.prepared_set;
+    if (!set) {
+        printf("IMAGE: Source preparation failed\n");
+        terminate = 1;
+        return -EINVAL;
+    }
+
+    image_source_size_init(set);
+    image_dev.image_set = set;
+    image_frame_sizes_init();
+    printf("IMAGE: Source prepared in %.3f ms\n", image_dev.prepare_time);
+
+    if (image_dev.image_selected) {
+        image_select_format(image_dev.image_selected);
+    }
+
+    if (settings.image_reload && image_reload_start() < 0) {
+        terminate = 1;
+        return -EINVAL;
+    }
+    return 0;
+}
+
+/* ---------------------------------------------------------------------------
+ * Text overlay
+ */
+
+static void overlay_free()
+{
+    free(uvc_dev.overlay.atlas);
+    uvc_dev.overlay.atlas = NULL;
+    uvc_dev.overlay.video_format = 0;
+}
+
+/*
+ * Rasterize the glyph atlas for the active format and resolution, through the
+ * same kernels as the frames, and mark the cells of every buffer as stale
+ */
+static int overlay_prepare()
+{
+    struct image_converted *active = image_dev.image_active;
+    struct overlay *overlay = &uvc_dev.overlay;
+    const struct overlay_glyph *glyph;
+    struct image cell = { .type = IMAGE_PIXEL_GREY8 };
+    uint8_t *atlas = NULL;
+    unsigned int cell_width;
+    size_t cell_size;
+    unsigned int g, x, y;
+    int gx, gy;
+    int ret = 0;
+
+    if (!settings.overlay_id || !active) {
+        return 0;
+    }
+
+    memset(overlay->cells, OVERLAY_CELL_STALE, sizeof(overlay->cells));
+
+    if (overlay->atlas && overlay->video_format == active->video_format &&
+            overlay->width == active->width && overlay->height == active->height) {
+        return 0;
+    }
+
+    overlay_free();
+
+    overlay->scale = max(active->height / 240, 1u);
+    overlay->cell_height = OVERLAY_CELL_HEIGHT * overlay->scale;
+    overlay->top = overlay->cell_height / 2;
+    cell_width = OVERLAY_CELL_WIDTH * overlay->scale;
+
+    /* Packed formats only, cells start on whole pixel groups */
+    switch (active->video_format) {
+        case V4L2_PIX_FMT_YUYV:
+        case V4L2_PIX_FMT_GREY:
+        case V4L2_PIX_FMT_Y16:
+        case V4L2_PIX_FMT_RGB565:
             break;
 
+        case V4L2_PIX_FMT_Y10P:
+            if (active->width % 4 == 0) {
+                break;
+            }
+            /* fall through */
+
         default:
-            resp->length = -EL2HLT;
-            uvc_dev.request_error_code = REQEC_INVALID_REQUEST;
-            break;
+            printf("OVERLAY: Not supported in format %c%c%c%c %ux%u\n",
+                    pixfmtstr(active->video_format), active->width, active->height);
+            return -EINVAL;
+    }
 
+    if (active->width < 3 * cell_width || active->height < overlay->top + overlay->cell_height) {
+        printf("OVERLAY: %ux%u is too small\n", active->width, active->height);
+        return -EINVAL;
     }
-    return;
+
+    /* One cell of margin on either side */
+    overlay->cell_count = min((active->width - 2 * cell_width) / cell_width, (unsigned int) OVERLAY_MAX_CELLS);
+    overlay->stride = image_frame_size(active->video_format, active->width, 1);
+    overlay->left_bytes = image_frame_size(active->video_format, cell_width, 1);
+    overlay->cell_bytes = overlay->left_bytes;
+    cell_size = overlay->cell_bytes * overlay->cell_height;
+
+    cell.width = cell_width;
+    cell.height = overlay->cell_height;
+    cell.pixels = malloc(cell.width * cell.height);
+    atlas = malloc(ARRAY_SIZE(overlay_font) * cell_size);
+    if (!cell.pixels || !atlas) {
+        ret = -ENOMEM;
+        goto done;
+    }
+
+    memset(overlay->glyph_index, 0, sizeof(overlay->glyph_index));
+
+    for (g = 0; g < ARRAY_SIZE(overlay_font); g++) {
+        glyph = &overlay_font[g];
+
+        for (y = 0; y < cell.height; y++) {
+            for (x = 0; x < cell.width; x++) {
+                gx = x / overlay->scale - (OVERLAY_CELL_WIDTH - OVERLAY_GLYPH_WIDTH) / 2;
+                gy = y / overlay->scale - (OVERLAY_CELL_HEIGHT - OVERLAY_GLYPH_HEIGHT) / 2;
+
+                ((uint8_t *) cell.pixels)[y * cell.width + x] =
+                    (gx >= 0 && gx < OVERLAY_GLYPH_WIDTH && gy >= 0 && gy < OVERLAY_GLYPH_HEIGHT &&
+                     (glyph->rows[gy] >> (OVERLAY_GLYPH_WIDTH - 1 - gx)) & 1) ?
+                    OVERLAY_FOREGROUND : OVERLAY_BACKGROUND;
+            }
+        }
+
+        ret = image_convert(atlas + g * cell_size, active->video_format, &cell);
+        if (ret < 0) {
+            goto done;
+        }
+
+        overlay->glyph_index[(unsigned char) glyph->c] = g;
+        if (glyph->c >= 'A' && glyph->c <= 'Z') {
+            overlay->glyph_index[glyph->c - 'A' + 'a'] = g;
+        }
+    }
+
+    overlay->atlas = atlas;
+    overlay->video_format = active->video_format;
+    overlay->width = active->width;
+    overlay->height = active->height;
+    atlas = NULL;
+
+    printf("OVERLAY: %u cells of %ux%u in format %c%c%c%c %ux%u\n", overlay->cell_count,
+            cell.width, cell.height, pixfmtstr(active->video_format), active->width, active->height);
+
+done:
+    if (ret < 0) {
+        printf("OVERLAY: Could not rasterize the glyphs: %s (%d)\n", strerror(-ret), -ret);
+    }
+    free(cell.pixels);
+    free(atlas);
+    return ret;
 }
 
-static void uvc_events_process_streaming(uint8_t req, uint8_t cs, struct uvc_request_data *resp)
+/* A whole frame was copied into the buffer, no cell shows the overlay */
+static void overlay_invalidate(unsigned int index)
 {
-    printf("UVC: Streaming request CS: %s, REQ: %s\n", uvc_vs_interface_control_name(cs),
-            uvc_request_code_name(req));
+    memset(uvc_dev.overlay.cells[index], 0, OVERLAY_MAX_CELLS);
+}
 
-    if (cs != UVC_VS_PROBE_CONTROL && cs != UVC_VS_COMMIT_CONTROL) {
+/*
+ * Bring the overlay of a buffer holding the given frame up to date: cells
+ * whose character changed since the buffer was last filled get their glyph
+ * from the atlas, cells the text no longer covers get the frame back
+ */
+static void overlay_render(unsigned int index, const struct image_frame *frame,
+        unsigned long long sequence)
+{
+    struct overlay *overlay = &uvc_dev.overlay;
+    uint8_t *memory = uvc_dev.mem[index].start;
+    char text[OVERLAY_MAX_CELLS * 2];
+    size_t cell_size = overlay->cell_bytes * overlay->cell_height;
+    const uint8_t *src;
+    size_t src_stride;
+    size_t offset;
+    unsigned int length;
+    unsigned int i, y;
+    struct timespec ts;
+    struct tm tm;
+    char c;
+
+    if (!overlay->atlas || overlay->video_format != image_dev.image_active->video_format ||
+            overlay->width != image_dev.image_active->width ||
+            overlay->height != image_dev.image_active->height) {
         return;
     }
 
-    struct uvc_streaming_control *ctrl = (struct uvc_streaming_control *) &resp->data;
-    struct uvc_streaming_control *target = (cs == UVC_VS_PROBE_CONTROL) ? &(uvc_dev.probe) : &(uvc_dev.commit);
+    clock_gettime(CLOCK_REALTIME, &ts);
+    localtime_r(&ts.tv_sec, &tm);
+    snprintf(text, sizeof(text), "%.*s %08llu %02d:%02d:%02d.%03ld", OVERLAY_ID_MAX, settings.overlay_id,
+            sequence, tm.tm_hour, tm.tm_min, tm.tm_sec, ts.tv_nsec / 1000000);
+    length = min((unsigned int) strlen(text), overlay->cell_count);
 
-    int ctrl_length = sizeof *ctrl;
-    resp->length = ctrl_length;
+    for (i = 0; i < overlay->cell_count; i++) {
+        c = (i < length) ? text[i] : 0;
+        if (overlay->cells[index][i] == c) {
+            continue;
+        }
 
-    switch (req) {
-        case UVC_SET_CUR:
-            uvc_dev.control = cs;
-            resp->length = ctrl_length;
-            break;
+        offset = overlay->top * overlay->stride + overlay->left_bytes + i * overlay->cell_bytes;
+        if (c) {
+            src = overlay->atlas + overlay->glyph_index[c & 0x7f] * cell_size;
+            src_stride = overlay->cell_bytes;
+        } else {
+            src = (const uint8_t *) frame->memory + offset;
+            src_stride = overlay->stride;
+        }
 
-        case UVC_GET_MAX:
-            uvc_fill_streaming_control(ctrl, STREAM_CONTROL_MAX, 0, 0);
-            break;
+        for (y = 0; y < overlay->cell_height; y++) {
+            memcpy(memory + offset + y * overlay->stride, src + y * src_stride, overlay->cell_bytes);
+        }
 
-        case UVC_GET_CUR:
-            memcpy(ctrl, target, ctrl_length);
-            break;
+        overlay->cells[index][i] = c;
+        overlay->cells_rendered++;
+        overlay->bytes_rendered += cell_size;
+    }
 
-        case UVC_GET_MIN:
-        case UVC_GET_DEF:
-            uvc_fill_streaming_control(ctrl, STREAM_CONTROL_MIN, 0, 0);
-            break;
+    overlay->frames++;
+}
 
-        case UVC_GET_RES:
-            CLEAR(ctrl);
-            break;
+/* ---------------------------------------------------------------------------
+ * V4L2 streaming related
+ */
 
-        case UVC_GET_LEN:
-            resp->data[0] = 0x00;
-            resp->data[1] = ctrl_length;
-            resp->length = 2;
-            break;
+static void uvc_uninit_device()
+{
+    if (settings.source_device == DEVICE_TYPE_IMAGE && uvc_dev.dummy_buf) {
+        printf("%s: Uninit device\n", uvc_dev.device_type_name);
 
-        case UVC_GET_INFO:
-            resp->data[0] = (uint8_t)(UVC_CONTROL_CAP_GET | UVC_CONTROL_CAP_SET);
-            resp->length = 1;
-            break;
+        /* The buffers stay in the pool for the next stream */
+        uvc_dev.dummy_buf = NULL;
+        uvc_dev.mem = NULL;
     }
 }
 
-static void uvc_events_process_class(struct usb_ctrlrequest *ctrl, struct uvc_request_data *resp)
+/*
+ * Buffer ioctls of a replay, which has no device. Queued buffers are sent
+ * right away and dequeued in the order they were queued, so the stream
+ * handlers and the streaming loop run unchanged in the soak.
+ */
+static int replay_ioctl(struct v4l2_device *dev, unsigned long request, void *arg)
+{
+    struct v4l2_requestbuffers *req = arg;
+    struct v4l2_buffer *buf = arg;
+
+    switch (request) {
+        case VIDIOC_REQBUFS:
+            req->count = min(req->count, (unsigned int) UVC_MAX_BUFFERS);
+            dev->replay_buffers = req->count;
+            dev->replay_queued = 0;
+            return 0;
+
+        case VIDIOC_QBUF:
+            if (buf->index >= dev->replay_buffers || dev->replay_queued == UVC_MAX_BUFFERS) {
+                errno = EINVAL;
+                return -1;
+            }
+            dev->replay_queue[(dev->replay_queue_head + dev->replay_queued++) % UVC_MAX_BUFFERS] = *buf;
+            return 0;
+
+        case VIDIOC_DQBUF:
+            if (!dev->replay_queued) {
+                errno = EAGAIN;
+                return -1;
+            }
+            *buf = dev->replay_queue[dev->replay_queue_head];
+            buf->flags = (buf->flags & ~V4L2_BUF_FLAG_TIMESTAMP_MASK) | V4L2_BUF_FLAG_TIMESTAMP_COPY;
+            dev->replay_queue_head = (dev->replay_queue_head + 1) % UVC_MAX_BUFFERS;
+            dev->replay_queued--;
+            return 0;
+
+        case VIDIOC_STREAMON:
+            return 0;
+
+        case VIDIOC_STREAMOFF:
+            dev->replay_queued = 0;
+            return 0;
+
+        default:
+            errno = ENOTTY;
+            return -1;
+    }
+}
+
+static int v4l2_ioctl(struct v4l2_device *dev, unsigned long request, void *arg)
+{
+    return (dev->replaying) ? replay_ioctl(dev, request, arg) : ioctl(dev->fd, request, arg);
+}
+
+static int v4l2_video_stream_control(struct v4l2_device *dev, enum video_stream_action action)
+{
+    int type = dev->buffer_type;
+    int ret;
+
+    if (action == STREAM_ON) {
+        ret = v4l2_ioctl(dev, VIDIOC_STREAMON, &type);
+        if (ret < 0) {
+            printf("%s: STREAM ON failed: %s (%d).\n", dev->device_type_name, strerror(errno), errno);
+            return ret;
+        }
+
+        printf("%s: STREAM ON success\n", dev->device_type_name);
+        dev->is_streaming = 1;
+        uvc_shutdown_requested = false;
+
+    } else if (dev->is_streaming) {
+        ret = v4l2_ioctl(dev, VIDIOC_STREAMOFF, &type);
+        if (ret < 0) {
+            printf("%s: STREAM OFF failed: %s (%d).\n", dev->device_type_name, strerror(errno), errno);
+            return ret;
+        }
+
+        printf("%s: STREAM OFF success\n", dev->device_type_name);
+        dev->is_streaming = 0;
+    }
+    return 0;
+}
+
+static int uvc_video_stream(enum video_stream_action action)
+{
+    return v4l2_video_stream_control(&uvc_dev, action);
+}
+
+static int v4l2_init_buffers(struct v4l2_device *dev, struct v4l2_requestbuffers *req,
+        unsigned int count)
+{
+    int ret;
+    req->count  = count;
+    req->type   = dev->buffer_type;
+    req->memory = dev->memory_type;
+
+    ret = v4l2_ioctl(dev, VIDIOC_REQBUFS, req);
+    if (ret < 0) {
+        if (ret == -EINVAL) {
+            printf("%s: Does not support %s\n", dev->device_type_name,
+                    (dev->memory_type == V4L2_MEMORY_USERPTR) ? "user pointer I/O" : "memory mapping");
+
+        } else {
+            printf("%s: VIDIOC_REQBUFS error: %s (%d).\n",
+                    dev->device_type_name, strerror(errno), errno);
+
+        }
+        return ret;
+    }
+    return count;
+}
+
+static int v4l2_reqbufs_mmap(struct v4l2_device *dev, struct v4l2_requestbuffers req)
+{
+    int ret;
+    unsigned int i = 0;
+
+    /* Map the buffers. */
+    dev->mem = calloc(req.count, sizeof dev->mem[0]);
+    if (!dev->mem) {
+        printf("%s: Out of memory\n", dev->device_type_name);
+        ret = -ENOMEM;
+        goto err;
+    }
+
+    for (i = 0; i < req.count; ++i) {
+        CLEAR(dev->mem[i].buf);
+
+        dev->mem[i].buf.type   = dev->buffer_type;
+        dev->mem[i].buf.memory = V4L2_MEMORY_MMAP;
+        dev->mem[i].buf.index  = i;
+
+        ret = ioctl(dev->fd, VIDIOC_QUERYBUF, &(dev->mem[i].buf));
+        if (ret < 0) {
+            printf("%s: VIDIOC_QUERYBUF failed for buf %d: %s (%d).\n",
+                    dev->device_type_name, i, strerror(errno), errno);
+
+            ret = -EINVAL;
+            goto err_free;
+        }
+
+        dev->mem[i].start =
+            mmap(NULL /* start anywhere */,
+                    dev->mem[i].buf.length,
+                    PROT_READ | PROT_WRITE /* required */,
+                    MAP_SHARED /* recommended */,
+                    dev->fd, dev->mem[i].buf.m.offset
+                );
+
+        if (MAP_FAILED == dev->mem[i].start) {
+            printf("%s: Unable to map buffer %u: %s (%d).\n",
+                    dev->device_type_name, i, strerror(errno), errno);
+
+            dev->mem[i].length = 0;
+            ret = -EINVAL;
+            goto err_free;
+        }
+
+        dev->mem[i].length = dev->mem[i].buf.length;
+        printf("%s: Buffer %u mapped at address %p, length %d.\n",
+                dev->device_type_name, i, dev->mem[i].start, dev->mem[i].length);
+    }
+
+    return 0;
+
+err_free:
+    free(dev->mem);
+err:
+    return ret;
+}
+
+static int v4l2_reqbufs_userptr(struct v4l2_device *dev, struct v4l2_requestbuffers req)
+{
+    int ret;
+
+    // Image device
+    if (dev->device_type == DEVICE_TYPE_UVC && settings.source_device == DEVICE_TYPE_IMAGE) {
+        /* Take the buffers from the pool, only allocated if they don't fit */
+        ret = buffer_pool_reserve(&dev->pool, req.count, image_dev.image_mem_size);
+        if (ret < 0) {
+            return ret;
+        }
+
+        dev->dummy_buf = dev->pool.buffers;
+        dev->mem = dev->dummy_buf;
+
+        printf("%s: %u buffers of %zu bytes from pool (%llu allocation(s))\n",
+                dev->device_type_name, req.count, dev->pool.buffer_size, dev->pool.allocations);
+    }
+
+    return 0;
+}
+
+static int v4l2_reqbufs(struct v4l2_device *dev, int nbufs)
+{
+    int ret = 0;
+    struct v4l2_requestbuffers req;
+    CLEAR(req);
+
+    dev->dqbuf_count = 0;
+    dev->qbuf_count = 0;
+
+    ret = v4l2_init_buffers(dev, &req, nbufs);
+    if (ret < 1) {
+        return ret;
+    }
+
+    if (!req.count) {
+        return 0;
+    }
+
+    if (dev->memory_type == V4L2_MEMORY_MMAP) {
+        if (req.count < 2) {
+            printf("%s: Insufficient buffer memory.\n", dev->device_type_name);
+            return -EINVAL;
+        }
+
+        ret = v4l2_reqbufs_mmap(dev, req);
+        if (ret < 0) {
+            return -EINVAL;
+        }
+    }
+
+    if (dev->memory_type == V4L2_MEMORY_USERPTR && settings.source_device == DEVICE_TYPE_IMAGE) {
+        if (req.count < 2) {
+            printf("%s: Insufficient buffer memory.\n", dev->device_type_name);
+            return -EINVAL;
+        }
+
+        ret = v4l2_reqbufs_userptr(dev, req);
+        if (ret < 0) {
+            return -EINVAL;
+        }
+    }
+
+    dev->nbufs = req.count;
+    printf("%s: %u buffers allocated.\n", dev->device_type_name, req.count);
+
+    return ret;
+}
+
+static int uvc_request_bufs(int nbufs)
+{
+    return v4l2_reqbufs(&uvc_dev, nbufs);
+}
+
+static void latency_add(struct latency_stats *stats, double latency)
+{
+    stats->sum += latency;
+    stats->max = max(stats->max, latency);
+    stats->count++;
+}
+
+/*
+ * Stamp a buffer about to be queued with the CLOCK_MONOTONIC capture time and
+ * the sequence number of its frame. Drivers copying the timestamps of output
+ * buffers (V4L2_BUF_FLAG_TIMESTAMP_COPY) pass them on with the timestamp
+ * source, e.g. to the UVC PTS/SCR header fields; the timestamp type flags
+ * belong to the driver and are left clear.
+ */
+static void uvc_stamp_buffer(struct v4l2_buffer *buf, double capture, unsigned long long sequence)
+{
+    long long usec = capture * 1000;
+    double now = monotonic_ms();
+
+    buf->timestamp.tv_sec = usec / 1000000;
+    buf->timestamp.tv_usec = usec % 1000000;
+    buf->sequence = sequence;
+    buf->flags &= ~(V4L2_BUF_FLAG_TIMESTAMP_MASK | V4L2_BUF_FLAG_TSTAMP_SRC_MASK);
+    buf->flags |= V4L2_BUF_FLAG_TSTAMP_SRC_SOE;
+
+    uvc_dev.capture_time[buf->index] = capture;
+    uvc_dev.qbuf_time[buf->index] = now;
+    uvc_dev.buffer_sequence[buf->index] = sequence;
+    latency_add(&uvc_dev.latency_produce, now - capture);
+}
+
+static int uvc_queue_buffer(unsigned int index, unsigned int bytesused)
+{
+    struct v4l2_buffer buf;
+    uint64_t start;
+    int ret;
+
+    CLEAR(buf);
+    buf.type      = V4L2_BUF_TYPE_VIDEO_OUTPUT;
+    buf.memory    = V4L2_MEMORY_USERPTR;
+    buf.m.userptr = (unsigned long) uvc_dev.dummy_buf[index].start;
+    buf.length    = uvc_dev.dummy_buf[index].length;
+    buf.index     = index;
+    buf.bytesused = bytesused;
+
+    /* Rotated frames are produced when their buffer is queued */
+    if (bytesused) {
+        overlay_render(index, &image_dev.image_active->frames[index % uvc_dev.rotation_length],
+                uvc_dev.frame_sequence);
+        uvc_stamp_buffer(&buf, monotonic_ms(), uvc_dev.frame_sequence++);
+    }
+
+    start = trace_begin();
+    ret = v4l2_ioctl(&uvc_dev, VIDIOC_QBUF, &buf);
+    trace_end("QBUF", start);
+    if (ret < 0) {
+        printf("UVC: VIDIOC_QBUF failed : %s (%d).\n", strerror(errno), errno);
+        return ret;
+    }
+
+    /* As on the fill path, the sequence number stamped into the buffer (0 when queued empty) */
+    USDT_PROBE3(qbuf, buf.index, buf.bytesused, buf.sequence);
+
+    uvc_dev.qbuf_count++;
+    return 0;
+}
+
+static int uvc_video_qbuf()
+{
+    unsigned int i;
+    int ret;
+
+    // Image device
+    for (i = 0; i < uvc_dev.nbufs; ++i) {
+        ret = uvc_queue_buffer(i, (uvc_dev.rotation_length) ? uvc_dev.rotation_bytesused[i] : 0);
+        if (ret < 0) {
+            return ret;
+        }
+    }
+
+    return 0;
+}
+
+/*
+ * V4L2 generic stuff
+ */
+
+static int v4l2_get_format(struct v4l2_device *dev)
+{
+    struct v4l2_format fmt;
+    int ret;
+
+    CLEAR(fmt);
+    fmt.type = dev->buffer_type;
+
+    ret = ioctl(dev->fd, VIDIOC_G_FMT, &fmt);
+    if (ret < 0) {
+        return ret;
+    }
+
+    printf("%s: Getting current format: %c%c%c%c %ux%u\n",
+            dev->device_type_name, pixfmtstr(fmt.fmt.pix.pixelformat),
+            fmt.fmt.pix.width, fmt.fmt.pix.height);
+
+    return 0;
+}
+
+static int v4l2_set_format(struct v4l2_device *dev, struct v4l2_format *fmt)
+{
+    int ret;
+
+    ret = ioctl(dev->fd, VIDIOC_S_FMT, fmt);
+    if (ret < 0) {
+        printf("%s: Unable to set format %s (%d).\n",
+                dev->device_type_name, strerror(errno), errno);
+        return ret;
+    }
+
+    printf("%s: Setting format to: %c%c%c%c %ux%u\n",
+            dev->device_type_name, pixfmtstr(fmt->fmt.pix.pixelformat),
+            fmt->fmt.pix.width, fmt->fmt.pix.height);
+
+    return 0;
+}
+
+static int v4l2_apply_format(struct v4l2_device *dev, unsigned int pixelformat,
+        unsigned int width, unsigned int height)
+{
+    struct v4l2_format fmt;
+    int ret = -EINVAL;
+
+    if (dev->is_streaming || !dev->fd) {
+        return ret;
+    }
+
+    if (settings.fast_switch && pixelformat == dev->applied_format &&
+            width == dev->applied_width && height == dev->applied_height) {
+        return 0;
+    }
+
+    CLEAR(fmt);
+    fmt.type                = dev->buffer_type;
+    fmt.fmt.pix.width       = width;
+    fmt.fmt.pix.height      = height;
+    fmt.fmt.pix.sizeimage   = get_frame_size(pixelformat, width, height);
+    fmt.fmt.pix.pixelformat = pixelformat;
+    fmt.fmt.pix.field       = V4L2_FIELD_ANY;
+
+    ret = v4l2_set_format(dev, &fmt);
+    if (ret < 0) {
+        return ret;
+    }
+
+    dev->applied_format = pixelformat;
+    dev->applied_width = width;
+    dev->applied_height = height;
+
+    return v4l2_get_format(dev);
+}
+
+static void uvc_close()
+{
+    if (uvc_dev.fd) {
+        close(uvc_dev.fd);
+        uvc_dev.fd = -1;
+    }
+}
+
+/*
+ * UVC streaming related
+ */
+
+static void uvc_image_fill_buffer(struct v4l2_buffer *buf)
+{
+    char *uvc_pixels = (char *)uvc_dev.mem[buf->index].start;
+    double interval = 1000.0 / settings.image_framerate;
+    unsigned long long sequence;
+    struct image_frame *frame;
+
+    USDT_PROBE1(fill_start, buf->index);
+
+    image_set_update();
+
+    if (settings.low_latency) {
+        /* Latest frame wins: send the newest frame of the source, drop the stale ones */
+        sequence = (monotonic_ms() - uvc_dev.stream_start) / interval;
+        if (sequence > uvc_dev.frame_sequence) {
+            uvc_dev.frames_dropped += sequence - uvc_dev.frame_sequence;
+        }
+        image_dev.image_frame_index = sequence % image_dev.image_active->nframes;
+    } else {
+        sequence = uvc_dev.frame_sequence;
+    }
+
+    uvc_dev.frame_sequence = max(uvc_dev.frame_sequence, sequence + 1);
+
+    frame = &image_dev.image_active->frames[image_dev.image_frame_index];
+
+    buf->bytesused = frame->mem_size;
+    uvc_dev.dedup_stats.fills++;
+
+    /* Repeated frames of a sequence or a static source: the buffer still holds it */
+    if (frame->fingerprint && uvc_dev.pool.fingerprints[buf->index] == frame->fingerprint) {
+        uvc_dev.dedup_stats.hits++;
+        uvc_dev.dedup_stats.bytes_saved += frame->mem_size;
+    } else {
+        memcpy(uvc_pixels, frame->memory, frame->mem_size);
+        uvc_dev.pool.fingerprints[buf->index] = frame->fingerprint;
+        overlay_invalidate(buf->index);
+    }
+
+    overlay_render(buf->index, frame, sequence);
+
+    if (++image_dev.image_frame_index >= image_dev.image_active->nframes) {
+        image_dev.image_frame_index = 0;
+    }
+
+    uvc_stamp_buffer(buf, uvc_dev.stream_start + sequence * interval, sequence);
+
+    USDT_PROBE3(fill_end, buf->index, buf->bytesused, sequence);
+
+    if (uvc_dev.switch_pending) {
+        printf("UVC: Format switch to first frame: %.2f ms\n", monotonic_ms() - uvc_dev.switch_time);
+        uvc_dev.switch_pending = false;
+    }
+} 
+
+/*
+ * Fill every buffer once with the frame of the sequence it is pinned to
+ */
+static void uvc_rotation_prepare()
+{
+    struct image_frame *frame;
+    unsigned int i;
+
+    for (i = 0; i < uvc_dev.nbufs; i++) {
+        frame = &image_dev.image_active->frames[i % uvc_dev.rotation_length];
+        memcpy(uvc_dev.dummy_buf[i].start, frame->memory, frame->mem_size);
+        uvc_dev.pool.fingerprints[i] = frame->fingerprint;
+        overlay_invalidate(i);
+        uvc_dev.rotation_bytesused[i] = frame->mem_size;
+        uvc_dev.rotation_ready[i] = false;
+    }
+
+    uvc_dev.rotation_next = 0;
+    uvc_dev.rotation_dq_next = 0;
+    uvc_dev.rotation_out_of_order = 0;
+
+    printf("UVC: Rotating %u frame(s) over %u buffers\n", uvc_dev.rotation_length, uvc_dev.nbufs);
+}
+
+/*
+ * Requeue the dequeued buffers in the phase of the frame cycle. A buffer that
+ * comes back out of order is held until the buffers before it in the cycle are
+ * back, so the frames are always sent in sequence.
+ */
+static void uvc_rotation_requeue(struct v4l2_buffer *buf)
+{
+    unsigned int length = uvc_dev.rotation_length;
+    unsigned int phase = buf->index % length;
+    bool queued;
+    unsigned int i;
+
+    if (phase != uvc_dev.rotation_dq_next) {
+        uvc_dev.rotation_out_of_order++;
+        printf("UVC: Buffer %u returned out of phase (%u, expected %u), holding it\n",
+                buf->index, phase, uvc_dev.rotation_dq_next);
+    }
+    uvc_dev.rotation_dq_next = (uvc_dev.rotation_dq_next + 1) % length;
+    uvc_dev.rotation_ready[buf->index] = true;
+
+    /* Queue the waiting buffers as long as one of them has the next phase */
+    do {
+        queued = false;
+
+        for (i = 0; i < uvc_dev.nbufs; i++) {
+            if (uvc_dev.rotation_ready[i] && i % length == uvc_dev.rotation_next) {
+                break;
+            }
+        }
+
+        if (i < uvc_dev.nbufs) {
+            if (uvc_queue_buffer(i, uvc_dev.rotation_bytesused[i]) < 0) {
+                return;
+            }
+
+            uvc_dev.rotation_ready[i] = false;
+            uvc_dev.rotation_next = (uvc_dev.rotation_next + 1) % length;
+            queued = true;
+        }
+    } while (queued);
+}
+
+static void uvc_image_video_process()
+{
+    struct v4l2_buffer ubuf;
+    unsigned int slack;
+    uint64_t start;
+    double latency;
+    double now;
+    int ret;
+    /*
+     * Return immediately if UVC video output device has not started
+     * streaming yet.
+     */
+    if (!uvc_dev.is_streaming) {
+        return;
+    }
+
+    /* Prepare a v4l2 buffer to be dequeued from UVC domain. */
+    CLEAR(ubuf);
+    ubuf.type   = uvc_dev.buffer_type;
+    ubuf.memory = uvc_dev.memory_type;
+
+    start = trace_begin();
+    ret = v4l2_ioctl(&uvc_dev, VIDIOC_DQBUF, &ubuf);
+    trace_end("DQBUF", start);
+    if (ret < 0) {
+        if (errno == EAGAIN) {
+            uvc_dev.queue_stats.eagain++;
+        }
+        printf("%s: Unable to dequeue buffer: %s (%d).\n",
+                uvc_dev.device_type_name, strerror(errno), errno);
+        return;
+    }
+
+    uvc_dev.dqbuf_count++;
+    uvc_dev.queue_stats.dqbufs++;
+
+    /* Buffers still waiting for transmission */
+    slack = uvc_dev.qbuf_count - uvc_dev.dqbuf_count;
+    if (!slack) {
+        uvc_dev.queue_stats.underruns++;
+    }
+    uvc_dev.queue_stats.min_slack = min(uvc_dev.queue_stats.min_slack, slack);
+
+    if (!uvc_dev.timestamp_reported) {
+        switch (ubuf.flags & V4L2_BUF_FLAG_TIMESTAMP_MASK) {
+        case V4L2_BUF_FLAG_TIMESTAMP_COPY:
+            printf("UVC: Driver copies the frame timestamps\n");
+            break;
+        case V4L2_BUF_FLAG_TIMESTAMP_MONOTONIC:
+            printf("UVC: Driver stamps the buffers itself, frame timestamps are ignored\n");
+            break;
+        default:
+            printf("UVC: Driver timestamp type unknown\n");
+            break;
+        }
+        uvc_dev.timestamp_reported = true;
+    }
+
+    /* The buffer's previous frame has been sent */
+    latency = 0;
+    if (uvc_dev.capture_time[ubuf.index]) {
+        now = monotonic_ms();
+        latency = now - uvc_dev.capture_time[ubuf.index];
+        latency_add(&uvc_dev.latency_queue, now - uvc_dev.qbuf_time[ubuf.index]);
+        latency_add(&uvc_dev.latency_total, latency);
+        uvc_dev.queue_stats.latency_sum += latency;
+        uvc_dev.sent_sequence = uvc_dev.buffer_sequence[ubuf.index];
+    }
+
+    USDT_PROBE3(dqbuf, ubuf.index, ubuf.bytesused, (long) (latency * 1000));
+
+    if (uvc_dev.rotation_length) {
+        uvc_rotation_requeue(&ubuf);
+
+    } else {
+        start = trace_begin();
+        uvc_image_fill_buffer(&ubuf);
+        trace_end("fill", start);
+
+        start = trace_begin();
+        ret = v4l2_ioctl(&uvc_dev, VIDIOC_QBUF, &ubuf);
+        trace_end("QBUF", start);
+        if (ret < 0) {
+            printf("%s: Unable to queue buffer: %s (%d).\n",
+                    uvc_dev.device_type_name, strerror(errno), errno);
+            return;
+        }
+
+        USDT_PROBE3(qbuf, ubuf.index, ubuf.bytesused, ubuf.sequence);
+
+        uvc_dev.qbuf_count++;
+    }
+
+    if (settings.show_fps) {
+        uvc_dev.buffers_processed++;
+    }
+}
+
+/*
+ * Adaptive queue depth
+ */
+
+static struct queue_depth_entry *queue_depth_find(bool create)
+{
+    struct image_converted *active = image_dev.image_active;
+    struct queue_depth_entry *entry;
+    unsigned int i;
+
+    for (i = 0; i < uvc_dev.queue_depth_count; i++) {
+        entry = &uvc_dev.queue_depths[i];
+        if (entry->speed == uvc_dev.usb_speed && entry->format == active->video_format &&
+                entry->width == active->width && entry->height == active->height) {
+            return entry;
+        }
+    }
+
+    if (!create || uvc_dev.queue_depth_count == QUEUE_DEPTH_ENTRIES) {
+        return NULL;
+    }
+
+    entry = &uvc_dev.queue_depths[uvc_dev.queue_depth_count++];
+    entry->speed = uvc_dev.usb_speed;
+    entry->format = active->video_format;
+    entry->width = active->width;
+    entry->height = active->height;
+    return entry;
+}
+
+static void queue_depth_load()
+{
+    struct queue_depth_entry entry;
+    FILE *file;
+
+    file = fopen(QUEUE_DEPTH_STATE_FILE, "r");
+    if (!file) {
+        return;
+    }
+
+    while (uvc_dev.queue_depth_count < QUEUE_DEPTH_ENTRIES &&
+            fscanf(file, "%u %x %u %u %u", &entry.speed, &entry.format,
+                &entry.width, &entry.height, &entry.depth) == 5) {
+        entry.depth = clamp(entry.depth, (unsigned int) QUEUE_DEPTH_MIN, (unsigned int) QUEUE_DEPTH_MAX);
+        uvc_dev.queue_depths[uvc_dev.queue_depth_count++] = entry;
+    }
+    fclose(file);
+}
+
+/* Written to a temporary file and renamed, so a crash never leaves a truncated state */
+static void queue_depth_save()
+{
+    struct queue_depth_entry *entry;
+    char tmp[] = QUEUE_DEPTH_STATE_FILE ".tmp";
+    unsigned int i;
+    FILE *file;
+    int ret = 0;
+
+    if (mkdir(QUEUE_DEPTH_STATE_DIR, 0755) < 0 && errno != EEXIST) {
+        ret = -errno;
+        goto done;
+    }
+
+    file = fopen(tmp, "w");
+    if (!file) {
+        ret = -errno;
+        goto done;
+    }
+
+    for (i = 0; i < uvc_dev.queue_depth_count; i++) {
+        entry = &uvc_dev.queue_depths[i];
+        fprintf(file, "%u %08x %u %u %u\n", entry->speed, entry->format,
+                entry->width, entry->height, entry->depth);
+    }
+
+    if (ferror(file)) {
+        ret = -EIO;
+    }
+    if (fclose(file) != 0 && ret == 0) {
+        ret = -errno;
+    }
+    if (ret == 0 && rename(tmp, QUEUE_DEPTH_STATE_FILE) < 0) {
+        ret = -errno;
+    }
+    if (ret < 0) {
+        unlink(tmp);
+    }
+
+done:
+    if (ret < 0) {
+        printf("QUEUE: Could not save queue depths to %s: %s (%d)\n",
+                QUEUE_DEPTH_STATE_FILE, strerror(-ret), -ret);
+    }
+}
+
+/* Queue depth remembered for the connection speed and committed format */
+static unsigned int queue_depth_select()
+{
+    struct queue_depth_entry *entry = queue_depth_find(false);
+
+    uvc_dev.queue_depth = (entry) ? entry->depth : QUEUE_DEPTH_DEFAULT;
+
+    printf("QUEUE: Depth %u for %c%c%c%c %ux%u (speed %u%s)\n", uvc_dev.queue_depth,
+            pixfmtstr(image_dev.image_active->video_format), image_dev.image_active->width,
+            image_dev.image_active->height, uvc_dev.usb_speed, (entry) ? "" : ", default");
+    return uvc_dev.queue_depth;
+}
+
+/*
+ * Pick the queue depth of the next stream from the one that just ended: grow
+ * when the queue ran empty or frames were filled late, shrink when buffers
+ * were always left waiting or the host rarely had a buffer ready for us
+ */
+static void queue_depth_adapt()
+{
+    struct queue_stats *stats = &uvc_dev.queue_stats;
+    struct queue_depth_entry *entry;
+    unsigned int depth = uvc_dev.queue_depth;
+    const char *decision = "keep";
+
+    if (!depth || !image_dev.image_active) {
+        return;
+    }
+
+    if (stats->dqbufs < QUEUE_DEPTH_MIN_SAMPLES) {
+        printf("QUEUE: Stream too short to adapt the depth (%llu frames)\n", stats->dqbufs);
+        return;
+    }
+
+    if (stats->underruns * 50 > stats->dqbufs || stats->missed * 100 > stats->dqbufs) {
+        if (depth < QUEUE_DEPTH_MAX) {
+            depth++;
+            decision = "grow";
+        }
+    } else if (!stats->underruns && !stats->missed &&
+            (stats->min_slack >= 2 || stats->eagain * 10 > stats->dqbufs)) {
+        if (depth > QUEUE_DEPTH_MIN) {
+            depth--;
+            decision = "shrink";
+        }
+    }
+
+    printf("QUEUE: %llu frames, underruns %llu, EAGAIN %llu, missed %llu, min slack %u, "
+            "avg latency %.2f ms: %s depth %u -> %u\n", stats->dqbufs, stats->underruns,
+            stats->eagain, stats->missed, stats->min_slack, stats->latency_sum / stats->dqbufs,
+            decision, uvc_dev.queue_depth, depth);
+
+    entry = queue_depth_find(true);
+    if (entry && entry->depth != depth) {
+        entry->depth = depth;
+        queue_depth_save();
+    }
+}
+
+static void uvc_handle_streamon_event()
+{
+    unsigned int nbufs;
+
+    printf("Stream On Event\n");
+    // Video4Linux2 device
+
+    if (settings.source_device == DEVICE_TYPE_IMAGE && image_prepare_adopt(true) < 0) {
+        return;
+    }
+
+    if (settings.source_device == DEVICE_TYPE_IMAGE && !image_dev.image_active) {
+        printf("IMAGE: No frames for the committed format, not streaming\n");
+        return;
+    }
+
+    /* The stream runs without the text, the reason is logged by overlay_prepare() */
+    if (overlay_prepare() < 0) {
+        printf("OVERLAY: -O %s is not drawn in this stream\n", settings.overlay_id);
+    }
+
+    nbufs = (settings.nbufs_auto) ? queue_depth_select() : uvc_dev.nbufs;
+
+    /* Whole frame cycles, so every buffer keeps its frame */
+    uvc_dev.rotation_length = (settings.rotation) ? image_dev.image_active->nframes : 0;
+    if (uvc_dev.rotation_length) {
+        nbufs = ALIGN_UP(max(nbufs, 2u), uvc_dev.rotation_length);
+        if (nbufs > UVC_MAX_BUFFERS) {
+            printf("UVC: %u frames are too many to rotate, filling buffers instead\n",
+                    uvc_dev.rotation_length);
+            uvc_dev.rotation_length = 0;
+            nbufs = uvc_dev.nbufs;
+        }
+    }
+
+    /* With fast switching the buffers stay requested between streams */
+    if (!settings.fast_switch || !uvc_dev.dummy_buf || nbufs != uvc_dev.nbufs) {
+        if (uvc_request_bufs(nbufs) < 0) {
+            return;
+        }
+    }
+
+    // Image device
+    if (settings.source_device == DEVICE_TYPE_IMAGE) {
+        uvc_dev.stream_start = monotonic_ms();
+        uvc_dev.frame_sequence = 0;
+        uvc_dev.frames_dropped = 0;
+        memset(uvc_dev.capture_time, 0, sizeof(uvc_dev.capture_time));
+        memset(uvc_dev.buffer_sequence, 0, sizeof(uvc_dev.buffer_sequence));
+        uvc_dev.sent_sequence = 0;
+
+        uvc_dev.qbuf_count = 0;
+        uvc_dev.dqbuf_count = 0;
+        CLEAR(uvc_dev.queue_stats);
+        uvc_dev.queue_stats.min_slack = UINT_MAX;
+
+        if (uvc_dev.rotation_length) {
+            uvc_rotation_prepare();
+        }
+
+        if (uvc_video_qbuf() < 0) {
+            return;
+        }
+
+        uvc_video_stream(STREAM_ON);
+        USDT_PROBE4(stream_on, uvc_dev.applied_format, uvc_dev.applied_width, uvc_dev.applied_height,
+                uvc_dev.nbufs);
+        settings.blink_on_startup = 0;
+        streaming_status_value(uvc_dev.is_streaming);
+    }
+}
+
+static void uvc_handle_streamoff_event()
+{
+    /* A replay has no real transmission to learn the queue depth from */
+    if (settings.nbufs_auto && uvc_dev.is_streaming && !uvc_dev.replaying) {
+        queue_depth_adapt();
+    }
+
+    uvc_video_stream(STREAM_OFF);
+    USDT_PROBE2(stream_off, uvc_dev.dqbuf_count, uvc_dev.frames_dropped);
+    if (!settings.fast_switch || terminate) {
+        uvc_request_bufs(0);
+        uvc_uninit_device();
+    }
+
+    streaming_status_value(uvc_dev.is_streaming);
+}
+
+/*
+ * UVC Request processing
+ */
+static void dump_uvc_streaming_control(struct uvc_streaming_control *ctrl)
+{
+    printf("DUMP: uvc_streaming_control: format: %d, frame: %d, frame interval: %d\n",
+            ctrl->bFormatIndex,
+            ctrl->bFrameIndex,
+            ctrl->dwFrameInterval
+          );
+}
+
+static int uvc_get_frame_format_index(int format_index, enum uvc_frame_format_getter getter)
+{
+    int index = -1;
+    int value;
+    int i;
+
+    for (i = 0; i <= last_format_index; i++) {
+        if (format_index == -1 || format_index == (int) uvc_frame_format[i].bFormatIndex) {
+
+            switch (getter) {
+                case FORMAT_INDEX_MIN:
+                case FORMAT_INDEX_MAX:
+                    value = uvc_frame_format[i].bFormatIndex;
+                    break;
+
+                case FRAME_INDEX_MIN:
+                case FRAME_INDEX_MAX:
+                    value = uvc_frame_format[i].bFrameIndex;
+                    break;
+            }
+            if (index == -1) {
+                index = value;
+
+            } else {
+                switch (getter) {
+                    case FORMAT_INDEX_MIN:
+                    case FRAME_INDEX_MIN:
+                        if (value < index) {
+                            index = value;
+                        }
+                        break;
+
+                    case FORMAT_INDEX_MAX:
+                    case FRAME_INDEX_MAX:
+                        if (value > index) {
+                            index = value;
+                        }
+                        break;
+                }
+            }
+        }
+    }
+    return index;
+}
+
+static int uvc_get_frame_format(struct uvc_frame_format **frame_format,
+        unsigned int iFormat, unsigned int iFrame)
+{
+    int i;
+    for (i = 0; i <= last_format_index; i++) {
+        if (uvc_frame_format[i].bFormatIndex == iFormat &&
+                uvc_frame_format[i].bFrameIndex == iFrame
+           ) {
+            *frame_format = &uvc_frame_format[i];
+            return 0;
+        }
+    }
+    return -1;
+}
+
+static void uvc_dump_frame_format(struct uvc_frame_format *frame_format, const char *title)
+{
+    printf("%s: format: %d, frame: %d, resolution: %dx%d, frame_interval: %d,  bitrate: [%d, %d]\n",
+            title,
+            frame_format->bFormatIndex,
+            frame_format->bFrameIndex,
+            frame_format->wWidth,
+            frame_format->wHeight,
+            frame_format->dwDefaultFrameInterval,
+            frame_format->dwMinBitRate,
+            frame_format->dwMaxBitRate
+          );
+}
+
+/*
+ * Switch the stream to a committed format. Runs in the streaming loop, the
+ * control thread forwards commits as messages.
+ */
+static void uvc_commit_format(struct uvc_frame_format *frame_format)
+{
+    struct image_converted *converted = image_dev.image_active;
+
+    if (!converted || converted->video_format != (unsigned int) frame_format->video_format ||
+            converted->width != frame_format->wWidth || converted->height != frame_format->wHeight) {
+        uvc_dev.switch_time = monotonic_ms();
+        uvc_dev.switch_pending = true;
+    }
+
+    /*
+     * With fast switching a commit while streaming only changes the frames
+     * sent, the buffers are sized for the largest frame
+     */
+    if (!uvc_dev.is_streaming || settings.fast_switch) {
+        image_select_format(frame_format);
+    }
+
+    /* Replayed events have no device to apply the format to */
+    if (!uvc_dev.replaying) {
+        v4l2_apply_format(&uvc_dev, frame_format->video_format, frame_format->wWidth, frame_format->wHeight);
+    }
+
+    USDT_PROBE4(format_commit, frame_format->video_format, frame_format->wWidth, frame_format->wHeight,
+            uvc_dev.switch_pending);
+}
+
+static void stream_message_post(enum stream_message_type type, int frame_format)
+{
+    struct stream_message message = { type, frame_format };
+
+    /* smaller than PIPE_BUF, so written atomically and in order */
+    if (write(uvc_dev.message_pipe[1], &message, sizeof(message)) != sizeof(message)) {
+        printf("CONTROL: Could not forward stream event %d: %s (%d)\n", type, strerror(errno), errno);
+    }
+}
+
+static void stream_messages_process()
+{
+    struct stream_message message;
+
+    while (read(uvc_dev.message_pipe[0], &message, sizeof(message)) == sizeof(message)) {
+        switch (message.type) {
+            case STREAM_MESSAGE_ON:
+                uvc_handle_streamon_event();
+                break;
+
+            case STREAM_MESSAGE_OFF:
+                uvc_handle_streamoff_event();
+                break;
+
+            case STREAM_MESSAGE_COMMIT:
+                uvc_commit_format(&uvc_frame_format[message.frame_format]);
+                break;
+        }
+    }
+}
+
+static void uvc_fill_streaming_control(struct uvc_streaming_control *ctrl,
+        enum stream_control_action action, int iformat, int iframe)
+{
+    int format_first;
+    int format_last;
+    int frame_first;
+    int format_frame_first;
+    int format_frame_last;
+    unsigned int frame_interval;
+    unsigned int dwMaxPayloadTransferSize;
+
+    switch (action) {
+        case STREAM_CONTROL_INIT:
+            printf("UVC: Streaming control: action: INIT\n");
+            break;
+
+        case STREAM_CONTROL_MIN:
+            printf("UVC: Streaming control: action: GET MIN\n");
+            break;
+
+        case STREAM_CONTROL_MAX:
+            printf("UVC: Streaming control: action: GET MAX\n");
+            break;
+
+        case STREAM_CONTROL_SET:
+            printf("UVC: Streaming control: action: SET, format: %d, frame: %d\n", iformat, iframe);
+            break;
+
+    }
+
+    format_first = uvc_get_frame_format_index(-1, FORMAT_INDEX_MIN);
+    format_last = uvc_get_frame_format_index(-1, FORMAT_INDEX_MAX);
+
+    frame_first = uvc_get_frame_format_index(-1, FRAME_INDEX_MIN);
+
+    if (action == STREAM_CONTROL_MIN) {
+        iformat = format_first;
+        iframe = frame_first;
+
+    } else if (action == STREAM_CONTROL_MAX) {
+        /* The last format may have fewer frames than others */
+        iformat = format_last;
+        iframe = uvc_get_frame_format_index(iformat, FRAME_INDEX_MAX);
+
+    } else {
+        iformat = clamp(iformat, format_first, format_last);
+
+        format_frame_first = uvc_get_frame_format_index(iformat, FRAME_INDEX_MIN);
+        format_frame_last = uvc_get_frame_format_index(iformat, FRAME_INDEX_MAX);
+
+        iframe = clamp(iframe, format_frame_first, format_frame_last);
+    }
+
+    struct uvc_frame_format *frame_format;
+    if (uvc_get_frame_format(&frame_format, iformat, iframe) < 0) {
+        frame_format = &uvc_frame_format[0];
+    }
+
+    uvc_dump_frame_format(frame_format, "FRAME");
+
+    if (frame_format->dwDefaultFrameInterval >= 100000) {
+        frame_interval = frame_format->dwDefaultFrameInterval;
+    } else {
+        frame_interval = 400000;
+    }
+
+    dwMaxPayloadTransferSize = streaming_maxpacket;
+    if (streaming_maxpacket > 1024 && streaming_maxpacket % 1024 != 0) {
+        dwMaxPayloadTransferSize -= (streaming_maxpacket / 1024) * 128;
+    }
+
+    memset(ctrl, 0, sizeof *ctrl);
+    ctrl->bmHint                   = 1;
+    ctrl->bFormatIndex             = iformat;
+    ctrl->bFrameIndex              = iframe;
+    /* ctrl->dwMaxVideoFrameSize      = get_frame_size(frame_format->video_format, frame_format->wWidth, frame_format->wHeight); */
+    ctrl->dwMaxVideoFrameSize      = atomic_load_explicit(&uvc_dev.frame_max_size[frame_format - uvc_frame_format],
+            memory_order_relaxed);
+    ctrl->dwMaxPayloadTransferSize = dwMaxPayloadTransferSize;
+    ctrl->dwFrameInterval          = frame_interval;
+    ctrl->bmFramingInfo            = 3;
+    ctrl->bMinVersion              = format_first;
+    ctrl->bMaxVersion              = format_last;
+    ctrl->bPreferedVersion         = format_last;
+
+    dump_uvc_streaming_control(ctrl);
+
+    if (action == STREAM_CONTROL_SET) {
+        USDT_PROBE5(streaming_control, uvc_dev.control, iformat, iframe, frame_interval,
+                ctrl->dwMaxVideoFrameSize);
+    }
+
+    if (action == STREAM_CONTROL_INIT && !uvc_dev.is_streaming) {
+        image_select_format(frame_format);
+    }
+
+    if (uvc_dev.control == UVC_VS_COMMIT_CONTROL && action == STREAM_CONTROL_SET) {
+        if (settings.control_thread) {
+            stream_message_post(STREAM_MESSAGE_COMMIT, frame_format - uvc_frame_format);
+        } else {
+            uvc_commit_format(frame_format);
+        }
+    }
+}
+
+static void uvc_interface_control(unsigned int interface,
+        uint8_t req, uint8_t cs, uint8_t len, struct uvc_request_data *resp)
+{
+    int i;
+    bool found = false;
+    const char *request_code_name = uvc_request_code_name(req);
+    const char *interface_name = (interface == UVC_VC_INPUT_TERMINAL) ? "INPUT_TERMINAL" : "PROCESSING_UNIT";
+
+    for (i = 0; i < control_mapping_size; i++) {
+        if (control_mapping[i].type == interface && control_mapping[i].uvc == cs) {
+            found = true;
+            break;
+        }
+    }
+
+    if (!found) {
+        printf("UVC: %s - %s - %02x - UNSUPPORTED\n", interface_name, request_code_name, cs);
+        resp->length = -EL2HLT;
+        uvc_dev.request_error_code = REQEC_INVALID_CONTROL;
+        return;
+    }
+
+    if (!control_mapping[i].enabled) {
+        printf("UVC: %s - %s - %s - DISABLED\n", interface_name, request_code_name,
+                control_mapping[i].uvc_name);
+        resp->length = -EL2HLT;
+        uvc_dev.request_error_code = REQEC_INVALID_CONTROL;
+        return;
+    }
+
+    printf("UVC: %s - %s - %s\n", interface_name, request_code_name, control_mapping[i].uvc_name);
+
+    switch (req) {
+        case UVC_SET_CUR:
+            resp->data[0] = 0x0;
+            resp->length = len;
+            uvc_dev.control_interface = interface;
+            uvc_dev.control_type = cs;
+            uvc_dev.request_error_code = REQEC_NO_ERROR;
+            break;
+
+        case UVC_GET_MIN:
+            resp->length = 4;
+            memcpy(&resp->data[0], &control_mapping[i].minimum, resp->length);
+            uvc_dev.request_error_code = REQEC_NO_ERROR;
+            break;
+
+        case UVC_GET_MAX:
+            resp->length = 4;
+            memcpy(&resp->data[0], &control_mapping[i].maximum, resp->length);
+            uvc_dev.request_error_code = REQEC_NO_ERROR;
+            break;
+
+        case UVC_GET_CUR:
+            resp->length = 4;
+            memcpy(&resp->data[0], &control_mapping[i].value, resp->length);
+            uvc_dev.request_error_code = REQEC_NO_ERROR;
+            break;
+
+        case UVC_GET_INFO:
+            resp->data[0] = (uint8_t)(UVC_CONTROL_CAP_GET | UVC_CONTROL_CAP_SET);
+            resp->length = 1;
+            uvc_dev.request_error_code = REQEC_NO_ERROR;
+            break;
+
+        case UVC_GET_DEF:
+            resp->length = 4;
+            memcpy(&resp->data[0], &control_mapping[i].default_value, resp->length);
+            uvc_dev.request_error_code = REQEC_NO_ERROR;
+            break;
+
+        case UVC_GET_RES:
+            resp->length = 4;
+            memcpy(&resp->data[0], &control_mapping[i].step, resp->length);
+            uvc_dev.request_error_code = REQEC_NO_ERROR;
+            break;
+
+        default:
+            resp->length = -EL2HLT;
+            uvc_dev.request_error_code = REQEC_INVALID_REQUEST;
+            break;
+
+    }
+    return;
+}
+
+static void uvc_events_process_streaming(uint8_t req, uint8_t cs, struct uvc_request_data *resp)
+{
+    printf("UVC: Streaming request CS: %s, REQ: %s\n", uvc_vs_interface_control_name(cs),
+            uvc_request_code_name(req));
+
+    if (cs != UVC_VS_PROBE_CONTROL && cs != UVC_VS_COMMIT_CONTROL) {
+        return;
+    }
+
+    struct uvc_streaming_control *ctrl = (struct uvc_streaming_control *) &resp->data;
+    struct uvc_streaming_control *target = (cs == UVC_VS_PROBE_CONTROL) ? &(uvc_dev.probe) : &(uvc_dev.commit);
+
+    int ctrl_length = sizeof *ctrl;
+    resp->length = ctrl_length;
+
+    switch (req) {
+        case UVC_SET_CUR:
+            uvc_dev.control = cs;
+            resp->length = ctrl_length;
+            break;
+
+        case UVC_GET_MAX:
+            uvc_fill_streaming_control(ctrl, STREAM_CONTROL_MAX, 0, 0);
+            break;
+
+        case UVC_GET_CUR:
+            memcpy(ctrl, target, ctrl_length);
+            break;
+
+        case UVC_GET_MIN:
+        case UVC_GET_DEF:
+            uvc_fill_streaming_control(ctrl, STREAM_CONTROL_MIN, 0, 0);
+            break;
+
+        case UVC_GET_RES:
+            CLEAR(ctrl);
+            break;
+
+        case UVC_GET_LEN:
+            resp->data[0] = 0x00;
+            resp->data[1] = ctrl_length;
+            resp->length = 2;
+            break;
+
+        case UVC_GET_INFO:
+            resp->data[0] = (uint8_t)(UVC_CONTROL_CAP_GET | UVC_CONTROL_CAP_SET);
+            resp->length = 1;
+            break;
+    }
+}
+
+static void uvc_events_process_class(struct usb_ctrlrequest *ctrl, struct uvc_request_data *resp)
+{
+    uint8_t type = ctrl->wIndex & 0xff;
+    uint8_t interface = ctrl->wIndex >> 8;
+    uint8_t control = ctrl->wValue >> 8;
+    uint8_t length = ctrl->wLength;
+
+    if ((ctrl->bRequestType & USB_RECIP_MASK) != USB_RECIP_INTERFACE) {
+        return;
+    }
+
+    switch (type) {
+        case UVC_INTF_CONTROL:
+            switch (interface) {
+                case 0:
+                    if (control == UVC_VC_REQUEST_ERROR_CODE_CONTROL) {
+                        resp->data[0] = uvc_dev.request_error_code;
+                        resp->length = 1;
+                    }
+                    break;
+
+                case 1:
+                    uvc_interface_control(UVC_VC_INPUT_TERMINAL, ctrl->bRequest, control, length, resp);
+                    break;
+
+                case 2:
+                    uvc_interface_control(UVC_VC_PROCESSING_UNIT, ctrl->bRequest, control, length, resp);
+                    break;
+
+                default:
+                    break;
+            }
+            break;
+
+        case UVC_INTF_STREAMING:
+            uvc_events_process_streaming(ctrl->bRequest, control, resp);
+            break;
+
+        default:
+            break;
+    }
+}
+
+static void uvc_events_process_setup(struct usb_ctrlrequest *ctrl, struct uvc_request_data *resp)
+{
+    uvc_dev.control = 0;
+    if ((ctrl->bRequestType & USB_TYPE_MASK) == USB_TYPE_CLASS) {
+        uvc_events_process_class(ctrl, resp);
+    }
+
+    if (uvc_dev.replaying) {
+        uvc_dev.replay_response = *resp;
+        uvc_dev.replay_responded = true;
+        return;
+    }
+
+    if (ioctl(uvc_dev.fd, UVCIOC_SEND_RESPONSE, resp) < 0) {
+        printf("UVCIOC_SEND_RESPONSE failed: %s (%d)\n", strerror(errno), errno);
+        return;
+    }
+
+    if (!uvc_dev.first_response_sent) {
+        uvc_dev.first_response_sent = true;
+        printf("UVC: First response %.3f ms after start\n", monotonic_ms() - start_time);
+    }
+}
+
+static void uvc_events_process_data_control(struct uvc_request_data *data, struct uvc_streaming_control *target)
+{
+    struct uvc_streaming_control *ctrl = (struct uvc_streaming_control *) &data->data;
+    unsigned int iformat = (unsigned int) ctrl->bFormatIndex;
+    unsigned int iframe = (unsigned int) ctrl->bFrameIndex;
+
+    uvc_fill_streaming_control(target, STREAM_CONTROL_SET, iformat, iframe);
+}
+
+static void uvc_events_process_data(struct uvc_request_data *data)
+{
+    int i;
+    printf("UVC: Control %s, length: %d\n", uvc_vs_interface_control_name(uvc_dev.control), data->length);
+
+    switch (uvc_dev.control) {
+        case UVC_VS_PROBE_CONTROL:
+            uvc_events_process_data_control(data, &(uvc_dev.probe));
+            break;
+
+        case UVC_VS_COMMIT_CONTROL:
+            uvc_events_process_data_control(data, &(uvc_dev.commit));
+            break;
+
+        case UVC_VS_CONTROL_UNDEFINED:
+            if (data->length > 0 && data->length <= 4) {
+                for (i = 0; i < control_mapping_size; i++) {
+                    if (control_mapping[i].type == uvc_dev.control_interface &&
+                            control_mapping[i].uvc == uvc_dev.control_type &&
+                            control_mapping[i].enabled
+                       ) {
+                        control_mapping[i].value = 0x00000000;
+                        control_mapping[i].length = data->length;
+                        memcpy(&control_mapping[i].value, data->data, data->length);
+                    }
+                }
+            }
+            break;
+
+        default:
+            printf("UVC: Setting unknown control, length = %d\n", data->length);
+            break;
+    }
+}
+
+static void control_stats_add(const struct timespec *queued)
+{
+    struct control_stats *stats = &uvc_dev.control_stats;
+    double latency = monotonic_ms() - (queued->tv_sec * 1000.0 + queued->tv_nsec / 1000000.0);
+
+    stats->requests++;
+    stats->latency_sum += latency;
+    stats->latency_max = max(stats->latency_max, latency);
+}
+
+/* Called once per second by the thread handling the events */
+static void control_stats_report(double now)
+{
+    struct control_stats *stats = &uvc_dev.control_stats;
+
+    if (stats->requests) {
+        printf("CONTROL: %u request(s), setup to response avg %.3f ms, max %.3f ms\n",
+                stats->requests, stats->latency_sum / stats->requests, stats->latency_max);
+    }
+
+    stats->requests = 0;
+    stats->latency_sum = 0;
+    stats->latency_max = 0;
+    stats->last_report = now;
+}
+
+static const char *uvc_event_names[EVENT_REPLAY_TYPES] = {
+    "CONNECT", "DISCONNECT", "STREAMON", "STREAMOFF", "SETUP", "DATA",
+};
+
+static const char *uvc_event_name(unsigned int type)
+{
+    if (type < UVC_EVENT_FIRST || type - UVC_EVENT_FIRST >= EVENT_REPLAY_TYPES) {
+        return "UNKNOWN";
+    }
+    return uvc_event_names[type - UVC_EVENT_FIRST];
+}
+
+/*
+ * Handle one UVC event, dequeued from the device or replayed from a
+ * recording. Returns the name of its trace span.
+ */
+static const char *uvc_event_handle(struct v4l2_event *v4l2_event)
+{
+    struct uvc_event *uvc_event = (void *) &v4l2_event->u.data;
+    struct uvc_request_data resp;
+    const char *span = "DQEVENT";
+
+    CLEAR(resp);
+    resp.length = -EL2HLT;
+
+    switch (v4l2_event->type) {
+        case UVC_EVENT_CONNECT:
+            span = "DQEVENT CONNECT";
+            USDT_PROBE1(event_connect, uvc_event->speed);
+            printf("%s: UVC_EVENT_CONNECT\n", uvc_dev.device_type_name);
+            uvc_dev.usb_speed = uvc_event->speed;
+            break;
+
+        case UVC_EVENT_DISCONNECT:
+            span = "DQEVENT DISCONNECT";
+            USDT_PROBE0(event_disconnect);
+            printf("%s: UVC_EVENT_DISCONNECT\n", uvc_dev.device_type_name);
+            uvc_shutdown_requested = true;
+            break;
+
+        case UVC_EVENT_SETUP:
+            span = "DQEVENT SETUP";
+            USDT_PROBE5(event_setup, uvc_event->req.bRequestType, uvc_event->req.bRequest,
+                    uvc_event->req.wValue, uvc_event->req.wIndex, uvc_event->req.wLength);
+            uvc_events_process_setup(&uvc_event->req, &resp);
+            if (!uvc_dev.replaying) {
+                control_stats_add(&v4l2_event->timestamp);
+            }
+            break;
+
+        case UVC_EVENT_DATA:
+            span = "DQEVENT DATA";
+            USDT_PROBE2(event_data, uvc_dev.control, uvc_event->data.length);
+            uvc_events_process_data(&uvc_event->data);
+            break;
+
+        case UVC_EVENT_STREAMON:
+            span = "DQEVENT STREAMON";
+            USDT_PROBE0(event_streamon);
+            if (settings.control_thread) {
+                stream_message_post(STREAM_MESSAGE_ON, 0);
+            } else {
+                uvc_handle_streamon_event();
+            }
+            break;
+
+        case UVC_EVENT_STREAMOFF:
+            span = "DQEVENT STREAMOFF";
+            USDT_PROBE0(event_streamoff);
+            if (settings.control_thread) {
+                stream_message_post(STREAM_MESSAGE_OFF, 0);
+            } else {
+                uvc_handle_streamoff_event();
+            }
+            break;
+
+        default:
+            break;
+    }
+
+    USDT_PROBE1(event_done, v4l2_event->type);
+    return span;
+}
+
+/* One EVENT line: kernel timestamp, type and the event data without trailing zeros */
+static void event_record_write(const struct v4l2_event *v4l2_event)
+{
+    unsigned int size = sizeof(v4l2_event->u.data);
+    unsigned int i;
+
+    while (size > 1 && !v4l2_event->u.data[size - 1]) {
+        size--;
+    }
+
+    fprintf(uvc_dev.event_record, "EVENT %ld.%09ld %s ", (long) v4l2_event->timestamp.tv_sec,
+            v4l2_event->timestamp.tv_nsec, uvc_event_name(v4l2_event->type));
+    for (i = 0; i < size; i++) {
+        fprintf(uvc_dev.event_record, "%02x", v4l2_event->u.data[i]);
+    }
+    fprintf(uvc_dev.event_record, "\n");
+    fflush(uvc_dev.event_record);
+}
+
+static void uvc_events_process()
+{
+    struct v4l2_event v4l2_event;
+    const char *span;
+    uint64_t start;
+
+    start = trace_begin();
+    if (ioctl(uvc_dev.fd, VIDIOC_DQEVENT, &v4l2_event) < 0) {
+        printf("%s: VIDIOC_DQEVENT failed: %s (%d)\n",
+                uvc_dev.device_type_name, strerror(errno), errno);
+        return;
+    }
+
+    if (uvc_dev.event_record) {
+        event_record_write(&v4l2_event);
+    }
+
+    span = uvc_event_handle(&v4l2_event);
+    trace_end(span, start);
+}
+
+static void uvc_events(int action)
+{
+    struct v4l2_event_subscription sub;
+    CLEAR(sub);
+
+    sub.type = UVC_EVENT_CONNECT;
+    ioctl(uvc_dev.fd, action, &sub);
+    sub.type = UVC_EVENT_DISCONNECT;
+    ioctl(uvc_dev.fd, action, &sub);
+    sub.type = UVC_EVENT_SETUP;
+    ioctl(uvc_dev.fd, action, &sub);
+    sub.type = UVC_EVENT_DATA;
+    ioctl(uvc_dev.fd, action, &sub);
+    sub.type = UVC_EVENT_STREAMON;
+    ioctl(uvc_dev.fd, action, &sub);
+    sub.type = UVC_EVENT_STREAMOFF;
+    ioctl(uvc_dev.fd, action, &sub);
+}
+
+static void uvc_events_subscribe()
+{
+    uvc_events(VIDIOC_SUBSCRIBE_EVENT);
+}
+
+static void uvc_events_unsubscribe()
+{
+    uvc_events(VIDIOC_UNSUBSCRIBE_EVENT);
+}
+
+/*
+ * UVC event recording and offline replay
+ *
+ * A recording starts with the streaming parameters and the format table read
+ * from configfs, followed by one EVENT line per event:
+ *
+ *   STREAMING maxpacket maxburst interval
+ *   FORMAT speed fourcc name bFormatIndex bFrameIndex wWidth wHeight
+ *          dwDefaultFrameInterval dwMinBitRate dwMaxBitRate dwMaxVideoFrameBufferSize
+ *   EVENT seconds.nanoseconds type hex-data
+ */
+
+static int event_record_open(const char *filename)
+{
+    struct uvc_frame_format *format;
+    int i;
+
+    uvc_dev.event_record = fopen(filename, "w");
+    if (!uvc_dev.event_record) {
+        printf("RECORD: Could not create %s: %s (%d)\n", filename, strerror(errno), errno);
+        return -errno;
+    }
+
+    fprintf(uvc_dev.event_record, "# uvc-gadget UVC event recording\n");
+    fprintf(uvc_dev.event_record, "STREAMING %u %u %u\n", streaming_maxpacket, streaming_maxburst,
+            streaming_interval);
+
+    for (i = 0; i <= last_format_index; i++) {
+        format = &uvc_frame_format[i];
+        fprintf(uvc_dev.event_record, "FORMAT %d 0x%08x %s %u %u %u %u %u %u %u %u\n",
+                format->usb_speed, format->video_format, format->format_name,
+                format->bFormatIndex, format->bFrameIndex, format->wWidth, format->wHeight,
+                format->dwDefaultFrameInterval, format->dwMinBitRate, format->dwMaxBitRate,
+                format->dwMaxVideoFrameBufferSize);
+    }
+
+    printf("RECORD: Recording UVC events to %s\n", filename);
+    return 0;
+}
+
+static int event_replay_parse_event(const char *line, struct v4l2_event *event)
+{
+    char type[16];
+    char data[2 * sizeof(event->u.data) + 1];
+    long seconds, nanoseconds;
+    unsigned int i;
+    unsigned int byte;
+
+    if (sscanf(line, "EVENT %ld.%ld %15s %128s", &seconds, &nanoseconds, type, data) != 4) {
+        return -EINVAL;
+    }
+
+    memset(event, 0, sizeof(*event));
+    event->timestamp.tv_sec = seconds;
+    event->timestamp.tv_nsec = nanoseconds;
+
+    for (i = 0; i < EVENT_REPLAY_TYPES; i++) {
+        if (!strcmp(type, uvc_event_names[i])) {
+            break;
+        }
+    }
+    if (i == EVENT_REPLAY_TYPES) {
+        return -EINVAL;
+    }
+    event->type = UVC_EVENT_FIRST + i;
+
+    for (i = 0; data[2 * i] && data[2 * i + 1] && i < sizeof(event->u.data); i++) {
+        if (sscanf(&data[2 * i], "%2x", &byte) != 1) {
+            return -EINVAL;
+        }
+        event->u.data[i] = byte;
+    }
+    return 0;
+}
+
+static int event_replay_parse_format(const char *line, struct uvc_frame_format *format)
+{
+    char name[32];
+    int speed;
+
+    memset(format, 0, sizeof(*format));
+    if (sscanf(line, "FORMAT %d %i %31s %u %u %u %u %u %u %u %u", &speed, &format->video_format, name,
+                &format->bFormatIndex, &format->bFrameIndex, &format->wWidth, &format->wHeight,
+                &format->dwDefaultFrameInterval, &format->dwMinBitRate, &format->dwMaxBitRate,
+                &format->dwMaxVideoFrameBufferSize) != 11) {
+        return -EINVAL;
+    }
+
+    format->usb_speed = speed;
+    snprintf(format->format_name, sizeof(format->format_name), "%s", name);
+    format->defined = true;
+    return 0;
+}
+
+static int event_replay_load(const char *filename, struct v4l2_event **events, unsigned int *count)
+{
+    char line[EVENT_RECORD_LINE];
+    unsigned int formats = 0;
+    unsigned int lineno = 0;
+    struct v4l2_event *grown;
+    FILE *fp;
+    int ret = 0;
+
+    *events = NULL;
+    *count = 0;
+
+    fp = fopen(filename, "r");
+    if (!fp) {
+        printf("REPLAY: Could not open %s: %s (%d)\n", filename, strerror(errno), errno);
+        return -errno;
+    }
+
+    while (fgets(line, sizeof(line), fp)) {
+        lineno++;
+
+        if (!strncmp(line, "EVENT ", 6)) {
+            grown = realloc(*events, (*count + 1) * sizeof(**events));
+            if (!grown) {
+                ret = -ENOMEM;
+                break;
+            }
+            *events = grown;
+            ret = event_replay_parse_event(line, &(*events)[*count]);
+            (*count)++;
+
+        } else if (!strncmp(line, "FORMAT ", 7)) {
+            if (formats >= ARRAY_SIZE(uvc_frame_format)) {
+                printf("REPLAY: Too many formats, line %u\n", lineno);
+                ret = -EINVAL;
+                break;
+            }
+            ret = event_replay_parse_format(line, &uvc_frame_format[formats++]);
+
+        } else if (!strncmp(line, "STREAMING ", 10)) {
+            if (sscanf(line, "STREAMING %u %u %u", &streaming_maxpacket, &streaming_maxburst,
+                        &streaming_interval) != 3) {
+                ret = -EINVAL;
+            }
+        }
+
+        if (ret < 0) {
+            printf("REPLAY: Invalid line %u in %s\n", lineno, filename);
+            break;
+        }
+    }
+    fclose(fp);
+
+    if (!ret && !formats) {
+        printf("REPLAY: No formats in %s\n", filename);
+        ret = -EINVAL;
+    }
+    if (ret < 0) {
+        free(*events);
+        *events = NULL;
+        return ret;
+    }
+
+    last_format_index = formats - 1;
+    return 0;
+}
+
+static void event_replay_print(unsigned int index, struct v4l2_event *event, double latency)
+{
+    struct uvc_event *uvc_event = (void *) &event->u.data;
+    struct uvc_request_data *data = NULL;
+    int i;
+
+    printf("REPLAY: %4u %-10s %8.2f us", index, uvc_event_name(event->type), latency);
+
+    switch (event->type) {
+        case UVC_EVENT_SETUP:
+            printf(" %02x %02x %04x %04x %04x %s", uvc_event->req.bRequestType, uvc_event->req.bRequest,
+                    uvc_event->req.wValue, uvc_event->req.wIndex, uvc_event->req.wLength,
+                    uvc_request_code_name(uvc_event->req.bRequest));
+            if (uvc_dev.replay_responded) {
+                data = &uvc_dev.replay_response;
+            }
+            break;
+
+        case UVC_EVENT_DATA:
+            data = &uvc_event->data;
+            break;
+
+        case UVC_EVENT_CONNECT:
+            printf(" speed %d", uvc_event->speed);
+            break;
+    }
+
+    if (data && data->length < 0) {
+        printf(" -> STALL");
+    } else if (data) {
+        printf(" %s %d:", (event->type == UVC_EVENT_DATA) ? "<-" : "->", data->length);
+        for (i = 0; i < data->length && i < (int) sizeof(data->data); i++) {
+            printf(" %02x", data->data[i]);
+        }
+    }
+    printf("\n");
+}
+
+/* Device state for handling events without a device, formats of the recording */
+static int event_replay_setup(const char *filename, struct v4l2_event **events, unsigned int *count)
+{
+    int ret;
+
+    memset(&uvc_dev, 0, sizeof(uvc_dev));
+    uvc_dev.fd = -1;
+    uvc_dev.device_type_name = "REPLAY";
+    uvc_dev.replaying = true;
+    settings.control_thread = false;
+
+    ret = event_replay_load(filename, events, count);
+    if (ret < 0) {
+        return ret;
+    }
+
+    /* Frame sizes of the probe control from the image source, when given */
+    if (image_dev.image_file_count) {
+        image_dev.image_set = image_set_create(NULL);
+        if (image_dev.image_set) {
+            image_source_size_init(image_dev.image_set);
+            image_frame_sizes_init();
+        }
+    }
+
+    uvc_fill_streaming_control(&(uvc_dev.probe), STREAM_CONTROL_INIT, 0, 0);
+    uvc_fill_streaming_control(&(uvc_dev.commit), STREAM_CONTROL_INIT, 0, 0);
+    return 0;
+}
+
+/*
+ * Feed a recording to the event handlers without a device and report the
+ * handling time and the response of every request
+ */
+static int event_replay(const char *filename)
+{
+    struct latency_stats stats[EVENT_REPLAY_TYPES];
+    struct v4l2_event *events;
+    unsigned int count;
+    unsigned int type;
+    unsigned int i;
+    double start;
+    double latency;
+    int ret;
+
+    memset(stats, 0, sizeof(stats));
+
+    ret = event_replay_setup(filename, &events, &count);
+    if (ret < 0) {
+        return ret;
+    }
+
+    printf("REPLAY: %u events from %s\n", count, filename);
+
+    for (i = 0; i < count; i++) {
+        type = events[i].type - UVC_EVENT_FIRST;
+
+        /* Stream events need the device */
+        if (events[i].type == UVC_EVENT_STREAMON || events[i].type == UVC_EVENT_STREAMOFF) {
+            printf("REPLAY: %4u %-10s not replayed\n", i, uvc_event_name(events[i].type));
+            continue;
+        }
+
+        uvc_dev.replay_responded = false;
+        start = monotonic_ms();
+        uvc_event_handle(&events[i]);
+        latency = (monotonic_ms() - start) * 1000;
+
+        latency_add(&stats[type], latency);
+        event_replay_print(i, &events[i], latency);
+    }
+
+    for (type = 0; type < EVENT_REPLAY_TYPES; type++) {
+        if (stats[type].count) {
+            printf("REPLAY: %-10s %4u events, avg %.2f us, max %.2f us\n", uvc_event_names[type],
+                    stats[type].count, stats[type].sum / stats[type].count, stats[type].max);
+        }
+    }
+
+    free(events);
+    if (image_dev.image_set) {
+        image_set_free(image_dev.image_set);
+    }
+    return 0;
+}
+
+/*
+ * Soak mode
+ */
+
+static void soak_setup_event(uint8_t type, uint8_t req, unsigned int cs, unsigned int index, unsigned int length)
+{
+    struct v4l2_event event;
+    struct uvc_event *uvc_event = (void *) &event.u.data;
+
+    memset(&event, 0, sizeof(event));
+    event.type = UVC_EVENT_SETUP;
+    uvc_event->req.bRequestType = type;
+    uvc_event->req.bRequest = req;
+    uvc_event->req.wValue = cs << 8;
+    uvc_event->req.wIndex = index;
+    uvc_event->req.wLength = length;
+    uvc_event_handle(&event);
+}
+
+static void soak_data_event(const void *data, unsigned int length)
+{
+    struct v4l2_event event;
+    struct uvc_event *uvc_event = (void *) &event.u.data;
+
+    memset(&event, 0, sizeof(event));
+    event.type = UVC_EVENT_DATA;
+    uvc_event->data.length = length;
+    memcpy(uvc_event->data.data, data, length);
+    uvc_event_handle(&event);
+}
+
+/* Probe and commit a random frame of the format table, the way hosts do */
+static void soak_negotiate()
+{
+    struct uvc_frame_format *format = &uvc_frame_format[rand() % (last_format_index + 1)];
+    struct uvc_streaming_control ctrl;
+    unsigned int cs;
+
+    memset(&ctrl, 0, sizeof(ctrl));
+    ctrl.bmHint = 1;
+    ctrl.bFormatIndex = format->bFormatIndex;
+    ctrl.bFrameIndex = format->bFrameIndex;
+    ctrl.dwFrameInterval = format->dwDefaultFrameInterval;
+
+    for (cs = UVC_VS_PROBE_CONTROL; cs <= UVC_VS_COMMIT_CONTROL; cs++) {
+        soak_setup_event(USB_TYPE_CLASS | USB_RECIP_INTERFACE, UVC_SET_CUR, cs, UVC_INTF_STREAMING,
+                sizeof(ctrl));
+        soak_data_event(&ctrl, sizeof(ctrl));
+        soak_setup_event(USB_DIR_IN | USB_TYPE_CLASS | USB_RECIP_INTERFACE, UVC_GET_CUR, cs,
+                UVC_INTF_STREAMING, sizeof(ctrl));
+    }
+}
+
+/* Set a random control of the processing unit to a random value and read it back */
+static void soak_change_control()
+{
+    struct control_mapping_pair *control = &control_mapping[rand() % control_mapping_size];
+    unsigned int index = (control->type == UVC_VC_INPUT_TERMINAL) ? 1 : 2;
+    uint16_t value = rand() % 256;
+
+    soak_setup_event(USB_TYPE_CLASS | USB_RECIP_INTERFACE, UVC_SET_CUR, control->uvc,
+            index << 8 | UVC_INTF_CONTROL, sizeof(value));
+    soak_data_event(&value, sizeof(value));
+    soak_setup_event(USB_DIR_IN | USB_TYPE_CLASS | USB_RECIP_INTERFACE, UVC_GET_CUR, control->uvc,
+            index << 8 | UVC_INTF_CONTROL, sizeof(value));
+}
+
+/*
+ * One stream cycle of the committed format through the STREAMON and STREAMOFF
+ * handlers, with a random number of frames through the streaming loop in
+ * between. The buffers are queued to the replay's stand-in for the device.
+ * Only frames that were copied into their buffer are timed: a frame the
+ * buffer already holds costs next to nothing and would hide a slower copy.
+ */
+static void soak_stream(double *latencies, unsigned int *count)
+{
+    unsigned int frames = 1 + rand() % SOAK_MAX_STREAM_FRAMES;
+    unsigned long long fills, hits;
+    double start;
+    unsigned int i;
+
+    uvc_handle_streamon_event();
+
+    for (i = 0; i < frames && uvc_dev.is_streaming; i++) {
+        fills = uvc_dev.dedup_stats.fills;
+        hits = uvc_dev.dedup_stats.hits;
+
+        start = monotonic_ms();
+        uvc_image_video_process();
+        if (uvc_dev.dedup_stats.fills != fills && uvc_dev.dedup_stats.hits == hits &&
+                *count < SOAK_MAX_FRAMES) {
+            latencies[(*count)++] = monotonic_ms() - start;
+        }
+    }
+
+    uvc_handle_streamoff_event();
+}
+
+static int soak_count_fds()
+{
+    struct dirent *entry;
+    int count = 0;
+    DIR *dir;
+
+    dir = opendir("/proc/self/fd");
+    if (!dir) {
+        return -1;
+    }
+
+    while ((entry = readdir(dir))) {
+        if (entry->d_name[0] != '.') {
+            count++;
+        }
+    }
+    closedir(dir);
+
+    /* Without the descriptor of the directory itself */
+    return count - 1;
+}
+
+static void soak_take_sample(struct soak_sample *sample, double *latencies, unsigned int count)
+{
+    struct mallinfo2 info = mallinfo2();
+    long pages = 0;
+    FILE *fp;
+
+    fp = fopen("/proc/self/statm", "r");
+    if (fp) {
+        if (fscanf(fp, "%*s %ld", &pages) != 1) {
+            pages = 0;
+        }
+        fclose(fp);
+    }
+
+    sample->rss_kb = pages * (sysconf(_SC_PAGESIZE) / 1024);
+    sample->heap = info.uordblks + info.hblkhd;
+    sample->heap_blocks = info.ordblks + info.hblks;
+    sample->fds = soak_count_fds();
+    sample->p99 = 0;
+
+    if (count) {
+        qsort(latencies, count, sizeof(*latencies), compare_double);
+        sample->p99 = latencies[(count - 1) * 99 / 100];
+    }
+}
+
+static bool soak_check_drift(const struct soak_sample *base, const struct soak_sample *sample)
+{
+    bool drift = false;
+
+    if (sample->rss_kb - base->rss_kb > SOAK_RSS_DRIFT_KB) {
+        fprintf(stderr, "SOAK: RSS grew by %ld KiB\n", sample->rss_kb - base->rss_kb);
+        drift = true;
+    }
+    if (sample->heap > base->heap + SOAK_HEAP_DRIFT) {
+        fprintf(stderr, "SOAK: Heap grew by %zu bytes\n", sample->heap - base->heap);
+        drift = true;
+    }
+    if (sample->heap_blocks > base->heap_blocks + SOAK_HEAP_CHUNKS_DRIFT) {
+        fprintf(stderr, "SOAK: Heap grew from %zu to %zu chunks\n", base->heap_blocks, sample->heap_blocks);
+        drift = true;
+    }
+    if (sample->fds != base->fds) {
+        fprintf(stderr, "SOAK: %d file descriptors open, %d at start\n", sample->fds, base->fds);
+        drift = true;
+    }
+    if (sample->p99 > base->p99 * SOAK_LATENCY_DRIFT + SOAK_LATENCY_DRIFT_MIN_MS) {
+        fprintf(stderr, "SOAK: p99 frame latency %.3f ms, %.3f ms at start\n", sample->p99, base->p99);
+        drift = true;
+    }
+    return drift;
+}
+
+/*
+ * Run random negotiation, control and stream traffic on the formats of a
+ * recording for the given time. Resources and the p99 frame latency are
+ * sampled every period and compared with the first sample, taken once the
+ * frame set and the buffer pool are allocated. The report goes to stderr,
+ * the handlers keep logging to stdout.
+ */
+static int soak_run(const char *filename, unsigned int seconds)
+{
+    unsigned int period = clamp(seconds / 10, 1u, (unsigned int) SOAK_SAMPLE_SECONDS);
+    struct soak_sample base = { 0 }, sample;
+    struct v4l2_event *events;
+    unsigned int latency_count = 0;
+    unsigned int samples = 0;
+    unsigned int seed = time(NULL);
+    double *latencies;
+    double end, next_sample;
+    bool failed = false;
+    unsigned int i;
+    int ret;
+
+    ret = event_replay_setup(filename, &events, &i);
+    if (ret < 0) {
+        return ret;
+    }
+    free(events);
+
+    /* Streams go to the stand-in for the device, see replay_ioctl() */
+    uvc_dev.device_type = DEVICE_TYPE_UVC;
+    uvc_dev.buffer_type = V4L2_BUF_TYPE_VIDEO_OUTPUT;
+    uvc_dev.memory_type = V4L2_MEMORY_USERPTR;
+    uvc_dev.nbufs = settings.nbufs;
+
+    /* The mock device supports every control */
+    for (i = 0; i < (unsigned int) control_mapping_size; i++) {
+        control_mapping[i].enabled = true;
+        control_mapping[i].minimum = 0;
+        control_mapping[i].maximum = 255;
+        control_mapping[i].step = 1;
+        control_mapping[i].default_value = 128;
+        control_mapping[i].value = 128;
+    }
+
+    if (image_dev.image_set && buffer_pool_reserve(&uvc_dev.pool,
+                (settings.nbufs_auto) ? QUEUE_DEPTH_MAX : settings.nbufs,
+                image_set_max_frame_size(image_dev.image_set)) < 0) {
+        return -ENOMEM;
+    }
+
+    latencies = malloc(SOAK_MAX_FRAMES * sizeof(*latencies));
+    if (!latencies) {
+        return -ENOMEM;
+    }
+
+    srand(seed);
+    fprintf(stderr, "SOAK: %u s on %s, seed %u, sample every %u s\n", seconds, filename, seed, period);
+
+    end = monotonic_ms() + seconds * 1000.0;
+    next_sample = monotonic_ms() + period * 1000.0;
+
+    while (!terminate && monotonic_ms() < end) {
+        switch (rand() % 3) {
+            case 0:
+                soak_negotiate();
+                break;
+
+            case 1:
+                soak_change_control();
+                break;
+
+            case 2:
+                soak_stream(latencies, &latency_count);
+                break;
+        }
+
+        if (monotonic_ms() < next_sample) {
+            continue;
+        }
+
+        soak_take_sample(&sample, latencies, latency_count);
+        fprintf(stderr, "SOAK: %4u s, RSS %ld KiB, heap %zu bytes in %zu chunks, %d fds, p99 frame %.3f ms "
+                "over %u copied frames, %.0f%% copies skipped\n", ++samples * period, sample.rss_kb,
+                sample.heap, sample.heap_blocks, sample.fds, sample.p99, latency_count,
+                100.0 * uvc_dev.dedup_stats.hits / max(uvc_dev.dedup_stats.fills, 1ULL));
+        CLEAR(uvc_dev.dedup_stats);
+
+        if (samples == 1) {
+            base = sample;
+        } else if (soak_check_drift(&base, &sample)) {
+            failed = true;
+            break;
+        }
+
+        latency_count = 0;
+        next_sample += period * 1000.0;
+    }
+
+    free(latencies);
+    overlay_free();
+    buffer_pool_release(&uvc_dev.pool);
+    if (image_dev.image_set) {
+        image_set_free(image_dev.image_set);
+    }
+
+    fprintf(stderr, "SOAK: %s\n", (failed) ? "FAILED" : "PASSED");
+    return (failed) ? -EINVAL : 0;
+}
+
+/*
+ * Control thread: handles the UVC events as soon as they are signalled
+ * (POLLPRI), so control requests are answered while frames are filled
+ */
+static void *control_thread_main(void *arg)
+{
+    struct epoll_event event;
+    uint64_t start;
+    double now;
+    int epfd;
+    int ret;
+
+    (void) arg;
+
+    thread_block_signals();
+
+    if (settings.trace_file) {
+        trace_thread_register("control");
+    }
+
+    epfd = epoll_create1(EPOLL_CLOEXEC);
+    if (epfd < 0) {
+        printf("CONTROL: epoll_create1 failed: %s (%d)\n", strerror(errno), errno);
+        return NULL;
+    }
+
+    CLEAR(event);
+    event.events = EPOLLPRI;
+    event.data.fd = uvc_dev.fd;
+    if (epoll_ctl(epfd, EPOLL_CTL_ADD, uvc_dev.fd, &event) < 0) {
+        printf("CONTROL: epoll_ctl failed: %s (%d)\n", strerror(errno), errno);
+        close(epfd);
+        return NULL;
+    }
+
+    while (!terminate) {
+        start = trace_begin();
+        ret = epoll_wait(epfd, &event, 1, 200);
+        trace_end("epoll_wait", start);
+        if (ret < 0 && errno != EINTR) {
+            printf("CONTROL: epoll_wait failed: %s (%d)\n", strerror(errno), errno);
+            break;
+        }
+
+        if (ret > 0) {
+            uvc_events_process();
+        }
+
+        now = monotonic_ms();
+        if (settings.show_fps && now - uvc_dev.control_stats.last_report >= 1000) {
+            control_stats_report(now);
+        }
+    }
+
+    close(epfd);
+    return NULL;
+}
+
+static int control_thread_start()
+{
+    struct sched_param param;
+    pthread_attr_t attr;
+    cpu_set_t cpus;
+    int ret;
+
+    if (pipe2(uvc_dev.message_pipe, O_NONBLOCK | O_CLOEXEC) < 0) {
+        printf("CONTROL: Could not create the message pipe: %s (%d)\n", strerror(errno), errno);
+        return -errno;
+    }
+
+    pthread_attr_init(&attr);
+    if (settings.control_priority) {
+        CLEAR(param);
+        param.sched_priority = settings.control_priority;
+        pthread_attr_setinheritsched(&attr, PTHREAD_EXPLICIT_SCHED);
+        pthread_attr_setschedpolicy(&attr, SCHED_FIFO);
+        pthread_attr_setschedparam(&attr, &param);
+    }
+
+    ret = pthread_create(&uvc_dev.control_thread, &attr, control_thread_main, NULL);
+    if (ret == EPERM && settings.control_priority) {
+        printf("CONTROL: No permission for SCHED_FIFO priority %d, using default scheduling\n",
+                settings.control_priority);
+        ret = pthread_create(&uvc_dev.control_thread, NULL, control_thread_main, NULL);
+    }
+    pthread_attr_destroy(&attr);
+
+    if (ret) {
+        printf("CONTROL: Could not start the control thread: %s (%d)\n", strerror(ret), ret);
+        return -ret;
+    }
+
+    if (settings.control_cpu >= 0) {
+        CPU_ZERO(&cpus);
+        CPU_SET(settings.control_cpu, &cpus);
+        ret = pthread_setaffinity_np(uvc_dev.control_thread, sizeof(cpus), &cpus);
+        if (ret) {
+            printf("CONTROL: Could not pin the control thread to CPU %d: %s (%d)\n",
+                    settings.control_cpu, strerror(ret), ret);
+        }
+    }
+
+    printf("CONTROL: Thread started (priority %d, CPU %d)\n", settings.control_priority, settings.control_cpu);
+    return 0;
+}
+
+
+/*
+ * main processing loop
+ */
+static void processing_loop_image_uvc() 
+{
+    struct timeval video_tv;
+    int activity;
+    double next_frame_time = 0;
+    double last_time_blink = 0;
+    bool blink_state = false;
+    uint64_t start;
+    double now;
+    fd_set fdsu;
+
+    int frame_interval = (1000 / settings.image_framerate);
+
+    printf("PROCESSING LOOP: IMAGE -> UVC\n");
+
+    while (!terminate) {
+        if (trace_requested) {
+            trace_requested = 0;
+            trace_write(settings.trace_file);
+        }
+
+        FD_ZERO(&fdsu);
+        FD_SET(uvc_dev.fd, &fdsu);
+
+        fd_set efds = fdsu;
+        fd_set dfds = fdsu;
+        fd_set rfds;
+
+        /* The control thread handles the events and forwards stream events through the pipe */
+        FD_ZERO(&rfds);
+        if (settings.control_thread) {
+            FD_ZERO(&efds);
+            FD_SET(uvc_dev.message_pipe[0], &rfds);
+        }
+
+        nanosleep ((const struct timespec[]) { {0, 1000000L} }, NULL);
+
+        start = trace_begin();
+        activity = select(max(uvc_dev.fd, uvc_dev.message_pipe[0]) + 1, &rfds, &dfds, &efds, NULL);
+        trace_end("select", start);
+
+        if (activity == -1) {
+            printf("PROCESSING: Select error %d, %s\n", errno, strerror(errno));
+            if (EINTR == errno) {
+                continue;
+            }
+            break;
+        }
+
+        if (activity == 0) {
+            printf("PROCESSING: Select timeout\n");
+            break;
+        }
+
+        if (FD_ISSET(uvc_dev.fd, &efds)) {
+            uvc_events_process();
+        }
+
+        if (settings.control_thread && FD_ISSET(uvc_dev.message_pipe[0], &rfds)) {
+            stream_messages_process();
+        }
+
+        if (image_dev.preparing) {
+            image_prepare_adopt(false);
+        }
+
+        gettimeofday(&video_tv, 0);
+        now = (video_tv.tv_sec + (video_tv.tv_usec * 1e-6)) * 1000;
+
+        if (FD_ISSET(uvc_dev.fd, &dfds)) {
+            if (now >= next_frame_time) {
+                if (next_frame_time && uvc_dev.is_streaming && now - next_frame_time > frame_interval) {
+                    uvc_dev.queue_stats.missed++;
+                }
+                uvc_image_video_process();
+                next_frame_time = now + frame_interval;
+            }
+        }
+
+        if (settings.lock_memory) {
+            rt_check_page_faults(now);
+        }
+
+        if (settings.show_fps) {
+            if (now - uvc_dev.last_time_video_process >= 1000) {
+                printf("FPS: %d\n", uvc_dev.buffers_processed);
+                if (!settings.control_thread) {
+                    control_stats_report(now);
+                }
+                if (settings.nbufs_auto && uvc_dev.is_streaming) {
+                    printf("QUEUE: depth %u, underruns %llu, EAGAIN %llu, missed %llu\n",
+                            uvc_dev.nbufs, uvc_dev.queue_stats.underruns, uvc_dev.queue_stats.eagain,
+                            uvc_dev.queue_stats.missed);
+                }
+                if (uvc_dev.rotation_length && uvc_dev.rotation_out_of_order) {
+                    printf("ROTATION: %llu buffer(s) returned out of phase\n", uvc_dev.rotation_out_of_order);
+                }
+                if (uvc_dev.dedup_stats.fills) {
+                    printf("DEDUP: %llu of %llu fill(s) found the frame in the buffer (%.0f%%), %.1f MiB not copied\n",
+                            uvc_dev.dedup_stats.hits, uvc_dev.dedup_stats.fills,
+                            100.0 * uvc_dev.dedup_stats.hits / uvc_dev.dedup_stats.fills,
+                            uvc_dev.dedup_stats.bytes_saved / 1048576.0);
+                    CLEAR(uvc_dev.dedup_stats);
+                }
+                if (uvc_dev.overlay.frames) {
+                    printf("OVERLAY: %llu frame(s), %.1f cells and %.1f KiB rendered per frame\n",
+                            uvc_dev.overlay.frames,
+                            (double) uvc_dev.overlay.cells_rendered / uvc_dev.overlay.frames,
+                            uvc_dev.overlay.bytes_rendered / 1024.0 / uvc_dev.overlay.frames);
+                    uvc_dev.overlay.frames = 0;
+                    uvc_dev.overlay.cells_rendered = 0;
+                    uvc_dev.overlay.bytes_rendered = 0;
+                }
+                if (uvc_dev.latency_total.count) {
+                    printf("LATENCY: produce->qbuf avg %.2f ms max %.2f ms, "
+                            "qbuf->dqbuf avg %.2f ms max %.2f ms, "
+                            "total avg %.2f ms max %.2f ms, sent frame %llu, dropped %llu\n",
+                            uvc_dev.latency_produce.sum / max(uvc_dev.latency_produce.count, 1u),
+                            uvc_dev.latency_produce.max,
+                            uvc_dev.latency_queue.sum / uvc_dev.latency_queue.count,
+                            uvc_dev.latency_queue.max,
+                            uvc_dev.latency_total.sum / uvc_dev.latency_total.count,
+                            uvc_dev.latency_total.max,
+                            uvc_dev.sent_sequence, uvc_dev.frames_dropped);
+                }
+                uvc_dev.buffers_processed = 0;
+                CLEAR(uvc_dev.latency_produce);
+                CLEAR(uvc_dev.latency_queue);
+                CLEAR(uvc_dev.latency_total);
+                uvc_dev.last_time_video_process = now;
+            }
+        }
+
+        if (settings.blink_on_startup > 0) {
+            if (now - last_time_blink >= 100) {
+                blink_state = !(blink_state);
+                streaming_status_value(blink_state);
+                last_time_blink = now;
+                if (!blink_state) {
+                    settings.blink_on_startup -= 1;
+                }
+            }
+        }
+    }
+}
+
+static int init()
+{
+    int ret;
+
+    memset(&uvc_dev, 0, sizeof(uvc_dev));
+
+    /* Before allocating, so all memory is locked */
+    rt_apply_settings();
+
+    if (settings.record_file && event_record_open(settings.record_file) < 0) {
+        goto err;
+    }
+
+    streaming_status_enable();
+
+    /* Open the UVC device. */
+    ret = uvc_open(settings.uvc_devname, settings.nbufs);
+    if (ret < 0) {
+        goto err;
+    }
+
+    if (settings.source_device == DEVICE_TYPE_IMAGE) {
+        /* Probe values from the frame descriptors until the source is prepared */
+        image_frame_sizes_init();
+
+        if (image_prepare_start() < 0) {
+            goto err;
+        }
+
+        if (settings.nbufs_auto) {
+            queue_depth_load();
+        }
+    } else {
+        /* Unknown device type */
+        goto err;
+    }
+
+    /* Init UVC events. */
+    uvc_fill_streaming_control(&(uvc_dev.probe), STREAM_CONTROL_INIT, 0, 0);
+    uvc_fill_streaming_control(&(uvc_dev.commit), STREAM_CONTROL_INIT, 0, 0);
+
+    uvc_events_subscribe();
+
+    if (settings.trace_file) {
+        trace_thread_register("streaming");
+    }
+
+    if (settings.control_thread && control_thread_start() < 0) {
+        goto err;
+    }
+
+    if (settings.source_device == DEVICE_TYPE_IMAGE) {
+        processing_loop_image_uvc();
+    }
+
+    if (settings.control_thread) {
+        pthread_join(uvc_dev.control_thread, NULL);
+    }
+
+    if (settings.trace_file) {
+        trace_write(settings.trace_file);
+    }
+
+    uvc_events_unsubscribe();
+
+    printf("\n*** UVC GADGET SHUTDOWN ***\n");
+
+    uvc_handle_streamoff_event();
+
+err:
+    /* The prepare thread allocates the buffer pool */
+    if (image_dev.preparing) {
+        pthread_join(image_dev.prepare_thread, NULL);
+        image_dev.preparing = false;
+    }
+
+    uvc_close();
+    overlay_free();
+    buffer_pool_release(&uvc_dev.pool);
+
+    if (uvc_dev.event_record) {
+        fclose(uvc_dev.event_record);
+    }
+
+    printf("*** UVC GADGET EXIT ***\n");
+    return 1;
+}
+
+static int find_text_pos(const char *s, const char *f)
+{
+    char *p = strstr(s, f);
+    return (p) ? p - s : 0;
+}
+
+static int configfs_read_value(const char *path)
+{
+    char buf[20];
+    int fd;
+    int ret;
+
+    fd = open(path, O_RDONLY); 
+    if (fd == -1) {
+        return -ENOENT;
+    }
+    ret = read(fd, buf, 20);
+    close(fd);
+
+    if (ret < 0 || ret > 10) {
+        return -ENODATA;
+    }
+    buf[ret] = '\0';
+    return strtol(buf, NULL, 10);
+}
+
+static void set_uvc_format_index(enum usb_device_speed usb_speed, int video_format,
+        unsigned int bFormatIndex)
+{
+    int i;
+    for (i = 0; i <= last_format_index; i++) {
+        if (uvc_frame_format[i].usb_speed == usb_speed &&
+                uvc_frame_format[i].video_format == video_format
+           ) {
+            uvc_frame_format[i].bFormatIndex = bFormatIndex;
+        }
+    }
+}
+
+static void set_uvc_format_value(const char *key_word, unsigned int index, int value)
+{
+    if (!strncmp(key_word, "dwDefaultFrameInterval", 22)) {
+        uvc_frame_format[index].dwDefaultFrameInterval = value;
+
+    } else if (!strncmp(key_word, "dwMaxVideoFrameBufferSize", 25)) {
+        uvc_frame_format[index].dwMaxVideoFrameBufferSize = value;
+
+    } else if (!strncmp(key_word, "dwMaxBitRate", 12)) {
+        uvc_frame_format[index].dwMaxBitRate = value;
+
+    } else if (!strncmp(key_word, "dwMinBitRate", 12)) {
+        uvc_frame_format[index].dwMinBitRate = value;
+
+    } else if (!strncmp(key_word, "wHeight", 7)) {
+        uvc_frame_format[index].wHeight = value;
+
+    } else if (!strncmp(key_word, "wWidth", 6)) {
+        uvc_frame_format[index].wWidth = value;
+
+    } else if (!strncmp(key_word, "bmCapabilities", 14)) {
+        uvc_frame_format[index].bmCapabilities = value;
+
+    } else if (!strncmp(key_word, "bFrameIndex", 11)) {
+        uvc_frame_format[index].bFrameIndex = value;
+
+    }
+}
+
+static int configfs_usb_speed(const char *speed)
+{
+    if (!strncmp(speed, "fs", 2)) {
+        return USB_SPEED_FULL;
+
+    } else if (!strncmp(speed, "hs", 2)) {
+        return USB_SPEED_HIGH;
+
+    } else if (!strncmp(speed, "ss", 2)) {
+        return USB_SPEED_SUPER;
+
+    }
+    return USB_SPEED_UNKNOWN;
+}
+
+static int configfs_read_guid(const char *path, uint8_t *guid)
+{
+    int fd;
+    int ret;
+
+    fd = open(path, O_RDONLY);
+    if (fd == -1) {
+        return -ENOENT;
+    }
+    ret = read(fd, guid, 16);
+    close(fd);
+
+    return (ret == 16) ? 0 : -ENODATA;
+}
+
+static int configfs_guid_video_format(const uint8_t *guid, int bits_per_pixel)
+{
+    unsigned int i;
+
+    for (i = 0; i < ARRAY_SIZE(uvc_guid_formats); i++) {
+        if (memcmp(uvc_guid_formats[i].guid, guid, 16)) {
+            continue;
+        }
+
+        if (bits_per_pixel > 0 && bits_per_pixel != (int) uvc_guid_formats[i].bits_per_pixel) {
+            printf("CONFIGFS: Format %s with %d bits per pixel, expected %d\n",
+                    uvc_guid_formats[i].name, bits_per_pixel, uvc_guid_formats[i].bits_per_pixel);
+        }
+        return uvc_guid_formats[i].video_format;
+    }
+
+    printf("CONFIGFS: Unknown guidFormat %02x%02x%02x%02x-..., %d bits per pixel\n",
+            guid[3], guid[2], guid[1], guid[0], bits_per_pixel);
+
+    switch (bits_per_pixel) {
+        case 8:
+            return V4L2_PIX_FMT_GREY;
+
+        case 10:
+            return V4L2_PIX_FMT_Y10P;
+
+        case 12:
+            return V4L2_PIX_FMT_NV12;
+
+        case 16:
+            return V4L2_PIX_FMT_YUYV;
+    }
+    return 0;
+}
+
+static int configfs_video_format(const char *format, const char *format_path)
+{
+    static char last_format_path[PATH_MAX];
+    static int last_video_format;
+    char path[PATH_MAX + 16];
+    uint8_t guid[16];
+
+    /* guidFormat and bBitsPerPixel are shared by all frames of a format */
+    if (!strcmp(format_path, last_format_path)) {
+        return last_video_format;
+    }
+
+    if (snprintf(path, sizeof(path), "%s/guidFormat", format_path) >= (int) sizeof(path)) {
+        return 0;
+    }
+
+    if (!configfs_read_guid(path, guid)) {
+        strcpy(path + strlen(format_path), "/bBitsPerPixel");
+        last_video_format = configfs_guid_video_format(guid, configfs_read_value(path));
+
+    } else if (!strncmp(format, "m", 1)) {
+        last_video_format = V4L2_PIX_FMT_MJPEG;
+
+    } else if (!strncmp(format, "u", 1)) {
+        last_video_format = V4L2_PIX_FMT_YUYV;
+
+    } else {
+        last_video_format = 0;
+    }
+
+    strcpy(last_format_path, format_path);
+    return last_video_format;
+}
+
+static void configfs_fill_formats(const char *path, const char *part)
+{
+    int index = 0;
+    int value = 0;
+    enum usb_device_speed usb_speed;
+    int video_format;
+    const char *format_name;
+    char format_path[PATH_MAX];
+    char *copy = strdup(part);
+    char *token = strtok(copy, "/");
+    char *array[10];
+
+    while (token != NULL)
+    {
+        array[index++] = token;
+        token = strtok (NULL, "/");
+    }
+
+    if (index > 3) {
+        format_name = array[3];
+
+        usb_speed = configfs_usb_speed(array[0]);
+        if (usb_speed == USB_SPEED_UNKNOWN) {
+            printf("CONFIGFS: Unsupported USB speed: (%s) %s\n", array[0], path);
+            goto free;
+        }
+
+        snprintf(format_path, sizeof(format_path), "%.*s%s/%s/%s",
+                (int) (part - path), path, array[0], array[1], array[2]);
+
+        video_format = configfs_video_format(array[2], format_path);
+        if (video_format == 0) {
+            printf("CONFIGFS: Unsupported format: (%s) %s\n", array[2], path);
+            goto free;
+        }
+
+        value = configfs_read_value(path);
+        if (value < 0) {
+            goto free;
+        }
+
+        if (!strncmp(array[index - 1], "bFormatIndex", 12)) {
+            set_uvc_format_index(usb_speed, video_format, value);
+            goto free;
+        }
+
+        if (index != 5) {
+            goto free;
+        }
+
+        if (
+                uvc_frame_format[last_format_index].usb_speed != usb_speed ||
+                uvc_frame_format[last_format_index].video_format != video_format ||
+                strncmp(uvc_frame_format[last_format_index].format_name, format_name, strlen(format_name))
+           ) {
+            if (uvc_frame_format[last_format_index].defined) {
+                last_format_index++;
+
+                /* too much defined formats */
+                if (last_format_index > 29) {
+                    goto free;
+                }
+            }
+
+            uvc_frame_format[last_format_index].usb_speed = usb_speed;
+            uvc_frame_format[last_format_index].video_format = video_format;
+            snprintf(uvc_frame_format[last_format_index].format_name,
+                    sizeof(uvc_frame_format[last_format_index].format_name), "%s", format_name);
+            uvc_frame_format[last_format_index].defined = true;
+        }
+
+        set_uvc_format_value(array[index - 1], last_format_index, value);
+    }
+
+free:
+    free(copy);
+}
+
+static void configfs_set_streaming_param(const char *part, int value)
+{
+    /*
+     * streaming_maxburst   0..15 (ss only)
+     * streaming_maxpacket  1..1023 (fs), 1..3072 (hs/ss)
+     * streaming_interval   1..16
+     */
+
+    if (!strncmp(part, "maxburst", 8)) {
+        streaming_maxburst = clamp(value, 0, 15);
+
+    } else if (!strncmp(part, "maxpacket", 9)) {
+        streaming_maxpacket = clamp(value, 1, 3072);
+
+    } else if (!strncmp(part, "interval", 8)) {
+        streaming_interval = clamp(value, 1, 16);
+
+    }
+}
+
+static void configfs_fill_streaming_params(const char* path, const char *part)
+{
+    configfs_set_streaming_param(part, configfs_read_value(path));
+}
+
+static int configfs_path_check(const char* fpath, const struct stat *sb, int tflag)
 {
-    uint8_t type = ctrl->wIndex & 0xff;
-    uint8_t interface = ctrl->wIndex >> 8;
-    uint8_t control = ctrl->wValue >> 8;
-    uint8_t length = ctrl->wLength;
+    int uvc = find_text_pos(fpath, "/uvc");
+    int streaming = find_text_pos(fpath, "streaming/class/");
+    int streaming_params = find_text_pos(fpath, "/streaming_");
+    (void)(tflag); /* avoid warning: unused parameter 'tflag' */
 
-    if ((ctrl->bRequestType & USB_RECIP_MASK) != USB_RECIP_INTERFACE) {
-        return;
-    }
+    if (!S_ISDIR(sb->st_mode)) {
+        if (streaming && uvc) {
+            configfs_fill_formats(fpath, fpath + streaming + 16);
 
-    switch (type) {
-        case UVC_INTF_CONTROL:
-            switch (interface) {
-                case 0:
-                    if (control == UVC_VC_REQUEST_ERROR_CODE_CONTROL) {
-                        resp->data[0] = uvc_dev.request_error_code;
-                        resp->length = 1;
-                    }
-                    break;
+        } else if (streaming_params) {
+            configfs_fill_streaming_params(fpath, fpath + streaming_params + 11);
 
-                case 1:
-                    uvc_interface_control(UVC_VC_INPUT_TERMINAL, ctrl->bRequest, control, length, resp);
-                    break;
+        }
+    }
+    return 0;
+}
 
-                case 2:
-                    uvc_interface_control(UVC_VC_PROCESSING_UNIT, ctrl->bRequest, control, length, resp);
-                    break;
+/*
+ * Targeted discovery of one UVC function: only its streaming tree is read,
+ * through directory descriptors, instead of walking every gadget.
+ */
 
-                default:
-                    break;
-            }
-            break;
+static int configfs_read_value_at(int dirfd, const char *name)
+{
+    char buf[20];
+    int fd;
+    int ret;
 
-        case UVC_INTF_STREAMING:
-            uvc_events_process_streaming(ctrl->bRequest, control, resp);
-            break;
+    fd = openat(dirfd, name, O_RDONLY);
+    if (fd == -1) {
+        return -ENOENT;
+    }
+    ret = read(fd, buf, 20);
+    close(fd);
 
-        default:
-            break;
+    if (ret < 0 || ret > 10) {
+        return -ENODATA;
     }
+    buf[ret] = '\0';
+    return strtol(buf, NULL, 10);
 }
 
-static void uvc_events_process_setup(struct usb_ctrlrequest *ctrl, struct uvc_request_data *resp)
+/* Subdirectories (or links to them) of a directory, "." and ".." excluded */
+static DIR *configfs_open_dir_at(int dirfd, const char *name)
 {
-    uvc_dev.control = 0;
-    if ((ctrl->bRequestType & USB_TYPE_MASK) == USB_TYPE_CLASS) {
-        uvc_events_process_class(ctrl, resp);
+    int fd;
+    DIR *dir;
+
+    fd = openat(dirfd, name, O_RDONLY | O_DIRECTORY);
+    if (fd == -1) {
+        return NULL;
     }
 
-    if (ioctl(uvc_dev.fd, UVCIOC_SEND_RESPONSE, resp) < 0) {
-        printf("UVCIOC_SEND_RESPONSE failed: %s (%d)\n", strerror(errno), errno);
+    dir = fdopendir(fd);
+    if (!dir) {
+        close(fd);
     }
+    return dir;
 }
 
-static void uvc_events_process_data_control(struct uvc_request_data *data, struct uvc_streaming_control *target)
+static struct dirent *configfs_next_dir(DIR *dir)
 {
-    struct uvc_streaming_control *ctrl = (struct uvc_streaming_control *) &data->data;
-    unsigned int iformat = (unsigned int) ctrl->bFormatIndex;
-    unsigned int iframe = (unsigned int) ctrl->bFrameIndex;
+    struct dirent *entry;
 
-    uvc_fill_streaming_control(target, STREAM_CONTROL_SET, iformat, iframe);
+    while ((entry = readdir(dir))) {
+        if (entry->d_name[0] != '.' && entry->d_type != DT_REG) {
+            return entry;
+        }
+    }
+    return NULL;
 }
 
-static void uvc_events_process_data(struct uvc_request_data *data)
+static int configfs_find_function(const char *function, char *path, size_t size)
 {
-    int i;
-    printf("UVC: Control %s, length: %d\n", uvc_vs_interface_control_name(uvc_dev.control), data->length);
-
-    switch (uvc_dev.control) {
-        case UVC_VS_PROBE_CONTROL:
-            uvc_events_process_data_control(data, &(uvc_dev.probe));
-            break;
+    struct dirent *entry;
+    struct stat sb;
+    DIR *dir;
+    int ret = -ENOENT;
+
+    /* A path to the function directory itself */
+    if (strchr(function, '/')) {
+        snprintf(path, size, "%s", function);
+        return (stat(path, &sb) == 0 && S_ISDIR(sb.st_mode)) ? 0 : -ENOENT;
+    }
 
-        case UVC_VS_COMMIT_CONTROL:
-            uvc_events_process_data_control(data, &(uvc_dev.commit));
-            break;
+    dir = opendir(CONFIGFS_PATH);
+    if (!dir) {
+        return -errno;
+    }
 
-        case UVC_VS_CONTROL_UNDEFINED:
-            if (data->length > 0 && data->length <= 4) {
-                for (i = 0; i < control_mapping_size; i++) {
-                    if (control_mapping[i].type == uvc_dev.control_interface &&
-                            control_mapping[i].uvc == uvc_dev.control_type &&
-                            control_mapping[i].enabled
-                       ) {
-                        control_mapping[i].value = 0x00000000;
-                        control_mapping[i].length = data->length;
-                        memcpy(&control_mapping[i].value, data->data, data->length);
-                    }
-                }
-            }
-            break;
+    while ((entry = configfs_next_dir(dir))) {
+        if (fstatat(dirfd(dir), entry->d_name, &sb, 0) < 0 || !S_ISDIR(sb.st_mode)) {
+            continue;
+        }
 
-        default:
-            printf("UVC: Setting unknown control, length = %d\n", data->length);
+        snprintf(path, size, "%s/%s/functions/%s", CONFIGFS_PATH, entry->d_name, function);
+        if (stat(path, &sb) == 0 && S_ISDIR(sb.st_mode)) {
+            ret = 0;
             break;
+        }
     }
+
+    closedir(dir);
+    return ret;
 }
 
-static void uvc_events_process()
+static const char *const configfs_frame_attributes[] = {
+    "bFrameIndex",
+    "wWidth",
+    "wHeight",
+    "dwDefaultFrameInterval",
+    "dwMaxVideoFrameBufferSize",
+    "dwMaxBitRate",
+    "dwMinBitRate",
+    "bmCapabilities",
+};
+
+/* Next free entry of uvc_frame_format, NULL when the table is full */
+static struct uvc_frame_format *configfs_add_frame()
 {
-    struct v4l2_event v4l2_event;
-    struct uvc_event *uvc_event = (void *) &v4l2_event.u.data;
-    struct uvc_request_data resp;
-
-    if (ioctl(uvc_dev.fd, VIDIOC_DQEVENT, &v4l2_event) < 0) {
-        printf("%s: VIDIOC_DQEVENT failed: %s (%d)\n",
-                uvc_dev.device_type_name, strerror(errno), errno);
-        return;
+    if (uvc_frame_format[last_format_index].defined) {
+        if (last_format_index >= (int) ARRAY_SIZE(uvc_frame_format) - 1) {
+            return NULL;
+        }
+        last_format_index++;
     }
+    return &uvc_frame_format[last_format_index];
+}
 
-    CLEAR(resp);
-    resp.length = -EL2HLT;
+static int configfs_read_format(enum usb_device_speed usb_speed, DIR *format_dir, const char *format,
+        const char *format_path)
+{
+    struct uvc_frame_format *frame_format;
+    int first = last_format_index + uvc_frame_format[last_format_index].defined;
+    struct dirent *entry;
+    int video_format;
+    int bFormatIndex;
+    unsigned int i;
+    int fd;
+    int value;
+    int ret = 0;
 
-    switch (v4l2_event.type) {
-        case UVC_EVENT_CONNECT:
-            printf("%s: UVC_EVENT_CONNECT\n", uvc_dev.device_type_name);
-            break;
+    video_format = configfs_video_format(format, format_path);
+    if (video_format == 0) {
+        printf("CONFIGFS: Unsupported format: (%s) %s\n", format, format_path);
+        return 0;
+    }
 
-        case UVC_EVENT_DISCONNECT:
-            printf("%s: UVC_EVENT_DISCONNECT\n", uvc_dev.device_type_name);
-            uvc_shutdown_requested = true;
-            break;
+    bFormatIndex = configfs_read_value_at(dirfd(format_dir), "bFormatIndex");
 
-        case UVC_EVENT_SETUP:
-            uvc_events_process_setup(&uvc_event->req, &resp);
-            break;
+    while ((entry = configfs_next_dir(format_dir))) {
+        fd = openat(dirfd(format_dir), entry->d_name, O_RDONLY | O_DIRECTORY);
+        if (fd == -1) {
+            continue;
+        }
 
-        case UVC_EVENT_DATA:
-            uvc_events_process_data(&uvc_event->data);
+        frame_format = configfs_add_frame();
+        if (!frame_format) {
+            close(fd);
+            ret = -ENOSPC;
             break;
+        }
 
-        case UVC_EVENT_STREAMON:
-            uvc_handle_streamon_event();
-            break;
+        frame_format->usb_speed = usb_speed;
+        frame_format->video_format = video_format;
+        snprintf(frame_format->format_name, sizeof(frame_format->format_name), "%.31s", entry->d_name);
+        frame_format->defined = true;
 
-        case UVC_EVENT_STREAMOFF:
-            uvc_handle_streamoff_event();
-            break;
+        for (i = 0; i < ARRAY_SIZE(configfs_frame_attributes); i++) {
+            value = configfs_read_value_at(fd, configfs_frame_attributes[i]);
+            if (value >= 0) {
+                set_uvc_format_value(configfs_frame_attributes[i], last_format_index, value);
+            }
+        }
+        close(fd);
+    }
 
-        default:
-            break;
+    /* Frames are read before the format index, it applies to all of them */
+    if (bFormatIndex >= 0) {
+        for (i = first; (int) i <= last_format_index; i++) {
+            uvc_frame_format[i].bFormatIndex = bFormatIndex;
+        }
     }
+    return ret;
 }
 
-static void uvc_events(int action)
+static int configfs_read_function_params(const char *function_path)
 {
-    struct v4l2_event_subscription sub;
-    CLEAR(sub);
+    static const char *const params[] = { "maxburst", "maxpacket", "interval" };
+    char name[32];
+    unsigned int i;
+    int function_fd;
 
-    sub.type = UVC_EVENT_CONNECT;
-    ioctl(uvc_dev.fd, action, &sub);
-    sub.type = UVC_EVENT_DISCONNECT;
-    ioctl(uvc_dev.fd, action, &sub);
-    sub.type = UVC_EVENT_SETUP;
-    ioctl(uvc_dev.fd, action, &sub);
-    sub.type = UVC_EVENT_DATA;
-    ioctl(uvc_dev.fd, action, &sub);
-    sub.type = UVC_EVENT_STREAMON;
-    ioctl(uvc_dev.fd, action, &sub);
-    sub.type = UVC_EVENT_STREAMOFF;
-    ioctl(uvc_dev.fd, action, &sub);
-}
+    function_fd = open(function_path, O_RDONLY | O_DIRECTORY);
+    if (function_fd == -1) {
+        return -errno;
+    }
 
-static void uvc_events_subscribe()
-{
-    uvc_events(VIDIOC_SUBSCRIBE_EVENT);
-}
+    for (i = 0; i < ARRAY_SIZE(params); i++) {
+        snprintf(name, sizeof(name), "streaming_%s", params[i]);
+        configfs_set_streaming_param(params[i], configfs_read_value_at(function_fd, name));
+    }
 
-static void uvc_events_unsubscribe()
-{
-    uvc_events(VIDIOC_UNSUBSCRIBE_EVENT);
+    close(function_fd);
+    return 0;
 }
 
-
-/*
- * main processing loop
- */
-static void processing_loop_image_uvc() 
+/* streaming/class/<speed>/<header>/<format>/<frame> of the function */
+static int configfs_read_function(const char *function_path)
 {
-    struct timeval video_tv;
-    int activity;
-    double next_frame_time = 0;
-    double last_time_blink = 0;
-    bool blink_state = false;
-    double now;
-    fd_set fdsu;
-
-    int frame_interval = (1000 / settings.image_framerate);
+    static const char *const speeds[] = { "fs", "hs", "ss" };
+    char format_path[PATH_MAX];
+    char name[32];
+    struct dirent *header, *format;
+    DIR *class_dir, *header_dir, *format_dir;
+    enum usb_device_speed usb_speed;
+    unsigned int i;
+    int function_fd;
+    int ret = 0;
 
-    printf("PROCESSING LOOP: IMAGE -> UVC\n");
+    function_fd = open(function_path, O_RDONLY | O_DIRECTORY);
+    if (function_fd == -1) {
+        return -errno;
+    }
 
-    while (!terminate) {
-        FD_ZERO(&fdsu);
-        FD_SET(uvc_dev.fd, &fdsu);
+    for (i = 0; i < ARRAY_SIZE(speeds) && ret == 0; i++) {
+        usb_speed = configfs_usb_speed(speeds[i]);
 
-        fd_set efds = fdsu;
-        fd_set dfds = fdsu;
+        snprintf(name, sizeof(name), "streaming/class/%s", speeds[i]);
+        class_dir = configfs_open_dir_at(function_fd, name);
+        if (!class_dir) {
+            continue;
+        }
 
-        nanosleep ((const struct timespec[]) { {0, 1000000L} }, NULL);
+        while (ret == 0 && (header = configfs_next_dir(class_dir))) {
+            header_dir = configfs_open_dir_at(dirfd(class_dir), header->d_name);
+            if (!header_dir) {
+                continue;
+            }
 
-        activity = select(uvc_dev.fd + 1, NULL, &dfds, &efds, NULL);
+            while (ret == 0 && (format = configfs_next_dir(header_dir))) {
+                format_dir = configfs_open_dir_at(dirfd(header_dir), format->d_name);
+                if (!format_dir) {
+                    continue;
+                }
 
-        if (activity == -1) {
-            printf("PROCESSING: Select error %d, %s\n", errno, strerror(errno));
-            if (EINTR == errno) {
-                continue;
+                if (snprintf(format_path, sizeof(format_path), "%s/%s/%s/%s", function_path, name,
+                            header->d_name, format->d_name) < (int) sizeof(format_path)) {
+                    ret = configfs_read_format(usb_speed, format_dir, format->d_name, format_path);
+                }
+                closedir(format_dir);
             }
-            break;
+            closedir(header_dir);
         }
+        closedir(class_dir);
+    }
 
-        if (activity == 0) {
-            printf("PROCESSING: Select timeout\n");
-            break;
-        }
+    close(function_fd);
+    return ret;
+}
 
-        if (FD_ISSET(uvc_dev.fd, &efds)) {
-            uvc_events_process();
-        }
+static void configfs_snapshot_key(const char *function_path, struct configfs_snapshot_key *key)
+{
+    static const char *const dirs[CONFIGFS_SNAPSHOT_DIRS] = {
+        "", "/streaming/class/fs", "/streaming/class/hs", "/streaming/class/ss",
+    };
+    char path[PATH_MAX + 32];
+    struct stat sb;
+    unsigned int i;
 
-        gettimeofday(&video_tv, 0);
-        now = (video_tv.tv_sec + (video_tv.tv_usec * 1e-6)) * 1000;
+    memset(key, 0, sizeof(*key));
+    snprintf(key->function_path, sizeof(key->function_path), "%s", function_path);
 
-        if (FD_ISSET(uvc_dev.fd, &dfds)) {
-            if (now >= next_frame_time) {
-                uvc_image_video_process();
-                next_frame_time = now + frame_interval;
-            }
+    for (i = 0; i < CONFIGFS_SNAPSHOT_DIRS; i++) {
+        snprintf(path, sizeof(path), "%s%s", function_path, dirs[i]);
+        if (stat(path, &sb) == 0) {
+            key->dirs[i].ino = sb.st_ino;
+            key->dirs[i].mtime = sb.st_mtim;
         }
+    }
+}
+
+static int configfs_snapshot_load(const char *filename, const struct configfs_snapshot_key *key)
+{
+    struct configfs_snapshot *snapshot;
+    FILE *fp;
+    int ret = -EINVAL;
+
+    fp = fopen(filename, "r");
+    if (!fp) {
+        return -errno;
+    }
+
+    snapshot = malloc(sizeof(*snapshot));
+    if (!snapshot) {
+        fclose(fp);
+        return -ENOMEM;
+    }
+
+    if (fread(snapshot, sizeof(*snapshot), 1, fp) == 1 &&
+            snapshot->magic == CONFIGFS_SNAPSHOT_MAGIC &&
+            snapshot->version == CONFIGFS_SNAPSHOT_VERSION &&
+            snapshot->format_size == sizeof(struct uvc_frame_format) &&
+            snapshot->last_format_index >= 0 &&
+            snapshot->last_format_index < (int) ARRAY_SIZE(uvc_frame_format) &&
+            !memcmp(&snapshot->key, key, sizeof(*key))) {
+        memcpy(uvc_frame_format, snapshot->formats, sizeof(uvc_frame_format));
+        last_format_index = snapshot->last_format_index;
+        ret = 0;
+    }
+
+    free(snapshot);
+    fclose(fp);
+    return ret;
+}
+
+/* Written to a temporary file and renamed, so readers never see a partial one */
+static int configfs_snapshot_save(const char *filename, const struct configfs_snapshot_key *key)
+{
+    struct configfs_snapshot *snapshot;
+    char tmp[PATH_MAX + 8];
+    FILE *fp;
+    int ret = 0;
+
+    snapshot = calloc(1, sizeof(*snapshot));
+    if (!snapshot) {
+        return -ENOMEM;
+    }
 
-        if (settings.show_fps) {
-            if (now - uvc_dev.last_time_video_process >= 1000) {
-                printf("FPS: %d\n", uvc_dev.buffers_processed);
-                uvc_dev.buffers_processed = 0;
-                uvc_dev.last_time_video_process = now;
-            }
-        }
+    snapshot->magic = CONFIGFS_SNAPSHOT_MAGIC;
+    snapshot->version = CONFIGFS_SNAPSHOT_VERSION;
+    snapshot->format_size = sizeof(struct uvc_frame_format);
+    snapshot->last_format_index = last_format_index;
+    snapshot->key = *key;
+    memcpy(snapshot->formats, uvc_frame_format, sizeof(uvc_frame_format));
+
+    snprintf(tmp, sizeof(tmp), "%s.tmp", filename);
+    fp = fopen(tmp, "w");
+    if (!fp) {
+        ret = -errno;
+        goto free;
+    }
 
-        if (settings.blink_on_startup > 0) {
-            if (now - last_time_blink >= 100) {
-                blink_state = !(blink_state);
-                streaming_status_value(blink_state);
-                last_time_blink = now;
-                if (!blink_state) {
-                    settings.blink_on_startup -= 1;
-                }
-            }
-        }
+    if (fwrite(snapshot, sizeof(*snapshot), 1, fp) != 1) {
+        ret = -EIO;
+    }
+    if (fclose(fp) != 0 && ret == 0) {
+        ret = -errno;
     }
+    if (ret == 0 && rename(tmp, filename) < 0) {
+        ret = -errno;
+    }
+    if (ret < 0) {
+        unlink(tmp);
+    }
+
+free:
+    free(snapshot);
+    return ret;
 }
 
-static int init()
+/* Formats of the named function, from the snapshot when it is still valid */
+static int configfs_get_function_settings(const char *function)
 {
+    struct configfs_snapshot_key key;
+    char function_path[PATH_MAX];
     int ret;
 
-    memset(&uvc_dev, 0, sizeof(uvc_dev));
+    ret = configfs_find_function(function, function_path, sizeof(function_path));
+    if (ret < 0) {
+        printf("CONFIGFS: Function %s not found in %s\n", function, CONFIGFS_PATH);
+        return ret;
+    }
 
-    streaming_status_enable();
+    printf("CONFIGFS: Function path: %s\n", function_path);
 
-    /* Open the UVC device. */
-    ret = uvc_open(settings.uvc_devname, settings.nbufs);
+    if (settings.configfs_snapshot) {
+        configfs_snapshot_key(function_path, &key);
+
+        if (configfs_snapshot_load(settings.configfs_snapshot, &key) == 0) {
+            printf("CONFIGFS: Formats loaded from snapshot %s\n", settings.configfs_snapshot);
+            return configfs_read_function_params(function_path);
+        }
+    }
+
+    ret = configfs_read_function_params(function_path);
     if (ret < 0) {
-        goto err;
+        return ret;
     }
 
-    if (settings.source_device == DEVICE_TYPE_IMAGE) {
-        switch(image_dev.image_format) {
-            case V4L2_PIX_FMT_YUYV:
-                image_dev.image_mem_size = image_dev.image_uncompressed_mem_size;
-                image_dev.image_memory = image_dev.image_uncompressed_memory;
-                break;
+    ret = configfs_read_function(function_path);
+    if (ret == -ENOSPC) {
+        printf("CONFIGFS: Too many formats in %s, the rest is ignored\n", function_path);
+    } else if (ret < 0) {
+        return ret;
+    }
 
-            case V4L2_PIX_FMT_MJPEG:
-                image_dev.image_mem_size = image_dev.image_mjpeg_mem_size;
-                image_dev.image_memory = image_dev.image_mjpeg_memory;
-                break;
+    if (settings.configfs_snapshot && uvc_frame_format[0].defined) {
+        ret = configfs_snapshot_save(settings.configfs_snapshot, &key);
+        if (ret < 0) {
+            printf("CONFIGFS: Could not save snapshot %s: %s (%d)\n", settings.configfs_snapshot,
+                    strerror(-ret), -ret);
+        }
+    }
+    return 0;
+}
 
-            case V4L2_PIX_FMT_GREY:
-                image_dev.image_mem_size = image_dev.image_l8_mem_size;
-                image_dev.image_memory = image_dev.image_l8_memory;
+static int configfs_get_uvc_settings()
+{
+    int i;
+    const char *configfs_path = CONFIGFS_PATH;
+    double start = monotonic_ms();
 
-                break;
+    if (settings.uvc_function) {
+        if (configfs_get_function_settings(settings.uvc_function) < 0) {
+            return -1;
         }
+
     } else {
-        /* Unknown device type */
-        goto err;
+        printf("CONFIGFS: Initial path: %s\n", configfs_path);
+
+        if(ftw(configfs_path, configfs_path_check, 20) == -1) {
+            return -1;
+        }
     }
 
-    /* Init UVC events. */
-    uvc_fill_streaming_control(&(uvc_dev.probe), STREAM_CONTROL_INIT, 0, 0);
-    uvc_fill_streaming_control(&(uvc_dev.commit), STREAM_CONTROL_INIT, 0, 0);
+    if (!uvc_frame_format[0].defined) {
+        return -1;
+    }
 
-    uvc_events_subscribe();
+    printf("CONFIGFS: Formats read in %.3f ms\n", monotonic_ms() - start);
 
-    if (settings.source_device == DEVICE_TYPE_IMAGE) {
-        processing_loop_image_uvc();
+    for (i = 0; i <= last_format_index; i++) {
+        uvc_dump_frame_format(&uvc_frame_format[i], "CONFIGFS: UVC");
     }
 
-    uvc_events_unsubscribe();
+    printf("CONFIGFS: STREAMING maxburst:  %d\n", streaming_maxburst);
+    printf("CONFIGFS: STREAMING maxpacket: %d\n", streaming_maxpacket);
+    printf("CONFIGFS: STREAMING interval:  %d\n", streaming_interval);
 
-    printf("\n*** UVC GADGET SHUTDOWN ***\n");
+    return 0;
+}
 
-    uvc_handle_streamoff_event();
+/*
+ * Gadget provisioning: the configfs tree of a profile is created with direct
+ * system calls, the UDC bound and the video node awaited with inotify. The
+ * format table is filled from the description, only the indexes assigned by
+ * the kernel are read back.
+ */
 
-err:
-    uvc_close();
+struct gadget_attribute {
+    const char *name;
+    const char *value;
+};
 
-    printf("*** UVC GADGET EXIT ***\n");
-    return 1;
+static int gadget_mkdir(const char *path)
+{
+    if (mkdir(path, 0755) < 0 && errno != EEXIST) {
+        printf("GADGET: Could not create %s: %s (%d)\n", path, strerror(errno), errno);
+        return -errno;
+    }
+    return 0;
 }
 
-static int find_text_pos(const char *s, const char *f)
+static int gadget_write(const char *dir, const char *name, const void *value, size_t length)
 {
-    char *p = strstr(s, f);
-    return (p) ? p - s : 0;
+    char path[PATH_MAX + 64];
+    int fd;
+    int ret = 0;
+
+    snprintf(path, sizeof(path), "%s/%s", dir, name);
+    fd = open(path, O_WRONLY);
+    if (fd == -1 || write(fd, value, length) != (ssize_t) length) {
+        ret = -errno;
+        printf("GADGET: Could not write %s: %s (%d)\n", path, strerror(errno), errno);
+    }
+    if (fd != -1) {
+        close(fd);
+    }
+    return ret;
 }
 
-static int configfs_read_value(const char *path)
+static int gadget_write_attributes(const char *dir, const struct gadget_attribute *attributes,
+        unsigned int count)
 {
-    char buf[20];
-    int fd;
+    unsigned int i;
     int ret;
 
-    fd = open(path, O_RDONLY); 
-    if (fd == -1) {
-        return -ENOENT;
+    for (i = 0; i < count; i++) {
+        ret = gadget_write(dir, attributes[i].name, attributes[i].value, strlen(attributes[i].value));
+        if (ret < 0) {
+            return ret;
+        }
     }
-    ret = read(fd, buf, 20);
-    close(fd);
+    return 0;
+}
 
-    if (ret < 0 || ret > 10) {
-        return -ENODATA;
+static int gadget_write_value(const char *dir, const char *name, unsigned int value)
+{
+    char buf[16];
+
+    return gadget_write(dir, name, buf, snprintf(buf, sizeof(buf), "%u", value));
+}
+
+/* configfs resolves link targets like any other path, they have to be absolute */
+static int gadget_link(const char *target, const char *dir, const char *name)
+{
+    char path[PATH_MAX + 64];
+
+    snprintf(path, sizeof(path), "%s/%s", dir, name);
+    if (symlink(target, path) < 0) {
+        printf("GADGET: Could not link %s to %s: %s (%d)\n", path, target, strerror(errno), errno);
+        return -errno;
     }
-    buf[ret] = '\0';
-    return strtol(buf, NULL, 10);
+    return 0;
 }
 
-static void set_uvc_format_index(enum usb_device_speed usb_speed, int video_format,
-        unsigned int bFormatIndex)
+static const struct uvc_guid_format *gadget_guid_format(const char *name)
 {
-    int i;
-    for (i = 0; i <= last_format_index; i++) {
-        if (uvc_frame_format[i].usb_speed == usb_speed &&
-                uvc_frame_format[i].video_format == video_format
-           ) {
-            uvc_frame_format[i].bFormatIndex = bFormatIndex;
+    unsigned int i;
+
+    for (i = 0; i < ARRAY_SIZE(uvc_guid_formats); i++) {
+        if (!strcmp(uvc_guid_formats[i].name, name)) {
+            return &uvc_guid_formats[i];
         }
     }
+    return NULL;
 }
 
-static void set_uvc_format_value(const char *key_word, unsigned int index, int value)
+/* Device descriptor, strings and the configuration c.1 */
+static int gadget_create_device(const char *gadget_path, const struct gadget_profile *profile)
 {
-    if (!strncmp(key_word, "dwDefaultFrameInterval", 22)) {
-        uvc_frame_format[index].dwDefaultFrameInterval = value;
+    const struct gadget_attribute device[] = {
+        { "bDeviceClass", "0xEF" },
+        { "bDeviceSubClass", "0x02" },
+        { "bDeviceProtocol", "0x01" },
+        { "idVendor", "0x1d6b" },
+        { "idProduct", "0x0104" },
+        { "bcdDevice", "0x0100" },
+        { "bcdUSB", "0x0200" },
+    };
+    const struct gadget_attribute strings[] = {
+        { "manufacturer", "Subface" },
+        { "product", profile->product },
+        { "serialnumber", profile->serial },
+    };
+    const struct gadget_attribute config[] = {
+        { "MaxPower", "500" },
+        { "strings/0x409/configuration", profile->configuration },
+    };
+    char path[PATH_MAX];
+    int ret;
 
-    } else if (!strncmp(key_word, "dwMaxVideoFrameBufferSize", 25)) {
-        uvc_frame_format[index].dwMaxVideoFrameBufferSize = value;
+    ret = gadget_mkdir(gadget_path);
+    if (ret < 0) {
+        return ret;
+    }
 
-    } else if (!strncmp(key_word, "dwMaxBitRate", 12)) {
-        uvc_frame_format[index].dwMaxBitRate = value;
+    ret = gadget_write_attributes(gadget_path, device, ARRAY_SIZE(device));
+    if (ret < 0) {
+        return ret;
+    }
 
-    } else if (!strncmp(key_word, "dwMinBitRate", 12)) {
-        uvc_frame_format[index].dwMinBitRate = value;
+    snprintf(path, sizeof(path), "%s/strings/0x409", gadget_path);
+    ret = gadget_mkdir(path);
+    if (ret < 0) {
+        return ret;
+    }
 
-    } else if (!strncmp(key_word, "wHeight", 7)) {
-        uvc_frame_format[index].wHeight = value;
+    ret = gadget_write_attributes(path, strings, ARRAY_SIZE(strings));
+    if (ret < 0) {
+        return ret;
+    }
 
-    } else if (!strncmp(key_word, "wWidth", 6)) {
-        uvc_frame_format[index].wWidth = value;
+    snprintf(path, sizeof(path), "%s/configs/c.1", gadget_path);
+    ret = gadget_mkdir(path);
+    if (ret < 0) {
+        return ret;
+    }
 
-    } else if (!strncmp(key_word, "bmCapabilities", 14)) {
-        uvc_frame_format[index].bmCapabilities = value;
+    snprintf(path, sizeof(path), "%s/configs/c.1/strings/0x409", gadget_path);
+    ret = gadget_mkdir(path);
+    if (ret < 0) {
+        return ret;
+    }
 
-    } else if (!strncmp(key_word, "bFrameIndex", 11)) {
-        uvc_frame_format[index].bFrameIndex = value;
+    snprintf(path, sizeof(path), "%s/configs/c.1", gadget_path);
+    return gadget_write_attributes(path, config, ARRAY_SIZE(config));
+}
+
+static int gadget_create_frame(const char *format_path, const struct gadget_frame *frame)
+{
+    unsigned int size = frame->width * frame->height;
+    char intervals[GADGET_MAX_INTERVALS * 12];
+    char path[PATH_MAX + 64];
+    unsigned int length = 0;
+    unsigned int i;
+    int ret;
+
+    snprintf(path, sizeof(path), "%s/%ux%up", format_path, frame->width, frame->height);
+    ret = gadget_mkdir(path);
+    if (ret < 0) {
+        return ret;
+    }
+
+    ret = gadget_write_value(path, "wWidth", frame->width);
+    ret = (ret < 0) ? ret : gadget_write_value(path, "wHeight", frame->height);
+    ret = (ret < 0) ? ret : gadget_write_value(path, "dwDefaultFrameInterval", frame->intervals[0]);
+    ret = (ret < 0) ? ret : gadget_write_value(path, "dwMinBitRate", size * 80);
+    ret = (ret < 0) ? ret : gadget_write_value(path, "dwMaxBitRate", size * 160);
+    ret = (ret < 0) ? ret : gadget_write_value(path, "dwMaxVideoFrameBufferSize", size * 2);
+    if (ret < 0) {
+        return ret;
+    }
 
+    /* All intervals in one write, one per line */
+    for (i = 0; i < GADGET_MAX_INTERVALS && frame->intervals[i]; i++) {
+        length += snprintf(intervals + length, sizeof(intervals) - length, "%u\n", frame->intervals[i]);
     }
+    return gadget_write(path, "dwFrameInterval", intervals, length);
 }
 
-static int configfs_usb_speed(const char *speed)
+/* functions/uvc.usbN with one uncompressed format, linked to the fs and hs classes and to c.1 */
+static int gadget_create_function(const char *gadget_path, const struct gadget_function *function)
 {
-    if (!strncmp(speed, "fs", 2)) {
-        return USB_SPEED_FULL;
+    const struct uvc_guid_format *guid_format = gadget_guid_format(function->format);
+    char function_path[1024];
+    char format_path[PATH_MAX];
+    char header_path[PATH_MAX];
+    char path[PATH_MAX];
+    unsigned int i;
+    int ret;
 
-    } else if (!strncmp(speed, "hs", 2)) {
-        return USB_SPEED_HIGH;
+    if (!guid_format) {
+        printf("GADGET: Unknown format %s of %s\n", function->format, function->name);
+        return -EINVAL;
+    }
 
-    } else if (!strncmp(speed, "ss", 2)) {
-        return USB_SPEED_SUPER;
+    snprintf(function_path, sizeof(function_path), "%s/functions/%s", gadget_path, function->name);
+    ret = gadget_mkdir(function_path);
+    if (ret < 0) {
+        return ret;
+    }
 
+    ret = gadget_write_value(function_path, "streaming_maxpacket", function->maxpacket);
+    if (ret < 0) {
+        return ret;
     }
-    return USB_SPEED_UNKNOWN;
+
+    snprintf(format_path, sizeof(format_path), "%s/streaming/uncompressed/u", function_path);
+    ret = gadget_mkdir(format_path);
+    if (ret < 0) {
+        return ret;
+    }
+
+    for (i = 0; i < GADGET_MAX_FRAMES && function->frames[i].width; i++) {
+        ret = gadget_create_frame(format_path, &function->frames[i]);
+        if (ret < 0) {
+            return ret;
+        }
+    }
+
+    ret = gadget_write(format_path, "guidFormat", guid_format->guid, sizeof(guid_format->guid));
+    ret = (ret < 0) ? ret : gadget_write_value(format_path, "bBitsPerPixel", guid_format->bits_per_pixel);
+    if (ret < 0) {
+        return ret;
+    }
+
+    /* Headers, then the links that make the descriptors read-only */
+    snprintf(header_path, sizeof(header_path), "%s/control/header/h", function_path);
+    ret = gadget_mkdir(header_path);
+    ret = (ret < 0) ? ret : gadget_link(header_path, function_path, "control/class/fs/h");
+    if (ret < 0) {
+        return ret;
+    }
+
+    snprintf(header_path, sizeof(header_path), "%s/streaming/header/h", function_path);
+    ret = gadget_mkdir(header_path);
+    ret = (ret < 0) ? ret : gadget_link(format_path, header_path, "u");
+    ret = (ret < 0) ? ret : gadget_link(header_path, function_path, "streaming/class/fs/h");
+    ret = (ret < 0) ? ret : gadget_link(header_path, function_path, "streaming/class/hs/h");
+    if (ret < 0) {
+        return ret;
+    }
+
+    snprintf(path, sizeof(path), "%s/configs/c.1", gadget_path);
+    return gadget_link(function_path, path, function->name);
 }
 
-static int configfs_video_format(const char *format)
+/*
+ * Format table of the function at full and high speed, from the description.
+ * The format and frame indexes are assigned by the kernel when linking.
+ */
+static int gadget_fill_formats(const char *gadget_path, const struct gadget_function *function)
 {
-    if (!strncmp(format, "m", 1)) {
-        return V4L2_PIX_FMT_MJPEG;
-
-    } else if (!strncmp(format, "u", 1)) {
-        /* return V4L2_PIX_FMT_YUYV; */
-        return V4L2_PIX_FMT_GREY;
+    static const enum usb_device_speed speeds[] = { USB_SPEED_FULL, USB_SPEED_HIGH };
+    const struct gadget_frame *frame;
+    struct uvc_frame_format *frame_format;
+    char format_path[PATH_MAX];
+    char path[PATH_MAX + 32];
+    int bFormatIndex;
+    unsigned int i, s;
+
+    snprintf(format_path, sizeof(format_path), "%s/functions/%s/streaming/uncompressed/u",
+            gadget_path, function->name);
+    snprintf(path, sizeof(path), "%s/bFormatIndex", format_path);
+    bFormatIndex = configfs_read_value(path);
+
+    memset(uvc_frame_format, 0, sizeof(uvc_frame_format));
+    last_format_index = 0;
+
+    for (s = 0; s < ARRAY_SIZE(speeds); s++) {
+        for (i = 0; i < GADGET_MAX_FRAMES && function->frames[i].width; i++) {
+            frame = &function->frames[i];
+
+            frame_format = configfs_add_frame();
+            if (!frame_format) {
+                return -ENOSPC;
+            }
 
+            snprintf(path, sizeof(path), "%s/%ux%up/bFrameIndex", format_path, frame->width, frame->height);
+
+            frame_format->defined = true;
+            frame_format->usb_speed = speeds[s];
+            frame_format->video_format = gadget_guid_format(function->format)->video_format;
+            snprintf(frame_format->format_name, sizeof(frame_format->format_name), "%ux%up",
+                    frame->width, frame->height);
+            frame_format->bFormatIndex = bFormatIndex;
+            frame_format->bFrameIndex = configfs_read_value(path);
+            frame_format->dwDefaultFrameInterval = frame->intervals[0];
+            frame_format->dwMaxVideoFrameBufferSize = frame->width * frame->height * 2;
+            frame_format->dwMinBitRate = frame->width * frame->height * 80;
+            frame_format->dwMaxBitRate = frame->width * frame->height * 160;
+            frame_format->wWidth = frame->width;
+            frame_format->wHeight = frame->height;
+        }
     }
+
+    streaming_maxpacket = clamp((unsigned int) function->maxpacket, 1u, 3072u);
     return 0;
 }
 
-static void configfs_fill_formats(const char *path, const char *part)
+static int gadget_configfs_root(char *path, size_t size)
 {
-    int index = 0;
-    int value = 0;
-    enum usb_device_speed usb_speed;
-    int video_format;
-    const char *format_name;
-    char *copy = strdup(part);
-    char *token = strtok(copy, "/");
-    char *array[10];
+    struct mntent *mount;
+    FILE *fp;
+    int ret = -ENOENT;
 
-    while (token != NULL)
-    {
-        array[index++] = token;
-        token = strtok (NULL, "/");
+    fp = setmntent("/proc/self/mounts", "r");
+    if (!fp) {
+        return -errno;
+    }
+
+    while ((mount = getmntent(fp))) {
+        if (!strcmp(mount->mnt_type, "configfs")) {
+            snprintf(path, size, "%s", mount->mnt_dir);
+            ret = 0;
+            break;
+        }
+    }
+
+    endmntent(fp);
+    return ret;
+}
+
+/* First UDC of the system, like ls /sys/class/udc */
+static int gadget_find_udc(char *name, size_t size)
+{
+    struct dirent *entry;
+    DIR *dir;
+    int ret = -ENODEV;
+
+    dir = opendir("/sys/class/udc");
+    if (!dir) {
+        return -ENODEV;
+    }
+
+    while ((entry = readdir(dir))) {
+        if (entry->d_name[0] != '.') {
+            snprintf(name, size, "%s", entry->d_name);
+            ret = 0;
+            break;
+        }
     }
 
-    if (index > 3) {
-        format_name = array[3];
+    closedir(dir);
+    return ret;
+}
 
-        usb_speed = configfs_usb_speed(array[0]);
-        if (usb_speed == USB_SPEED_UNKNOWN) {
-            printf("CONFIGFS: Unsupported USB speed: (%s) %s\n", array[0], path);
-            goto free;
-        }
+/* Numbers of the /dev/videoN nodes below 64 */
+static uint64_t gadget_video_nodes()
+{
+    struct dirent *entry;
+    uint64_t nodes = 0;
+    unsigned int number;
+    DIR *dir;
 
-        video_format = configfs_video_format(array[2]);
-        if (video_format == 0) {
-            printf("CONFIGFS: Unsupported format: (%s) %s\n", array[2], path);
-            goto free;
-        }
+    dir = opendir("/dev");
+    if (!dir) {
+        return 0;
+    }
 
-        value = configfs_read_value(path);
-        if (value < 0) {
-            goto free;
+    while ((entry = readdir(dir))) {
+        if (sscanf(entry->d_name, "video%u", &number) == 1 && number < 64) {
+            nodes |= 1ULL << number;
         }
+    }
 
-        if (!strncmp(array[index - 1], "bFormatIndex", 12)) {
-            set_uvc_format_index(usb_speed, video_format, value);
-            goto free;
+    closedir(dir);
+    return nodes;
+}
+
+/* Video nodes created since the given ones, once there are count of them */
+static uint64_t gadget_wait_video_nodes(int inotify_fd, uint64_t existing, unsigned int count)
+{
+    double deadline = monotonic_ms() + GADGET_VIDEO_TIMEOUT_MS;
+    struct pollfd pfd = { .fd = inotify_fd, .events = POLLIN };
+    char events[4096];
+    uint64_t nodes;
+    int timeout;
+
+    while (true) {
+        nodes = gadget_video_nodes() & ~existing;
+        if ((unsigned int) __builtin_popcountll(nodes) >= count) {
+            return nodes;
         }
 
-        if (index != 5) {
-            goto free;
+        timeout = deadline - monotonic_ms();
+        if (timeout <= 0 || poll(&pfd, 1, timeout) <= 0) {
+            return nodes;
         }
 
-        if (
-                uvc_frame_format[last_format_index].usb_speed != usb_speed ||
-                uvc_frame_format[last_format_index].video_format != video_format ||
-                strncmp(uvc_frame_format[last_format_index].format_name, format_name, strlen(format_name))
-           ) {
-            if (uvc_frame_format[last_format_index].defined) {
-                last_format_index++;
+        if (read(inotify_fd, events, sizeof(events)) < 0) {
+            return nodes;
+        }
+    }
+}
 
-                /* too much defined formats */
-                if (last_format_index > 29) {
-                    goto free;
-                }
+/*
+ * Video node of a UVC function among the given nodes: the UVC function names
+ * its video device after its configfs directory in the function_name sysfs
+ * attribute, which can show up shortly after the node
+ */
+static int gadget_function_video_node(const char *function, uint64_t nodes)
+{
+    double deadline = monotonic_ms() + GADGET_VIDEO_TIMEOUT_MS;
+    char path[64];
+    char name[64];
+    unsigned int number;
+    uint64_t pending;
+    FILE *fp;
+
+    while (true) {
+        for (pending = nodes; pending; pending &= pending - 1) {
+            number = __builtin_ctzll(pending);
+            snprintf(path, sizeof(path), "/sys/class/video4linux/video%u/function_name", number);
+
+            fp = fopen(path, "r");
+            if (!fp) {
+                continue;
             }
+            if (!fgets(name, sizeof(name), fp)) {
+                name[0] = '\0';
+            }
+            fclose(fp);
 
-            uvc_frame_format[last_format_index].usb_speed = usb_speed;
-            uvc_frame_format[last_format_index].video_format = video_format;
-            uvc_frame_format[last_format_index].format_name = strdup(format_name);
-            uvc_frame_format[last_format_index].defined = true;
+            name[strcspn(name, "\n")] = '\0';
+            if (!strcmp(name, function)) {
+                return number;
+            }
         }
 
-        set_uvc_format_value(array[index - 1], last_format_index, value);
+        if (monotonic_ms() >= deadline) {
+            return -ENOENT;
+        }
+        usleep(1000);
     }
-
-free:
-    free(copy);
 }
 
-static void configfs_fill_streaming_params(const char* path, const char *part)
+/*
+ * Build the gadget of a profile, bind it and select the video node and the
+ * formats of the function to stream (-F, the first function by default)
+ */
+static int gadget_provision(const char *name)
 {
-    int value = configfs_read_value(path);
+    static char video_node[32];
+    const struct gadget_profile *profile = NULL;
+    const struct gadget_function *function = NULL;
+    char configfs_path[256];
+    char gadget_path[512];
+    char udc[256];
+    unsigned int nfunctions = 0;
+    uint64_t existing, nodes;
+    double start, configfs_time, bind_time, video_time;
+    int inotify_fd = -1;
+    unsigned int i;
+    int ret;
 
-    /*
-     * streaming_maxburst   0..15 (ss only)
-     * streaming_maxpacket  1..1023 (fs), 1..3072 (hs/ss)
-     * streaming_interval   1..16
-     */
+    for (i = 0; i < ARRAY_SIZE(gadget_profiles); i++) {
+        if (!strcmp(gadget_profiles[i].name, name)) {
+            profile = &gadget_profiles[i];
+        }
+    }
+    if (!profile) {
+        printf("GADGET: Unknown profile %s\n", name);
+        return -EINVAL;
+    }
 
-    if (!strncmp(part, "maxburst", 8)) {
-        streaming_maxburst = clamp(value, 0, 15);
+    for (i = 0; i < GADGET_MAX_FUNCTIONS && profile->functions[i].name; i++) {
+        if ((!settings.uvc_function && !function) ||
+                (settings.uvc_function && !strcmp(settings.uvc_function, profile->functions[i].name))) {
+            function = &profile->functions[i];
+        }
+        nfunctions++;
+    }
+    if (!function) {
+        printf("GADGET: Profile %s has no function %s, its functions are", profile->name, settings.uvc_function);
+        for (i = 0; i < nfunctions; i++) {
+            printf(" %s", profile->functions[i].name);
+        }
+        printf("\n");
+        return -EINVAL;
+    }
+    settings.uvc_function = (char *) function->name;
 
-    } else if (!strncmp(part, "maxpacket", 9)) {
-        streaming_maxpacket = clamp(value, 1, 3072);
+    ret = gadget_configfs_root(configfs_path, sizeof(configfs_path));
+    if (ret < 0) {
+        printf("GADGET: configfs is not mounted\n");
+        return ret;
+    }
 
-    } else if (!strncmp(part, "interval", 8)) {
-        streaming_interval = clamp(value, 1, 16);
+    snprintf(gadget_path, sizeof(gadget_path), "%s/usb_gadget/%s", configfs_path, GADGET_NAME);
+    if (access(gadget_path, F_OK) == 0) {
+        printf("GADGET: %s already exists, remove it with gadget-cleanup.sh first\n", gadget_path);
+        return -EEXIST;
+    }
 
+    ret = gadget_find_udc(udc, sizeof(udc));
+    if (ret < 0) {
+        printf("GADGET: No UDC found in /sys/class/udc\n");
+        return ret;
     }
-}
 
-static int configfs_path_check(const char* fpath, const struct stat *sb, int tflag)
-{
-    int uvc = find_text_pos(fpath, "/uvc");
-    int streaming = find_text_pos(fpath, "streaming/class/");
-    int streaming_params = find_text_pos(fpath, "/streaming_");
-    (void)(tflag); /* avoid warning: unused parameter 'tflag' */
+    /* Watched before binding, so no node can be missed */
+    inotify_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (inotify_fd < 0 || inotify_add_watch(inotify_fd, "/dev", IN_CREATE) < 0) {
+        printf("GADGET: Could not watch /dev: %s (%d)\n", strerror(errno), errno);
+        ret = -errno;
+        goto err;
+    }
+    existing = gadget_video_nodes();
 
-    if (!S_ISDIR(sb->st_mode)) {
-        if (streaming && uvc) {
-            configfs_fill_formats(fpath, fpath + streaming + 16);
+    printf("GADGET: Provisioning %s in %s\n", profile->name, gadget_path);
+    start = monotonic_ms();
 
-        } else if (streaming_params) {
-            configfs_fill_streaming_params(fpath, fpath + streaming_params + 11);
+    ret = gadget_create_device(gadget_path, profile);
+    for (i = 0; i < nfunctions && ret == 0; i++) {
+        ret = gadget_create_function(gadget_path, &profile->functions[i]);
+    }
+    if (ret < 0) {
+        goto err_partial;
+    }
+    configfs_time = monotonic_ms();
 
-        }
+    ret = gadget_write(gadget_path, "UDC", udc, strlen(udc));
+    if (ret < 0) {
+        goto err_partial;
+    }
+    bind_time = monotonic_ms();
+
+    nodes = gadget_wait_video_nodes(inotify_fd, existing, nfunctions);
+    if ((unsigned int) __builtin_popcountll(nodes) < nfunctions) {
+        printf("GADGET: Video nodes of the functions did not appear within %d ms\n", GADGET_VIDEO_TIMEOUT_MS);
+        ret = -ETIMEDOUT;
+        goto err;
+    }
+
+    ret = gadget_function_video_node(function->name, nodes);
+    if (ret < 0) {
+        printf("GADGET: No new video node belongs to %s (function_name in sysfs)\n", function->name);
+        goto err;
+    }
+    snprintf(video_node, sizeof(video_node), "/dev/video%d", ret);
+    settings.uvc_devname = video_node;
+    video_time = monotonic_ms();
+
+    ret = gadget_fill_formats(gadget_path, function);
+    if (ret < 0) {
+        goto err;
+    }
+
+    for (i = 0; (int) i <= last_format_index; i++) {
+        uvc_dump_frame_format(&uvc_frame_format[i], "GADGET: UVC");
     }
+
+    printf("GADGET: %s bound to %s, %s is %s\n", GADGET_NAME, udc, function->name, video_node);
+    printf("GADGET: Provisioned in %.3f ms: configfs %.3f ms, UDC bind %.3f ms, video node %.3f ms\n",
+            video_time - start, configfs_time - start, bind_time - configfs_time, video_time - bind_time);
+
+    close(inotify_fd);
     return 0;
+
+err_partial:
+    printf("GADGET: Provisioning failed, remove the partial gadget with gadget-cleanup.sh\n");
+
+err:
+    if (inotify_fd >= 0) {
+        close(inotify_fd);
+    }
+    return ret;
 }
 
-static int configfs_get_uvc_settings()
+/* CPU list like "1" or "2,3" */
+static int parse_cpu_list(const char *list, cpu_set_t *cpus)
 {
-    int i;
-    const char *configfs_path = "/sys/kernel/config/usb_gadget";
+    char *end;
+    long cpu;
 
-    printf("CONFIGFS: Initial path: %s\n", configfs_path);
+    CPU_ZERO(cpus);
+    do {
+        cpu = strtol(list, &end, 10);
+        if (end == list || cpu < 0 || cpu >= CPU_SETSIZE) {
+            return -EINVAL;
+        }
+        CPU_SET(cpu, cpus);
+        list = end + 1;
+    } while (*end == ',');
 
-    if(ftw(configfs_path, configfs_path_check, 20) == -1) {
-        return -1;
-    }
+    return (*end == '\0') ? 0 : -EINVAL;
+}
 
-    if (!uvc_frame_format[0].defined) {
-        return -1;
-    }
+/* Scheduling policy like "fifo:50" or "rr:10" */
+static int parse_sched_policy(const char *arg)
+{
+    const char *priority = strchr(arg, ':');
 
-    for (i = 0; i <= last_format_index; i++) {
-        uvc_dump_frame_format(&uvc_frame_format[i], "CONFIGFS: UVC");
+    if (!priority || atoi(priority + 1) < 1 || atoi(priority + 1) > 99) {
+        return -EINVAL;
     }
 
-    printf("CONFIGFS: STREAMING maxburst:  %d\n", streaming_maxburst);
-    printf("CONFIGFS: STREAMING maxpacket: %d\n", streaming_maxpacket);
-    printf("CONFIGFS: STREAMING interval:  %d\n", streaming_interval);
+    if (!strncmp(arg, "fifo:", 5)) {
+        settings.rt_policy = SCHED_FIFO;
+    } else if (!strncmp(arg, "rr:", 3)) {
+        settings.rt_policy = SCHED_RR;
+    } else {
+        return -EINVAL;
+    }
 
+    settings.rt_priority = atoi(priority + 1);
     return 0;
 }
 
@@ -1735,22 +5969,72 @@ static void usage(const char *argv0)
 {
     fprintf(stderr, "Usage: %s [options]\n", argv0);
     fprintf(stderr, "Available options are\n");
+    fprintf(stderr, " -a cpus     Pin the streaming thread to CPUs (e.g. 2 or 2,3)\n");
     fprintf(stderr, " -b value    Blink X times on startup (b/w 1 and 20 with led0 or GPIO pin if defined)\n");
+    fprintf(stderr, " -c          Pin every buffer to one frame of the sequence and rotate without copying\n");
+    fprintf(stderr, " -C cpu      Pin the control thread to a CPU (implies -t)\n");
+    fprintf(stderr, " -d dir      Cache the converted frames in a directory, reused while the source is unchanged\n");
+    fprintf(stderr, " -D MiB      Size limit of the frame cache, least recently used files are removed (default %d)\n",
+            IMAGE_CACHE_LIMIT_MB);
+    fprintf(stderr, " -e file     Replay recorded UVC events without a device, report latency and responses\n");
+    fprintf(stderr, " -f          Fast format switching, keep the buffers between streams\n");
+    fprintf(stderr, " -F function Read only this UVC function from configfs (e.g. uvc.usb0)\n");
+    fprintf(stderr, " -g profile  Create and bind the gadget (rgb, ir, ir10, ir16 or composite) and stream it\n");
+    fprintf(stderr, " -G file     With -F, snapshot of the function's formats reused while configfs is unchanged\n");
     fprintf(stderr, " -h          Print this help screen and exit\n");
-    fprintf(stderr, " -i file     PNG image source\n");
+    fprintf(stderr, " -H          Use huge pages for the video buffers\n");
+    fprintf(stderr, " -i file     PNG image source (repeat for a frame sequence)\n");
+    fprintf(stderr, " -j file     JPEG or MJPEG file sent as is to MJPEG formats of the same resolution\n");
+    fprintf(stderr, " -J seconds  Run a frame pacing jitter benchmark with and without -S/-a/-m and exit\n");
+    fprintf(stderr, " -K seconds  With -e, soak the handlers with random traffic and fail on resource drift\n");
     fprintf(stderr, " -l          Use onboard led0 for streaming status indication\n");
-    fprintf(stderr, " -n value    Number of Video buffers (between 2 and 32)\n");
+    fprintf(stderr, " -L          Low latency mode, always send the newest frame with 2 buffers\n");
+    fprintf(stderr, " -m          Lock and prefault all memory, warn about page faults while streaming\n");
+    fprintf(stderr, " -n value    Number of Video buffers (between 2 and 32, or auto to adapt at runtime)\n");
+    fprintf(stderr, " -O id       Overlay the device ID, frame counter and time on the frames (YUYV, GREY, Y16, Y10P, RGBP)\n");
     fprintf(stderr, " -p value    GPIO pin number for streaming status indication\n");
+    fprintf(stderr, " -P value    SCHED_FIFO priority of the control thread (between 1 and 99, implies -t)\n");
+    fprintf(stderr, " -q value    Maximum JPEG quality for MJPEG formats (between 1 and 100)\n");
     fprintf(stderr, " -r value    Framerate for image source (between 1 and 30)\n");
+    fprintf(stderr, " -R file     Record the UVC events to a file for replay with -e\n");
+    fprintf(stderr, " -S pol:prio Real-time scheduling of the streaming thread (fifo:prio or rr:prio, 1-99)\n");
+    fprintf(stderr, " -t          Handle UVC control requests on a separate thread\n");
+    fprintf(stderr, " -T file     Record a timeline to a Chrome trace file (written on exit and SIGUSR1)\n");
     fprintf(stderr, " -u device   UVC Video Output device\n");
+    fprintf(stderr, " -w          Reload the image source when its files change\n");
     fprintf(stderr, " -x          Show FPS information\n");
+    fprintf(stderr, " -y file     16-bit greyscale PNG image source (Y16 or packed 10-bit)\n");
     fprintf(stderr, " -z file     L8 image source\n");
 }
 
 static void show_settings()
 {
-    printf("SETTINGS: Number of buffers requested: %d\n", settings.nbufs);
+    if (settings.nbufs_auto) {
+        printf("SETTINGS: Number of buffers requested: auto (%d to %d)\n", QUEUE_DEPTH_MIN, QUEUE_DEPTH_MAX);
+    } else {
+        printf("SETTINGS: Number of buffers requested: %d\n", settings.nbufs);
+    }
     printf("SETTINGS: Show FPS: %s\n", (settings.show_fps) ? "ENABLED" : "DISABLED");
+    printf("SETTINGS: Low latency mode: %s\n", (settings.low_latency) ? "ENABLED" : "DISABLED");
+    printf("SETTINGS: Frame rotation: %s\n", (settings.rotation) ? "ENABLED" : "DISABLED");
+    printf("SETTINGS: Control thread: %s\n", (settings.control_thread) ? "ENABLED" : "DISABLED");
+    if (settings.rt_policy != SCHED_OTHER) {
+        printf("SETTINGS: Streaming thread scheduling: %s priority %d\n",
+                (settings.rt_policy == SCHED_FIFO) ? "SCHED_FIFO" : "SCHED_RR", settings.rt_priority);
+    }
+    printf("SETTINGS: Memory locking: %s\n", (settings.lock_memory) ? "ENABLED" : "DISABLED");
+    if (settings.trace_file) {
+        printf("SETTINGS: Trace file: %s\n", settings.trace_file);
+    }
+    if (settings.record_file) {
+        printf("SETTINGS: UVC event recording: %s\n", settings.record_file);
+    }
+    if (settings.cache_dir) {
+        printf("SETTINGS: Frame cache: %s, %u MiB\n", settings.cache_dir, settings.cache_limit_mb);
+    }
+    if (settings.overlay_id) {
+        printf("SETTINGS: Overlay: %s\n", settings.overlay_id);
+    }
     if (settings.streaming_status_pin) {
         printf("SETTINGS: GPIO pin for streaming status: %s\n", settings.streaming_status_pin);
     } else {
@@ -1762,6 +6046,9 @@ static void show_settings()
     printf("SETTINGS: Blink on startup: %d times\n", settings.blink_on_startup);
 
     printf("SETTINGS: UVC device name: %s\n", settings.uvc_devname);
+    if (settings.uvc_function) {
+        printf("SETTINGS: UVC function: %s\n", settings.uvc_function);
+    }
     if(settings.source_device == DEVICE_TYPE_IMAGE) {
         printf("SETTINGS: IMAGE device source: %s\n", settings.image_name);
     }
@@ -1774,18 +6061,22 @@ int main(int argc, char *argv[])
 
     struct sigaction action;
     CLEAR(action);
+
+    start_time = monotonic_ms();
     action.sa_handler = term;
     sigaction(SIGTERM, &action, NULL);
     sigaction(SIGINT, &action, NULL);
 
-    ret = configfs_get_uvc_settings();
-    if (ret < 0) {
-        printf("[-] ERROR: Configfs settings for UVC gadget not found!\n");
-        return 1;
-    }
-
-    while ((opt = getopt(argc, argv, "hlb:n:p:r:u:xi:z:")) != -1) {
+    while ((opt = getopt(argc, argv, "cfhHlLmta:b:C:d:D:e:F:g:G:J:K:n:O:p:P:q:r:R:S:T:u:wxi:j:y:z:")) != -1) {
         switch (opt) {
+            case 'a':
+                if (parse_cpu_list(optarg, &settings.rt_cpus) < 0) {
+                    fprintf(stderr, "ERROR: Invalid CPU list\n");
+                    goto err;
+                }
+                settings.rt_cpus_set = true;
+                break;
+
             case 'b':
                 if (atoi(optarg) < 1 || atoi(optarg) > 20) {
                     fprintf(stderr, "ERROR: Blink x times on startup\n");
@@ -1794,26 +6085,120 @@ int main(int argc, char *argv[])
                 settings.blink_on_startup = atoi(optarg);
                 break;
             
+            case 'c':
+                settings.rotation = true;
+                break;
+
+            case 'e':
+                settings.replay_file = optarg;
+                break;
+
+            case 'C':
+                settings.control_cpu = atoi(optarg);
+                settings.control_thread = true;
+                break;
+
+            case 'd':
+                settings.cache_dir = optarg;
+                break;
+
+            case 'D':
+                if (atoi(optarg) < 1) {
+                    fprintf(stderr, "ERROR: Invalid cache size limit\n");
+                    goto err;
+                }
+                settings.cache_limit_mb = atoi(optarg);
+                break;
+
+            case 'f':
+                settings.fast_switch = true;
+                break;
+
             case 'h':
                 usage(argv[0]);
                 return 1;
 
+            case 'H':
+                settings.hugepages = true;
+                break;
+
+            case 'F':
+                settings.uvc_function = optarg;
+                break;
+
+            case 'g':
+                settings.gadget_profile = optarg;
+                break;
+
+            case 'G':
+                settings.configfs_snapshot = optarg;
+                break;
+
+            case 'K':
+                if (atoi(optarg) < 1) {
+                    fprintf(stderr, "ERROR: Invalid soak duration\n");
+                    goto err;
+                }
+                settings.soak_seconds = atoi(optarg);
+                break;
+
+            case 'J':
+                if (atoi(optarg) < 1 || atoi(optarg) > 3600) {
+                    fprintf(stderr, "ERROR: Jitter benchmark duration out of range\n");
+                    goto err;
+                }
+                settings.jitter_seconds = atoi(optarg);
+                break;
+
             case 'l':
                 settings.streaming_status_onboard = true;
                 break;
 
+            case 'L':
+                settings.low_latency = true;
+                break;
+
+            case 'm':
+                settings.lock_memory = true;
+                break;
+
             case 'n':
-                if (atoi(optarg) < 2 || atoi(optarg) > 32) {
+                if (!strcmp(optarg, "auto")) {
+                    settings.nbufs_auto = true;
+                    break;
+                }
+                if (atoi(optarg) < 2 || atoi(optarg) > UVC_MAX_BUFFERS) {
                     fprintf(stderr, "ERROR: Number of Video buffers value out of range\n");
                     goto err;
                 }
                 settings.nbufs = atoi(optarg);
                 break;
 
+            case 'O':
+                settings.overlay_id = optarg;
+                break;
+
             case 'p':
                 settings.streaming_status_pin = optarg;
                 break;
 
+            case 'P':
+                if (atoi(optarg) < 1 || atoi(optarg) > 99) {
+                    fprintf(stderr, "ERROR: Control thread priority out of range\n");
+                    goto err;
+                }
+                settings.control_priority = atoi(optarg);
+                settings.control_thread = true;
+                break;
+
+            case 'q':
+                if (atoi(optarg) < 1 || atoi(optarg) > 100) {
+                    fprintf(stderr, "ERROR: JPEG quality value out of range\n");
+                    goto err;
+                }
+                settings.jpeg_quality = atoi(optarg);
+                break;
+
             case 'r':
                 if (atoi(optarg) < 1 || atoi(optarg) > 30) {
                     fprintf(stderr, "ERROR: Framerate value out of range\n");
@@ -1822,6 +6207,25 @@ int main(int argc, char *argv[])
                 settings.image_framerate = atoi(optarg);
                 break;
 
+            case 'S':
+                if (parse_sched_policy(optarg) < 0) {
+                    fprintf(stderr, "ERROR: Invalid scheduling policy, use fifo:prio or rr:prio\n");
+                    goto err;
+                }
+                break;
+
+            case 't':
+                settings.control_thread = true;
+                break;
+
+            case 'R':
+                settings.record_file = optarg;
+                break;
+
+            case 'T':
+                settings.trace_file = optarg;
+                break;
+
             case 'u':
                 settings.uvc_devname = optarg;
                 break;
@@ -1830,26 +6234,52 @@ int main(int argc, char *argv[])
                 settings.v4l2_devname = optarg;
                 break;
 
+            case 'w':
+                settings.image_reload = true;
+                break;
+
             case 'x':
                 settings.show_fps = true;
                 break;
 
             case 'i':
                 settings.image_name = optarg;
+                settings.image_type = IMAGE_TYPE_PNG;
+                settings.source_device = DEVICE_TYPE_IMAGE;
+
+                if (image_add_file(settings.image_type, settings.image_name) < 0) {
+                    return 1;
+                }
+                break;
+
+            case 'j':
+                settings.image_name = optarg;
+                settings.image_type = IMAGE_TYPE_JPEG;
+                settings.source_device = DEVICE_TYPE_IMAGE;
+
+                if (image_add_file(settings.image_type, settings.image_name) < 0) {
+                    return 1;
+                }
+                break;
+
+            case 'y':
+                settings.image_name = optarg;
+                settings.image_type = IMAGE_TYPE_PNG16;
                 settings.source_device = DEVICE_TYPE_IMAGE;
 
-                /* Try to load the PNG image */
-                load_png_image(settings.image_name);
-                image_dev.image_format = V4L2_PIX_FMT_YUYV;
+                if (image_add_file(settings.image_type, settings.image_name) < 0) {
+                    return 1;
+                }
                 break;
 
             case 'z':
                 settings.image_name = optarg;
+                settings.image_type = IMAGE_TYPE_L8;
                 settings.source_device = DEVICE_TYPE_IMAGE;
 
-                /* Try to load the L8 image */
-                load_l8_image(settings.image_name);
-                image_dev.image_format = V4L2_PIX_FMT_GREY;
+                if (image_add_file(settings.image_type, settings.image_name) < 0) {
+                    return 1;
+                }
                 break;
 
             default:
@@ -1858,6 +6288,50 @@ int main(int argc, char *argv[])
         }
     }
 
+    if (settings.jitter_seconds) {
+        return (rt_jitter_benchmark() < 0) ? 1 : 0;
+    }
+
+    if (settings.soak_seconds && !settings.replay_file) {
+        printf("ERROR: -K needs a recording to soak, given with -e\n");
+        return 1;
+    }
+
+    if (settings.replay_file && settings.soak_seconds) {
+        return (soak_run(settings.replay_file, settings.soak_seconds) < 0) ? 1 : 0;
+    }
+
+    if (settings.replay_file) {
+        return (event_replay(settings.replay_file) < 0) ? 1 : 0;
+    }
+
+    if (settings.gadget_profile) {
+        ret = gadget_provision(settings.gadget_profile);
+        if (ret < 0) {
+            printf("[-] ERROR: Gadget provisioning failed!\n");
+            return 1;
+        }
+
+    } else {
+        ret = configfs_get_uvc_settings();
+        if (ret < 0) {
+            printf("[-] ERROR: Configfs settings for UVC gadget not found!\n");
+            return 1;
+        }
+    }
+
+    if (settings.low_latency) {
+        /* Smallest queue that keeps one buffer in flight while the next is filled */
+        settings.nbufs = 2;
+        settings.nbufs_auto = false;
+        settings.rotation = false;
+    }
+
+    if (settings.trace_file) {
+        action.sa_handler = trace_signal;
+        sigaction(SIGUSR1, &action, NULL);
+    }
+
     show_settings();
     return init();
 
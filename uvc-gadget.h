@@ -16,8 +16,11 @@
 #include <linux/types.h>
 #include <linux/usb/ch9.h>
 
+#include "image-convert.h"
+
 #define CLEAR(x) memset(&(x), 0, sizeof(x))
 #define max(a, b) (((a) > (b)) ? (a) : (b))
+#define min(a, b) (((a) < (b)) ? (a) : (b))
 
 #define clamp(val, min, max)                        \
     ({                                              \
@@ -31,6 +34,7 @@
     })
 
 #define ARRAY_SIZE(a) ((sizeof(a) / sizeof(a[0])))
+#define ALIGN_UP(x, a) ((((x) + (a) - 1) / (a)) * (a))
 #define pixfmtstr(x) (x) & 0xff, ((x) >> 8) & 0xff, ((x) >> 16) & 0xff, ((x) >> 24) & 0xff
 
 enum gpio {
@@ -115,6 +119,116 @@ struct buffer {
     size_t length;
 };
 
+#define UVC_MAX_BUFFERS 32
+
+/* Stream events forwarded from the control thread to the streaming loop */
+enum stream_message_type {
+    STREAM_MESSAGE_ON,
+    STREAM_MESSAGE_OFF,
+    STREAM_MESSAGE_COMMIT,
+};
+
+struct stream_message {
+    enum stream_message_type type;
+    int frame_format;           /* index in uvc_frame_format for COMMIT */
+};
+
+/* Time from a SETUP event being queued by the kernel to its response being sent */
+struct control_stats {
+    unsigned int requests;
+    double latency_sum;
+    double latency_max;
+    double last_report;
+};
+
+/* Stack touched up front with -m, so the streaming loop never faults on it */
+#define RT_STACK_PREFAULT (512 * 1024)
+
+/* Frame copied every period by the jitter benchmark (YUYV 1280x720) */
+#define RT_JITTER_FRAME_SIZE (1280 * 720 * 2)
+
+/* Queue depth range and state of the adaptive buffer count (-n auto) */
+#define QUEUE_DEPTH_MIN 2
+#define QUEUE_DEPTH_MAX 8
+#define QUEUE_DEPTH_DEFAULT 3
+#define QUEUE_DEPTH_MIN_SAMPLES 100
+#define QUEUE_DEPTH_ENTRIES 64
+#define QUEUE_DEPTH_STATE_DIR "/var/lib/uvc-gadget"
+#define QUEUE_DEPTH_STATE_FILE QUEUE_DEPTH_STATE_DIR "/queue-depth"
+
+/* Queue depth chosen for a connection speed and format */
+struct queue_depth_entry {
+    unsigned int speed;
+    unsigned int format;
+    unsigned int width;
+    unsigned int height;
+    unsigned int depth;
+};
+
+/* Queue behaviour of the current stream */
+struct queue_stats {
+    unsigned long long dqbufs;
+    unsigned long long underruns;   /* no buffer left queued after DQBUF */
+    unsigned long long eagain;      /* no buffer ready to dequeue */
+    unsigned long long missed;      /* frames filled more than one interval late */
+    unsigned int min_slack;
+    double latency_sum;
+};
+
+/* Events of a recording replayed with -e, in the order of UVC_EVENT_* */
+#define EVENT_REPLAY_TYPES 6
+#define EVENT_RECORD_LINE 512
+
+/*
+ * Soak mode (-K): random negotiation, control and stream traffic on the replay
+ * harness. Resources are sampled periodically and must not drift from the
+ * first sample.
+ */
+#define SOAK_SAMPLE_SECONDS 10
+#define SOAK_MAX_FRAMES 65536
+#define SOAK_MAX_STREAM_FRAMES 300
+#define SOAK_RSS_DRIFT_KB 1024
+#define SOAK_HEAP_DRIFT (256 * 1024)
+#define SOAK_HEAP_CHUNKS_DRIFT 256
+#define SOAK_LATENCY_DRIFT 2.0
+#define SOAK_LATENCY_DRIFT_MIN_MS 1.0
+
+struct soak_sample {
+    long rss_kb;
+    size_t heap;                /* bytes allocated with malloc() */
+    size_t heap_blocks;         /* free chunks and mmapped allocations of the heap */
+    int fds;
+    double p99;                 /* latency of frames that were copied (DQBUF, fill, QBUF), ms */
+};
+
+/* Latency samples between two points of a frame's or request's life */
+struct latency_stats {
+    double sum;
+    double max;
+    unsigned int count;
+};
+
+/* Fills that found the frame already in the buffer and skipped the copy */
+struct dedup_stats {
+    unsigned long long fills;
+    unsigned long long hits;
+    unsigned long long bytes_saved;
+};
+#define BUFFER_POOL_HUGEPAGE_SIZE (2 * 1024 * 1024)
+
+/* Frame buffers kept for the lifetime of the process, reused by every stream */
+struct buffer_pool {
+    void *memory;
+    size_t size;
+    size_t buffer_size;
+    unsigned int count;
+    bool hugepages;
+    bool locked;
+    unsigned long long allocations;
+    struct buffer buffers[UVC_MAX_BUFFERS];
+    uint64_t fingerprints[UVC_MAX_BUFFERS];     /* frame each buffer holds, 0 when unknown */
+};
+
 /* ---------------------------------------------------------------------------
  * UVC specific stuff
  */
@@ -124,7 +238,7 @@ struct uvc_frame_format {
 
     enum usb_device_speed usb_speed;
     int video_format;
-    const char *format_name;
+    char format_name[32];
 
     unsigned int bFormatIndex;
     unsigned int bFrameIndex;
@@ -155,6 +269,132 @@ unsigned int streaming_maxburst = 0;
 unsigned int streaming_maxpacket = 1023;
 unsigned int streaming_interval = 1;
 
+#define CONFIGFS_PATH "/sys/kernel/config/usb_gadget"
+
+/*
+ * Format table of one UVC function saved with -G. It is reused while the
+ * function directory and its streaming/class/<speed> directories keep their
+ * inode and mtime: formats can not be changed while their header is linked
+ * there, so relinking is the only way to change the descriptors.
+ */
+#define CONFIGFS_SNAPSHOT_MAGIC 0x53435655      /* "UVCS" */
+#define CONFIGFS_SNAPSHOT_VERSION 1
+#define CONFIGFS_SNAPSHOT_DIRS 4
+
+struct configfs_snapshot_key {
+    char function_path[PATH_MAX];
+    struct {
+        ino_t ino;
+        struct timespec mtime;
+    } dirs[CONFIGFS_SNAPSHOT_DIRS];
+};
+
+struct configfs_snapshot {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t format_size;       /* sizeof(struct uvc_frame_format) */
+    int last_format_index;
+    struct configfs_snapshot_key key;
+    struct uvc_frame_format formats[ARRAY_SIZE(uvc_frame_format)];
+};
+
+/* Uncompressed format GUIDs (guidFormat in configfs) */
+#define UVC_GUID_FORMAT(a, b, c, d, data2) \
+    { a, b, c, d, (data2) & 0xff, (data2) >> 8, 0x10, 0x00, \
+      0x80, 0x00, 0x00, 0xaa, 0x00, 0x38, 0x9b, 0x71 }
+
+struct uvc_guid_format {
+    uint8_t guid[16];
+    const char *name;
+    unsigned int bits_per_pixel;
+    unsigned int video_format;
+};
+
+struct uvc_guid_format uvc_guid_formats[] = {
+    { UVC_GUID_FORMAT('Y', 'U', 'Y', '2', 0x0000), "YUY2", 16, V4L2_PIX_FMT_YUYV },
+    { UVC_GUID_FORMAT('N', 'V', '1', '2', 0x0000), "NV12", 12, V4L2_PIX_FMT_NV12 },
+    { UVC_GUID_FORMAT('Y', '8', '0', '0', 0x0000), "Y800",  8, V4L2_PIX_FMT_GREY },
+    { UVC_GUID_FORMAT('Y', '8', ' ', ' ', 0x0000), "Y8",    8, V4L2_PIX_FMT_GREY },
+    { UVC_GUID_FORMAT(0x32, 0, 0, 0,      0x0002), "L8_IR", 8, V4L2_PIX_FMT_GREY },
+    { UVC_GUID_FORMAT('Y', '1', '0', 'P', 0x0000), "Y10P", 10, V4L2_PIX_FMT_Y10P },
+    { UVC_GUID_FORMAT('Y', '1', '6', ' ', 0x0000), "Y16",  16, V4L2_PIX_FMT_Y16 },
+    { UVC_GUID_FORMAT(0x51, 0, 0, 0,      0x0002), "L16_IR", 16, V4L2_PIX_FMT_Y16 },
+    { UVC_GUID_FORMAT('R', 'G', 'B', 'P', 0x0000), "RGBP", 16, V4L2_PIX_FMT_RGB565 },
+};
+
+/*
+ * Gadget provisioning (-g): declarative descriptions of the gadgets of the
+ * gadget-subface-*.sh scripts, built in configfs by the program itself
+ */
+#define GADGET_NAME "subface_gadget"
+#define GADGET_MAX_FUNCTIONS 2
+#define GADGET_MAX_FRAMES 4
+#define GADGET_MAX_INTERVALS 4
+#define GADGET_VIDEO_TIMEOUT_MS 5000
+
+struct gadget_frame {
+    unsigned int width;
+    unsigned int height;
+    unsigned int intervals[GADGET_MAX_INTERVALS];   /* 100 ns units, the first one is the default */
+};
+
+struct gadget_function {
+    const char *name;           /* uvc.usbN */
+    const char *format;         /* guidFormat, name in uvc_guid_formats */
+    unsigned int maxpacket;
+    struct gadget_frame frames[GADGET_MAX_FRAMES];
+};
+
+struct gadget_profile {
+    const char *name;
+    const char *product;
+    const char *serial;
+    const char *configuration;
+    struct gadget_function functions[GADGET_MAX_FUNCTIONS];
+};
+
+struct gadget_profile gadget_profiles[] = {
+    { "rgb", "Subface RGB Camera", "202102140001", "Subface Camera Front", {
+        { "uvc.usb0", "YUY2", 2048, { { 640, 480, { 333333, 400000, 666666 } } } },
+    } },
+    { "ir", "Subface IR", "202102140001", "Subface IR Camera", {
+        { "uvc.usb0", "L8_IR", 2048, { { 480, 480, { 333333 } } } },
+    } },
+    { "ir10", "Subface IR", "202102140001", "Subface IR Camera", {
+        { "uvc.usb0", "Y10P", 2048, { { 480, 480, { 333333 } } } },
+    } },
+    { "ir16", "Subface IR", "202102140001", "Subface IR Camera", {
+        { "uvc.usb0", "L16_IR", 2048, { { 480, 480, { 333333 } } } },
+    } },
+    { "composite", "Subface Camera", "202102190001", "UVC Configuration", {
+        { "uvc.usb0", "YUY2", 2048, { { 640, 480, { 333333 } } } },
+        { "uvc.usb1", "L8_IR", 2048, { { 480, 480, { 333333 } } } },
+    } },
+};
+
+/* One source frame in the wire format of a video format and resolution */
+struct image_frame {
+    void *memory;
+    unsigned int mem_size;
+    uint64_t fingerprint;   /* image_hash() of the contents, 0 for frames that are always copied */
+};
+
+/* Source frames converted to one of the video formats / resolutions of the UVC function */
+struct image_converted {
+    unsigned int video_format;
+    unsigned int width;
+    unsigned int height;
+    unsigned int quality;
+    unsigned int max_size;
+    unsigned int nframes;
+    bool mapped;            /* frames point into the JPEG passthrough or a cache file mapping */
+    struct image_frame *frames;
+
+    /* Cache file the frames are mapped from */
+    void *cache_map;
+    size_t cache_map_size;
+};
+
 /* ---------------------------------------------------------------------------
  * V4L2 and UVC device instances
  */
@@ -167,6 +407,167 @@ enum device_type {
     DEVICE_TYPE_IMAGE
 };
 
+/* image source type */
+enum image_type {
+    IMAGE_TYPE_PNG,
+    IMAGE_TYPE_PNG16,
+    IMAGE_TYPE_L8,
+    IMAGE_TYPE_JPEG,
+};
+
+/* Image source file given on the command line */
+struct image_file {
+    const char *name;
+    enum image_type type;
+};
+
+/* Source frames and their conversions, replaced as a whole when the source is reloaded */
+struct image_set {
+    /* Decoded source frames */
+    struct image *sources;
+    unsigned int source_count;
+    unsigned int source_width;
+    unsigned int source_height;
+
+    /* Hash of the contents of the source files, for the converted frame cache */
+    uint64_t source_hash;
+
+    /* JPEG / MJPEG file served without decoding */
+    const uint8_t *jpeg_map;
+    size_t jpeg_map_size;
+    struct jpeg_frame *jpeg_frames;
+    unsigned int jpeg_frame_count;
+
+    struct image_converted converted[ARRAY_SIZE(uvc_frame_format)];
+    unsigned int converted_count;
+};
+
+/*
+ * Converted frame cache (-d): one file per format and resolution, named after
+ * a hash of the source contents and the conversion parameters. The header and
+ * every frame start on a page boundary, so hits are mapped as they are.
+ */
+#define IMAGE_CACHE_MAGIC 0x46435655        /* "UVCF" */
+#define IMAGE_CACHE_VERSION 2               /* bump when a conversion or the header changes */
+#define IMAGE_CACHE_LIMIT_MB 256
+
+struct image_cache_header {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t video_format;
+    uint32_t width;
+    uint32_t height;
+    uint32_t source_width;
+    uint32_t source_height;
+    uint32_t quality;
+    uint32_t max_size;
+    uint32_t nframes;
+    struct {
+        uint64_t offset;
+        uint32_t size;
+        uint32_t reserved;
+        uint64_t fingerprint;
+    } frames[];
+};
+
+/* Time without further file events before a changed image source is reloaded */
+#define IMAGE_RELOAD_SETTLE_MS 100
+
+/*
+ * Text overlay (-O): the device ID, frame counter and time in a line of glyph
+ * cells. The glyphs are rasterized once per format and resolution into an
+ * atlas in the wire format; every buffer remembers the character of each cell,
+ * so a fill only writes the cells that changed since that buffer was last sent.
+ */
+#define OVERLAY_MAX_CELLS 48
+#define OVERLAY_ID_MAX 16
+#define OVERLAY_GLYPH_WIDTH 5
+#define OVERLAY_GLYPH_HEIGHT 7
+#define OVERLAY_CELL_WIDTH 8            /* font pixels, a multiple of 4 for Y10P */
+#define OVERLAY_CELL_HEIGHT 10
+#define OVERLAY_BACKGROUND 16
+#define OVERLAY_FOREGROUND 235
+#define OVERLAY_CELL_STALE 0x7f         /* cell content unknown, always rendered */
+
+/* 5x7 glyph, one row per byte, MSB of the 5 bits on the left */
+struct overlay_glyph {
+    char c;
+    uint8_t rows[OVERLAY_GLYPH_HEIGHT];
+};
+
+/* Lower case is drawn in upper case, any other character as a blank cell */
+const struct overlay_glyph overlay_font[] = {
+    { ' ', { 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00 } },
+    { '0', { 0x0e, 0x11, 0x13, 0x15, 0x19, 0x11, 0x0e } },
+    { '1', { 0x04, 0x0c, 0x04, 0x04, 0x04, 0x04, 0x0e } },
+    { '2', { 0x0e, 0x11, 0x01, 0x02, 0x04, 0x08, 0x1f } },
+    { '3', { 0x1f, 0x02, 0x04, 0x02, 0x01, 0x11, 0x0e } },
+    { '4', { 0x02, 0x06, 0x0a, 0x12, 0x1f, 0x02, 0x02 } },
+    { '5', { 0x1f, 0x10, 0x1e, 0x01, 0x01, 0x11, 0x0e } },
+    { '6', { 0x06, 0x08, 0x10, 0x1e, 0x11, 0x11, 0x0e } },
+    { '7', { 0x1f, 0x01, 0x02, 0x04, 0x08, 0x08, 0x08 } },
+    { '8', { 0x0e, 0x11, 0x11, 0x0e, 0x11, 0x11, 0x0e } },
+    { '9', { 0x0e, 0x11, 0x11, 0x0f, 0x01, 0x02, 0x0c } },
+    { 'A', { 0x0e, 0x11, 0x11, 0x11, 0x1f, 0x11, 0x11 } },
+    { 'B', { 0x1e, 0x11, 0x11, 0x1e, 0x11, 0x11, 0x1e } },
+    { 'C', { 0x0e, 0x11, 0x10, 0x10, 0x10, 0x11, 0x0e } },
+    { 'D', { 0x1c, 0x12, 0x11, 0x11, 0x11, 0x12, 0x1c } },
+    { 'E', { 0x1f, 0x10, 0x10, 0x1e, 0x10, 0x10, 0x1f } },
+    { 'F', { 0x1f, 0x10, 0x10, 0x1e, 0x10, 0x10, 0x10 } },
+    { 'G', { 0x0e, 0x11, 0x10, 0x17, 0x11, 0x11, 0x0f } },
+    { 'H', { 0x11, 0x11, 0x11, 0x1f, 0x11, 0x11, 0x11 } },
+    { 'I', { 0x0e, 0x04, 0x04, 0x04, 0x04, 0x04, 0x0e } },
+    { 'J', { 0x07, 0x02, 0x02, 0x02, 0x02, 0x12, 0x0c } },
+    { 'K', { 0x11, 0x12, 0x14, 0x18, 0x14, 0x12, 0x11 } },
+    { 'L', { 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x1f } },
+    { 'M', { 0x11, 0x1b, 0x15, 0x15, 0x11, 0x11, 0x11 } },
+    { 'N', { 0x11, 0x11, 0x19, 0x15, 0x13, 0x11, 0x11 } },
+    { 'O', { 0x0e, 0x11, 0x11, 0x11, 0x11, 0x11, 0x0e } },
+    { 'P', { 0x1e, 0x11, 0x11, 0x1e, 0x10, 0x10, 0x10 } },
+    { 'Q', { 0x0e, 0x11, 0x11, 0x11, 0x15, 0x12, 0x0d } },
+    { 'R', { 0x1e, 0x11, 0x11, 0x1e, 0x14, 0x12, 0x11 } },
+    { 'S', { 0x0f, 0x10, 0x10, 0x0e, 0x01, 0x01, 0x1e } },
+    { 'T', { 0x1f, 0x04, 0x04, 0x04, 0x04, 0x04, 0x04 } },
+    { 'U', { 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x0e } },
+    { 'V', { 0x11, 0x11, 0x11, 0x11, 0x11, 0x0a, 0x04 } },
+    { 'W', { 0x11, 0x11, 0x11, 0x15, 0x15, 0x15, 0x0a } },
+    { 'X', { 0x11, 0x11, 0x0a, 0x04, 0x0a, 0x11, 0x11 } },
+    { 'Y', { 0x11, 0x11, 0x11, 0x0a, 0x04, 0x04, 0x04 } },
+    { 'Z', { 0x1f, 0x01, 0x02, 0x04, 0x08, 0x10, 0x1f } },
+    { ':', { 0x00, 0x0c, 0x0c, 0x00, 0x0c, 0x0c, 0x00 } },
+    { '.', { 0x00, 0x00, 0x00, 0x00, 0x00, 0x0c, 0x0c } },
+    { '-', { 0x00, 0x00, 0x00, 0x1f, 0x00, 0x00, 0x00 } },
+    { '_', { 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x1f } },
+    { '/', { 0x00, 0x01, 0x02, 0x04, 0x08, 0x10, 0x00 } },
+};
+
+struct overlay {
+    /* Format and resolution the atlas was rasterized for */
+    unsigned int video_format;
+    unsigned int width;
+    unsigned int height;
+
+    /* Geometry in pixels and in bytes of the wire format */
+    unsigned int scale;
+    unsigned int cell_count;
+    unsigned int cell_height;
+    unsigned int top;
+    size_t left_bytes;
+    size_t cell_bytes;          /* bytes of one cell row */
+    size_t stride;              /* bytes of one frame line */
+
+    uint8_t *atlas;             /* glyph cells, cell_bytes * cell_height each */
+    uint8_t glyph_index[128];
+
+    /* Character in each cell of each buffer, 0 where the frame shows through */
+    char cells[UVC_MAX_BUFFERS][OVERLAY_MAX_CELLS];
+
+    /* Since the last report */
+    unsigned long long frames;
+    unsigned long long cells_rendered;
+    unsigned long long bytes_rendered;
+};
+
 /* Represents a V4L2 based video capture device */
 struct v4l2_device {
     enum device_type device_type;
@@ -199,20 +600,124 @@ struct v4l2_device {
     int uvc_shutdown_requested;
 
     struct buffer *dummy_buf;
+    struct buffer_pool pool;
+
+    /* Last format set with S_FMT */
+    unsigned int applied_format;
+    unsigned int applied_width;
+    unsigned int applied_height;
+
+    /* Time of the last format switch, until its first frame is sent */
+    double switch_time;
+    bool switch_pending;
+
+    /*
+     * Frames of the source are produced at the image framerate from the start
+     * of the stream; capture time of the frame in each queued buffer
+     */
+    double stream_start;
+    unsigned long long frame_sequence;
+    unsigned long long frames_dropped;
+    double capture_time[UVC_MAX_BUFFERS];
+
+    /*
+     * N-frame rotation: buffer i is filled once with frame i % rotation_length
+     * of the sequence and requeued in phase without copying
+     */
+    unsigned int rotation_length;
+    unsigned int rotation_next;         /* phase of the next buffer to queue */
+    unsigned int rotation_dq_next;      /* phase expected from the next DQBUF */
+    bool rotation_ready[UVC_MAX_BUFFERS];
+    unsigned int rotation_bytesused[UVC_MAX_BUFFERS];
+    unsigned long long rotation_out_of_order;
+
+    struct overlay overlay;
+
+    /* Control thread, the streaming loop receives its stream events through the pipe */
+    pthread_t control_thread;
+    int message_pipe[2];
+    struct control_stats control_stats;
+
+    /*
+     * dwMaxVideoFrameSize of every entry of uvc_frame_format for the probe
+     * control, so the control thread never reads the frame sets. Set from the
+     * frame descriptors at startup and from the frames once the source is
+     * adopted, while the control thread may be answering probes.
+     */
+    _Atomic unsigned int frame_max_size[ARRAY_SIZE(uvc_frame_format)];
+
+    /* Page faults of the streaming loop, checked every second with -m */
+    long page_faults;
+    double page_fault_check;
+
+    /* Adaptive queue depth */
+    unsigned int usb_speed;
+    unsigned int queue_depth;
+    struct queue_stats queue_stats;
+    struct queue_depth_entry queue_depths[QUEUE_DEPTH_ENTRIES];
+    unsigned int queue_depth_count;
+
+    /*
+     * Sequence number and QBUF time of the frame in each queued buffer, the
+     * driver's timestamp type is reported on the first DQBUF
+     */
+    unsigned long long buffer_sequence[UVC_MAX_BUFFERS];
+    double qbuf_time[UVC_MAX_BUFFERS];
+    unsigned long long sent_sequence;
+    bool timestamp_reported;
+
+    /* Capture to QBUF, QBUF to DQBUF and capture to DQBUF latencies */
+    struct latency_stats latency_produce;
+    struct latency_stats latency_queue;
+    struct latency_stats latency_total;
+
+    struct dedup_stats dedup_stats;
+
+    /*
+     * UVC events recorded with -R, or replayed from a recording with -e:
+     * responses are kept for the replay instead of being sent
+     */
+    FILE *event_record;
+    bool replaying;
+    struct uvc_request_data replay_response;
+    bool replay_responded;
+
+    /* Buffers requested and queued while replaying, in the order they were queued */
+    unsigned int replay_buffers;
+    struct v4l2_buffer replay_queue[UVC_MAX_BUFFERS];
+    unsigned int replay_queue_head;
+    unsigned int replay_queued;
+
+    bool first_response_sent;
 
     /* Image specific */
     unsigned int image_size;
-    unsigned int image_uncompressed_mem_size;
-    unsigned int image_mjpeg_mem_size;
-    unsigned int image_l8_mem_size;
     unsigned int image_mem_size;
     unsigned int image_width;
     unsigned int image_height;
     unsigned int image_format;
-    void *image_memory;
-    void *image_uncompressed_memory;
-    void *image_mjpeg_memory;
-    void *image_l8_memory;
+
+    /* Source files and the frame set streamed from them */
+    struct image_file *image_files;
+    unsigned int image_file_count;
+    struct image_set *image_set;
+    struct image_converted *image_active;
+    unsigned int image_frame_index;
+
+    /* Frame sets handed between the reload thread and the streaming loop */
+    struct image_set *_Atomic image_set_pending;
+    struct image_set *_Atomic image_set_retired;
+
+    /*
+     * Initial frame set prepared on a worker thread while host requests are
+     * answered, adopted by the streaming loop (at the latest on STREAMON)
+     */
+    pthread_t prepare_thread;
+    bool preparing;
+    _Atomic bool prepare_done;
+    struct image_set *prepared_set;
+    double prepare_time;
+    struct uvc_frame_format *image_selected;    /* format to select once the set is adopted */
 
     double last_time_video_process;
     int buffers_processed;
@@ -225,10 +730,37 @@ struct uvc_settings {
     char *uvc_devname;
     char *v4l2_devname;
     char *image_name;
+    enum image_type image_type;
     enum device_type source_device;
     unsigned int nbufs;
+    bool nbufs_auto;
     bool show_fps;
     unsigned int image_framerate;
+    unsigned int jpeg_quality;
+    bool image_reload;
+    bool hugepages;
+    bool fast_switch;
+    bool low_latency;
+    bool rotation;
+    bool control_thread;
+    int control_priority;
+    int control_cpu;
+    int rt_policy;
+    int rt_priority;
+    cpu_set_t rt_cpus;
+    bool rt_cpus_set;
+    bool lock_memory;
+    unsigned int jitter_seconds;
+    char *trace_file;
+    char *record_file;
+    char *replay_file;
+    unsigned int soak_seconds;
+    char *uvc_function;
+    char *configfs_snapshot;
+    char *gadget_profile;
+    char *cache_dir;
+    unsigned int cache_limit_mb;
+    char *overlay_id;
     bool streaming_status_onboard;
     bool streaming_status_onboard_enabled;
     char *streaming_status_pin;
@@ -242,6 +774,10 @@ struct uvc_settings settings = {
     .source_device = DEVICE_TYPE_IMAGE,
     .nbufs = 2,
     .image_framerate = 25,
+    .jpeg_quality = 90,
+    .cache_limit_mb = IMAGE_CACHE_LIMIT_MB,
+    .control_cpu = -1,
+    .rt_policy = SCHED_OTHER,
     .show_fps = false,
     .streaming_status_onboard = false,
     .streaming_status_onboard_enabled = false,
@@ -488,114 +1024,3 @@ struct control_mapping_pair control_mapping[] = {
 };
 
 int control_mapping_size = sizeof(control_mapping) / sizeof(*control_mapping);
-
-/*
- * RGB to YUYV conversion 
- */
-
-unsigned int mult_38[256] = {0, 38, 76, 114, 152, 190, 228, 266, 304, 342, 380, 418, 456, 494, 532,
-    570, 608, 646, 684, 722, 760, 798, 836, 874, 912, 950, 988, 1026, 1064, 1102, 1140, 1178, 1216,
-    1254, 1292, 1330, 1368, 1406, 1444, 1482, 1520, 1558, 1596, 1634, 1672, 1710, 1748, 1786, 1824,
-    1862, 1900, 1938, 1976, 2014, 2052, 2090, 2128, 2166, 2204, 2242, 2280, 2318, 2356, 2394, 2432,
-    2470, 2508, 2546, 2584, 2622, 2660, 2698, 2736, 2774, 2812, 2850, 2888, 2926, 2964, 3002, 3040,
-    3078, 3116, 3154, 3192, 3230, 3268, 3306, 3344, 3382, 3420, 3458, 3496, 3534, 3572, 3610, 3648,
-    3686, 3724, 3762, 3800, 3838, 3876, 3914, 3952, 3990, 4028, 4066, 4104, 4142, 4180, 4218, 4256,
-    4294, 4332, 4370, 4408, 4446, 4484, 4522, 4560, 4598, 4636, 4674, 4712, 4750, 4788, 4826, 4864,
-    4902, 4940, 4978, 5016, 5054, 5092, 5130, 5168, 5206, 5244, 5282, 5320, 5358, 5396, 5434, 5472,
-    5510, 5548, 5586, 5624, 5662, 5700, 5738, 5776, 5814, 5852, 5890, 5928, 5966, 6004, 6042, 6080,
-    6118, 6156, 6194, 6232, 6270, 6308, 6346, 6384, 6422, 6460, 6498, 6536, 6574, 6612, 6650, 6688,
-    6726, 6764, 6802, 6840, 6878, 6916, 6954, 6992, 7030, 7068, 7106, 7144, 7182, 7220, 7258, 7296,
-    7334, 7372, 7410, 7448, 7486, 7524, 7562, 7600, 7638, 7676, 7714, 7752, 7790, 7828, 7866, 7904,
-    7942, 7980, 8018, 8056, 8094, 8132, 8170, 8208, 8246, 8284, 8322, 8360, 8398, 8436, 8474, 8512,
-    8550, 8588, 8626, 8664, 8702, 8740, 8778, 8816, 8854, 8892, 8930, 8968, 9006, 9044, 9082, 9120,
-    9158, 9196, 9234, 9272, 9310, 9348, 9386, 9424, 9462, 9500, 9538, 9576, 9614, 9652, 9690
-};
-
-unsigned int mult_74[256] = {0, 74, 148, 222, 296, 370, 444, 518, 592, 666, 740, 814, 888, 962,
-    1036, 1110, 1184, 1258, 1332, 1406, 1480, 1554, 1628, 1702, 1776, 1850, 1924, 1998, 2072, 2146,
-    2220, 2294, 2368, 2442, 2516, 2590, 2664, 2738, 2812, 2886, 2960, 3034, 3108, 3182, 3256, 3330,
-    3404, 3478, 3552, 3626, 3700, 3774, 3848, 3922, 3996, 4070, 4144, 4218, 4292, 4366, 4440, 4514,
-    4588, 4662, 4736, 4810, 4884, 4958, 5032, 5106, 5180, 5254, 5328, 5402, 5476, 5550, 5624, 5698,
-    5772, 5846, 5920, 5994, 6068, 6142, 6216, 6290, 6364, 6438, 6512, 6586, 6660, 6734, 6808, 6882,
-    6956, 7030, 7104, 7178, 7252, 7326, 7400, 7474, 7548, 7622, 7696, 7770, 7844, 7918, 7992, 8066,
-    8140, 8214, 8288, 8362, 8436, 8510, 8584, 8658, 8732, 8806, 8880, 8954, 9028, 9102, 9176, 9250,
-    9324, 9398, 9472, 9546, 9620, 9694, 9768, 9842, 9916, 9990, 10064, 10138, 10212, 10286, 10360,
-    10434, 10508, 10582, 10656, 10730, 10804, 10878, 10952, 11026, 11100, 11174, 11248, 11322, 11396,
-    11470, 11544, 11618, 11692, 11766, 11840, 11914, 11988, 12062, 12136, 12210, 12284, 12358, 12432,
-    12506, 12580, 12654, 12728, 12802, 12876, 12950, 13024, 13098, 13172, 13246, 13320, 13394, 13468,
-    13542, 13616, 13690, 13764, 13838, 13912, 13986, 14060, 14134, 14208, 14282, 14356, 14430, 14504,
-    14578, 14652, 14726, 14800, 14874, 14948, 15022, 15096, 15170, 15244, 15318, 15392, 15466, 15540,
-    15614, 15688, 15762, 15836, 15910, 15984, 16058, 16132, 16206, 16280, 16354, 16428, 16502, 16576,
-    16650, 16724, 16798, 16872, 16946, 17020, 17094, 17168, 17242, 17316, 17390, 17464, 17538, 17612,
-    17686, 17760, 17834, 17908, 17982, 18056, 18130, 18204, 18278, 18352, 18426, 18500, 18574, 18648,
-    18722, 18796, 18870
-};
-
-unsigned int mult_112[256] = {0, 112, 224, 336, 448, 560, 672, 784, 896, 1008, 1120, 1232, 1344, 1456,
-    1568, 1680, 1792, 1904, 2016, 2128, 2240, 2352, 2464, 2576, 2688, 2800, 2912, 3024, 3136, 3248,
-    3360, 3472, 3584, 3696, 3808, 3920, 4032, 4144, 4256, 4368, 4480, 4592, 4704, 4816, 4928, 5040,
-    5152, 5264, 5376, 5488, 5600, 5712, 5824, 5936, 6048, 6160, 6272, 6384, 6496, 6608, 6720, 6832,
-    6944, 7056, 7168, 7280, 7392, 7504, 7616, 7728, 7840, 7952, 8064, 8176, 8288, 8400, 8512, 8624,
-    8736, 8848, 8960, 9072, 9184, 9296, 9408, 9520, 9632, 9744, 9856, 9968, 10080, 10192, 10304,
-    10416, 10528, 10640, 10752, 10864, 10976, 11088, 11200, 11312, 11424, 11536, 11648, 11760, 11872,
-    11984, 12096, 12208, 12320, 12432, 12544, 12656, 12768, 12880, 12992, 13104, 13216, 13328, 13440,
-    13552, 13664, 13776, 13888, 14000, 14112, 14224, 14336, 14448, 14560, 14672, 14784, 14896, 15008,
-    15120, 15232, 15344, 15456, 15568, 15680, 15792, 15904, 16016, 16128, 16240, 16352, 16464, 16576,
-    16688, 16800, 16912, 17024, 17136, 17248, 17360, 17472, 17584, 17696, 17808, 17920, 18032, 18144,
-    18256, 18368, 18480, 18592, 18704, 18816, 18928, 19040, 19152, 19264, 19376, 19488, 19600, 19712,
-    19824, 19936, 20048, 20160, 20272, 20384, 20496, 20608, 20720, 20832, 20944, 21056, 21168, 21280,
-    21392, 21504, 21616, 21728, 21840, 21952, 22064, 22176, 22288, 22400, 22512, 22624, 22736, 22848,
-    22960, 23072, 23184, 23296, 23408, 23520, 23632, 23744, 23856, 23968, 24080, 24192, 24304, 24416,
-    24528, 24640, 24752, 24864, 24976, 25088, 25200, 25312, 25424, 25536, 25648, 25760, 25872, 25984,
-    26096, 26208, 26320, 26432, 26544, 26656, 26768, 26880, 26992, 27104, 27216, 27328, 27440, 27552,
-    27664, 27776, 27888, 28000, 28112, 28224, 28336, 28448, 28560
-};
-
-unsigned int mult_94[256] = {0, 94, 188, 282, 376, 470, 564, 658, 752, 846, 940, 1034, 1128, 1222,
-    1316, 1410, 1504, 1598, 1692, 1786, 1880, 1974, 2068, 2162, 2256, 2350, 2444, 2538, 2632, 2726,
-    2820, 2914, 3008, 3102, 3196, 3290, 3384, 3478, 3572, 3666, 3760, 3854, 3948, 4042, 4136, 4230,
-    4324, 4418, 4512, 4606, 4700, 4794, 4888, 4982, 5076, 5170, 5264, 5358, 5452, 5546, 5640, 5734,
-    5828, 5922, 6016, 6110, 6204, 6298, 6392, 6486, 6580, 6674, 6768, 6862, 6956, 7050, 7144, 7238,
-    7332, 7426, 7520, 7614, 7708, 7802, 7896, 7990, 8084, 8178, 8272, 8366, 8460, 8554, 8648, 8742,
-    8836, 8930, 9024, 9118, 9212, 9306, 9400, 9494, 9588, 9682, 9776, 9870, 9964, 10058, 10152, 10246,
-    10340, 10434, 10528, 10622, 10716, 10810, 10904, 10998, 11092, 11186, 11280, 11374, 11468, 11562,
-    11656, 11750, 11844, 11938, 12032, 12126, 12220, 12314, 12408, 12502, 12596, 12690, 12784, 12878,
-    12972, 13066, 13160, 13254, 13348, 13442, 13536, 13630, 13724, 13818, 13912, 14006, 14100, 14194,
-    14288, 14382, 14476, 14570, 14664, 14758, 14852, 14946, 15040, 15134, 15228, 15322, 15416, 15510,
-    15604, 15698, 15792, 15886, 15980, 16074, 16168, 16262, 16356, 16450, 16544, 16638, 16732, 16826,
-    16920, 17014, 17108, 17202, 17296, 17390, 17484, 17578, 17672, 17766, 17860, 17954, 18048, 18142,
-    18236, 18330, 18424, 18518, 18612, 18706, 18800, 18894, 18988, 19082, 19176, 19270, 19364, 19458,
-    19552, 19646, 19740, 19834, 19928, 20022, 20116, 20210, 20304, 20398, 20492, 20586, 20680, 20774,
-    20868, 20962, 21056, 21150, 21244, 21338, 21432, 21526, 21620, 21714, 21808, 21902, 21996, 22090,
-    22184, 22278, 22372, 22466, 22560, 22654, 22748, 22842, 22936, 23030, 23124, 23218, 23312, 23406,
-    23500, 23594, 23688, 23782, 23876, 23970
-};
-
-unsigned int mult_18[256] = {128, 146, 164, 182, 200, 218, 236, 254, 272, 290, 308, 326, 344, 362,
-    380, 398, 416, 434, 452, 470, 488, 506, 524, 542, 560, 578, 596, 614, 632, 650, 668, 686, 704,
-    722, 740, 758, 776, 794, 812, 830, 848, 866, 884, 902, 920, 938, 956, 974, 992, 1010, 1028, 1046,
-    1064, 1082, 1100, 1118, 1136, 1154, 1172, 1190, 1208, 1226, 1244, 1262, 1280, 1298, 1316, 1334,
-    1352, 1370, 1388, 1406, 1424, 1442, 1460, 1478, 1496, 1514, 1532, 1550, 1568, 1586, 1604, 1622,
-    1640, 1658, 1676, 1694, 1712, 1730, 1748, 1766, 1784, 1802, 1820, 1838, 1856, 1874, 1892, 1910,
-    1928, 1946, 1964, 1982, 2000, 2018, 2036, 2054, 2072, 2090, 2108, 2126, 2144, 2162, 2180, 2198,
-    2216, 2234, 2252, 2270, 2288, 2306, 2324, 2342, 2360, 2378, 2396, 2414, 2432, 2450, 2468, 2486,
-    2504, 2522, 2540, 2558, 2576, 2594, 2612, 2630, 2648, 2666, 2684, 2702, 2720, 2738, 2756, 2774,
-    2792, 2810, 2828, 2846, 2864, 2882, 2900, 2918, 2936, 2954, 2972, 2990, 3008, 3026, 3044, 3062,
-    3080, 3098, 3116, 3134, 3152, 3170, 3188, 3206, 3224, 3242, 3260, 3278, 3296, 3314, 3332, 3350,
-    3368, 3386, 3404, 3422, 3440, 3458, 3476, 3494, 3512, 3530, 3548, 3566, 3584, 3602, 3620, 3638,
-    3656, 3674, 3692, 3710, 3728, 3746, 3764, 3782, 3800, 3818, 3836, 3854, 3872, 3890, 3908, 3926,
-    3944, 3962, 3980, 3998, 4016, 4034, 4052, 4070, 4088, 4106, 4124, 4142, 4160, 4178, 4196, 4214,
-    4232, 4250, 4268, 4286, 4304, 4322, 4340, 4358, 4376, 4394, 4412, 4430, 4448, 4466, 4484, 4502,
-    4520, 4538, 4556, 4574, 4592, 4610, 4628, 4646, 4664, 4682, 4700, 4718
-};
-
-#define rgb2yvyu(b1, g1, r1, b2, g2, r2)                                                 \
-    ({                                                                                   \
-        uint8_t r12 = (r1 + r2) >> 1;                                                    \
-        uint8_t g12 = (g1 + g2) >> 1;                                                    \
-        uint8_t b12 = (b1 + b2) >> 1;                                                    \
-        (uint8_t) ((r1 >> 2) + (g1 >> 1) + (b1 >> 3) + 16) +                             \
-        ((uint8_t)(((mult_112[r12] - mult_94[g12] -  mult_18[b12]) >> 8) + 128) << 8) +  \
-        ((uint8_t)((r2 >> 2) + (g2 >> 1) + (b2 >> 3) + 16) << 16) +                      \
-        ((uint8_t)(((-mult_38[r12] - mult_74[g12] + mult_112[b12]) >> 8) + 128) << 24);  \
-    })